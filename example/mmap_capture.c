@@ -0,0 +1,714 @@
+/*
+ * mmap_capture.c
+ *
+ * Copyright (C) 2011-21 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ndpi_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "mmap_capture.h"
+
+#ifndef WIN32
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define PCAP_MAGIC_USEC     0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAP_FILE_HDR_LEN   24
+#define PCAP_PKT_HDR_LEN    16
+
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_PB           0x00000002 /* obsolete packet block */
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL  9
+
+#define LINKTYPE_RAW        101
+
+#define MMAP_MAX_IFACES     0xFFFF
+#define MMAP_READAHEAD      (1 << 24) /* 16 MB ahead of the reader */
+
+/*
+  A packet is referenced by its record offset in the file (48 bits) and
+  the interface it was captured on (16 bits): the interface gives the
+  byte order, link type and timestamp resolution needed to decode it
+*/
+#define MMAP_REF(off, iface)  (((u_int64_t)(off) << 16) | (iface))
+#define MMAP_REF_OFF(ref)     ((ref) >> 16)
+#define MMAP_REF_IFACE(ref)   ((u_int16_t)((ref) & 0xFFFF))
+
+struct mmap_iface {
+  u_int8_t swap, skip;
+  u_int64_t units; /* timestamp units per second */
+};
+
+struct mmap_index {
+  u_int64_t *refs;
+  u_int64_t num, size;
+};
+
+struct ndpi_mmap_capture {
+  char name[256];
+  int fd, datalink;
+  u_int8_t *map;
+  size_t map_len;
+  u_int8_t pcapng;
+
+  /* pcap: one interface, pcapng: the interfaces of all the sections */
+  struct mmap_iface *ifaces;
+  u_int32_t num_ifaces, max_ifaces;
+
+  u_int8_t has_filter;
+  struct bpf_program fcode;
+
+  u_int16_t num_workers;
+  struct mmap_index *index;
+
+  u_int8_t has_time_range;
+  struct timeval first_ts, last_ts;
+};
+
+/* Sequential walk of the records */
+struct mmap_iter {
+  size_t pos;
+  u_int8_t swap;
+  u_int32_t section_iface; /* first interface of the pcapng section */
+};
+
+/* ********************************** */
+
+int ndpi_mmap_is_capture(const char *name) {
+  return(name != NULL && strncmp(name, MMAP_CAPTURE_PREFIX, sizeof(MMAP_CAPTURE_PREFIX)-1) == 0);
+}
+
+/* ********************************** */
+
+static inline u_int16_t rd16(const u_int8_t *p, u_int8_t swap) {
+  u_int16_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return(swap ? (u_int16_t)((v >> 8) | (v << 8)) : v);
+}
+
+static inline u_int32_t rd32(const u_int8_t *p, u_int8_t swap) {
+  u_int32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return(swap ? __builtin_bswap32(v) : v);
+}
+
+/* ********************************** */
+
+static int mmap_linktype_to_dlt(u_int32_t linktype) {
+  /* LINKTYPE_* and DLT_* values are the same but for a few link types */
+  switch(linktype) {
+  case LINKTYPE_RAW:
+    return(DLT_RAW);
+  default:
+    return((int)linktype);
+  }
+}
+
+/* ********************************** */
+
+static int mmap_add_iface(struct ndpi_mmap_capture *cap, u_int8_t swap,
+			  u_int32_t linktype, u_int64_t units) {
+  struct mmap_iface *iface;
+  int dlt = mmap_linktype_to_dlt(linktype);
+
+  if(cap->num_ifaces == MMAP_MAX_IFACES)
+    return(-1);
+
+  if(cap->num_ifaces == cap->max_ifaces) {
+    u_int32_t n = cap->max_ifaces ? cap->max_ifaces * 2 : 8;
+    struct mmap_iface *ifaces = (struct mmap_iface*)realloc(cap->ifaces, n * sizeof(*ifaces));
+
+    if(ifaces == NULL) return(-1);
+    cap->ifaces = ifaces, cap->max_ifaces = n;
+  }
+
+  /* The link type of the first interface is the one of the capture */
+  if(cap->num_ifaces == 0)
+    cap->datalink = dlt;
+
+  iface = &cap->ifaces[cap->num_ifaces++];
+  iface->swap = swap, iface->skip = (dlt != cap->datalink), iface->units = units;
+
+  return(0);
+}
+
+/* ********************************** */
+
+static u_int64_t pcapng_tsresol(const u_int8_t *opt, const u_int8_t *end, u_int8_t swap) {
+  while(opt + 4 <= end) {
+    u_int16_t code = rd16(opt, swap), len = rd16(opt + 2, swap);
+
+    if(code == 0 /* opt_endofopt */ || opt + 4 + len > end)
+      break;
+
+    if(code == PCAPNG_OPT_TSRESOL && len >= 1) {
+      u_int8_t v = opt[4], exp = v & 0x7F;
+      u_int64_t units = 1;
+
+      if(v & 0x80) {
+	if(exp > 63) return(0);
+	return((u_int64_t)1 << exp);
+      }
+
+      if(exp > 19) return(0);
+      while(exp--) units *= 10;
+      return(units);
+    }
+
+    opt += 4 + ((len + 3) & ~3);
+  }
+
+  return(1000000); /* default: microseconds */
+}
+
+/* ********************************** */
+
+/*
+  Returns 1 with the reference of the next packet, 0 at the end of the
+  file (a truncated last record is ignored) and -1 on format errors
+*/
+static int mmap_next(struct ndpi_mmap_capture *cap, struct mmap_iter *it, u_int64_t *ref) {
+  const u_int8_t *map = cap->map;
+  size_t len = cap->map_len;
+
+  if(!cap->pcapng) {
+    u_int32_t caplen;
+
+    if(it->pos + PCAP_PKT_HDR_LEN > len)
+      return(0);
+
+    caplen = rd32(&map[it->pos + 8], cap->ifaces[0].swap);
+    if(caplen > len - it->pos - PCAP_PKT_HDR_LEN)
+      return(0);
+
+    *ref = MMAP_REF(it->pos, 0);
+    it->pos += PCAP_PKT_HDR_LEN + caplen;
+    return(1);
+  }
+
+  while(it->pos + 12 <= len) {
+    const u_int8_t *b = &map[it->pos];
+    u_int32_t type, block_len;
+    u_int8_t swap = it->swap;
+
+    if(rd32(b, 0) == PCAPNG_SHB) {
+      /* A new section: it sets the byte order */
+      u_int32_t bom;
+
+      memcpy(&bom, &b[8], sizeof(bom));
+      if(bom == PCAPNG_BOM) swap = 0;
+      else if(bom == __builtin_bswap32(PCAPNG_BOM)) swap = 1;
+      else return(-1);
+
+      it->swap = swap, it->section_iface = cap->num_ifaces;
+    }
+
+    type = rd32(b, swap), block_len = rd32(&b[4], swap);
+
+    if((block_len < 12) || (block_len & 3))
+      return(-1);
+    if(block_len > len - it->pos)
+      return(0);
+
+    it->pos += block_len;
+
+    switch(type) {
+    case PCAPNG_IDB:
+      if(block_len < 20)
+	return(-1);
+      if(mmap_add_iface(cap, swap, rd16(&b[8], swap),
+			pcapng_tsresol(&b[16], &b[block_len - 4], swap)) != 0)
+	return(-1);
+      break;
+
+    case PCAPNG_EPB:
+    case PCAPNG_PB:
+      {
+	u_int32_t iface, caplen;
+
+	if(block_len < 32)
+	  return(-1);
+
+	iface = (type == PCAPNG_EPB) ? rd32(&b[8], swap) : rd16(&b[8], swap);
+	caplen = rd32(&b[20], swap);
+
+	if((caplen > block_len - 32) || (iface >= cap->num_ifaces - it->section_iface))
+	  return(-1);
+
+	iface += it->section_iface;
+	if(cap->ifaces[iface].skip || (cap->ifaces[iface].units == 0))
+	  continue;
+
+	*ref = MMAP_REF(b - map, iface);
+	return(1);
+      }
+
+    case PCAPNG_SPB:
+      if(block_len < 16)
+	return(-1);
+      if((it->section_iface >= cap->num_ifaces) || cap->ifaces[it->section_iface].skip)
+	continue;
+
+      *ref = MMAP_REF(b - map, it->section_iface);
+      return(1);
+
+    default:
+      /* SHB, name resolution, statistics... */
+      break;
+    }
+  }
+
+  return(0);
+}
+
+/* ********************************** */
+
+static const u_char *mmap_decode(struct ndpi_mmap_capture *cap, u_int64_t ref,
+				 struct pcap_pkthdr *h) {
+  const u_int8_t *b = &cap->map[MMAP_REF_OFF(ref)];
+  const struct mmap_iface *iface = &cap->ifaces[MMAP_REF_IFACE(ref)];
+  u_int8_t swap = iface->swap;
+  u_int64_t ts;
+
+  if(!cap->pcapng) {
+    h->ts.tv_sec  = rd32(b, swap);
+    h->ts.tv_usec = rd32(&b[4], swap);
+    if(iface->units != 1000000) h->ts.tv_usec /= 1000;
+    h->caplen = rd32(&b[8], swap), h->len = rd32(&b[12], swap);
+    return(&b[PCAP_PKT_HDR_LEN]);
+  }
+
+  if(rd32(b, swap) == PCAPNG_SPB) {
+    u_int32_t block_len = rd32(&b[4], swap);
+
+    h->ts.tv_sec = 0, h->ts.tv_usec = 0;
+    h->len = rd32(&b[8], swap);
+    h->caplen = (h->len < block_len - 16) ? h->len : block_len - 16;
+    return(&b[12]);
+  }
+
+  /* EPB and PB have the same layout after the interface id */
+  ts = ((u_int64_t)rd32(&b[12], swap) << 32) | rd32(&b[16], swap);
+  h->ts.tv_sec  = ts / iface->units;
+  h->ts.tv_usec = ((ts % iface->units) * 1000000) / iface->units;
+  h->caplen = rd32(&b[20], swap), h->len = rd32(&b[24], swap);
+  return(&b[28]);
+}
+
+/* ********************************** */
+
+/*
+  Worker of a packet: symmetric hash of the (outer) IP addresses. Not
+  IP packets all go to worker 0
+*/
+static u_int16_t mmap_packet_worker(int datalink, const u_int8_t *p, u_int32_t caplen,
+				    u_int16_t num_workers) {
+  u_int32_t off, h = 0, i;
+  u_int16_t type = 0;
+
+  switch(datalink) {
+  case DLT_EN10MB:
+    if(caplen < 14) return(0);
+    type = (p[12] << 8) | p[13], off = 14;
+
+    while((type == 0x8100 || type == 0x88A8) && (off + 4 <= caplen)) /* VLAN, QinQ */
+      type = (p[off + 2] << 8) | p[off + 3], off += 4;
+
+    if(type == 0x8864 && off + 8 <= caplen) { /* PPPoE session */
+      u_int16_t ppp = (p[off + 6] << 8) | p[off + 7];
+
+      type = (ppp == 0x0021) ? 0x0800 : ((ppp == 0x0057) ? 0x86DD : 0), off += 8;
+    } else if(type == 0x8847) { /* MPLS: IP after the bottom of stack */
+      while(off + 4 <= caplen && !(p[off + 2] & 0x01)) off += 4;
+      off += 4, type = 0;
+    }
+    break;
+
+  case DLT_LINUX_SLL:
+    if(caplen < 16) return(0);
+    type = (p[14] << 8) | p[15], off = 16;
+    break;
+
+  case DLT_NULL:
+#ifdef DLT_LOOP
+  case DLT_LOOP:
+#endif
+    off = 4;
+    break;
+
+  case DLT_RAW:
+    off = 0;
+    break;
+
+  default:
+    return(0);
+  }
+
+  if(off >= caplen)
+    return(0);
+
+  if(type == 0) /* from the IP version */
+    type = ((p[off] >> 4) == 4) ? 0x0800 : (((p[off] >> 4) == 6) ? 0x86DD : 0);
+
+  if(type == 0x0800 && off + 20 <= caplen) {
+    h = rd32(&p[off + 12], 0) ^ rd32(&p[off + 16], 0);
+  } else if(type == 0x86DD && off + 40 <= caplen) {
+    for(i = 0; i < 8; i++)
+      h ^= rd32(&p[off + 8 + 4 * i], 0);
+  } else
+    return(0);
+
+  /* Multiplicative hash: the high bits are the well mixed ones */
+  return((u_int16_t)(((u_int64_t)(h * 2654435761U) * num_workers) >> 32));
+}
+
+/* ********************************** */
+
+struct ndpi_mmap_capture *ndpi_mmap_open(const char *name, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len) {
+  struct ndpi_mmap_capture *cap;
+  const char *path = &name[sizeof(MMAP_CAPTURE_PREFIX)-1];
+  struct stat st;
+  u_int32_t magic;
+
+  if((cap = (struct ndpi_mmap_capture*)calloc(1, sizeof(*cap))) == NULL) {
+    snprintf(errbuf, errbuf_len, "not enough memory");
+    return(NULL);
+  }
+
+  snprintf(cap->name, sizeof(cap->name), "%s", path);
+  cap->map = MAP_FAILED;
+
+  if(((cap->fd = open(path, O_RDONLY)) < 0) || (fstat(cap->fd, &st) != 0)) {
+    snprintf(errbuf, errbuf_len, "%s: %s", path, strerror(errno));
+    goto error;
+  }
+
+  if((st.st_size < PCAP_FILE_HDR_LEN) || ((u_int64_t)st.st_size >> 48)) {
+    snprintf(errbuf, errbuf_len, "%s: unsupported file size", path);
+    goto error;
+  }
+
+  /*
+    Private writable mapping: the dissectors get the packets in place as
+    with libpcap buffers, a page they write to is copied
+  */
+  cap->map_len = (size_t)st.st_size;
+  if((cap->map = (u_int8_t*)mmap(NULL, cap->map_len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE, cap->fd, 0)) == MAP_FAILED) {
+    snprintf(errbuf, errbuf_len, "mmap(%s): %s", path, strerror(errno));
+    goto error;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(cap->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  madvise(cap->map, cap->map_len, MADV_SEQUENTIAL);
+
+  memcpy(&magic, cap->map, sizeof(magic));
+
+  if(magic == PCAPNG_SHB) {
+    struct mmap_iter it;
+    u_int64_t ref;
+
+    cap->pcapng = 1;
+
+    /* The link type is the one of the first interface */
+    memset(&it, 0, sizeof(it));
+    while(cap->num_ifaces == 0 && mmap_next(cap, &it, &ref) == 1)
+      ;
+
+    if(cap->num_ifaces == 0) {
+      snprintf(errbuf, errbuf_len, "%s: no pcapng interface description block", path);
+      goto error;
+    }
+
+    /* Walks restart from the beginning */
+    cap->num_ifaces = 0;
+  } else {
+    u_int8_t swap;
+    u_int64_t units;
+
+    if(magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC)
+      swap = 0;
+    else if(magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+      swap = 1;
+    else {
+      snprintf(errbuf, errbuf_len, "%s: not a pcap/pcapng file", path);
+      goto error;
+    }
+
+    units = (rd32(cap->map, swap) == PCAP_MAGIC_NSEC) ? 1000000000 : 1000000;
+    mmap_add_iface(cap, swap, rd32(&cap->map[20], swap) & 0xFFFF, units);
+  }
+
+  if(bpf_filter) {
+    pcap_t *dead = pcap_open_dead(cap->datalink, 262144);
+
+    if(dead == NULL || pcap_compile(dead, &cap->fcode, bpf_filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+      snprintf(errbuf, errbuf_len, "pcap_compile error: '%s'", dead ? pcap_geterr(dead) : "");
+      if(dead) pcap_close(dead);
+      goto error;
+    }
+
+    pcap_close(dead);
+    cap->has_filter = 1;
+  }
+
+  return(cap);
+
+ error:
+  ndpi_mmap_close(cap);
+  return(NULL);
+}
+
+/* ********************************** */
+
+int ndpi_mmap_datalink(struct ndpi_mmap_capture *cap) {
+  return(cap->datalink);
+}
+
+/* ********************************** */
+
+static int mmap_index_add(struct mmap_index *idx, u_int64_t ref) {
+  if(idx->num == idx->size) {
+    u_int64_t n = idx->size ? idx->size * 2 : 4096;
+    u_int64_t *refs = (u_int64_t*)realloc(idx->refs, n * sizeof(u_int64_t));
+
+    if(refs == NULL) return(-1);
+    idx->refs = refs, idx->size = n;
+  }
+
+  idx->refs[idx->num++] = ref;
+  return(0);
+}
+
+/* ********************************** */
+
+int ndpi_mmap_partition(struct ndpi_mmap_capture *cap, u_int16_t num_workers,
+			char *errbuf, size_t errbuf_len) {
+  struct mmap_iter it;
+  u_int64_t ref, num = 0;
+  int rc;
+
+  if(num_workers <= 1)
+    return(0);
+
+  if((cap->index = (struct mmap_index*)calloc(num_workers, sizeof(struct mmap_index))) == NULL) {
+    snprintf(errbuf, errbuf_len, "not enough memory");
+    return(-1);
+  }
+
+  cap->num_workers = num_workers, cap->num_ifaces = cap->pcapng ? 0 : 1;
+
+  memset(&it, 0, sizeof(it));
+  if(!cap->pcapng) it.pos = PCAP_FILE_HDR_LEN;
+
+  while((rc = mmap_next(cap, &it, &ref)) == 1) {
+    struct pcap_pkthdr h;
+    const u_char *data = mmap_decode(cap, ref, &h);
+    u_int16_t worker = mmap_packet_worker(cap->datalink, data, h.caplen, num_workers);
+
+    if(mmap_index_add(&cap->index[worker], ref) != 0) {
+      snprintf(errbuf, errbuf_len, "not enough memory for the packet index");
+      return(-1);
+    }
+
+    if(num++ == 0) cap->first_ts = h.ts;
+    cap->last_ts = h.ts;
+  }
+
+  if(rc < 0) {
+    snprintf(errbuf, errbuf_len, "%s: bad pcapng block at offset %llu", cap->name,
+	     (unsigned long long)it.pos);
+    return(-1);
+  }
+
+  cap->has_time_range = (num > 0);
+  return(0);
+}
+
+/* ********************************** */
+
+static inline void mmap_readahead(struct ndpi_mmap_capture *cap, u_int64_t off, u_int64_t *next) {
+  if(off >= *next) {
+    size_t page = (size_t)getpagesize(), start = (off + MMAP_READAHEAD) & ~(page - 1);
+
+    if(start < cap->map_len)
+      madvise(cap->map + start,
+	      (cap->map_len - start < MMAP_READAHEAD) ? cap->map_len - start : MMAP_READAHEAD,
+	      MADV_WILLNEED);
+
+    *next = off + MMAP_READAHEAD;
+  }
+}
+
+/* ********************************** */
+
+static inline int mmap_deliver(struct ndpi_mmap_capture *cap, u_int64_t ref,
+			       ndpi_mmap_handler callback, u_char *user) {
+  struct pcap_pkthdr h;
+  const u_char *data = mmap_decode(cap, ref, &h);
+
+  if(cap->has_filter && !pcap_offline_filter(&cap->fcode, &h, data))
+    return(0);
+
+  callback(user, &h, data);
+  return(1);
+}
+
+/* ********************************** */
+
+long long ndpi_mmap_loop(struct ndpi_mmap_capture *cap, u_int16_t worker_id,
+			 ndpi_mmap_handler callback, u_char *user, volatile u_int8_t *stop) {
+  u_int64_t ref, next_readahead = 0;
+  long long num = 0;
+
+  if(cap->index != NULL) {
+    struct mmap_index *idx;
+    u_int64_t i;
+
+    if(worker_id >= cap->num_workers)
+      return(0);
+
+    idx = &cap->index[worker_id];
+    for(i = 0; (i < idx->num) && !*stop; i++) {
+      ref = idx->refs[i];
+      mmap_readahead(cap, MMAP_REF_OFF(ref), &next_readahead);
+      num += mmap_deliver(cap, ref, callback, user);
+    }
+  } else {
+    struct mmap_iter it;
+    int rc = 0;
+
+    if(worker_id != 0)
+      return(0);
+
+    cap->num_ifaces = cap->pcapng ? 0 : 1;
+    memset(&it, 0, sizeof(it));
+    if(!cap->pcapng) it.pos = PCAP_FILE_HDR_LEN;
+
+    while(!*stop && (rc = mmap_next(cap, &it, &ref)) == 1) {
+      mmap_readahead(cap, MMAP_REF_OFF(ref), &next_readahead);
+      num += mmap_deliver(cap, ref, callback, user);
+    }
+
+    if(rc < 0)
+      return(-1);
+  }
+
+  return(num);
+}
+
+/* ********************************** */
+
+int ndpi_mmap_time_range(struct ndpi_mmap_capture *cap, struct timeval *first,
+			 struct timeval *last) {
+  if(!cap->has_time_range)
+    return(-1);
+
+  *first = cap->first_ts, *last = cap->last_ts;
+  return(0);
+}
+
+/* ********************************** */
+
+const char *ndpi_mmap_name(struct ndpi_mmap_capture *cap) {
+  return(cap->name);
+}
+
+/* ********************************** */
+
+void ndpi_mmap_close(struct ndpi_mmap_capture *cap) {
+  u_int16_t i;
+
+  if(cap == NULL) return;
+
+  if(cap->index) {
+    for(i = 0; i < cap->num_workers; i++)
+      free(cap->index[i].refs);
+    free(cap->index);
+  }
+
+  if(cap->has_filter)     pcap_freecode(&cap->fcode);
+  if(cap->map != MAP_FAILED) munmap(cap->map, cap->map_len);
+  if(cap->fd >= 0)        close(cap->fd);
+  free(cap->ifaces);
+  free(cap);
+}
+
+#else /* WIN32 */
+
+struct ndpi_mmap_capture {
+  int unused;
+};
+
+int ndpi_mmap_is_capture(const char *name) {
+  return(0);
+}
+
+struct ndpi_mmap_capture *ndpi_mmap_open(const char *name, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len) {
+  snprintf(errbuf, errbuf_len, "mmap captures are not available on Windows");
+  return(NULL);
+}
+
+int ndpi_mmap_datalink(struct ndpi_mmap_capture *cap) {
+  return(DLT_EN10MB);
+}
+
+int ndpi_mmap_partition(struct ndpi_mmap_capture *cap, u_int16_t num_workers,
+			char *errbuf, size_t errbuf_len) {
+  return(-1);
+}
+
+long long ndpi_mmap_loop(struct ndpi_mmap_capture *cap, u_int16_t worker_id,
+			 ndpi_mmap_handler callback, u_char *user, volatile u_int8_t *stop) {
+  return(-1);
+}
+
+int ndpi_mmap_time_range(struct ndpi_mmap_capture *cap, struct timeval *first,
+			 struct timeval *last) {
+  return(-1);
+}
+
+const char *ndpi_mmap_name(struct ndpi_mmap_capture *cap) {
+  return("");
+}
+
+void ndpi_mmap_close(struct ndpi_mmap_capture *cap) { ; }
+
+#endif /* WIN32 */
@@ -0,0 +1,74 @@
+/*
+ * mmap_capture.h
+ *
+ * Copyright (C) 2011-21 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _MMAP_CAPTURE_H_
+#define _MMAP_CAPTURE_H_
+
+/*
+  Native pcap/pcapng file reader for ndpiReader:
+
+  mmap:<file>       the file is mapped and packets are passed to the
+                    callback straight from the mapping (no copy)
+
+  With several workers the file is read twice: the first pass assigns
+  each packet to a worker by a symmetric hash of its IP addresses (so
+  both directions of a flow, and the fragments of a packet, go to the
+  same worker), the second pass is run by each worker on its packets.
+*/
+
+#include <pcap.h>
+
+#define MMAP_CAPTURE_PREFIX "mmap:"
+
+struct ndpi_mmap_capture;
+
+/* Same signature as pcap_handler, so pcap callbacks can be reused */
+typedef void (*ndpi_mmap_handler)(u_char *user, const struct pcap_pkthdr *h,
+				  const u_char *bytes);
+
+int ndpi_mmap_is_capture(const char *name);
+
+struct ndpi_mmap_capture *ndpi_mmap_open(const char *name, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len);
+
+/* DLT_* of the capture: packets of interfaces with another link type are skipped */
+int ndpi_mmap_datalink(struct ndpi_mmap_capture *cap);
+
+/* First pass: split the packets among num_workers (no-op with one worker) */
+int ndpi_mmap_partition(struct ndpi_mmap_capture *cap, u_int16_t num_workers,
+			char *errbuf, size_t errbuf_len);
+
+/* Second pass: the packets of worker_id, in file order. Returns the number
+   of processed packets or -1. Can be called by the workers in parallel */
+long long ndpi_mmap_loop(struct ndpi_mmap_capture *cap, u_int16_t worker_id,
+			 ndpi_mmap_handler callback, u_char *user, volatile u_int8_t *stop);
+
+/* Timestamps of the first and last packets, known after the first pass */
+int ndpi_mmap_time_range(struct ndpi_mmap_capture *cap, struct timeval *first,
+			 struct timeval *last);
+
+const char *ndpi_mmap_name(struct ndpi_mmap_capture *cap);
+
+void ndpi_mmap_close(struct ndpi_mmap_capture *cap);
+
+#endif /* _MMAP_CAPTURE_H_ */
@@ -39,6 +39,7 @@
 #include <netinet/in.h>
 #endif
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <search.h>
 #include <pcap.h>
@@ -56,6 +57,8 @@
 
 #include "reader_util.h"
 #include "intrusion_detection.h"
+#include "ring_capture.h"
+#include "mmap_capture.h"
 #include "../src/lib/third_party/include/ahocorasick.h"
 extern int bt_parse_debug;
 
@@ -68,6 +71,8 @@ extern int bt_parse_debug;
 
 static char *_pcap_file[MAX_NUM_READER_THREADS]; /**< Ingress pcap file/interfaces */
 static FILE *playlist_fp[MAX_NUM_READER_THREADS] = { NULL }; /**< Ingress playlist */
+static struct ndpi_ring_capture *ring_capture[MAX_NUM_READER_THREADS] = { NULL }; /**< Ingress tpacket/xdp rings */
+static struct ndpi_mmap_capture *mmap_capture = NULL; /**< mmap:<file>, shared by all the threads */
 static FILE *results_file           = NULL;
 static char *results_path           = NULL;
 static char * bpfFilter             = NULL; /**< bpf filter  */
@@ -75,6 +80,7 @@ static char *_protoFilePath         = NULL; /**< Protocol file path */
 static char *_customCategoryFilePath= NULL; /**< Custom categories file path  */
 static char *_maliciousJA3Path      = NULL; /**< Malicious JA3 signatures */
 static char *_maliciousSHA1Path     = NULL; /**< Malicious SSL certificate SHA1 fingerprints */
+static char *_exportPath            = NULL; /**< Flow records (TLV) output file */
 static char *_riskyDomainFilePath   = NULL; /**< Risky domain files */
 static u_int8_t live_capture = 0;
 static u_int8_t undetected_flows_deleted = 0;
@@ -87,6 +93,7 @@ u_int8_t verbose = 0, enable_joy_stats = 0;
 int nDPI_LogLevel = 0;
 char *_debug_protocols = NULL;
 u_int8_t human_readeable_string_len = 5;
+static u_int64_t mem_soft_limit = 0, mem_hard_limit = 0; /* bytes, 0 = unlimited */
 u_int8_t max_num_udp_dissected_pkts = 24 /* 8 is enough for most protocols, Signal and SnapchatCall require more */, max_num_tcp_dissected_pkts = 80 /* due to telnet */;
 static u_int32_t pcap_analysis_duration = (u_int32_t)-1;
 static u_int32_t risk_stats[NDPI_MAX_RISK] = { 0 }, risks_found = 0, flows_with_risks = 0;
@@ -94,6 +101,7 @@ static struct ndpi_stats cumulative_stats;
 static u_int16_t decode_tunnels = 0;
 static u_int16_t num_loops = 1;
 static u_int8_t shutdown_app = 0, quiet_mode = 0;
+static u_int8_t enable_detection_stats = 0, enable_detection_budget = 0;
 static u_int8_t num_threads = 1;
 static struct timeval startup_time, begin, end;
 #ifdef linux
@@ -200,9 +208,7 @@ struct reader_thread {
   struct ndpi_workflow *workflow;
   pthread_t pthread;
   u_int64_t last_idle_scan_time;
-  u_int32_t idle_scan_idx;
-  u_int32_t num_idle_flows;
-  struct ndpi_flow_info *idle_flows[IDLE_SCAN_BUDGET];
+  ndpi_flow_exporter *exporter;
 };
 
 // array for every thread created for a flow
@@ -452,16 +458,25 @@ static void help(u_int long_help) {
 #ifndef USE_DPDK
 	 "-i <file|device> "
 #endif
-	 "[-f <filter>][-s <duration>][-m <duration>][-b <num bin clusters>]\n"
+	 "[-f <filter>][-s <duration>][-m <duration>][-M <soft>:<hard>][-b <num bin clusters>]\n"
 	 "          [-p <protos>][-l <loops> [-q][-d][-J][-h][-D][-e <len>][-t][-v <level>]\n"
 	 "          [-n <threads>][-w <file>][-c <file>][-C <file>][-j <file>][-x <file>]\n"
-	 "          [-r <file>][-j <file>][-S <file>][-T <num>][-U <num>] [-x <domain>][-z]\n\n"
+	 "          [-r <file>][-j <file>][-S <file>][-E <file>][-T <num>][-U <num>] [-x <domain>][-z][-k][-A]\n\n"
 	 "Usage:\n"
 	 "  -i <file.pcap|device>     | Specify a pcap file/playlist to read packets from or a\n"
 	 "                            | device for live capture (comma-separated list)\n"
+	 "                            | tpacket:<device> captures with AF_PACKET TPACKET_V3\n"
+	 "                            | (one fanout group per device), xdp:<device> with AF_XDP\n"
+	 "                            | (the Nth thread on a device reads its queue N). See -n\n"
+	 "                            | mmap:<file> reads a pcap/pcapng file without copies,\n"
+	 "                            | splitting it among the -n threads by host pair\n"
+	 "                            | (it must be the only -i input)\n"
 	 "  -f <BPF filter>           | Specify a BPF filter for filtering selected traffic\n"
 	 "  -s <duration>             | Maximum capture duration in seconds (live traffic capture only)\n"
 	 "  -m <duration>             | Split analysis duration in <duration> max seconds\n"
+	 "  -M <soft>:<hard>          | nDPI memory budget in MB (0 = unlimited). Past <soft>\n"
+	 "                            | URLs, certificates and JA3 are not extracted, past\n"
+	 "                            | <hard> new flows are not dissected\n"
 	 "  -p <file>.protos          | Specify a protocol file (eg. protos.txt)\n"
 	 "  -l <num loops>            | Number of detection loops (test only)\n"
 	 "  -n <num threads>          | Number of threads. Default: number of interfaces in -i.\n"
@@ -488,6 +503,8 @@ static void help(u_int long_help) {
 	 "  -r <path>                 | Load risky domain file\n"
 	 "  -j <path>                 | Load malicious JA3 fingeprints\n"
 	 "  -S <path>                 | Load malicious SSL certificate SHA1 fingerprints\n"
+	 "  -E <path>                 | Export a TLV record per classified flow on the specified\n"
+	 "                            | file (<path>.<thread id> with multiple threads)\n"
 	 "  -w <path>                 | Write test output on the specified file. This is useful for\n"
 	 "                            | testing purposes in order to compare results across runs\n"
 	 "  -h                        | This help\n"
@@ -503,10 +520,16 @@ static void help(u_int long_help) {
 	 "                            | only the last instance will be considered\n"
 	 "  -T <num>                  | Max number of TCP processed packets before giving up [default: %u]\n"
 	 "  -U <num>                  | Max number of UDP processed packets before giving up [default: %u]\n"
+	 "  -A                        | Adaptive giveup: stop dissecting a flow once no dissector can\n"
+	 "                            | match it or past the packets learnt for its candidate\n"
+	 "                            | protocols and port (-T/-U stay the upper bounds)\n"
 	 "  -D                        | Enable DoH traffic analysis based on content (no DPI)\n"
 	 "  -x <domain>               | Check domain name [Test only]\n"
 	 "  -I                        | Ignore VLAN id for flow hash calculation\n"
 	 "  -z                        | Enable JA3+\n"
+	 "  -k                        | Print how flows were classified (DPI, guess, giveup) per\n"
+	 "                            | protocol, with packets and ms to classification histograms,\n"
+	 "                            | and the host name match cache hit ratio\n"
 	 ,
 	 human_readeable_string_len,
 	 min_pattern_len, max_pattern_len, max_num_packets_per_flow, max_packet_payload_dissection,
@@ -835,13 +858,17 @@ static void parseOptions(int argc, char **argv) {
   }
 #endif
 
-  while((opt = getopt_long(argc, argv, "b:e:c:C:dDf:g:i:Ij:S:hp:pP:l:r:s:tu:v:V:n:Jrp:x:w:zq0123:456:7:89:m:T:U:",
+  while((opt = getopt_long(argc, argv, "Ab:e:c:C:dDE:f:g:i:Ij:kS:hp:pP:l:r:s:tu:v:V:n:Jrp:x:w:zq0123:456:7:89:m:M:T:U:",
 			   longopts, &option_idx)) != EOF) {
 #ifdef DEBUG_TRACE
     if(trace) fprintf(trace, " #### Handling option -%c [%s] #### \n", opt, optarg ? optarg : "");
 #endif
 
     switch (opt) {
+    case 'A':
+      enable_detection_budget = 1;
+      break;
+
     case 'b':
       if((num_bin_clusters = atoi(optarg)) > 32)
 	num_bin_clusters = 32;
@@ -859,6 +886,10 @@ static void parseOptions(int argc, char **argv) {
       human_readeable_string_len = atoi(optarg);
       break;
 
+    case 'k':
+      enable_detection_stats = 1;
+      break;
+
     case 'i':
     case '3':
       _pcap_file[0] = optarg;
@@ -876,6 +907,10 @@ static void parseOptions(int argc, char **argv) {
       _maliciousSHA1Path = optarg;
       break;
 
+    case 'E':
+      _exportPath = optarg;
+      break;
+
     case 'm':
       pcap_analysis_duration = atol(optarg);
       break;
@@ -1025,6 +1060,20 @@ static void parseOptions(int argc, char **argv) {
       if(max_num_tcp_dissected_pkts < 3) max_num_tcp_dissected_pkts = 3;
       break;
 
+    case 'M':
+      {
+	unsigned long long soft = 0, hard = 0;
+
+	if(sscanf(optarg, "%llu:%llu", &soft, &hard) < 1) {
+	  printf("Invalid memory budget %s\n", optarg);
+	  help(0);
+	}
+
+	mem_soft_limit = (u_int64_t)soft * 1024 * 1024, mem_hard_limit = (u_int64_t)hard * 1024 * 1024;
+	ndpi_set_memory_limits(mem_soft_limit, mem_hard_limit);
+      }
+      break;
+
     case 'x':
       domain_to_check = optarg;
       break;
@@ -1068,6 +1117,12 @@ static void parseOptions(int argc, char **argv) {
       num_threads = 0;               /* setting number of threads = number of interfaces */
       __pcap_file = strtok(_pcap_file[0], ",");
       while(__pcap_file != NULL && num_threads < MAX_NUM_READER_THREADS) {
+	/* The mmap reader splits one file among all the threads */
+	if(ndpi_mmap_is_capture(__pcap_file)) {
+	  printf("ERROR: %s must be the only -i input (use -n for threads)\n", __pcap_file);
+	  exit(-1);
+	}
+
 	_pcap_file[num_threads++] = __pcap_file;
 	__pcap_file = strtok(NULL, ",");
       }
@@ -2046,44 +2101,95 @@ static void port_stats_walker(const void *node, ndpi_VISIT which, int depth, voi
 /* *********************************************** */
 
 /**
- * @brief Idle Scan Walker
+ * @brief Idle flow callback: account the flow before it is freed
  */
-static void node_idle_scan_walker(const void *node, ndpi_VISIT which, int depth, void *user_data) {
-  struct ndpi_flow_info *flow = *(struct ndpi_flow_info **) node;
-  u_int16_t thread_id = *((u_int16_t *) user_data);
+static void on_idle_flow(struct ndpi_workflow * workflow,
+			 struct ndpi_flow_info * flow,
+			 void * udata) {
+  u_int16_t thread_id = (u_int16_t)(uintptr_t)udata;
+
+  /* update stats */
+  node_proto_guess_walker(&flow, ndpi_leaf, 0, &thread_id);
+  if(verbose == 3)
+    port_stats_walker(&flow, ndpi_leaf, 0, &thread_id);
+
+  if((flow->detected_protocol.app_protocol == NDPI_PROTOCOL_UNKNOWN) && !undetected_flows_deleted)
+    undetected_flows_deleted = 1;
+}
 
-  if(ndpi_thread_info[thread_id].num_idle_flows == IDLE_SCAN_BUDGET) /* TODO optimise with a budget-based walk */
+/* *********************************************** */
+
+/**
+ * @brief On Protocol Discover - demo callback
+ */
+static void on_protocol_discovered(struct ndpi_workflow * workflow,
+				   struct ndpi_flow_info * flow,
+				   void * udata) {
+  ndpi_flow_exporter *exporter = ndpi_thread_info[(u_int16_t)(uintptr_t)udata].exporter;
+  ndpi_serializer *serializer;
+
+  if(exporter == NULL)
     return;
 
-  if((which == ndpi_preorder) || (which == ndpi_leaf)) { /* Avoid walking the same node multiple times */
-    if(flow->last_seen_ms + MAX_IDLE_TIME < ndpi_thread_info[thread_id].workflow->last_time) {
+  /* The exporter serializer is reused: no allocation per flow */
+  serializer = ndpi_flow_exporter_begin(exporter);
+
+  ndpi_serialize_string_string(serializer, "src_ip", flow->src_name);
+  ndpi_serialize_string_string(serializer, "dest_ip", flow->dst_name);
+  ndpi_serialize_string_uint32(serializer, "src_port", ntohs(flow->src_port));
+  ndpi_serialize_string_uint32(serializer, "dst_port", ntohs(flow->dst_port));
+  ndpi_serialize_string_uint32(serializer, "proto", flow->protocol);
+  if(flow->vlan_id) ndpi_serialize_string_uint32(serializer, "vlan_id", flow->vlan_id);
+  ndpi_serialize_string_uint64(serializer, "first_seen_ms", flow->first_seen_ms);
+  ndpi_serialize_string_uint64(serializer, "last_seen_ms", flow->last_seen_ms);
+  ndpi_serialize_string_uint32(serializer, "src2dst_packets", flow->src2dst_packets);
+  ndpi_serialize_string_uint64(serializer, "src2dst_bytes", flow->src2dst_bytes);
+  ndpi_serialize_string_uint32(serializer, "dst2src_packets", flow->dst2src_packets);
+  ndpi_serialize_string_uint64(serializer, "dst2src_bytes", flow->dst2src_bytes);
+
+  if(flow->ndpi_flow)
+    ndpi_dpi2json(workflow->ndpi_struct, flow->ndpi_flow, flow->detected_protocol, serializer);
+
+  ndpi_flow_exporter_commit(exporter, workflow->last_time);
+}
 
-      /* update stats */
-      node_proto_guess_walker(node, which, depth, user_data);
-      if(verbose == 3)
-        port_stats_walker(node, which, depth, user_data);
+/* *********************************************** */
 
-      if((flow->detected_protocol.app_protocol == NDPI_PROTOCOL_UNKNOWN) && !undetected_flows_deleted)
-        undetected_flows_deleted = 1;
+static void setupExporter(u_int16_t thread_id) {
+  char path[256];
+  int fd;
 
-      ndpi_flow_info_free_data(flow);
-      ndpi_thread_info[thread_id].workflow->stats.ndpi_flow_count--;
+  if(num_threads > 1)
+    snprintf(path, sizeof(path), "%s.%u", _exportPath, thread_id);
+  else
+    snprintf(path, sizeof(path), "%s", _exportPath);
 
-      /* adding to a queue (we can't delete it from the tree inline ) */
-      ndpi_thread_info[thread_id].idle_flows[ndpi_thread_info[thread_id].num_idle_flows++] = flow;
-    }
+  if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    printf("Unable to create export file %s: %s\n", path, strerror(errno));
+    exit(-1);
+  }
+
+  ndpi_thread_info[thread_id].exporter = (ndpi_flow_exporter*)ndpi_malloc(sizeof(ndpi_flow_exporter));
+
+  if((ndpi_thread_info[thread_id].exporter == NULL)
+     || (ndpi_init_flow_exporter(ndpi_thread_info[thread_id].exporter, fd, 0, 1000) != 0)) {
+    printf("Unable to initialize the flow exporter\n");
+    exit(-1);
   }
 }
 
 /* *********************************************** */
 
-/**
- * @brief On Protocol Discover - demo callback
- */
-static void on_protocol_discovered(struct ndpi_workflow * workflow,
-				   struct ndpi_flow_info * flow,
-				   void * udata) {
-  ;
+static void terminateExporter(u_int16_t thread_id) {
+  ndpi_flow_exporter *exporter = ndpi_thread_info[thread_id].exporter;
+
+  if(exporter == NULL)
+    return;
+
+  ndpi_term_flow_exporter(exporter);
+  close(exporter->fd);
+  ndpi_free(exporter);
+  ndpi_thread_info[thread_id].exporter = NULL;
 }
 
 /* *********************************************** */
@@ -2145,12 +2251,22 @@ static void setupDetection(u_int16_t thread_id, pcap_t * pcap_handle) {
 
   memset(&ndpi_thread_info[thread_id], 0, sizeof(ndpi_thread_info[thread_id]));
   ndpi_thread_info[thread_id].workflow = ndpi_workflow_init(&prefs, pcap_handle);
+  ndpi_thread_info[thread_id].workflow->next_flow_id = thread_id;
+  ndpi_thread_info[thread_id].workflow->flow_id_step = num_threads;
 
   /* Preferences */
   ndpi_workflow_set_flow_detected_callback(ndpi_thread_info[thread_id].workflow,
 					   on_protocol_discovered,
 					   (void *)(uintptr_t)thread_id);
 
+  if(_exportPath) {
+    /* Unknown flows are exported too */
+    ndpi_workflow_set_flow_giveup_callback(ndpi_thread_info[thread_id].workflow,
+					   on_protocol_discovered,
+					   (void *)(uintptr_t)thread_id);
+    setupExporter(thread_id);
+  }
+
   // enable all protocols
   NDPI_BITMASK_SET_ALL(all);
   ndpi_set_protocol_detection_bitmask2(ndpi_thread_info[thread_id].workflow->ndpi_struct, &all);
@@ -2186,6 +2302,15 @@ static void setupDetection(u_int16_t thread_id, pcap_t * pcap_handle) {
 
   if(enable_doh_dot_detection)
     ndpi_set_detection_preferences(ndpi_thread_info[thread_id].workflow->ndpi_struct, ndpi_pref_enable_tls_block_dissection, 1);
+
+  if(enable_detection_budget
+     && (ndpi_set_detection_budget(ndpi_thread_info[thread_id].workflow->ndpi_struct,
+				   max_num_tcp_dissected_pkts, max_num_udp_dissected_pkts) != 0))
+    printf("WARNING: not enough memory for the detection budgets\n");
+
+  if(enable_detection_stats
+     && (ndpi_enable_detection_stats(ndpi_thread_info[thread_id].workflow->ndpi_struct) != 0))
+    printf("WARNING: not enough memory for the detection stats\n");
 }
 
 /* *********************************************** */
@@ -2194,6 +2319,7 @@ static void setupDetection(u_int16_t thread_id, pcap_t * pcap_handle) {
  * @brief End of detection and free flow
  */
 static void terminateDetection(u_int16_t thread_id) {
+  terminateExporter(thread_id);
   ndpi_workflow_free(ndpi_thread_info[thread_id].workflow);
 }
 
@@ -2388,6 +2514,94 @@ static void printRiskStats() {
 
 /* *********************************************** */
 
+static void printDetectionStats() {
+  struct ndpi_detection_module_struct *ndpi_struct = ndpi_thread_info[0].workflow->ndpi_struct;
+  u_int32_t totals[NDPI_NUM_DETECTION_METHODS] = { 0 }, num_flows = 0;
+  u_int i, j;
+  int thread_id;
+
+  if(quiet_mode || (!enable_detection_stats))
+    return;
+
+  printf("\n\nDetection stats:\n");
+  printf("\t[pkts: packets to classification 1 2 <=4 <=8 <=16 <=32 <=64 >64]\n");
+  printf("\t[ms: time from the first packet <1 <2 <4 <8 ... <512 <1024 >=1024]\n\n");
+
+  for(i = 0; i < ndpi_get_num_supported_protocols(ndpi_struct); i++) {
+    struct ndpi_detection_stats s, t;
+    u_int32_t flows = 0;
+
+    memset(&s, 0, sizeof(s));
+
+    for(thread_id = 0; thread_id < num_threads; thread_id++) {
+      if(ndpi_get_detection_stats(ndpi_thread_info[thread_id].workflow->ndpi_struct, i, &t) != 0)
+	continue;
+
+      for(j = 0; j < NDPI_NUM_DETECTION_METHODS; j++) s.flows[j] += t.flows[j];
+      for(j = 0; j < NDPI_DETECTION_PKT_BINS; j++)    s.pkts[j] += t.pkts[j];
+      for(j = 0; j < NDPI_DETECTION_TIME_BINS; j++)   s.time_ms[j] += t.time_ms[j];
+    }
+
+    for(j = 0; j < NDPI_NUM_DETECTION_METHODS; j++)
+      flows += s.flows[j], totals[j] += s.flows[j];
+
+    if(flows == 0)
+      continue;
+
+    printf("\t%-20s", ndpi_get_proto_name(ndpi_struct, i));
+    for(j = 0; j < NDPI_NUM_DETECTION_METHODS; j++)
+      if(s.flows[j])
+	printf(" %s: %u", ndpi_detection_method2str((ndpi_detection_method)j), s.flows[j]);
+
+    printf("\n\t%-20s pkts:", "");
+    for(j = 0; j < NDPI_DETECTION_PKT_BINS; j++)
+      printf(" %u", s.pkts[j]);
+
+    printf("\n\t%-20s ms:  ", "");
+    for(j = 0; j < NDPI_DETECTION_TIME_BINS; j++)
+      printf(" %u", s.time_ms[j]);
+    printf("\n");
+  }
+
+  for(j = 0; j < NDPI_NUM_DETECTION_METHODS; j++)
+    if(j != ndpi_detection_by_extra_dissection)
+      num_flows += totals[j];
+
+  if(num_flows == 0)
+    return;
+
+  printf("\n\tClassified flows: %u\n", num_flows);
+  for(j = 0; j < NDPI_NUM_DETECTION_METHODS; j++)
+    printf("\t\t%-10s %u [%.1f %%]\n", ndpi_detection_method2str((ndpi_detection_method)j),
+	   totals[j], (100. * totals[j]) / num_flows);
+}
+
+/* *********************************************** */
+
+static void printHostMatchCacheStats() {
+  u_int64_t hits = 0, misses = 0;
+  int thread_id;
+
+  if(quiet_mode || (!enable_detection_stats))
+    return;
+
+  for(thread_id = 0; thread_id < num_threads; thread_id++) {
+    struct ndpi_host_match_cache_stats s;
+
+    if(ndpi_get_host_match_cache_stats(ndpi_thread_info[thread_id].workflow->ndpi_struct, &s) == 0)
+      hits += s.hits, misses += s.misses;
+  }
+
+  if((hits + misses) == 0)
+    return;
+
+  printf("\n\tHost match cache: %llu lookups [hits: %llu][misses: %llu][hit ratio: %.1f %%]\n",
+	 (long long unsigned int)(hits + misses), (long long unsigned int)hits,
+	 (long long unsigned int)misses, (100. * hits) / (hits + misses));
+}
+
+/* *********************************************** */
+
 static void printFlowsStats() {
   int thread_id;
   u_int32_t total_flows = 0;
@@ -2993,6 +3207,21 @@ static void printResults(u_int64_t processing_time_usec, u_int64_t setup_time_us
     printf("\tFlow Memory (per flow):  %-13s\n", formatBytes(sizeof(struct ndpi_flow_struct), buf, sizeof(buf)));
     printf("\tActual Memory:           %-13s\n", formatBytes(current_ndpi_memory, buf, sizeof(buf)));
     printf("\tPeak Memory:             %-13s\n", formatBytes(max_ndpi_memory, buf, sizeof(buf)));
+
+    if(mem_soft_limit || mem_hard_limit) {
+      struct ndpi_mem_stats mem_stats;
+      int cat;
+
+      ndpi_get_memory_stats(&mem_stats);
+
+      for(cat = 0; cat < NDPI_MEM_NUM_CATEGORIES; cat++)
+	printf("\t%-8s Memory:         %-13s\n", ndpi_mem_category_name(cat),
+	       formatBytes(mem_stats.used[cat], buf, sizeof(buf)));
+
+      printf("\tBudget Peak:             %-13s\n", formatBytes(mem_stats.peak, buf, sizeof(buf)));
+      printf("\tShed Extractions:        %llu\n", (long long unsigned int)mem_stats.shed);
+      printf("\tRefused Flows:           %llu\n", (long long unsigned int)mem_stats.denied);
+    }
     printf("\tSetup Time:              %lu msec\n", (unsigned long)(setup_time_usec/1000));
     printf("\tPacket Processing Time:  %lu msec\n", (unsigned long)(processing_time_usec/1000));
 
@@ -3053,6 +3282,30 @@ static void printResults(u_int64_t processing_time_usec, u_int64_t setup_time_us
 
       if(enable_protocol_guess)
 	printf("\tGuessed flow protos:   %-13u\n", cumulative_stats.guessed_flow_protocols);
+
+      for(thread_id = 0; thread_id < num_threads; thread_id++) {
+	u_int64_t received, dropped;
+
+	if(ring_capture[thread_id] == NULL) continue;
+
+	ndpi_ring_stats(ring_capture[thread_id], &received, &dropped);
+	printf("\tQueue %-2d %-20s received %llu dropped %llu\n", thread_id,
+	       ndpi_ring_name(ring_capture[thread_id]),
+	       (long long unsigned int)received, (long long unsigned int)dropped);
+      }
+
+      for(thread_id = 0; thread_id < num_threads; thread_id++) {
+	ndpi_flow_exporter *exporter = ndpi_thread_info[thread_id].exporter;
+
+	if(exporter == NULL) continue;
+
+	ndpi_flow_exporter_flush(exporter);
+	printf("\tExported flows [%-2d]:    %llu records / %llu bytes / %llu writes (%llu errors)\n",
+	       thread_id, (long long unsigned int)exporter->num_records,
+	       (long long unsigned int)exporter->num_bytes,
+	       (long long unsigned int)exporter->num_flushes,
+	       (long long unsigned int)exporter->num_errors);
+      }
   }
 
 
@@ -3099,6 +3352,8 @@ static void printResults(u_int64_t processing_time_usec, u_int64_t setup_time_us
 
   printRiskStats();
   printFlowsStats();
+  printDetectionStats();
+  printHostMatchCacheStats();
 
   if(verbose == 3) {
     HASH_SORT(srcStats, port_stats_sort);
@@ -3210,6 +3465,30 @@ static void configurePcapHandle(pcap_t * pcap_handle) {
   }
 }
 
+/**
+ * @brief Number of threads reading the same -i input as thread_id, the first
+ *        of them and the rank of thread_id among them
+ */
+static u_int8_t get_input_peers(u_int16_t thread_id, u_int8_t *first, u_int8_t *rank) {
+  u_int8_t i, num = 0;
+
+  *first = thread_id, *rank = 0;
+
+  for(i = 0; i < num_threads; i++) {
+    if(strcmp(_pcap_file[i], _pcap_file[thread_id]) != 0)
+      continue;
+
+    if(num == 0)
+      *first = i;
+
+    if(i < thread_id)
+      (*rank)++;
+
+    num++;
+  }
+
+  return(num);
+}
 
 /**
  * @brief Open a pcap file or a specified device - Always returns a valid pcap_t
@@ -3233,6 +3512,69 @@ static pcap_t * openPcapFileOrDevice(u_int16_t thread_id, const u_char * pcap_fi
   if(dpdk_port_init(dpdk_port_id, mbuf_pool) != 0)
     rte_exit(EXIT_FAILURE, "DPDK: Cannot init port %u: please see README.dpdk\n", dpdk_port_id);
 #else
+  if(ndpi_mmap_is_capture((const char*)pcap_file)) {
+    char mmap_error_buffer[256];
+
+    /* One mapping and one packet partition for all the threads */
+    if(thread_id == 0) {
+      if((mmap_capture = ndpi_mmap_open((const char*)pcap_file, bpfFilter,
+					mmap_error_buffer, sizeof(mmap_error_buffer))) == NULL
+	 || ndpi_mmap_partition(mmap_capture, num_threads,
+				mmap_error_buffer, sizeof(mmap_error_buffer)) != 0) {
+	printf("ERROR: could not open %s: %s\n", pcap_file, mmap_error_buffer);
+	exit(-1);
+      }
+
+      if(!ndpi_is_datalink_supported(ndpi_mmap_datalink(mmap_capture))) {
+	printf("ERROR: unsupported datalink %d in %s\n", ndpi_mmap_datalink(mmap_capture), pcap_file);
+	exit(-1);
+      }
+
+      if((!quiet_mode))
+	printf("Reading packets from pcap file %s (mmap)...\n", ndpi_mmap_name(mmap_capture));
+    }
+
+    capture_for = capture_until = 0;
+    live_capture = 0;
+
+    /* Only used for the link type */
+    return(pcap_open_dead(ndpi_mmap_datalink(mmap_capture), 262144));
+  }
+
+  if(ndpi_ring_is_capture((const char*)pcap_file)) {
+    char ring_error_buffer[256];
+    u_int8_t first, rank, num_peers = get_input_peers(thread_id, &first, &rank);
+    /*
+      Only the threads reading the same device share a fanout group (the
+      kernel refuses members bound to other devices): one per device, named
+      after the first thread reading it. Their rank is the AF_XDP queue
+    */
+    u_int16_t fanout_id = (num_peers > 1) ? (u_int16_t)(((getpid() & 0x7FF) << 5) | (first + 1)) : 0;
+
+    if((ring_capture[thread_id] = ndpi_ring_open((const char*)pcap_file, rank, fanout_id, bpfFilter,
+						 ring_error_buffer, sizeof(ring_error_buffer))) == NULL) {
+      printf("ERROR: could not open %s: %s\n", pcap_file, ring_error_buffer);
+      exit(-1);
+    }
+
+    live_capture = 1;
+
+    if((!quiet_mode))
+      printf("Capturing live traffic from %s...\n", ndpi_ring_name(ring_capture[thread_id]));
+
+    if(capture_for > 0) {
+      if((!quiet_mode))
+	printf("Capturing traffic up to %u seconds\n", (unsigned int)capture_for);
+
+#ifndef WIN32
+      alarm(capture_for);
+      signal(SIGALRM, sigproc);
+#endif
+    }
+
+    return(NULL);
+  }
+
   /* Trying to open the interface */
   if((pcap_handle = pcap_open_live((char*)pcap_file, snaplen,
 				   promisc, 500, pcap_error_buffer)) == NULL) {
@@ -3299,14 +3641,20 @@ static void ndpi_process_packet(u_char *args,
   struct ndpi_proto p;
   ndpi_risk flow_risk;
   u_int16_t thread_id = *((u_int16_t*)args);
+  uint8_t *packet_checked;
 
-  /* allocate an exact size buffer to check overflows */
-  uint8_t *packet_checked = ndpi_malloc(header->caplen);
+  if(ring_capture[thread_id] != NULL || mmap_capture != NULL) {
+    /* ring frames and mapped files are processed in place */
+    packet_checked = (uint8_t*)packet;
+  } else {
+    /* allocate an exact size buffer to check overflows */
+    packet_checked = ndpi_malloc(header->caplen);
 
-  if(packet_checked == NULL){
-    return ;
+    if(packet_checked == NULL){
+      return ;
+    }
+    memcpy(packet_checked, packet, header->caplen);
   }
-  memcpy(packet_checked, packet, header->caplen);
   p = ndpi_workflow_process_packet(ndpi_thread_info[thread_id].workflow, header, packet_checked, &flow_risk, csv_fp);
 
   if(!pcap_start.tv_sec) pcap_start.tv_sec = header->ts.tv_sec, pcap_start.tv_usec = header->ts.tv_usec;
@@ -3315,26 +3663,14 @@ static void ndpi_process_packet(u_char *args,
   /* Idle flows cleanup */
   if(live_capture) {
     if(ndpi_thread_info[thread_id].last_idle_scan_time + IDLE_SCAN_PERIOD < ndpi_thread_info[thread_id].workflow->last_time) {
-      /* scan for idle flows */
-      ndpi_twalk(ndpi_thread_info[thread_id].workflow->ndpi_flows_root[ndpi_thread_info[thread_id].idle_scan_idx],
-		 node_idle_scan_walker, &thread_id);
-
-      /* remove idle flows (unfortunately we cannot do this inline) */
-      while(ndpi_thread_info[thread_id].num_idle_flows > 0) {
-	/* search and delete the idle flow from the "ndpi_flow_root" (see struct reader thread) - here flows are the node of a b-tree */
-	ndpi_tdelete(ndpi_thread_info[thread_id].idle_flows[--ndpi_thread_info[thread_id].num_idle_flows],
-		     &ndpi_thread_info[thread_id].workflow->ndpi_flows_root[ndpi_thread_info[thread_id].idle_scan_idx],
-		     ndpi_workflow_node_cmp);
-
-	/* free the memory associated to idle flow in "idle_flows" - (see struct reader thread)*/
-	ndpi_free_flow_info_half(ndpi_thread_info[thread_id].idle_flows[ndpi_thread_info[thread_id].num_idle_flows]);
-	ndpi_free(ndpi_thread_info[thread_id].idle_flows[ndpi_thread_info[thread_id].num_idle_flows]);
-      }
-
-      if(++ndpi_thread_info[thread_id].idle_scan_idx == ndpi_thread_info[thread_id].workflow->prefs.num_roots)
-	ndpi_thread_info[thread_id].idle_scan_idx = 0;
+      /* remove idle flows */
+      ndpi_workflow_expire_idle_flows(ndpi_thread_info[thread_id].workflow, IDLE_SCAN_BUDGET,
+				      on_idle_flow, (void *)(uintptr_t)thread_id);
 
       ndpi_thread_info[thread_id].last_idle_scan_time = ndpi_thread_info[thread_id].workflow->last_time;
+
+      if(ndpi_thread_info[thread_id].exporter)
+	ndpi_flow_exporter_tick(ndpi_thread_info[thread_id].exporter, ndpi_thread_info[thread_id].workflow->last_time);
     }
   }
 
@@ -3381,7 +3717,7 @@ static void ndpi_process_packet(u_char *args,
   }
 
   /* check for buffer changes */
-  if(memcmp(packet, packet_checked, header->caplen) != 0)
+  if((packet_checked != packet) && memcmp(packet, packet_checked, header->caplen) != 0)
     printf("INTERNAL ERROR: ingress packet was modified by nDPI: this should not happen [thread_id=%u, packetId=%lu, caplen=%u]\n",
 	   thread_id, (unsigned long)ndpi_thread_info[thread_id].workflow->stats.raw_packet_count, header->caplen);
 
@@ -3402,6 +3738,12 @@ static void ndpi_process_packet(u_char *args,
       memset(&ndpi_thread_info[thread_id].workflow->stats, 0, sizeof(struct ndpi_stats));
     }
 
+    /* the flows are gone: empty the idle timer wheel too */
+    memset(ndpi_thread_info[thread_id].workflow->idle_wheel, 0,
+	   sizeof(ndpi_thread_info[thread_id].workflow->idle_wheel));
+
+    ndpi_reset_detection_stats(ndpi_thread_info[thread_id].workflow->ndpi_struct);
+
     if(!quiet_mode)
       printf("\n-------------------------------------------\n\n");
 
@@ -3413,7 +3755,7 @@ static void ndpi_process_packet(u_char *args,
      Leave the free as last statement to avoid crashes when ndpi_detection_giveup()
      is called above by printResults()
   */
-  if(packet_checked){
+  if(packet_checked && (packet_checked != packet)){
     ndpi_free(packet_checked);
     packet_checked = NULL;
   }
@@ -3485,6 +3827,26 @@ void * processing_thread(void *_thread_id) {
     }
   }
 #else
+  if(ring_capture[thread_id] != NULL) {
+    u_int16_t ring_thread_id = thread_id;
+
+    if(ndpi_ring_loop(ring_capture[thread_id], ndpi_process_packet,
+		      (u_char*)&ring_thread_id, &shutdown_app) < 0)
+      printf("Error while reading from %s\n", ndpi_ring_name(ring_capture[thread_id]));
+
+    return NULL;
+  }
+
+  if(mmap_capture != NULL) {
+    u_int16_t mmap_thread_id = thread_id;
+
+    if(ndpi_mmap_loop(mmap_capture, mmap_thread_id, ndpi_process_packet,
+		      (u_char*)&mmap_thread_id, &shutdown_app) < 0)
+      printf("Error while reading %s\n", ndpi_mmap_name(mmap_capture));
+
+    return NULL;
+  }
+
 pcap_loop:
   runPcapLoop(thread_id);
 
@@ -3557,6 +3919,10 @@ void test_lib() {
   dpdk_port_deinit(dpdk_port_id);
 #endif
 
+  /* The threads did not see the packets in file order */
+  if(mmap_capture != NULL)
+    ndpi_mmap_time_range(mmap_capture, &pcap_start, &pcap_end);
+
   gettimeofday(&end, NULL);
   processing_time_usec = end.tv_sec*1000000 + end.tv_usec - (begin.tv_sec*1000000 + begin.tv_usec);
   setup_time_usec = begin.tv_sec*1000000 + begin.tv_usec - (startup_time.tv_sec*1000000 + startup_time.tv_usec);
@@ -3568,8 +3934,18 @@ void test_lib() {
     if(ndpi_thread_info[thread_id].workflow->pcap_handle != NULL)
       pcap_close(ndpi_thread_info[thread_id].workflow->pcap_handle);
 
+    if(ring_capture[thread_id] != NULL) {
+      ndpi_ring_close(ring_capture[thread_id]);
+      ring_capture[thread_id] = NULL;
+    }
+
     terminateDetection(thread_id);
   }
+
+  if(mmap_capture != NULL) {
+    ndpi_mmap_close(mmap_capture);
+    mmap_capture = NULL;
+  }
 }
 
 /* *********************************************** */
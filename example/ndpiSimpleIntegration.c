@@ -13,11 +13,13 @@
 #include <unistd.h>
 
 #define MAX_FLOW_ROOTS_PER_THREAD 2048
-#define MAX_IDLE_FLOWS_PER_THREAD 64
+#define MAX_IDLE_FLOWS_PER_THREAD 64 /* flows checked per packet */
 #define TICK_RESOLUTION 1000
 #define MAX_READER_THREADS 4
-#define IDLE_SCAN_PERIOD 10000 /* msec */
 #define MAX_IDLE_TIME 300000 /* msec */
+#define MAX_END_TIME 10000 /* msec, ended TCP flows */
+#define IDLE_WHEEL_SLOTS 512 /* power of 2, IDLE_WHEEL_SLOTS * IDLE_WHEEL_TICK > MAX_IDLE_TIME */
+#define IDLE_WHEEL_TICK 1000 /* msec */
 #define INITIAL_THREAD_HASH 0x03dd018b
 
 #ifndef ETH_P_IP
@@ -74,6 +76,11 @@ struct nDPI_flow_info {
   struct ndpi_flow_struct * ndpi_flow;
   struct ndpi_id_struct * ndpi_src;
   struct ndpi_id_struct * ndpi_dst;
+
+  /* idle timer wheel slot list and expiry tick */
+  struct nDPI_flow_info * idle_next;
+  struct nDPI_flow_info ** idle_pprev;
+  uint64_t idle_tick;
 };
 
 struct nDPI_workflow {
@@ -88,7 +95,6 @@ struct nDPI_workflow {
   unsigned long long int total_l4_data_len;
   unsigned long long int detected_flow_protocols;
 
-  uint64_t last_idle_scan_time;
   uint64_t last_time;
 
   void ** ndpi_flows_active;
@@ -96,9 +102,8 @@ struct nDPI_workflow {
   unsigned long long int cur_active_flows;
   unsigned long long int total_active_flows;
 
-  void ** ndpi_flows_idle;
-  unsigned long long int max_idle_flows;
-  unsigned long long int cur_idle_flows;
+  struct nDPI_flow_info * idle_wheel[IDLE_WHEEL_SLOTS];
+  uint64_t idle_wheel_tick;
   unsigned long long int total_idle_flows;
 
   struct ndpi_detection_module_struct * ndpi_struct;
@@ -156,12 +161,6 @@ static struct nDPI_workflow * init_workflow(char const * const file_or_device)
   }
 
   workflow->total_idle_flows = 0;
-  workflow->max_idle_flows = MAX_IDLE_FLOWS_PER_THREAD;
-  workflow->ndpi_flows_idle = (void **)ndpi_calloc(workflow->max_idle_flows, sizeof(void *));
-  if (workflow->ndpi_flows_idle == NULL) {
-    free_workflow(&workflow);
-    return NULL;
-  }
 
   NDPI_PROTOCOL_BITMASK protos;
   NDPI_BITMASK_SET_ALL(protos);
@@ -201,7 +200,6 @@ static void free_workflow(struct nDPI_workflow ** const workflow)
     ndpi_tdestroy(w->ndpi_flows_active[i], ndpi_flow_info_freer);
   }
   ndpi_free(w->ndpi_flows_active);
-  ndpi_free(w->ndpi_flows_idle);
   ndpi_free(w);
   *workflow = NULL;
 }
@@ -257,6 +255,7 @@ static int setup_reader_threads(char const * const file_or_device)
   return 0;
 }
 
+#ifdef VERBOSE
 static int ip_tuple_to_string(struct nDPI_flow_info const * const flow,
                               char * const src_addr_str, size_t src_addr_len,
                               char * const dst_addr_str, size_t dst_addr_len)
@@ -277,7 +276,6 @@ static int ip_tuple_to_string(struct nDPI_flow_info const * const flow,
   return 0;
 }
 
-#ifdef VERBOSE
 static void print_packet_info(struct nDPI_reader_thread const * const reader_thread,
                               struct pcap_pkthdr const * const header,
                               uint32_t l4_data_len,
@@ -392,32 +390,63 @@ static int ip_tuples_compare(struct nDPI_flow_info const * const A,
   return 0;
 }
 
-static void ndpi_idle_scan_walker(void const * const A, ndpi_VISIT which, int depth, void * const user_data)
+static int flow_is_idle(struct nDPI_workflow const * const workflow,
+                        struct nDPI_flow_info const * const flow)
 {
-  struct nDPI_workflow * const workflow = (struct nDPI_workflow *)user_data;
-  struct nDPI_flow_info * const flow = *(struct nDPI_flow_info **)A;
+  return (flow->flow_fin_ack_seen == 1 && flow->flow_ack_seen == 1) ||
+         flow->last_seen + MAX_IDLE_TIME < workflow->last_time;
+}
 
-  (void)depth;
+/*
+ * Idle flows are linked in the timer wheel slot of the tick they can
+ * expire at: expiring costs the flows in the due slots only, not a walk
+ * of all the trees. A flow seen again meanwhile is moved to its new slot
+ * when the old tick is reached.
+ */
+static void idle_wheel_add(struct nDPI_workflow * const workflow,
+                           struct nDPI_flow_info * const flow,
+                           uint64_t const tick)
+{
+  struct nDPI_flow_info ** const slot = &workflow->idle_wheel[tick & (IDLE_WHEEL_SLOTS - 1)];
 
-  if (workflow == NULL || flow == NULL) {
-    return;
+  flow->idle_tick = tick;
+  flow->idle_next = *slot;
+  if (flow->idle_next != NULL) {
+    flow->idle_next->idle_pprev = &flow->idle_next;
   }
+  flow->idle_pprev = slot;
+  *slot = flow;
+}
 
-  if (workflow->cur_idle_flows == MAX_IDLE_FLOWS_PER_THREAD) {
-    return;
+static void idle_wheel_del(struct nDPI_flow_info * const flow)
+{
+  if (flow->idle_next != NULL) {
+    flow->idle_next->idle_pprev = flow->idle_pprev;
   }
+  *flow->idle_pprev = flow->idle_next;
+  flow->idle_next = NULL;
+  flow->idle_pprev = NULL;
+}
 
-  if (which == ndpi_preorder || which == ndpi_leaf) {
-    if ((flow->flow_fin_ack_seen == 1 && flow->flow_ack_seen == 1) ||
-	flow->last_seen + MAX_IDLE_TIME < workflow->last_time)
-      {
-	char src_addr_str[INET6_ADDRSTRLEN+1];
-	char dst_addr_str[INET6_ADDRSTRLEN+1];
-	ip_tuple_to_string(flow, src_addr_str, sizeof(src_addr_str), dst_addr_str, sizeof(dst_addr_str));
-	workflow->ndpi_flows_idle[workflow->cur_idle_flows++] = flow;
-	workflow->total_idle_flows++;
-      }
+static void idle_wheel_schedule(struct nDPI_workflow * const workflow,
+                                struct nDPI_flow_info * const flow)
+{
+  uint64_t tick;
+
+  if (flow->flow_fin_ack_seen == 1 && flow->flow_ack_seen == 1) {
+    tick = (workflow->last_time + MAX_END_TIME) / IDLE_WHEEL_TICK + 1;
+  } else {
+    tick = (flow->last_seen + MAX_IDLE_TIME) / IDLE_WHEEL_TICK + 1;
+  }
+
+  if (flow->idle_pprev != NULL) {
+    if (flow->idle_tick <= tick) {
+      /* moved to its new slot when the old tick is reached */
+      return;
+    }
+    idle_wheel_del(flow);
   }
+  idle_wheel_add(workflow, flow, tick);
 }
 
 static int ndpi_workflow_node_cmp(void const * const A, void const * const B) {
@@ -449,26 +478,49 @@ static int ndpi_workflow_node_cmp(void const * const A, void const * const B) {
 
 static void check_for_idle_flows(struct nDPI_workflow * const workflow)
 {
-  if (workflow->last_idle_scan_time + IDLE_SCAN_PERIOD < workflow->last_time) {
-    for (size_t idle_scan_index = 0; idle_scan_index < workflow->max_active_flows; ++idle_scan_index) {
-      ndpi_twalk(workflow->ndpi_flows_active[idle_scan_index], ndpi_idle_scan_walker, workflow);
-
-      while (workflow->cur_idle_flows > 0) {
-	struct nDPI_flow_info * const f =
-	  (struct nDPI_flow_info *)workflow->ndpi_flows_idle[--workflow->cur_idle_flows];
-	if (f->flow_fin_ack_seen == 1) {
-	  printf("Free fin flow with id %u\n", f->flow_id);
-	} else {
-	  printf("Free idle flow with id %u\n", f->flow_id);
-	}
-	ndpi_tdelete(f, &workflow->ndpi_flows_active[idle_scan_index],
-		     ndpi_workflow_node_cmp);
-	ndpi_flow_info_freer(f);
-	workflow->cur_active_flows--;
+  uint64_t const now_tick = workflow->last_time / IDLE_WHEEL_TICK;
+  size_t budget = MAX_IDLE_FLOWS_PER_THREAD;
+
+  /* past a full turn all the slots are checked anyway */
+  if (workflow->idle_wheel_tick + IDLE_WHEEL_SLOTS <= now_tick) {
+    workflow->idle_wheel_tick = now_tick - IDLE_WHEEL_SLOTS + 1;
+  }
+
+  while (workflow->idle_wheel_tick <= now_tick) {
+    struct nDPI_flow_info * f = workflow->idle_wheel[workflow->idle_wheel_tick & (IDLE_WHEEL_SLOTS - 1)];
+    struct nDPI_flow_info * next;
+
+    for (; f != NULL; f = next) {
+      next = f->idle_next;
+
+      if (f->idle_tick > workflow->idle_wheel_tick) {
+        /* a later turn */
+        continue;
+      }
+      if (budget-- == 0) {
+        /* this slot is checked again with the next packet */
+        return;
+      }
+
+      idle_wheel_del(f);
+      if (flow_is_idle(workflow, f) == 0) {
+        idle_wheel_schedule(workflow, f);
+        continue;
+      }
+
+      if (f->flow_fin_ack_seen == 1) {
+        printf("Free fin flow with id %u\n", f->flow_id);
+      } else {
+        printf("Free idle flow with id %u\n", f->flow_id);
       }
+      ndpi_tdelete(f, &workflow->ndpi_flows_active[f->hashval % workflow->max_active_flows],
+                   ndpi_workflow_node_cmp);
+      ndpi_flow_info_freer(f);
+      workflow->cur_active_flows--;
+      workflow->total_idle_flows++;
     }
 
-    workflow->last_idle_scan_time = workflow->last_time;
+    workflow->idle_wheel_tick++;
   }
 }
 
@@ -742,7 +794,7 @@ static void ndpi_process_packet(uint8_t * const args,
     if (workflow->cur_active_flows == workflow->max_active_flows) {
       fprintf(stderr, "[%8llu, %d] max flows to track reached: %llu, idle: %llu\n",
 	      workflow->packets_captured, reader_thread->array_index,
-	      workflow->max_active_flows, workflow->cur_idle_flows);
+	      workflow->max_active_flows, workflow->total_idle_flows);
       return;
     }
 
@@ -764,7 +816,6 @@ static void ndpi_process_packet(uint8_t * const args,
 	      workflow->packets_captured, reader_thread->array_index, flow_to_process->flow_id);
       return;
     }
-    memset(flow_to_process->ndpi_flow, 0, SIZEOF_FLOW_STRUCT);
 
     flow_to_process->ndpi_src = (struct ndpi_id_struct *)ndpi_calloc(1, SIZEOF_ID_STRUCT);
     if (flow_to_process->ndpi_src == NULL) {
@@ -815,10 +866,12 @@ static void ndpi_process_packet(uint8_t * const args,
   /* TCP-FIN: indicates that at least one side wants to end the connection */
   if (flow.flow_fin_ack_seen != 0 && flow_to_process->flow_fin_ack_seen == 0) {
     flow_to_process->flow_fin_ack_seen = 1;
+    idle_wheel_schedule(workflow, flow_to_process);
     printf("[%8llu, %d, %4u] end of flow\n",  workflow->packets_captured, thread_index,
 	   flow_to_process->flow_id);
     return;
   }
+  idle_wheel_schedule(workflow, flow_to_process);
 
   /*
    * This example tries to use maximum supported packets for detection:
@@ -89,34 +89,45 @@
 extern u_int8_t enable_protocol_guess, enable_joy_stats, enable_payload_analyzer;
 extern u_int8_t verbose, human_readeable_string_len;
 extern u_int8_t max_num_udp_dissected_pkts /* 24 */, max_num_tcp_dissected_pkts /* 80 */;
-static u_int32_t flow_id = 0;
 
 u_int8_t enable_doh_dot_detection = 0;
 u_int8_t enable_ja3_plus = 0;
 
 /* ****************************************************** */
 
-struct flow_id_stats {
-  u_int32_t flow_id;
-  UT_hash_handle hh;   /* makes this structure hashable */
-};
+/*
+  Payload pattern analyzer: runs in fixed memory on any capture size.
 
-struct packet_id_stats {
-  u_int32_t packet_id;
-  UT_hash_handle hh;   /* makes this structure hashable */
-};
+  Occurrences of every pattern are counted by a count-min sketch
+  (conservative update); the patterns with the highest estimates are
+  kept in a min-heap of PAYLOAD_TOPK_MIN..max_num_reported_top_payloads*4
+  entries, each one with a HLL of the flows where it has been seen.
+*/
+#define PAYLOAD_CMS_DEPTH     4
+#define PAYLOAD_CMS_WIDTH     65536 /* power of 2 */
+#define PAYLOAD_TOPK_MIN      256
+#define PAYLOAD_HLL_BITS      10
+#define PAYLOAD_MAX_PKT_IDS   8
 
 struct payload_stats {
-  u_int8_t *pattern;
+  u_int8_t pattern[16];
   u_int8_t pattern_len;
-  u_int16_t num_occurrencies;
-  struct flow_id_stats *flows;
-  struct packet_id_stats *packets;
+  u_int32_t num_occurrencies;  /* count-min estimate */
+  u_int32_t heap_idx;
+  struct ndpi_hll flows;       /* distinct flow ids */
+  u_int32_t num_packets;       /* distinct packets since the pattern is tracked */
+  u_int8_t num_packet_ids;
+  u_int32_t packet_ids[PAYLOAD_MAX_PKT_IDS]; /* first packets (sample) */
   UT_hash_handle hh;   /* makes this structure hashable */
 };
 
+static struct {
+  u_int32_t *cms;              /* PAYLOAD_CMS_DEPTH rows of PAYLOAD_CMS_WIDTH counters */
+  struct payload_stats *entries, **heap, *by_pattern;
+  u_int32_t topk, num_entries;
+  u_int64_t num_occurrencies;
+} pstats;
 
-struct payload_stats *pstats = NULL;
 u_int32_t max_num_packets_per_flow      = 10; /* ETTA requires min 10 pkts for record. */
 u_int32_t max_packet_payload_dissection = 128;
 u_int32_t max_num_reported_top_payloads = 25;
@@ -125,14 +136,129 @@ u_int16_t max_pattern_len = 8;
 
 /* *********************************************************** */
 
+static int ndpi_payload_stats_init() {
+  u_int32_t i;
+
+  pstats.topk = ndpi_max(PAYLOAD_TOPK_MIN, max_num_reported_top_payloads * 4);
+  pstats.cms = (u_int32_t*)ndpi_calloc(PAYLOAD_CMS_DEPTH * PAYLOAD_CMS_WIDTH, sizeof(u_int32_t));
+  pstats.entries = (struct payload_stats*)ndpi_calloc(pstats.topk, sizeof(struct payload_stats));
+  pstats.heap = (struct payload_stats**)ndpi_calloc(pstats.topk, sizeof(struct payload_stats*));
+
+  if((pstats.cms == NULL) || (pstats.entries == NULL) || (pstats.heap == NULL))
+    goto init_error;
+
+  for(i = 0; i < pstats.topk; i++)
+    if(ndpi_hll_init(&pstats.entries[i].flows, PAYLOAD_HLL_BITS) != 0)
+      goto init_error;
+
+  return(0);
+
+ init_error:
+  if(pstats.entries) {
+    for(i = 0; i < pstats.topk; i++) ndpi_hll_destroy(&pstats.entries[i].flows);
+  }
+
+  ndpi_free(pstats.cms), ndpi_free(pstats.entries), ndpi_free(pstats.heap);
+  memset(&pstats, 0, sizeof(pstats));
+  return(-1);
+}
+
+/* *********************************************************** */
+
+static void ndpi_payload_stats_term() {
+  u_int32_t i;
+
+  HASH_CLEAR(hh, pstats.by_pattern);
+
+  if(pstats.entries) {
+    for(i = 0; i < pstats.topk; i++) ndpi_hll_destroy(&pstats.entries[i].flows);
+  }
+
+  ndpi_free(pstats.cms), ndpi_free(pstats.entries), ndpi_free(pstats.heap);
+  memset(&pstats, 0, sizeof(pstats));
+}
+
+/* *********************************************************** */
+
+static u_int64_t ndpi_payload_hash(const u_int8_t *pattern, u_int16_t pattern_len) {
+  u_int64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+  u_int16_t i;
+
+  for(i = 0; i < pattern_len; i++)
+    h = (h ^ pattern[i]) * 0x100000001b3ULL;
+
+  return(h);
+}
+
+/* Returns the updated estimate of the pattern occurrencies */
+static u_int32_t ndpi_payload_cms_update(u_int64_t h) {
+  u_int32_t h1, h2, idx[PAYLOAD_CMS_DEPTH], min = 0xFFFFFFFF, i;
+
+  h1 = (u_int32_t)h, h2 = (u_int32_t)(h >> 32) | 1;
+
+  for(i = 0; i < PAYLOAD_CMS_DEPTH; i++) {
+    idx[i] = i * PAYLOAD_CMS_WIDTH + ((h1 + i * h2) & (PAYLOAD_CMS_WIDTH - 1));
+    if(pstats.cms[idx[i]] < min) min = pstats.cms[idx[i]];
+  }
+
+  if(min == 0xFFFFFFFF)
+    return(min);
+
+  /* Conservative update: only the counters that are at the minimum grow */
+  for(i = 0; i < PAYLOAD_CMS_DEPTH; i++)
+    if(pstats.cms[idx[i]] == min) pstats.cms[idx[i]]++;
+
+  return(min + 1);
+}
+
+/* *********************************************************** */
+
+static void ndpi_payload_heap_swap(u_int32_t a, u_int32_t b) {
+  struct payload_stats *tmp = pstats.heap[a];
+
+  pstats.heap[a] = pstats.heap[b], pstats.heap[b] = tmp;
+  pstats.heap[a]->heap_idx = a, pstats.heap[b]->heap_idx = b;
+}
+
+/* Estimates only grow, so an updated entry can only move down */
+static void ndpi_payload_heap_sift_down(u_int32_t i) {
+  while(1) {
+    u_int32_t l = 2 * i + 1, r = l + 1, smallest = i;
+
+    if((l < pstats.num_entries) && (pstats.heap[l]->num_occurrencies < pstats.heap[smallest]->num_occurrencies))
+      smallest = l;
+    if((r < pstats.num_entries) && (pstats.heap[r]->num_occurrencies < pstats.heap[smallest]->num_occurrencies))
+      smallest = r;
+
+    if(smallest == i) break;
+
+    ndpi_payload_heap_swap(i, smallest);
+    i = smallest;
+  }
+}
+
+static void ndpi_payload_heap_sift_up(u_int32_t i) {
+  while(i > 0) {
+    u_int32_t parent = (i - 1) / 2;
+
+    if(pstats.heap[parent]->num_occurrencies <= pstats.heap[i]->num_occurrencies)
+      break;
+
+    ndpi_payload_heap_swap(i, parent);
+    i = parent;
+  }
+}
+
+/* *********************************************************** */
+
 void ndpi_analyze_payload(struct ndpi_flow_info *flow,
 			  u_int8_t src_to_dst_direction,
 			  u_int8_t *payload,
 			  u_int16_t payload_len,
 			  u_int32_t packet_id) {
   struct payload_stats *ret;
-  struct flow_id_stats *f;
-  struct packet_id_stats *p;
+  u_int64_t h;
+  u_int32_t hashv, estimate;
 
 #ifdef DEBUG_PAYLOAD
   for(i=0; i<payload_len; i++)
@@ -140,46 +266,60 @@ void ndpi_analyze_payload(struct ndpi_flow_info *flow,
   printf("\n");
 #endif
 
-  HASH_FIND(hh, pstats, payload, payload_len, ret);
-  if(ret == NULL) {
-    if((ret = (struct payload_stats*)ndpi_calloc(1, sizeof(struct payload_stats))) == NULL)
-      return; /* OOM */
+  if((pstats.cms == NULL) && (ndpi_payload_stats_init() != 0))
+    return; /* OOM */
 
-    if((ret->pattern = (u_int8_t*)ndpi_malloc(payload_len)) == NULL) {
-      ndpi_free(ret);
+  if(payload_len > sizeof(ret->pattern))
+    payload_len = sizeof(ret->pattern);
+
+  /* The same hash is used by the sketch and by the top-k lookup */
+  h = ndpi_payload_hash(payload, payload_len);
+  hashv = (u_int32_t)(h ^ (h >> 32));
+
+  pstats.num_occurrencies++;
+  estimate = ndpi_payload_cms_update(h);
+
+  HASH_FIND_BYHASHVALUE(hh, pstats.by_pattern, payload, payload_len, hashv, ret);
+
+  if(ret == NULL) {
+    if(pstats.num_entries < pstats.topk) {
+      ret = &pstats.entries[pstats.num_entries];
+      ret->heap_idx = pstats.num_entries++;
+      pstats.heap[ret->heap_idx] = ret;
+    } else if(estimate > pstats.heap[0]->num_occurrencies) {
+      /* Evict the least frequent tracked pattern */
+      ret = pstats.heap[0];
+      HASH_DEL(pstats.by_pattern, ret);
+      ndpi_hll_reset(&ret->flows);
+    } else
       return;
-    }
 
     memcpy(ret->pattern, payload, payload_len);
     ret->pattern_len = payload_len;
-    ret->num_occurrencies = 1;
+    ret->num_packets = 0, ret->num_packet_ids = 0;
+    ret->num_occurrencies = estimate;
 
-    HASH_ADD(hh, pstats, pattern[0], payload_len, ret);
+    HASH_ADD_BYHASHVALUE(hh, pstats.by_pattern, pattern[0], payload_len, hashv, ret);
+    ndpi_payload_heap_sift_up(ret->heap_idx);
+    ndpi_payload_heap_sift_down(ret->heap_idx);
 
 #ifdef DEBUG_PAYLOAD
-    printf("Added element [total: %u]\n", HASH_COUNT(pstats));
+    printf("Added element [total: %u]\n", HASH_COUNT(pstats.by_pattern));
 #endif
   } else {
-    ret->num_occurrencies++;
-    // printf("==> %u\n", ret->num_occurrencies);
+    ret->num_occurrencies = estimate;
+    ndpi_payload_heap_sift_down(ret->heap_idx);
   }
 
-  HASH_FIND_INT(ret->flows, &flow->flow_id, f);
-  if(f == NULL) {
-    if((f = (struct flow_id_stats*)ndpi_calloc(1, sizeof(struct flow_id_stats))) == NULL)
-      return; /* OOM */
-
-    f->flow_id = flow->flow_id;
-    HASH_ADD_INT(ret->flows, flow_id, f);
-  }
+  ndpi_hll_add_number(&ret->flows, flow->flow_id);
 
-  HASH_FIND_INT(ret->packets, &packet_id, p);
-  if(p == NULL) {
-    if((p = (struct packet_id_stats*)ndpi_calloc(1, sizeof(struct packet_id_stats))) == NULL)
-      return; /* OOM */
-    p->packet_id = packet_id;
-
-    HASH_ADD_INT(ret->packets, packet_id, p);
+  /* A packet is scanned at once: repeated packet ids are consecutive */
+  if((ret->num_packet_ids == 0) || (ret->packet_ids[ret->num_packet_ids - 1] != packet_id)) {
+    if(ret->num_packet_ids < PAYLOAD_MAX_PKT_IDS)
+      ret->packet_ids[ret->num_packet_ids++] = packet_id;
+    else
+      ret->packet_ids[PAYLOAD_MAX_PKT_IDS - 1] = packet_id; /* last one */
+    ret->num_packets++;
   }
 }
 
@@ -215,20 +355,18 @@ void ndpi_payload_analyzer(struct ndpi_flow_info *flow,
 
 /* ***************************************************** */
 
-static int payload_stats_sort_asc(void *_a, void *_b) {
-  struct payload_stats *a = (struct payload_stats *)_a;
-  struct payload_stats *b = (struct payload_stats *)_b;
+static int payload_stats_sort_desc(const void *_a, const void *_b) {
+  const struct payload_stats *a = *(const struct payload_stats **)_a;
+  const struct payload_stats *b = *(const struct payload_stats **)_b;
 
-  //return(a->num_occurrencies - b->num_occurrencies);
-  return(b->num_occurrencies - a->num_occurrencies);
+  if(a->num_occurrencies == b->num_occurrencies) return(0);
+  return((b->num_occurrencies > a->num_occurrencies) ? 1 : -1);
 }
 
 /* ***************************************************** */
 
 void print_payload_stat(struct payload_stats *p) {
   u_int i;
-  struct flow_id_stats *s, *tmp;
-  struct packet_id_stats *s1, *tmp1;
 
   printf("\t[");
 
@@ -249,68 +387,38 @@ void print_payload_stat(struct payload_stats *p) {
   for(; i<16; i++) printf("  ");
   for(i=p->pattern_len; i<max_pattern_len; i++) printf(" ");
 
-  printf("[len: %u][num_occurrencies: %u][flowId: ",
-	 p->pattern_len, p->num_occurrencies);
-
-  i = 0;
-  HASH_ITER(hh, p->flows, s, tmp) {
-    printf("%s%u", (i > 0) ? " " : "", s->flow_id);
-    i++;
-  }
-
-  printf("][packetIds: ");
-
-  /* ******************************** */
+  printf("[len: %u][num_occurrencies: %u][num_flows: %.0f][num_packets: %u][packetIds: ",
+	 p->pattern_len, p->num_occurrencies, ndpi_hll_count(&p->flows), p->num_packets);
 
-  i = 0;
-  HASH_ITER(hh, p->packets, s1, tmp1) {
-    printf("%s%u", (i > 0) ? " " : "", s1->packet_id);
-    i++;
+  for(i=0; i<p->num_packet_ids; i++) {
+    if((i == (PAYLOAD_MAX_PKT_IDS - 1)) && (p->num_packets > PAYLOAD_MAX_PKT_IDS))
+      printf(" ...");
+    printf("%s%u", (i > 0) ? " " : "", p->packet_ids[i]);
   }
 
   printf("]\n");
-
-
 }
 
 /* ***************************************************** */
 
 void ndpi_report_payload_stats() {
-  struct payload_stats *p, *tmp;
-  u_int num = 0;
+  u_int num;
 
   printf("\n\nPayload Analysis\n");
 
-  HASH_SORT(pstats, payload_stats_sort_asc);
-
-  HASH_ITER(hh, pstats, p, tmp) {
-    if(num <= max_num_reported_top_payloads)
-      print_payload_stat(p);
-
-    ndpi_free(p->pattern);
-
-    {
-      struct flow_id_stats *p1, *tmp1;
+  if(pstats.num_entries == 0)
+    return;
 
-      HASH_ITER(hh, p->flows, p1, tmp1) {
-	HASH_DEL(p->flows, p1);
-	ndpi_free(p1);
-      }
-    }
+  printf("\t[occurrencies: %llu][tracked patterns: %u/%u][sketch: %u x %u]\n",
+	 (long long unsigned int)pstats.num_occurrencies, pstats.num_entries, pstats.topk,
+	 PAYLOAD_CMS_DEPTH, PAYLOAD_CMS_WIDTH);
 
-    {
-      struct packet_id_stats *p1, *tmp1;
+  qsort(pstats.heap, pstats.num_entries, sizeof(struct payload_stats*), payload_stats_sort_desc);
 
-      HASH_ITER(hh, p->packets, p1, tmp1) {
-	HASH_DEL(p->packets, p1);
-	ndpi_free(p1);
-      }
-    }
+  for(num = 0; (num < pstats.num_entries) && (num <= max_num_reported_top_payloads); num++)
+    print_payload_stat(pstats.heap[num]);
 
-    HASH_DEL(pstats, p);
-    ndpi_free(p);
-    num++;
-  }
+  ndpi_payload_stats_term();
 }
 
 /* ***************************************************** */
@@ -438,6 +546,7 @@ struct ndpi_workflow* ndpi_workflow_init(const struct ndpi_workflow_prefs * pref
   workflow->pcap_handle = pcap_handle;
   workflow->prefs       = *prefs;
   workflow->ndpi_struct = module;
+  workflow->flow_id_step = 1;
 
   ndpi_set_log_level(module, nDPI_LogLevel);
 
@@ -579,6 +688,81 @@ int ndpi_workflow_node_cmp(const void *a, const void *b) {
 
 /* ***************************************************** */
 
+/* Idle flows: each flow is linked in the timer wheel slot of the tick
+   it can expire at (after MAX_IDLE_TIME without packets). Packets don't
+   move flows: a flow seen again is moved to its new slot when its old
+   tick is reached, so expiring costs O(flows checked) instead of a
+   walk of all the flows */
+
+static void ndpi_idle_wheel_add(struct ndpi_workflow *workflow, struct ndpi_flow_info *flow,
+				u_int64_t last_seen_ms) {
+  struct ndpi_flow_info **slot;
+
+  flow->idle_tick = (last_seen_ms + MAX_IDLE_TIME) / IDLE_WHEEL_TICK + 1;
+  slot = &workflow->idle_wheel[flow->idle_tick & (IDLE_WHEEL_SLOTS - 1)];
+
+  if((flow->idle_next = *slot) != NULL)
+    flow->idle_next->idle_pprev = &flow->idle_next;
+  flow->idle_pprev = slot, *slot = flow;
+}
+
+static void ndpi_idle_wheel_del(struct ndpi_flow_info *flow) {
+  if(flow->idle_next)
+    flow->idle_next->idle_pprev = flow->idle_pprev;
+  *flow->idle_pprev = flow->idle_next;
+  flow->idle_next = NULL, flow->idle_pprev = NULL;
+}
+
+/* ***************************************************** */
+
+u_int32_t ndpi_workflow_expire_idle_flows(struct ndpi_workflow * workflow, u_int32_t budget,
+					  ndpi_workflow_callback_ptr idle_callback, void * udata) {
+  u_int64_t now_tick = workflow->last_time / IDLE_WHEEL_TICK;
+  u_int32_t num_checked = 0, num_expired = 0;
+
+  /* Past a full turn all the slots are checked anyway */
+  if(workflow->idle_wheel_tick + IDLE_WHEEL_SLOTS <= now_tick)
+    workflow->idle_wheel_tick = now_tick - IDLE_WHEEL_SLOTS + 1;
+
+  while(workflow->idle_wheel_tick <= now_tick) {
+    struct ndpi_flow_info *flow = workflow->idle_wheel[workflow->idle_wheel_tick & (IDLE_WHEEL_SLOTS - 1)], *next;
+
+    for(; flow != NULL; flow = next) {
+      next = flow->idle_next;
+
+      if(flow->idle_tick > workflow->idle_wheel_tick)
+	continue; /* a later turn */
+
+      if(num_checked++ == budget)
+	return(num_expired); /* this slot will be checked again */
+
+      ndpi_idle_wheel_del(flow);
+
+      if(flow->last_seen_ms + MAX_IDLE_TIME >= workflow->last_time) {
+	/* seen meanwhile */
+	ndpi_idle_wheel_add(workflow, flow, flow->last_seen_ms);
+	continue;
+      }
+
+      if(idle_callback)
+	idle_callback(workflow, flow, udata);
+
+      ndpi_tdelete(flow, &workflow->ndpi_flows_root[flow->hashval % workflow->prefs.num_roots],
+		   ndpi_workflow_node_cmp);
+      ndpi_flow_info_free_data(flow);
+      ndpi_free(flow);
+      workflow->stats.ndpi_flow_count--;
+      num_expired++;
+    }
+
+    workflow->idle_wheel_tick++;
+  }
+
+  return(num_expired);
+}
+
+/* ***************************************************** */
+
 /**
  * \brief Update the byte count for the flow record.
  * \param f Flow data
@@ -607,20 +791,11 @@ ndpi_flow_update_byte_count(struct ndpi_flow_info *flow, const void *x,
     }
 
     if(current_count < ETTA_MIN_OCTETS) {
-      u_int32_t i;
-      const unsigned char *data = x;
-
-      for(i=0; i<len; i++) {
-        if(src_to_dst_direction) {
-          flow->entropy.src2dst_byte_count[data[i]]++;
-        } else {
-          flow->entropy.dst2src_byte_count[data[i]]++;
-        }
-        current_count++;
-        if(current_count >= ETTA_MIN_OCTETS) {
-          break;
-        }
-      }
+      u_int32_t n = ndpi_min(len, ETTA_MIN_OCTETS - current_count);
+
+      ndpi_byte_histogram_update(src_to_dst_direction ? flow->entropy.src2dst_byte_count
+				 : flow->entropy.dst2src_byte_count,
+				 (const u_int8_t *)x, n);
     }
   }
 }
@@ -637,26 +812,14 @@ ndpi_flow_update_byte_count(struct ndpi_flow_info *flow, const void *x,
 static void
 ndpi_flow_update_byte_dist_mean_var(ndpi_flow_info_t *flow, const void *x,
                                     unsigned int len, u_int8_t src_to_dst_direction) {
-  const unsigned char *data = x;
-
   if((flow->entropy.src2dst_pkt_count+flow->entropy.dst2src_pkt_count) <= max_num_packets_per_flow) {
-    unsigned int i;
-
-    for(i=0; i<len; i++) {
-      double delta;
-
-      if(src_to_dst_direction) {
-        flow->entropy.src2dst_num_bytes += 1;
-        delta = ((double)data[i] - flow->entropy.src2dst_bd_mean);
-        flow->entropy.src2dst_bd_mean += delta/((double)flow->entropy.src2dst_num_bytes);
-        flow->entropy.src2dst_bd_variance += delta*((double)data[i] - flow->entropy.src2dst_bd_mean);
-      } else {
-        flow->entropy.dst2src_num_bytes += 1;
-        delta = ((double)data[i] - flow->entropy.dst2src_bd_mean);
-        flow->entropy.dst2src_bd_mean += delta/((double)flow->entropy.dst2src_num_bytes);
-        flow->entropy.dst2src_bd_variance += delta*((double)data[i] - flow->entropy.dst2src_bd_mean);
-      }
-    }
+    /* bd_variance holds the sum of squared deviations (see ndpiReader) */
+    if(src_to_dst_direction)
+      ndpi_byte_dist_update(&flow->entropy.src2dst_num_bytes, &flow->entropy.src2dst_bd_mean,
+			    &flow->entropy.src2dst_bd_variance, (const u_int8_t *)x, len);
+    else
+      ndpi_byte_dist_update(&flow->entropy.dst2src_num_bytes, &flow->entropy.dst2src_bd_mean,
+			    &flow->entropy.dst2src_bd_variance, (const u_int8_t *)x, len);
   }
 }
 
@@ -665,17 +828,7 @@ ndpi_flow_update_byte_dist_mean_var(ndpi_flow_info_t *flow, const void *x,
 float ndpi_flow_get_byte_count_entropy(const uint32_t byte_count[256],
 				       unsigned int num_bytes)
 {
-  int i;
-  float sum = 0.0;
-
-  for(i=0; i<256; i++) {
-    float tmp = (float) byte_count[i] / (float) num_bytes;
-
-    if(tmp > FLT_EPSILON) {
-      sum -= tmp * logf(tmp);
-    }
-  }
-  return(sum / logf(2.0));
+  return(ndpi_byte_count_entropy(byte_count, num_bytes));
 }
 
 /* ***************************************************** */
@@ -831,7 +984,7 @@ static struct ndpi_flow_info *get_ndpi_flow_info(struct ndpi_workflow * workflow
         workflow->num_allocated_flows++;
 
       memset(newflow, 0, sizeof(struct ndpi_flow_info));
-      newflow->flow_id = flow_id++;
+      newflow->flow_id = workflow->next_flow_id, workflow->next_flow_id += workflow->flow_id_step;
       newflow->hashval = hashval;
       newflow->tunnel_type = tunnel_type;
       newflow->protocol = iph->protocol, newflow->vlan_id = vlan_id;
@@ -870,8 +1023,7 @@ static struct ndpi_flow_info *get_ndpi_flow_info(struct ndpi_workflow * workflow
 #endif
 	ndpi_free(newflow);
 	return(NULL);
-      } else
-	memset(newflow->ndpi_flow, 0, SIZEOF_FLOW_STRUCT);
+      }
 
       if((newflow->src_id = ndpi_malloc(SIZEOF_ID_STRUCT)) == NULL) {
 	LOG(NDPI_LOG_ERROR, "[NDPI] %s(3): not enough memory\n", __FUNCTION__);
@@ -899,6 +1051,7 @@ static struct ndpi_flow_info *get_ndpi_flow_info(struct ndpi_workflow * workflow
 
       ndpi_tsearch(newflow, &workflow->ndpi_flows_root[idx], ndpi_workflow_node_cmp); /* Add */
       workflow->stats.ndpi_flow_count++;
+      ndpi_idle_wheel_add(workflow, newflow, workflow->last_time);
 
       *src = newflow->src_id, *dst = newflow->dst_id;
       newflow->entropy.src2dst_pkt_len[newflow->entropy.src2dst_pkt_count] = l4_data_len;
@@ -1521,7 +1674,11 @@ static struct ndpi_proto packet_processing(struct ndpi_workflow * workflow,
     flow->detected_protocol = ndpi_detection_process_packet(workflow->ndpi_struct, ndpi_flow,
 							    iph ? (uint8_t *)iph : (uint8_t *)iph6,
 							    ipsize, time_ms, src, dst);
-    
+
+    /* Nothing left to dissect (only with ndpi_set_detection_budget()) */
+    if(ndpi_detection_budget_exhausted(workflow->ndpi_struct, ndpi_flow))
+      enough_packets = 1;
+
     if(enough_packets || (flow->detected_protocol.app_protocol != NDPI_PROTOCOL_UNKNOWN)) {
       if((!enough_packets)
 	 && ndpi_extra_dissection_possible(workflow->ndpi_struct, ndpi_flow))
@@ -1774,7 +1931,8 @@ struct ndpi_proto ndpi_workflow_process_packet(struct ndpi_workflow * workflow,
 #ifdef USE_DPDK
   datalink_type = DLT_EN10MB;
 #else
-  datalink_type = (int)pcap_datalink(workflow->pcap_handle);
+  /* tpacket/xdp ring captures have no pcap handle and are always ethernet */
+  datalink_type = workflow->pcap_handle ? (int)pcap_datalink(workflow->pcap_handle) : DLT_EN10MB;
 #endif
   h_caplen = header->caplen;
   h_len = header->len;
@@ -71,6 +71,9 @@ extern int dpdk_port_deinit(int port);
 #define IDLE_SCAN_PERIOD           10 /* msec (use TICK_RESOLUTION = 1000) */
 #define MAX_IDLE_TIME           30000
 #define IDLE_SCAN_BUDGET         1024
+/* Idle flow timer wheel: IDLE_WHEEL_SLOTS * IDLE_WHEEL_TICK must exceed MAX_IDLE_TIME */
+#define IDLE_WHEEL_SLOTS           64 /* power of 2 */
+#define IDLE_WHEEL_TICK          1000 /* msec */
 #define NUM_ROOTS                 512
 #define MAX_EXTRA_PACKETS_TO_CHECK  7
 #define MAX_NDPI_FLOWS      200000000
@@ -244,6 +247,10 @@ typedef struct ndpi_flow_info {
 #else
   struct ndpi_bin payload_len_bin;
 #endif
+
+  /* Idle timer wheel slot list, expiry tick (see ndpi_workflow_expire_idle_flows) */
+  struct ndpi_flow_info *idle_next, **idle_pprev;
+  u_int64_t idle_tick;
 } ndpi_flow_info_t;
 
 
@@ -298,6 +305,14 @@ typedef struct ndpi_workflow {
   void **ndpi_flows_root;
   struct ndpi_detection_module_struct *ndpi_struct;
   u_int32_t num_allocated_flows;
+
+  /* Flow ids: next_flow_id, then every flow_id_step (workflows reading
+     parts of the same capture get distinct, reproducible ids) */
+  u_int32_t next_flow_id, flow_id_step;
+
+  /* Flows by idle expiry tick: a flow is checked once its tick is reached */
+  struct ndpi_flow_info *idle_wheel[IDLE_WHEEL_SLOTS];
+  u_int64_t idle_wheel_tick; /* next tick to check */
 } ndpi_workflow_t;
 
 
@@ -325,6 +340,12 @@ struct ndpi_proto ndpi_workflow_process_packet(struct ndpi_workflow * workflow,
 
 int ndpi_is_datalink_supported(int datalink_type);
 
+/* Remove the flows idle for more than MAX_IDLE_TIME, checking at most
+   budget flows: the callback is called for each of them before it is
+   freed. Returns the number of flows removed */
+u_int32_t ndpi_workflow_expire_idle_flows(struct ndpi_workflow * workflow, u_int32_t budget,
+					  ndpi_workflow_callback_ptr idle_callback, void * udata);
+
 /* flow callbacks for complete detected flow
    (ndpi_flow_info will be freed right after) */
 static inline void ndpi_workflow_set_flow_detected_callback(struct ndpi_workflow * workflow, ndpi_workflow_callback_ptr callback, void * udata) {
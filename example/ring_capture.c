@@ -0,0 +1,497 @@
+/*
+ * ring_capture.c
+ *
+ * Copyright (C) 2011-21 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ndpi_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "ring_capture.h"
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#ifdef HAVE_LIBBPF_XSK
+#ifdef HAVE_XDP_XSK_H
+#include <xdp/xsk.h>
+#else
+#include <bpf/xsk.h>
+#endif
+#include <linux/if_xdp.h>
+#endif
+
+/* TPACKET_V3: 64 blocks of 4 MB, each block is retired after 60 msec at most */
+#define RING_BLOCK_SIZE   (1 << 22)
+#define RING_BLOCK_NR     64
+#define RING_FRAME_SIZE   2048
+#define RING_BLOCK_TMO    60
+
+/* AF_XDP */
+#define XSK_NUM_FRAMES    4096
+#define XSK_RX_BATCH      64
+
+#define RING_POLL_TMO     100 /* msec, keeps the loop responsive to *stop */
+
+enum ring_type {
+  RING_TPACKET = 0,
+  RING_XDP
+};
+
+struct ndpi_ring_capture {
+  enum ring_type type;
+  int fd;
+  u_int16_t queue_id;
+  char name[64];
+  u_int64_t received, dropped;
+
+  /* TPACKET_V3 */
+  u_int8_t *map;
+  size_t map_len;
+  u_int32_t block_idx;
+
+#ifdef HAVE_LIBBPF_XSK
+  /* AF_XDP */
+  void *umem_area;
+  struct xsk_umem *umem;
+  struct xsk_socket *xsk;
+  struct xsk_ring_prod fq;
+  struct xsk_ring_cons cq;
+  struct xsk_ring_cons rx;
+#endif
+};
+
+/* ********************************** */
+
+int ndpi_ring_is_capture(const char *name) {
+  return(name != NULL
+	 && ((strncmp(name, RING_CAPTURE_TPACKET_PREFIX, sizeof(RING_CAPTURE_TPACKET_PREFIX)-1) == 0)
+	     || (strncmp(name, RING_CAPTURE_XDP_PREFIX, sizeof(RING_CAPTURE_XDP_PREFIX)-1) == 0)));
+}
+
+/* ********************************** */
+
+static int ring_attach_filter(struct ndpi_ring_capture *ring, const char *bpf_filter,
+			      char *errbuf, size_t errbuf_len) {
+  struct bpf_program fcode;
+  struct sock_fprog prog;
+  pcap_t *dead;
+  int rc = 0;
+
+  if((dead = pcap_open_dead(DLT_EN10MB, RING_FRAME_SIZE)) == NULL) {
+    snprintf(errbuf, errbuf_len, "pcap_open_dead failed");
+    return(-1);
+  }
+
+  if(pcap_compile(dead, &fcode, bpf_filter, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+    snprintf(errbuf, errbuf_len, "pcap_compile error: '%s'", pcap_geterr(dead));
+    pcap_close(dead);
+    return(-1);
+  }
+
+  /* struct bpf_insn and struct sock_filter share the same layout */
+  prog.len = fcode.bf_len, prog.filter = (struct sock_filter*)fcode.bf_insns;
+
+  if(setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    snprintf(errbuf, errbuf_len, "SO_ATTACH_FILTER: %s", strerror(errno));
+    rc = -1;
+  }
+
+  pcap_freecode(&fcode);
+  pcap_close(dead);
+  return(rc);
+}
+
+/* ********************************** */
+
+static int tpacket_open(struct ndpi_ring_capture *ring, const char *device,
+			u_int16_t fanout_id, const char *bpf_filter,
+			char *errbuf, size_t errbuf_len) {
+  struct tpacket_req3 req;
+  struct sockaddr_ll ll;
+  struct packet_mreq mr;
+  int ifindex, version = TPACKET_V3;
+
+  if((ifindex = if_nametoindex(device)) == 0) {
+    snprintf(errbuf, errbuf_len, "unknown device %s", device);
+    return(-1);
+  }
+
+  if((ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+    snprintf(errbuf, errbuf_len, "socket(AF_PACKET): %s", strerror(errno));
+    return(-1);
+  }
+
+  if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+    snprintf(errbuf, errbuf_len, "PACKET_VERSION: %s", strerror(errno));
+    return(-1);
+  }
+
+  /* The filter must be in place before the ring starts filling up */
+  if(bpf_filter && (ring_attach_filter(ring, bpf_filter, errbuf, errbuf_len) != 0))
+    return(-1);
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = RING_BLOCK_SIZE;
+  req.tp_block_nr = RING_BLOCK_NR;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NR;
+  req.tp_retire_blk_tov = RING_BLOCK_TMO;
+  req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+  if(setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    snprintf(errbuf, errbuf_len, "PACKET_RX_RING: %s", strerror(errno));
+    return(-1);
+  }
+
+  ring->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+  if(ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    snprintf(errbuf, errbuf_len, "mmap: %s", strerror(errno));
+    return(-1);
+  }
+
+  memset(&ll, 0, sizeof(ll));
+  ll.sll_family = AF_PACKET, ll.sll_protocol = htons(ETH_P_ALL), ll.sll_ifindex = ifindex;
+  if(bind(ring->fd, (struct sockaddr*)&ll, sizeof(ll)) < 0) {
+    snprintf(errbuf, errbuf_len, "bind(%s): %s", device, strerror(errno));
+    return(-1);
+  }
+
+  memset(&mr, 0, sizeof(mr));
+  mr.mr_ifindex = ifindex, mr.mr_type = PACKET_MR_PROMISC;
+  setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr));
+
+  if(fanout_id != 0) {
+    int fanout = fanout_id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+    if(setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+      snprintf(errbuf, errbuf_len, "PACKET_FANOUT: %s", strerror(errno));
+      return(-1);
+    }
+  }
+
+  return(0);
+}
+
+/* ********************************** */
+
+static void tpacket_update_stats(struct ndpi_ring_capture *ring) {
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+
+  /* The kernel resets the counters on every read */
+  if(getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+    ring->dropped += st.tp_drops;
+}
+
+/* ********************************** */
+
+static long long tpacket_loop(struct ndpi_ring_capture *ring, ndpi_ring_handler callback,
+			      u_char *user, volatile u_int8_t *stop) {
+  struct pollfd pfd;
+  long long num = 0;
+
+  pfd.fd = ring->fd, pfd.events = POLLIN | POLLERR, pfd.revents = 0;
+
+  while(!*stop) {
+    struct tpacket_block_desc *pbd = (struct tpacket_block_desc*)(ring->map + (size_t)ring->block_idx * RING_BLOCK_SIZE);
+    struct tpacket3_hdr *ppd;
+    u_int32_t i, num_pkts;
+
+    if((__atomic_load_n(&pbd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+      if(poll(&pfd, 1, RING_POLL_TMO) < 0 && errno != EINTR)
+	return(-1);
+      continue;
+    }
+
+    num_pkts = pbd->hdr.bh1.num_pkts;
+    ppd = (struct tpacket3_hdr*)((u_int8_t*)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+
+    for(i = 0; i < num_pkts; i++) {
+      struct pcap_pkthdr h;
+
+      h.caplen = ppd->tp_snaplen, h.len = ppd->tp_len;
+      h.ts.tv_sec = ppd->tp_sec, h.ts.tv_usec = ppd->tp_nsec / 1000;
+      callback(user, &h, (const u_char*)ppd + ppd->tp_mac);
+
+      ppd = (struct tpacket3_hdr*)((u_int8_t*)ppd + ppd->tp_next_offset);
+    }
+
+    ring->received += num_pkts, num += num_pkts;
+
+    /* Give the block back to the kernel */
+    __atomic_store_n(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    if(++ring->block_idx == RING_BLOCK_NR) ring->block_idx = 0;
+  }
+
+  return(num);
+}
+
+/* ********************************** */
+
+#ifdef HAVE_LIBBPF_XSK
+
+static int xdp_open(struct ndpi_ring_capture *ring, const char *device,
+		    char *errbuf, size_t errbuf_len) {
+  struct xsk_socket_config cfg;
+  size_t umem_len = (size_t)XSK_NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE;
+  u_int32_t i, idx;
+  int rc;
+
+  if(posix_memalign(&ring->umem_area, getpagesize(), umem_len) != 0) {
+    snprintf(errbuf, errbuf_len, "unable to allocate UMEM");
+    return(-1);
+  }
+
+  if((rc = xsk_umem__create(&ring->umem, ring->umem_area, umem_len, &ring->fq, &ring->cq, NULL)) != 0) {
+    snprintf(errbuf, errbuf_len, "xsk_umem__create: %s", strerror(-rc));
+    return(-1);
+  }
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+  cfg.tx_size = 0; /* RX only */
+
+  if((rc = xsk_socket__create(&ring->xsk, device, ring->queue_id, ring->umem, &ring->rx, NULL, &cfg)) != 0) {
+    snprintf(errbuf, errbuf_len, "xsk_socket__create(%s@%u): %s", device, ring->queue_id, strerror(-rc));
+    return(-1);
+  }
+
+  ring->fd = xsk_socket__fd(ring->xsk);
+
+  /* Hand all frames to the kernel */
+  if(xsk_ring_prod__reserve(&ring->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS, &idx) != XSK_RING_PROD__DEFAULT_NUM_DESCS) {
+    snprintf(errbuf, errbuf_len, "unable to populate the fill ring");
+    return(-1);
+  }
+
+  for(i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i++)
+    *xsk_ring_prod__fill_addr(&ring->fq, idx++) = (u_int64_t)i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+  xsk_ring_prod__submit(&ring->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+  return(0);
+}
+
+/* ********************************** */
+
+static void xdp_update_stats(struct ndpi_ring_capture *ring) {
+  struct xdp_statistics st;
+  socklen_t len = sizeof(st);
+
+  /* Cumulative counters */
+  if(getsockopt(ring->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == 0)
+    ring->dropped = st.rx_dropped;
+}
+
+/* ********************************** */
+
+static long long xdp_loop(struct ndpi_ring_capture *ring, ndpi_ring_handler callback,
+			  u_char *user, volatile u_int8_t *stop) {
+  struct pollfd pfd;
+  long long num = 0;
+
+  pfd.fd = ring->fd, pfd.events = POLLIN, pfd.revents = 0;
+
+  while(!*stop) {
+    u_int32_t i, rcvd, idx_rx = 0, idx_fq = 0;
+    struct pcap_pkthdr h;
+
+    if((rcvd = xsk_ring_cons__peek(&ring->rx, XSK_RX_BATCH, &idx_rx)) == 0) {
+      if(poll(&pfd, 1, RING_POLL_TMO) < 0 && errno != EINTR)
+	return(-1);
+      continue;
+    }
+
+    /* Frames are recycled once processed: make room for them first */
+    while(xsk_ring_prod__reserve(&ring->fq, rcvd, &idx_fq) != rcvd) {
+      if(*stop) return(num);
+    }
+
+    /* AF_XDP has no per-frame timestamp */
+    gettimeofday(&h.ts, NULL);
+
+    for(i = 0; i < rcvd; i++) {
+      const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&ring->rx, idx_rx + i);
+
+      h.caplen = h.len = desc->len;
+      callback(user, &h, (const u_char*)xsk_umem__get_data(ring->umem_area, desc->addr));
+
+      *xsk_ring_prod__fill_addr(&ring->fq, idx_fq + i) = desc->addr & ~((u_int64_t)XSK_UMEM__DEFAULT_FRAME_SIZE - 1);
+    }
+
+    xsk_ring_prod__submit(&ring->fq, rcvd);
+    xsk_ring_cons__release(&ring->rx, rcvd);
+
+    ring->received += rcvd, num += rcvd;
+  }
+
+  return(num);
+}
+
+#endif /* HAVE_LIBBPF_XSK */
+
+/* ********************************** */
+
+struct ndpi_ring_capture *ndpi_ring_open(const char *name, u_int16_t queue_id,
+					 u_int16_t fanout_id, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len) {
+  struct ndpi_ring_capture *ring;
+  const char *device;
+  int rc;
+
+  if(!ndpi_ring_is_capture(name)) {
+    snprintf(errbuf, errbuf_len, "%s is not a ring capture", name);
+    return(NULL);
+  }
+
+  if((ring = (struct ndpi_ring_capture*)calloc(1, sizeof(*ring))) == NULL) {
+    snprintf(errbuf, errbuf_len, "not enough memory");
+    return(NULL);
+  }
+
+  ring->fd = -1, ring->queue_id = queue_id;
+
+  if(strncmp(name, RING_CAPTURE_TPACKET_PREFIX, sizeof(RING_CAPTURE_TPACKET_PREFIX)-1) == 0) {
+    device = &name[sizeof(RING_CAPTURE_TPACKET_PREFIX)-1];
+    ring->type = RING_TPACKET;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    rc = tpacket_open(ring, device, fanout_id, bpf_filter, errbuf, errbuf_len);
+  } else {
+    device = &name[sizeof(RING_CAPTURE_XDP_PREFIX)-1];
+    ring->type = RING_XDP;
+    snprintf(ring->name, sizeof(ring->name), "%s@%u", name, queue_id);
+#ifdef HAVE_LIBBPF_XSK
+    if(bpf_filter)
+      fprintf(stderr, "WARNING: BPF filters are not supported with AF_XDP, ignored\n");
+    rc = xdp_open(ring, device, errbuf, errbuf_len);
+#else
+    snprintf(errbuf, errbuf_len, "AF_XDP support not available (configure --with-xdp)");
+    rc = -1;
+#endif
+  }
+
+  if(rc != 0) {
+    ndpi_ring_close(ring);
+    return(NULL);
+  }
+
+  return(ring);
+}
+
+/* ********************************** */
+
+long long ndpi_ring_loop(struct ndpi_ring_capture *ring, ndpi_ring_handler callback,
+			 u_char *user, volatile u_int8_t *stop) {
+#ifdef HAVE_LIBBPF_XSK
+  if(ring->type == RING_XDP)
+    return(xdp_loop(ring, callback, user, stop));
+#endif
+
+  return(tpacket_loop(ring, callback, user, stop));
+}
+
+/* ********************************** */
+
+void ndpi_ring_stats(struct ndpi_ring_capture *ring, u_int64_t *received, u_int64_t *dropped) {
+#ifdef HAVE_LIBBPF_XSK
+  if(ring->type == RING_XDP)
+    xdp_update_stats(ring);
+  else
+#endif
+    tpacket_update_stats(ring);
+
+  *received = ring->received, *dropped = ring->dropped;
+}
+
+/* ********************************** */
+
+const char *ndpi_ring_name(struct ndpi_ring_capture *ring) {
+  return(ring->name);
+}
+
+/* ********************************** */
+
+void ndpi_ring_close(struct ndpi_ring_capture *ring) {
+  if(ring == NULL) return;
+
+#ifdef HAVE_LIBBPF_XSK
+  if(ring->type == RING_XDP) {
+    if(ring->xsk)  xsk_socket__delete(ring->xsk);
+    if(ring->umem) xsk_umem__delete(ring->umem);
+    free(ring->umem_area);
+    free(ring);
+    return;
+  }
+#endif
+
+  if(ring->map)     munmap(ring->map, ring->map_len);
+  if(ring->fd >= 0) close(ring->fd);
+  free(ring);
+}
+
+#else /* !__linux__ */
+
+struct ndpi_ring_capture {
+  int unused;
+};
+
+int ndpi_ring_is_capture(const char *name) {
+  return(0);
+}
+
+struct ndpi_ring_capture *ndpi_ring_open(const char *name, u_int16_t queue_id,
+					 u_int16_t fanout_id, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len) {
+  snprintf(errbuf, errbuf_len, "ring captures are available on Linux only");
+  return(NULL);
+}
+
+long long ndpi_ring_loop(struct ndpi_ring_capture *ring, ndpi_ring_handler callback,
+			 u_char *user, volatile u_int8_t *stop) {
+  return(-1);
+}
+
+void ndpi_ring_stats(struct ndpi_ring_capture *ring, u_int64_t *received, u_int64_t *dropped) {
+  *received = *dropped = 0;
+}
+
+const char *ndpi_ring_name(struct ndpi_ring_capture *ring) {
+  return("");
+}
+
+void ndpi_ring_close(struct ndpi_ring_capture *ring) { ; }
+
+#endif /* __linux__ */
@@ -0,0 +1,67 @@
+/*
+ * ring_capture.h
+ *
+ * Copyright (C) 2011-21 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _RING_CAPTURE_H_
+#define _RING_CAPTURE_H_
+
+/*
+  Native Linux capture backends for ndpiReader:
+
+  tpacket:<device>  AF_PACKET TPACKET_V3 ring; the sockets of the threads
+                    reading the same device join a PACKET_FANOUT_HASH group
+  xdp:<device>      AF_XDP socket bound to queue <n> of the device, <n> being
+                    the rank of the thread among those reading it
+                    (requires configure --with-xdp)
+
+  Frames are passed to the callback straight from the shared ring.
+*/
+
+#include <pcap.h>
+
+#define RING_CAPTURE_TPACKET_PREFIX "tpacket:"
+#define RING_CAPTURE_XDP_PREFIX     "xdp:"
+
+struct ndpi_ring_capture;
+
+/* Same signature as pcap_handler, so pcap callbacks can be reused */
+typedef void (*ndpi_ring_handler)(u_char *user, const struct pcap_pkthdr *h,
+				  const u_char *bytes);
+
+int ndpi_ring_is_capture(const char *name);
+
+/* fanout_id 0 means no fanout group */
+struct ndpi_ring_capture *ndpi_ring_open(const char *name, u_int16_t queue_id,
+					 u_int16_t fanout_id, const char *bpf_filter,
+					 char *errbuf, size_t errbuf_len);
+
+/* Runs until *stop is set; returns the number of processed frames or -1 */
+long long ndpi_ring_loop(struct ndpi_ring_capture *ring, ndpi_ring_handler callback,
+			 u_char *user, volatile u_int8_t *stop);
+
+void ndpi_ring_stats(struct ndpi_ring_capture *ring, u_int64_t *received, u_int64_t *dropped);
+
+const char *ndpi_ring_name(struct ndpi_ring_capture *ring);
+
+void ndpi_ring_close(struct ndpi_ring_capture *ring);
+
+#endif /* _RING_CAPTURE_H_ */
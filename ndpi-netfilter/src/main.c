@@ -30,6 +30,7 @@
 #include <linux/atomic.h>
 #include <linux/proc_fs.h>
 #include <linux/jiffies.h>
+#include <linux/percpu.h>
 
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
@@ -73,7 +74,7 @@ extern ndpi_protocol_match host_match[];
 //#define NDPI_IPPORT_DEBUG
 
 
-#define COUNTER(a) (volatile unsigned long int)(a)++
+#define COUNTER(a) this_cpu_inc(ndpi_cpu_stats.cnt[a])
 
 #define NDPI_PROCESS_ERROR (NDPI_NUM_BITS+1)
 #ifndef IPPROTO_OSPF
@@ -194,8 +195,8 @@ struct osdpi_id_node {
 #include "ndpi_proc_flow.h"
 #include "ndpi_proc_hostdef.h"
 #include "ndpi_proc_ipdef.h"
+#include "ndpi_host_match.h"
 
-#include "../libre/regexp.h"
 
 #define MAGIC_CT 0xa55a
 struct nf_ct_ext_labels { /* max size 128 bit */
@@ -258,6 +259,7 @@ static inline int flow_have_info( struct nf_ct_ext_ndpi *c) {
 static ndpi_protocol_nf proto_null = NDPI_PROTOCOL_NULL;
 
 unsigned long int ndpi_flow_limit=10000000; // 4.3Gb
+static unsigned long ndpi_mem_soft_mb=0, ndpi_mem_hard_mb=0;
 unsigned long int ndpi_enable_flow=0;
 unsigned long int ndpi_log_debug=0;
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
@@ -281,38 +283,101 @@ static unsigned long  ndpi_size_flow_struct=0;
 static unsigned long  ndpi_size_id_struct=0;
 static unsigned long  ndpi_size_hash_ip4p_node=0;
 
-static unsigned long  ndpi_jumbo=0;
-static unsigned long  ndpi_falloc=0;
-static unsigned long  ndpi_nskb=0;
-static unsigned long  ndpi_lskb=0;
-static unsigned long  ndpi_flow_c=0;
-static unsigned long  ndpi_flow_d=0;
 static unsigned long  ndpi_bt_gc=0;
 
-static unsigned long  ndpi_p0=0;
-static unsigned long  ndpi_p1=0;
-static unsigned long  ndpi_p2=0;
-static unsigned long  ndpi_p31=0;
-static unsigned long  ndpi_p34=0;
-static unsigned long  ndpi_p7=0;
-static unsigned long  ndpi_p9=0;
-static unsigned long  ndpi_pa=0;
-static unsigned long  ndpi_pb=0;
-static unsigned long  ndpi_pc=0;
-static unsigned long  ndpi_pd=0;
-static unsigned long  ndpi_pe=0;
-static unsigned long  ndpi_pf=0;
-static unsigned long  ndpi_pg=0;
-static unsigned long  ndpi_ph=0;
-static unsigned long  ndpi_pi=0;
-static unsigned long  ndpi_pi2=0;
-static unsigned long  ndpi_pi3=0;
-static unsigned long  ndpi_pi4=0;
-static unsigned long  ndpi_pj=0;
-static unsigned long  ndpi_pjc=0;
-static unsigned long  ndpi_pk=0;
-
-static unsigned long  ndpi_pl[11]={0,};
+/* Namespaces other than init_net are set up by their first ndpi rule */
+static unsigned long  ndpi_lazy_netns=1;
+static atomic_t ndpi_ns_total = ATOMIC_INIT(0), ndpi_ns_active = ATOMIC_INIT(0);
+static DEFINE_MUTEX(ndpi_ns_lock);		/* ndpi_net_start(), ndpi_tables */
+static struct ndpi_shared_tables *ndpi_tables = NULL; /* used by all active namespaces */
+
+DEFINE_PER_CPU(struct ndpi_cpu_stats, ndpi_cpu_stats);
+
+void ndpi_stats_sum(struct ndpi_cpu_stats *s)
+{
+	int cpu,i;
+
+	memset(s,0,sizeof(*s));
+	for_each_possible_cpu(cpu) {
+		const struct ndpi_cpu_stats *c = per_cpu_ptr(&ndpi_cpu_stats,cpu);
+
+		for(i=0; i < NDPI_STAT_NUM; i++)
+			s->cnt[i] += READ_ONCE(c->cnt[i]);
+		for(i=0; i < NDPI_PARSED_LINES_BINS; i++)
+			s->parsed_lines[i] += READ_ONCE(c->parsed_lines[i]);
+		if(READ_ONCE(c->max_parsed_lines) > s->max_parsed_lines)
+			s->max_parsed_lines = READ_ONCE(c->max_parsed_lines);
+		s->host_memo_hit += READ_ONCE(c->host_memo_hit);
+		s->host_memo_miss += READ_ONCE(c->host_memo_miss);
+	}
+}
+
+void ndpi_proto_stats_sum(const struct ndpi_proto_stats __percpu *ps, int proto,
+		struct ndpi_proto_stats *s)
+{
+	int cpu,i;
+
+	memset(s,0,sizeof(*s));
+	for_each_possible_cpu(cpu) {
+		const struct ndpi_proto_stats *c = &per_cpu_ptr(ps,cpu)[proto];
+
+		s->packets += READ_ONCE(c->packets);
+		s->bytes += READ_ONCE(c->bytes);
+		for(i=0; i < NDPI_LATENCY_BINS; i++)
+			s->latency[i] += READ_ONCE(c->latency[i]);
+	}
+}
+
+/* The counters exported as module parameters are summed when read */
+static int ndpi_stat_param_get(char *buffer, const struct kernel_param *kp)
+{
+	struct ndpi_cpu_stats s;
+	struct kernel_param p = *kp;
+	long id = (long)kp->arg;
+	unsigned long v;
+
+	ndpi_stats_sum(&s);
+	v = id < NDPI_STAT_NUM ? s.cnt[id] : s.max_parsed_lines;
+	p.arg = &v;
+	return param_get_ulong(buffer,&p);
+}
+
+static const struct kernel_param_ops ndpi_stat_param_ops = {
+	.get = ndpi_stat_param_get,
+};
+
+#define NDPI_STAT_PARAM(name,id) \
+	module_param_cb(name, &ndpi_stat_param_ops, (void *)(long)(id), 0400)
+
+/* Namespaces: 0 - set up, 1 - idle, 2 - memory held by the idle ones */
+static int ndpi_ns_param_get(char *buffer, const struct kernel_param *kp)
+{
+	struct kernel_param p = *kp;
+	int active = atomic_read(&ndpi_ns_active);
+	int idle = atomic_read(&ndpi_ns_total) - active;
+	unsigned long v;
+
+	if(idle < 0) idle = 0;
+	switch((long)kp->arg) {
+	case 0: v = active; break;
+	case 1: v = idle; break;
+	default: v = (unsigned long)idle * sizeof(struct ndpi_net);
+	}
+	p.arg = &v;
+	return param_get_ulong(buffer,&p);
+}
+
+static const struct kernel_param_ops ndpi_ns_param_ops = {
+	.get = ndpi_ns_param_get,
+};
+
+module_param_cb(ns_active, &ndpi_ns_param_ops, (void *)0L, 0400);
+MODULE_PARM_DESC(ns_active,"Network namespaces with nDPI set up. [info]");
+module_param_cb(ns_idle, &ndpi_ns_param_ops, (void *)1L, 0400);
+MODULE_PARM_DESC(ns_idle,"Network namespaces without ndpi rules yet. [info]");
+module_param_cb(ns_idle_mem, &ndpi_ns_param_ops, (void *)2L, 0400);
+MODULE_PARM_DESC(ns_idle_mem,"Memory (bytes) held by the idle network namespaces. [info]");
+
 unsigned long  ndpi_btp_tm[20]={0,};
 
 module_param_named(xt_debug,   ndpi_log_debug, ulong, 0600);
@@ -347,53 +412,65 @@ MODULE_PARM_DESC(ndpi_stun_cache,"STUN cache control (0-1). Disabled by default.
 module_param_named(ndpi_flow_limit, ndpi_flow_limit, ulong, 0400);
 MODULE_PARM_DESC(ndpi_flow_limit,"Limit netflow records. Default 10000000 (~4.3Gb RAM)");
 
+module_param_named(mem_soft_limit, ndpi_mem_soft_mb, ulong, 0400);
+MODULE_PARM_DESC(mem_soft_limit,"Memory budget (Mb) above which certificates, URLs and JA3 are not extracted. Default 0 (unlimited)");
+module_param_named(mem_hard_limit, ndpi_mem_hard_mb, ulong, 0400);
+MODULE_PARM_DESC(mem_hard_limit,"Memory budget (Mb) above which new flows are not dissected. Default 0 (unlimited)");
+
 module_param_named(max_unk_tcp,max_packet_unk_tcp,ulong, 0600);
 module_param_named(max_unk_udp,max_packet_unk_udp,ulong, 0600);
 module_param_named(max_unk_other,max_packet_unk_other,ulong, 0600);
 module_param_named(flow_read_debug,flow_read_debug,ulong, 0600);
 
+module_param_named(lazy_netns, ndpi_lazy_netns, ulong, 0400);
+MODULE_PARM_DESC(lazy_netns,"Set up a network namespace on its first ndpi rule instead of at its creation. Default 1");
+
 module_param_named(ndpi_size_flow_struct,ndpi_size_flow_struct,ulong, 0400);
 module_param_named(ndpi_size_id_struct,ndpi_size_id_struct,ulong, 0400);
 module_param_named(ndpi_size_hash_ip4p_node,ndpi_size_hash_ip4p_node,ulong, 0400);
 
-module_param_named(err_oversize, ndpi_jumbo, ulong, 0400);
+NDPI_STAT_PARAM(err_oversize, NDPI_STAT_ERR_OVERSIZE);
 MODULE_PARM_DESC(err_oversize,"Counter nonlinear packets bigger than MTU. [info]");
-module_param_named(err_skb_linear, ndpi_falloc, ulong, 0400);
+NDPI_STAT_PARAM(err_skb_linear, NDPI_STAT_ERR_SKB_LINEAR);
 MODULE_PARM_DESC(err_skb_linear,"Counter of unsuccessful conversions of nonlinear packets. [error]");
 
-module_param_named(skb_seg,	 ndpi_nskb, ulong, 0400);
+NDPI_STAT_PARAM(skb_seg, NDPI_STAT_SKB_SEG);
 MODULE_PARM_DESC(skb_seg,"Counter nonlinear packets. [info]");
-module_param_named(skb_lin,	 ndpi_lskb, ulong, 0400);
+NDPI_STAT_PARAM(skb_lin, NDPI_STAT_SKB_LIN);
 MODULE_PARM_DESC(skb_lin,"Counter linear packets. [info]");
 
-module_param_named(flow_created, ndpi_flow_c, ulong, 0400);
+NDPI_STAT_PARAM(flow_created, NDPI_STAT_FLOW_CREATED);
 MODULE_PARM_DESC(flow_created,"Counter of created flows. [info]");
-module_param_named(flow_deleted, ndpi_flow_d, ulong, 0400);
+NDPI_STAT_PARAM(flow_deleted, NDPI_STAT_FLOW_DELETED);
 MODULE_PARM_DESC(flow_deleted,"Counter of destroyed flows. [info]");
 module_param_named(bt_gc_count,  ndpi_bt_gc, ulong, 0400);
 
-module_param_named(ipv4,         ndpi_p0, ulong, 0400);
-module_param_named(ipv6,         ndpi_pa, ulong, 0400);
-module_param_named(nonip,        ndpi_pb, ulong, 0400);
-module_param_named(err_ip_frag_len, ndpi_p1, ulong, 0400);
-module_param_named(err_bad_tcp_udp, ndpi_p2, ulong, 0400);
-module_param_named(ct_confirm,   ndpi_p31, ulong, 0400);
-module_param_named(err_add_ndpi, ndpi_p34, ulong, 0400);
-module_param_named(non_tcpudp,   ndpi_p7, ulong, 0400);
-module_param_named(max_parsed_lines, ndpi_p9, ulong, 0400);
-module_param_named(id_num,	 ndpi_pc, ulong, 0400);
-module_param_named(noncached,	 ndpi_pd, ulong, 0400);
-module_param_named(err_prot_err, ndpi_pe, ulong, 0400);
-module_param_named(err_prot_err1, ndpi_pf, ulong, 0400);
-module_param_named(err_alloc_flow, ndpi_pg, ulong, 0400);
-module_param_named(err_alloc_id, ndpi_ph, ulong, 0400);
-module_param_named(cached,	 ndpi_pi,  ulong, 0400);
-module_param_named(c_skb_not,	 ndpi_pi2, ulong, 0400);
-module_param_named(c_last_ct_not, ndpi_pi3, ulong, 0400);
-module_param_named(c_magic_not,	 ndpi_pi4, ulong, 0400);
-module_param_named(l4mismatch,	 ndpi_pj,  ulong, 0400);
-module_param_named(l4mis_size,	 ndpi_pjc, ulong, 0400);
-module_param_named(ndpi_match,	 ndpi_pk,  ulong, 0400);
+NDPI_STAT_PARAM(ipv4, NDPI_STAT_IPV4);
+NDPI_STAT_PARAM(ipv6, NDPI_STAT_IPV6);
+NDPI_STAT_PARAM(nonip, NDPI_STAT_NONIP);
+NDPI_STAT_PARAM(err_ip_frag_len, NDPI_STAT_ERR_IP_FRAG_LEN);
+NDPI_STAT_PARAM(err_bad_tcp_udp, NDPI_STAT_ERR_BAD_TCP_UDP);
+NDPI_STAT_PARAM(ct_confirm, NDPI_STAT_CT_CONFIRM);
+NDPI_STAT_PARAM(err_add_ndpi, NDPI_STAT_ERR_ADD_NDPI);
+NDPI_STAT_PARAM(non_tcpudp, NDPI_STAT_NON_TCPUDP);
+NDPI_STAT_PARAM(max_parsed_lines, NDPI_STAT_NUM);
+NDPI_STAT_PARAM(id_num, NDPI_STAT_ID_NUM);
+NDPI_STAT_PARAM(noncached, NDPI_STAT_NONCACHED);
+NDPI_STAT_PARAM(err_prot_err, NDPI_STAT_ERR_PROT_ERR);
+NDPI_STAT_PARAM(err_prot_err1, NDPI_STAT_ERR_PROT_ERR1);
+NDPI_STAT_PARAM(err_alloc_flow, NDPI_STAT_ERR_ALLOC_FLOW);
+NDPI_STAT_PARAM(err_mem_limit, NDPI_STAT_ERR_MEM_LIMIT);
+MODULE_PARM_DESC(err_mem_limit,"Counter of flows not dissected because of mem_hard_limit. [error]");
+NDPI_STAT_PARAM(err_alloc_id, NDPI_STAT_ERR_ALLOC_ID);
+NDPI_STAT_PARAM(cached, NDPI_STAT_CACHED);
+NDPI_STAT_PARAM(c_skb_not, NDPI_STAT_C_SKB_NOT);
+NDPI_STAT_PARAM(c_last_ct_not, NDPI_STAT_C_LAST_CT_NOT);
+NDPI_STAT_PARAM(c_magic_not, NDPI_STAT_C_MAGIC_NOT);
+NDPI_STAT_PARAM(l4mismatch, NDPI_STAT_L4MISMATCH);
+NDPI_STAT_PARAM(l4mis_size, NDPI_STAT_L4MIS_SIZE);
+NDPI_STAT_PARAM(ndpi_match, NDPI_STAT_NDPI_MATCH);
+NDPI_STAT_PARAM(fast_path, NDPI_STAT_FAST_PATH);
+MODULE_PARM_DESC(fast_path,"Counter of packets matched by the published verdict without locking. [info]");
 
 unsigned long  ndpi_pto=0,
 	       ndpi_ptss=0, ndpi_ptsd=0,
@@ -414,6 +491,7 @@ static inline struct ndpi_net *ndpi_pernet(struct net *net)
 {
 	        return net_generic(net, ndpi_net_id);
 }
+static int ndpi_net_activate(struct net *net);
 
 /* detection */
 
@@ -578,7 +656,8 @@ ndpi_id_search_or_insert(struct ndpi_net *n,
 		pr_err("xt_ndpi: couldn't allocate new id.\n");
 		return NULL;
 	}
-	(volatile unsigned long int)ndpi_pc++;
+	ndpi_mem_account(NDPI_MEM_OTHER, ndpi_size_id_struct);
+	COUNTER(NDPI_STAT_ID_NUM);
 	memcpy(&id->ip, ip, sizeof(union nf_inet_addr));
 	kref_init (&id->refcnt);
 
@@ -594,7 +673,8 @@ ndpi_free_id (struct ndpi_net *n, struct osdpi_id_node * id)
 	if (refcount_dec_and_test(&id->refcnt.refcount)) {
 	        rb_erase(&id->node, &n->osdpi_id_root);
 	        kmem_cache_free (osdpi_id_cache, id);
-		(volatile unsigned long int)ndpi_pc--;
+		ndpi_mem_account(NDPI_MEM_OTHER, -(int64_t)ndpi_size_id_struct);
+		this_cpu_dec(ndpi_cpu_stats.cnt[NDPI_STAT_ID_NUM]);
 	}
 }
 
@@ -727,8 +807,9 @@ static inline void __ndpi_free_ct_flow(struct nf_ct_ext_ndpi *ct_ndpi) {
 	if(ct_ndpi->flow != NULL) {
 		ndpi_free_flow(ct_ndpi->flow);
 		kmem_cache_free (osdpi_flow_cache, ct_ndpi->flow);
+		ndpi_mem_account(NDPI_MEM_FLOW, -(int64_t)ndpi_size_flow_struct);
 		ct_ndpi->flow = NULL;
-		COUNTER(ndpi_flow_d);
+		COUNTER(NDPI_STAT_FLOW_DELETED);
 		module_put(THIS_MODULE);
 	}
 }
@@ -746,15 +827,23 @@ static inline void __ndpi_free_ct_ndpi_id(struct ndpi_net *n, struct nf_ct_ext_n
 }
 
 static inline void __ndpi_free_ct_proto(struct nf_ct_ext_ndpi *ct_ndpi) {
+        ndpi_host_memo_free(ct_ndpi);
         if(ct_ndpi->host) {
+                ndpi_mem_account(NDPI_MEM_METADATA, -(int64_t)(strlen(ct_ndpi->host)+1));
                 kfree(ct_ndpi->host);
                 ct_ndpi->host = NULL;
         }
         if(ct_ndpi->ssl) {
+                ndpi_mem_account(NDPI_MEM_METADATA, -(int64_t)(strlen(ct_ndpi->ssl)+1));
                 kfree(ct_ndpi->ssl);
                 ct_ndpi->ssl = NULL;
         }
 }
+
+static inline void ct_ndpi_info_free(struct nf_ct_ext_ndpi *ct_ndpi) {
+	kmem_cache_free (ct_info_cache, ct_ndpi);
+	ndpi_mem_account(NDPI_MEM_OTHER, -(int64_t)sizeof(struct nf_ct_ext_ndpi));
+}
 static void
 ct_ndpi_free_flow (struct ndpi_net *n,
 		struct nf_ct_ext_labels *ext_l,
@@ -782,7 +871,7 @@ ct_ndpi_free_flow (struct ndpi_net *n,
 	spin_unlock_bh(&ct_ndpi->lock);
 
 	if(delete)
-		kmem_cache_free (ct_info_cache, ct_ndpi);
+		ct_ndpi_info_free(ct_ndpi);
 }
 
 /* free ndpi info on ndpi_net_exit() */
@@ -833,10 +922,11 @@ ndpi_alloc_flow (struct nf_ct_ext_ndpi *ct_ndpi)
                 return flow;
         }
 
+	ndpi_mem_account(NDPI_MEM_FLOW, ndpi_size_flow_struct);
 	ct_ndpi->proto = proto_null;
 	ct_ndpi->flow = flow;
 	__module_get(THIS_MODULE);
-	COUNTER(ndpi_flow_c);
+	COUNTER(NDPI_STAT_FLOW_CREATED);
 	if(ndpi_log_debug > 2)
 		pr_info("ndpi: ct_ndpi %pK alloc_flow\n", ct_ndpi);
         return flow;
@@ -884,12 +974,44 @@ ndpi_enable_protocols (struct ndpi_net *n)
 
 static void add_stat(unsigned long int n) {
 
-	if(n > ndpi_p9) ndpi_p9 = n;
+	if(n > this_cpu_read(ndpi_cpu_stats.max_parsed_lines))
+		this_cpu_write(ndpi_cpu_stats.max_parsed_lines, n);
 	n /= 10;
-	if(n < 0) n = 0;
-	if(n > sizeof(ndpi_pl)/sizeof(ndpi_pl[0])-1)
-		n = sizeof(ndpi_pl)/sizeof(ndpi_pl[0])-1;
-	ndpi_pl[n]++;
+	if(n > NDPI_PARSED_LINES_BINS-1)
+		n = NDPI_PARSED_LINES_BINS-1;
+	this_cpu_inc(ndpi_cpu_stats.parsed_lines[n]);
+}
+
+/* Per protocol statistics: packets and bytes, ndpi_process_packet() time */
+static inline struct ndpi_proto_stats *ndpi_proto_stat(struct ndpi_net *n,
+		const ndpi_protocol_nf *proto)
+{
+	uint16_t id = proto->app_protocol != NDPI_PROTOCOL_UNKNOWN ?
+			proto->app_protocol : proto->master_protocol;
+
+	if(!n->proto_stats || id > NDPI_NUM_BITS) return NULL;
+	return &this_cpu_ptr(n->proto_stats)[id];
+}
+
+static inline void ndpi_proto_stat_packet(struct ndpi_net *n,
+		const ndpi_protocol_nf *proto, unsigned int len)
+{
+	struct ndpi_proto_stats *ps = ndpi_proto_stat(n,proto);
+
+	if(!ps) return;
+	ps->packets++;
+	ps->bytes += len;
+}
+
+static inline void ndpi_proto_stat_latency(struct ndpi_net *n,
+		const ndpi_protocol_nf *proto, u64 ns)
+{
+	struct ndpi_proto_stats *ps = ndpi_proto_stat(n,proto);
+	int bin;
+
+	if(!ps) return;
+	bin = fls64(ns >> NDPI_LATENCY_SHIFT);
+	ps->latency[min(bin,NDPI_LATENCY_BINS-1)]++;
 }
 
 static char *ct_info(const struct nf_conn * ct,char *buf,size_t buf_size,int dir) {
@@ -964,15 +1086,21 @@ ndpi_process_packet(struct ndpi_net *n, struct nf_conn * ct, struct nf_ct_ext_nd
 		&& !ip6h
 #endif
 	  ) {
-		COUNTER(ndpi_pf);
+		COUNTER(NDPI_STAT_ERR_PROT_ERR1);
 		return NDPI_PROCESS_ERROR;
 	}
 
 	flow = ct_ndpi->flow;
 	if (!flow) {
+		if(ndpi_mem_deny()) {
+			/* Over mem_hard_limit: give up on this flow right away */
+			COUNTER(NDPI_STAT_ERR_MEM_LIMIT);
+			set_detect_done(ct_ndpi);
+			return NDPI_PROTOCOL_UNKNOWN;
+		}
 		flow = ndpi_alloc_flow(ct_ndpi);
 		if (!flow) {
-			COUNTER(ndpi_pg);
+			COUNTER(NDPI_STAT_ERR_ALLOC_FLOW);
 			return NDPI_PROCESS_ERROR;
 		}
 	}
@@ -982,7 +1110,7 @@ ndpi_process_packet(struct ndpi_net *n, struct nf_conn * ct, struct nf_ct_ext_nd
 		src = ndpi_id_search_or_insert (n,
 			&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3);
 		if (!src) {
-			COUNTER(ndpi_ph);
+			COUNTER(NDPI_STAT_ERR_ALLOC_ID);
 			return NDPI_PROCESS_ERROR;
 		}
 		ct_ndpi->src = src;
@@ -992,7 +1120,7 @@ ndpi_process_packet(struct ndpi_net *n, struct nf_conn * ct, struct nf_ct_ext_nd
 		dst = ndpi_id_search_or_insert (n,
 			&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3);
 		if (!dst) {
-			COUNTER(ndpi_ph);
+			COUNTER(NDPI_STAT_ERR_ALLOC_ID);
 			return NDPI_PROCESS_ERROR;
 		}
 		ct_ndpi->dst = dst;
@@ -1088,7 +1216,7 @@ static inline int can_handle(const struct sk_buff *skb,uint8_t *l4_proto)
 
 	ip6h = ipv6_hdr(skb);
 	if(ip6h->version == 6) {
-		COUNTER(ndpi_pa);
+		COUNTER(NDPI_STAT_IPV6);
 		*l4_proto = ip6h->nexthdr;
 		// FIXME!
 		return 1;
@@ -1096,35 +1224,35 @@ static inline int can_handle(const struct sk_buff *skb,uint8_t *l4_proto)
 #endif
 	iph = ip_hdr(skb);
         if(!iph) { /* not IP */
-		COUNTER(ndpi_pb); return 0;
+		COUNTER(NDPI_STAT_NONIP); return 0;
 	}
 	if(iph->version != 4) {
-		COUNTER(ndpi_pb); return 0;
+		COUNTER(NDPI_STAT_NONIP); return 0;
 	}
 	*l4_proto = proto = iph->protocol;
-	COUNTER(ndpi_p0);
+	COUNTER(NDPI_STAT_IPV4);
 
 	if(ntohs(iph->frag_off) & 0x3fff) {
-		COUNTER(ndpi_p1); return 0;
+		COUNTER(NDPI_STAT_ERR_IP_FRAG_LEN); return 0;
 	}
 	if(skb->len <= (iph->ihl << 2)) {
-		COUNTER(ndpi_p1); return 0; 
+		COUNTER(NDPI_STAT_ERR_IP_FRAG_LEN); return 0; 
 	}
 
 	l4_len = skb->len - (iph->ihl << 2);
         if(proto == IPPROTO_TCP) {
 		if(l4_len < sizeof(struct tcphdr)) {
-			COUNTER(ndpi_p2); return 0;
+			COUNTER(NDPI_STAT_ERR_BAD_TCP_UDP); return 0;
 		}
 		return 1;
 	}
         if(proto == IPPROTO_UDP) {
 		if(l4_len < sizeof(struct udphdr)) {
-			COUNTER(ndpi_p2); return 0;
+			COUNTER(NDPI_STAT_ERR_BAD_TCP_UDP); return 0;
 		}
 		return 1;
 	}
-	COUNTER(ndpi_p7);
+	COUNTER(NDPI_STAT_NON_TCPUDP);
 	return 1;
 }
 
@@ -1139,6 +1267,8 @@ static void ndpi_host_ssl(struct nf_ct_ext_ndpi *ct_ndpi) {
 	if(*name)
 		ct_ndpi->host = kstrndup(name, 
 				sizeof(ct_ndpi->flow->host_server_name)-1, GFP_ATOMIC);
+	if(ct_ndpi->host)
+		ndpi_mem_account(NDPI_MEM_METADATA, strlen(ct_ndpi->host)+1);
     }
 
     if(!ct_ndpi->ssl && (
@@ -1153,43 +1283,61 @@ static void ndpi_host_ssl(struct nf_ct_ext_ndpi *ct_ndpi) {
 	} else if(name_s) {
 		ct_ndpi->ssl = kstrndup(name_s, s_len, GFP_ATOMIC);
 	}
+	if(ct_ndpi->ssl)
+		ndpi_mem_account(NDPI_MEM_METADATA, strlen(ct_ndpi->ssl)+1);
     }
 }
 
+/*
+ * All host/ssl rules are compiled into one matcher and its result is
+ * cached per conntrack, see ndpi_host_match.c
+ */
+static bool __ndpi_host_match( const struct xt_ndpi_mtinfo *info,
+			     struct nf_ct_ext_ndpi *ct_ndpi,
+			     const char *host, const char *ssl,
+			     const ndpi_protocol_nf *proto) {
+bool res;
+
+res = ndpi_host_rule_match(info, ct_ndpi, host, ssl,
+		proto->app_protocol == NDPI_PROTOCOL_TLS ||
+		proto->master_protocol == NDPI_PROTOCOL_TLS);
+
+if(ndpi_log_debug > 2)
+    pr_info("%s: match%s %s %s '%s' %s,%s %d\n", __func__,
+	info->re ? "-re":"", info->host ? "host":"", info->ssl ? "ssl":"",
+	info->hostname,host ? host:"-", ssl ? ssl:"-",res);
+
+return res;
+}
+
 static bool ndpi_host_match( const struct xt_ndpi_mtinfo *info,
 			     struct nf_ct_ext_ndpi *ct_ndpi) {
-bool res = false;
 
 if(!info->hostname[0]) return true;
 
 ndpi_host_ssl(ct_ndpi);
 
-do {
-  if(info->host) {
-	if(ct_ndpi->host) {
-		res = info->re ? ndpi_regexec(info->reg_data,ct_ndpi->host) != 0 :
-			strstr(ct_ndpi->host,info->hostname) != NULL;
-		if(res) break;
-	}
-  }
+return __ndpi_host_match(info,ct_ndpi,ct_ndpi->host,ct_ndpi->ssl,&ct_ndpi->proto);
+}
 
-  if(info->ssl && ( ct_ndpi->proto.app_protocol == NDPI_PROTOCOL_TLS ||
-		    ct_ndpi->proto.master_protocol == NDPI_PROTOCOL_TLS )) {
-	if(ct_ndpi->ssl) {
-		res = info->re ? ndpi_regexec(info->reg_data,ct_ndpi->ssl) != 0 :
-			strstr(ct_ndpi->ssl,info->hostname) != NULL;
-		if(res) break;
-	}
-  }
-} while(0);
+/*
+ * Publish the verdict of the flow if detection is finished.
+ * After that host and ssl are not changed until the conntrack is destroyed.
+ * must be locked ct_ndpi->lock
+ */
+static void ndpi_publish_verdict(struct nf_ct_ext_ndpi *ct_ndpi) {
+	struct ndpi_flow_struct *flow = ct_ndpi->flow;
 
-if(ndpi_log_debug > 2)
-    pr_info("%s: match%s %s %s '%s' %s,%s %d\n", __func__,
-	info->re ? "-re":"", info->host ? "host":"", info->ssl ? "ssl":"",
-	info->hostname,ct_ndpi->host ? ct_ndpi->host:"-",
-	ct_ndpi->ssl ? ct_ndpi->ssl:"-",res);
+	if(READ_ONCE(ct_ndpi->verdict)) return;
 
-return res;
+	if(!test_detect_done(ct_ndpi)) {
+		if(!flow || flow->check_extra_packets ||
+		    flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
+			return;
+		ndpi_host_ssl(ct_ndpi);
+	}
+	smp_wmb();
+	WRITE_ONCE(ct_ndpi->verdict,pack_verdict(ct_ndpi->proto));
 }
 
 static inline uint16_t get_in_if(const struct net_device *dev) {
@@ -1202,6 +1350,52 @@ static inline uint16_t get_in_if(const struct net_device *dev) {
 
 #define pack_proto(proto) ((proto.app_protocol << 16) | proto.master_protocol)
 
+/*
+ * Lockless match for flows with a published verdict.
+ * Flow accounting needs per packet counters, so it always uses the slow path.
+ */
+static inline bool ndpi_mt_fast(const struct sk_buff *skb,
+		const struct xt_ndpi_mtinfo *info, struct ndpi_cb *c_proto,
+		uint8_t l4_proto, ndpi_protocol_nf *proto, bool *host_match)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn * ct;
+	struct nf_ct_ext_ndpi *ct_ndpi;
+	uint32_t v;
+
+	if(ndpi_enable_flow) return false;
+
+	ct = nf_ct_get (skb, &ctinfo);
+	if(ct == NULL) return false;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+	if (nf_ct_is_untracked(ct)) return false;
+#else
+	if(ctinfo == IP_CT_UNTRACKED) return false;
+#endif
+	ct_ndpi = nf_ct_ext_find_ndpi(ct);
+	if(!ct_ndpi) return false;
+
+	v = READ_ONCE(ct_ndpi->verdict);
+	if(!(v & NDPI_VERDICT_FINAL)) return false;
+	/* icmp for TCP/UDP flows */
+	if(l4_proto != ct_ndpi->l4_proto) return false;
+	smp_rmb();
+
+	proto->master_protocol = verdict_master(v);
+	proto->app_protocol = verdict_app(v);
+	if(info->hostname[0])
+		*host_match = __ndpi_host_match(info,ct_ndpi,READ_ONCE(ct_ndpi->host),
+					READ_ONCE(ct_ndpi->ssl),proto);
+
+	c_proto->magic = NDPI_ID;
+	c_proto->proto = pack_proto((*proto));
+	ct_proto_set_flow(c_proto,ct,0);
+	COUNTER(NDPI_STAT_FAST_PATH);
+	if(ndpi_log_debug > 1)
+		packet_trace(skb,ct,"fast       ");
+	return true;
+}
+
 static bool
 ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 {
@@ -1218,8 +1412,9 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	struct nf_ct_ext_ndpi *ct_ndpi = NULL;
 	struct ndpi_cb *c_proto;
 	uint8_t l4_proto=0,ct_dir=0;
-	bool result=false, host_match = true, is_ipv6=false;
+	bool result=false, host_match = true, is_ipv6=false, account=false;
 	struct ndpi_net *n;
+	u64 t_start;
 
 	char ct_buf[128];
 
@@ -1252,14 +1447,20 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		break;
 	}
 	if( skb->len > ndpi_mtu && skb_is_nonlinear(skb) ) {
-		COUNTER(ndpi_jumbo);
+		COUNTER(NDPI_STAT_ERR_OVERSIZE);
 		break;
 	}
 
 	if(c_proto->magic != NDPI_ID)
 		ct_proto_set_flow(c_proto,NULL,0);
 
-	COUNTER(ndpi_pk);
+	COUNTER(NDPI_STAT_NDPI_MATCH);
+
+	/* Each packet is accounted once, whatever the number of rules */
+	account = ct_proto_last(c_proto) == NULL;
+
+	if(ndpi_mt_fast(skb,info,c_proto,l4_proto,&proto,&host_match))
+		break;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,18,0)
 	ktime_get_real_ts64(&tm);
@@ -1269,7 +1470,7 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 
 	ct = nf_ct_get (skb, &ctinfo);
 	if (ct == NULL) {
-		COUNTER(ndpi_p31);
+		COUNTER(NDPI_STAT_CT_CONFIRM);
 		break;
 	}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
@@ -1278,7 +1479,7 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	if(ctinfo == IP_CT_UNTRACKED)	
 #endif
 	{
-		COUNTER(ndpi_p31);
+		COUNTER(NDPI_STAT_CT_CONFIRM);
 		break;
 	}
 	ct_dir = CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL;
@@ -1287,7 +1488,7 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 #ifdef NF_CT_CUSTOM
 	    if(!ct_label) {
 		if(nf_ct_is_confirmed(ct)) {
-			COUNTER(ndpi_p31);
+			COUNTER(NDPI_STAT_CT_CONFIRM);
 			break;
 		}
 		ct_label = nf_ct_ext_add_ndpi(ct);
@@ -1300,6 +1501,7 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		if(!ct_label->magic) {
 			ct_ndpi = kmem_cache_zalloc (ct_info_cache, GFP_ATOMIC);
 			if(ct_ndpi) {
+				ndpi_mem_account(NDPI_MEM_OTHER, sizeof(struct nf_ct_ext_ndpi));
 				WRITE_ONCE(ct_label->ndpi_ext, ct_ndpi);
 				WRITE_ONCE(ct_label->magic, MAGIC_CT);
 				ndpi_init_ct_struct(n,ct_ndpi,l4_proto,ct,is_ipv6,tm.tv_sec);
@@ -1314,14 +1516,14 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 					pr_info("Reuse   ct_ndpi %p ct %p %s\n",
 						(void *)ct_ndpi, (void *)ct, ct_info(ct,ct_buf,sizeof(ct_buf),ct_dir));
 			  } else
-				COUNTER(ndpi_p34);
+				COUNTER(NDPI_STAT_ERR_ADD_NDPI);
 		}
 	    } else 
-		COUNTER(ndpi_p31);
+		COUNTER(NDPI_STAT_CT_CONFIRM);
 	}
 
 	if(!ct_ndpi) {
-		COUNTER(ndpi_p31);
+		COUNTER(NDPI_STAT_CT_CONFIRM);
 		break;
 	}
 	if(ndpi_log_debug > 2)
@@ -1362,16 +1564,16 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 			host_match = ndpi_host_match(info,ct_ndpi);
 
 		spin_unlock_bh (&ct_ndpi->lock);
-		COUNTER(ndpi_pi);
+		COUNTER(NDPI_STAT_CACHED);
 		if(ndpi_log_debug > 1)
 		    packet_trace(skb,ct,"cache      ");
 		break;
 	    } else {
 		if(ct_proto_last(c_proto))
-		    	COUNTER(ndpi_pi3);
+		    	COUNTER(NDPI_STAT_C_LAST_CT_NOT);
 	    }
 	} else 
-		COUNTER(ndpi_pi4); // new packet
+		COUNTER(NDPI_STAT_C_MAGIC_NOT); // new packet
 
 	if(!ct_ndpi->flinfo.ifidx) 
 		ct_ndpi->flinfo.ifidx = get_in_if(xt_in(par));
@@ -1383,8 +1585,8 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		proto.master_protocol = NDPI_PROTOCOL_IP_ICMP;
 		proto.app_protocol = NDPI_PROTOCOL_IP_ICMP;
 		spin_unlock_bh (&ct_ndpi->lock);
-		COUNTER(ndpi_pj);
-		ndpi_pjc += skb->len;
+		COUNTER(NDPI_STAT_L4MISMATCH);
+		this_cpu_add(ndpi_cpu_stats.cnt[NDPI_STAT_L4MIS_SIZE], skb->len);
 		break;
 	}
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
@@ -1392,8 +1594,8 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		proto.master_protocol = NDPI_PROTOCOL_IP_ICMPV6;
 		proto.app_protocol = NDPI_PROTOCOL_IP_ICMPV6;
 		spin_unlock_bh (&ct_ndpi->lock);
-		COUNTER(ndpi_pj);
-		ndpi_pjc += skb->len;
+		COUNTER(NDPI_STAT_L4MISMATCH);
+		this_cpu_add(ndpi_cpu_stats.cnt[NDPI_STAT_L4MIS_SIZE], skb->len);
 		break;
 	}
 #endif
@@ -1412,6 +1614,7 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		if(info->hostname[0])
 			host_match = ndpi_host_match(info,ct_ndpi);
 
+		ndpi_publish_verdict(ct_ndpi);
 		spin_unlock_bh (&ct_ndpi->lock);
 		if(ndpi_log_debug > 1)
 			packet_trace(skb,ct,"detect_done ");
@@ -1425,21 +1628,23 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 			linearized_skb = skb_copy(skb, GFP_ATOMIC);
 			if (linearized_skb == NULL) {
 				spin_unlock_bh (&ct_ndpi->lock);
-				COUNTER(ndpi_falloc);
+				COUNTER(NDPI_STAT_ERR_SKB_LINEAR);
 				proto.app_protocol = NDPI_PROCESS_ERROR;
 				break;
 			}
 			skb_use = linearized_skb;
-			ndpi_nskb += 1;
+			COUNTER(NDPI_STAT_SKB_SEG);
 		} else {
 			skb_use = skb;
-			ndpi_lskb += 1;
+			COUNTER(NDPI_STAT_SKB_LIN);
 		}
 
 		time = (uint64_t)(tm.tv_sec*1000 + tm.tv_nsec/1000000);
 
 		n = ndpi_pernet(nf_ct_net(ct));
+		t_start = ktime_to_ns(ktime_get());
 		r_proto = ndpi_process_packet(n, ct, ct_ndpi, time, skb_use, ct_dir);
+		ndpi_proto_stat_latency(n, &ct_ndpi->proto, ktime_to_ns(ktime_get()) - t_start);
 
 		c_proto->magic = NDPI_ID;
 		c_proto->proto = r_proto;
@@ -1447,11 +1652,11 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		ct_proto_set_flow(c_proto,ct, !test_flow_yes(ct_ndpi) ? 0:
 			(test_nat_done(ct_ndpi) ? FLOW_NAT_END:FLOW_NAT_START));
 
-		COUNTER(ndpi_pd);
+		COUNTER(NDPI_STAT_NONCACHED);
 		do {
 		    // special case for errors
 		    if(r_proto == NDPI_PROCESS_ERROR) {
-			COUNTER(ndpi_pe);
+			COUNTER(NDPI_STAT_ERR_PROT_ERR);
 			c_proto->proto = r_proto;
 			proto.app_protocol = r_proto;
 			proto.master_protocol = NDPI_PROTOCOL_UNKNOWN;
@@ -1473,6 +1678,8 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 			break;
 		    }
 		    // ndpi_process_packet return unknown
+		    if(!ct_ndpi->flow) // refused by the memory budget
+			break;
 		    if(ct_ndpi->proto.app_protocol != NDPI_PROTOCOL_UNKNOWN &&
 			    ct_ndpi->flow->check_extra_packets) { // restore proto
 			proto = ct_ndpi->proto;
@@ -1491,6 +1698,8 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		    }
 		} while(0);
 
+		if(r_proto != NDPI_PROCESS_ERROR)
+			ndpi_publish_verdict(ct_ndpi);
 		if(info->hostname[0])
 			host_match = ndpi_host_match(info,ct_ndpi);
 		spin_unlock_bh (&ct_ndpi->lock);
@@ -1500,6 +1709,9 @@ ndpi_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	}
     } while(0);
 
+    if(account)
+	ndpi_proto_stat_packet(n, &proto, skb->len);
+
     read_unlock(&n->ndpi_busy);
 
     if (info->error)
@@ -1549,24 +1761,13 @@ struct xt_ndpi_mtinfo *info = par->matchinfo;
 		return -EINVAL;
 	}
 	info->empty = NDPI_BITMASK_IS_ZERO(info->flags);
-	if(info->hostname[0] && info->re) {
-		char re_buf[sizeof(info->hostname)];
-		int re_len = strlen(info->hostname);
-		if(re_len < 3 || info->hostname[0] != '/' || 
-				info->hostname[re_len-1] != '/') {
-			pr_info("Invalid REGEXP\n");
-			return -EINVAL;
-		}
-		re_len -= 2;
-		strncpy(re_buf,&info->hostname[1],re_len);
-		re_buf[re_len] = '\0';
-		info->reg_data = ndpi_regcomp(re_buf,&re_len);
-		if(!info->reg_data) {
-			pr_info("regcomp failed\n");
-			return -EINVAL;
-		}
-		if(ndpi_log_debug > 2)
-			pr_info("regcomp '%s' success\n",re_buf);
+	if(ndpi_net_activate(par->net))
+		return -ENOMEM;
+	if(info->hostname[0]) {
+		/* info->reg_data: shared rule of the host matcher */
+		int ret = ndpi_host_rule_get(info);
+		if(ret < 0)
+			return ret;
 	} else {
 		info->reg_data = NULL;
 	}
@@ -1578,6 +1779,7 @@ struct xt_ndpi_mtinfo *info = par->matchinfo;
 		if (ret < 0) {
 			pr_info("cannot load conntrack support for proto=%u\n",
 				par->family);
+			ndpi_host_rule_put(info);
 			return ret;
 		}
 	}
@@ -1593,7 +1795,7 @@ struct xt_ndpi_mtinfo *info = par->matchinfo;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
 	nf_ct_netns_put(par->net, par->family);
 #endif
-	if(info->reg_data) kfree(info->reg_data);
+	ndpi_host_rule_put(info);
 }
 
 #ifdef NF_CT_CUSTOM
@@ -1775,6 +1977,8 @@ ndpi_tg_check(const struct xt_tgchk_param *par)
 	const struct xt_ndpi_tginfo *info = par->targinfo;
 	if(info->flow_yes && !ndpi_enable_flow)
 		return -EINVAL;
+	if(ndpi_net_activate(par->net))
+		return -ENOMEM;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
 	{
@@ -2033,7 +2237,7 @@ int ndpi_delete_acct(struct ndpi_net *n,int all) {
 			}
 			atomic_dec(&n->acc_work);
 			atomic_dec(&n->acc_rem);
-			kmem_cache_free (ct_info_cache, ct_ndpi);
+			ct_ndpi_info_free(ct_ndpi);
 			i2++;
 			if(all < 3 && (atomic_read(&n->acc_rem) <= 0)) break;
 		} else {
@@ -2220,7 +2424,7 @@ ssize_t nflow_read(struct ndpi_net *n, char __user *buf,
 
 		if(del) {
 			__ndpi_free_ct_proto(ct_ndpi);
-			kmem_cache_free (ct_info_cache, ct_ndpi);
+			ct_ndpi_info_free(ct_ndpi);
 			atomic_dec(&n->acc_work);
 			atomic_dec(&n->acc_rem);
 			n->cnt_del++;
@@ -2417,7 +2621,12 @@ static void __net_exit ndpi_net_exit(struct net *net)
 
 	n = ndpi_pernet(net);
 	if(ndpi_log_debug)
-		pr_info("%s:%s\n",__func__,n->ns_name);
+		pr_info("%s:%s%s\n",__func__,n->ns_name,
+				n->ndpi_struct ? "":" idle");
+
+	atomic_dec(&ndpi_ns_total);
+	if(!n->ndpi_struct)
+		return; /* never had an ndpi rule */
 
 	atomic_set(&n->ndpi_ready,0);
 
@@ -2465,13 +2674,13 @@ static void __net_exit ndpi_net_exit(struct net *net)
 		next = rb_next(&id->node);
 		rb_erase(&id->node, &n->osdpi_id_root);
 		kmem_cache_free (osdpi_id_cache, id);
+		ndpi_mem_account(NDPI_MEM_OTHER, -(int64_t)ndpi_size_id_struct);
 	}
 	
 	str_hosts_done(n->hosts);
 	kfree(n->str_buf);
+	free_percpu(n->proto_stats);
 	
-	ndpi_exit_detection_module(n->ndpi_struct);
-
 	if(n->pde) {
 		if(n->pe_ipdef)
 			remove_proc_entry(ipdef_name, n->pde);
@@ -2493,26 +2702,25 @@ static void __net_exit ndpi_net_exit(struct net *net)
 #endif
 		PROC_REMOVE(n->pde,net);
 	}
+
+	mutex_lock(&ndpi_ns_lock);
+	ndpi_exit_detection_module(n->ndpi_struct);
+	n->ndpi_struct = NULL;
+	if(atomic_dec_and_test(&ndpi_ns_active) && ndpi_tables) {
+		ndpi_put_shared_tables(ndpi_tables);
+		ndpi_tables = NULL;
+	}
+	mutex_unlock(&ndpi_ns_lock);
 }
 
-static int __net_init ndpi_net_init(struct net *net)
+/*
+ * Sets up the detection module, the tables and the procfs entries of a
+ * namespace. Called with ndpi_ns_lock held, at most once per namespace.
+ */
+static int ndpi_net_start(struct net *net, struct ndpi_net *n)
 {
-	struct ndpi_net *n;
 	int i;
 
-	/* init global detection structure */
-
-	n = ndpi_pernet(net);
-	snprintf(n->ns_name,sizeof(n->ns_name)-1,"ns%d",net_ns_id);
-
-	rwlock_init(&n->ndpi_busy);
-	atomic_set(&n->ndpi_ready,0);
-
-	spin_lock_init(&n->id_lock);
-	spin_lock_init(&n->ipq_lock);
-	spin_lock_init(&n->w_buff_lock);
-	mutex_init(&n->host_lock);
-	mutex_init(&n->rem_lock);
 	atomic_set(&n->acc_work,0);
 	atomic_set(&n->acc_rem,0);
 	n->acc_limit = ndpi_flow_limit;
@@ -2531,18 +2739,24 @@ static int __net_init ndpi_net_init(struct net *net)
 	n->str_buf = kmalloc(NF_STR_LBUF,GFP_KERNEL);
 	if (n->str_buf == NULL) {
 		pr_err("xt_ndpi: alloc str_buf failed\n");
-                return -ENOMEM;
+		goto err_str_buf;
 	}
+	n->proto_stats = __alloc_percpu(sizeof(struct ndpi_proto_stats)*(NDPI_NUM_BITS+1),
+					__alignof__(struct ndpi_proto_stats));
+	if (n->proto_stats == NULL)
+		pr_err("xt_ndpi: alloc proto_stats failed, per protocol statistics disabled\n");
 	ndpi_stun_cache_enable = ndpi_stun_cache_opt;
 
 	/* init global detection structure */
 	n->ndpi_struct = ndpi_init_detection_module(ndpi_no_prefs);
 	if (n->ndpi_struct == NULL) {
 		pr_err("xt_ndpi: global structure initialization failed.\n");
-                return -ENOMEM;
+		goto err_str_buf;
 	}
 	n->flow_h = NULL;
 	n->ndpi_struct->direction_detect_disable = 1;
+	if(ndpi_enable_detection_stats(n->ndpi_struct))
+		pr_err("xt_ndpi: alloc detection stats failed, detection statistics disabled\n");
 	/* disable all protocols */
 	NDPI_BITMASK_RESET(n->protocols_bitmask);
 	ndpi_set_protocol_detection_bitmask2(n->ndpi_struct, &n->protocols_bitmask);
@@ -2579,13 +2793,18 @@ static int __net_init ndpi_net_init(struct net *net)
 	ndpi_finalize_initialization(n->ndpi_struct);
 	n->n_hash = -1;
 
+	/* The read-only tables of the first namespace are used by the next ones */
+	if(!ndpi_tables)
+		ndpi_tables = ndpi_get_shared_tables(n->ndpi_struct);
+	else if(ndpi_use_shared_tables(n->ndpi_struct, ndpi_tables))
+		pr_err("xt_ndpi: %s: can't use shared tables\n",n->ns_name);
+
 	/* Create proc files */
 	
 	n->pde = proc_mkdir(dir_name, net->proc_net);
 	if(!n->pde) {
-		ndpi_exit_detection_module(n->ndpi_struct);
 		pr_err("xt_ndpi: cant create net/%s\n",dir_name);
-		return -ENOMEM;
+		goto err_ndpi_struct;
 	}
 	do {
 		ndpi_protocol_match *hm;
@@ -2689,11 +2908,15 @@ static int __net_init ndpi_net_init(struct net *net)
 		}
 		if(hm && str_coll_to_automata(n->host_ac,n->hosts)) hm = NULL;
 		if(hm) {
-			ac_automata_release(n->ndpi_struct->host_automa.ac_automa,0);
-			n->ndpi_struct->host_automa.ac_automa = n->host_ac;
+			ac_automata_release(ndpi_automa_host_replace(n->ndpi_struct,n->host_ac),0);
 			n->host_ac = NULL;
 		} else break;
 
+		/* Last step that can fail: nothing to undo below */
+		if( ndpi_enable_flow && 
+		    nf_register_net_hooks(net, nf_nat_ipv4_ops,
+	                                   ARRAY_SIZE(nf_nat_ipv4_ops))) break;
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
 		init_timer(&n->gc);
 		n->gc.data = (unsigned long)n;
@@ -2713,22 +2936,18 @@ static int __net_init ndpi_net_init(struct net *net)
 #endif
 		net->ct.labels_used++;
 #endif
-		if( ndpi_enable_flow && 
-		    nf_register_net_hooks(net, nf_nat_ipv4_ops,
-	                                   ARRAY_SIZE(nf_nat_ipv4_ops))) break;
 		/* All success! */
+		atomic_inc(&ndpi_ns_active);
 		atomic_set(&n->ndpi_ready,1);
-		net_ns_id++;
 		if(ndpi_log_debug)
 			pr_info("%s:%s OK\n",__func__,n->ns_name);
 		return 0;
 	} while(0);
 
 /* rollback procfs on error */
-	if(n->hosts)
-		str_hosts_done(n->hosts);
 	if(n->host_ac)
 		ac_automata_release(n->host_ac,0);
+	n->host_ac = NULL;
 
 	if(n->pe_hostdef)
 		remove_proc_entry(hostdef_name,n->pde);
@@ -2750,11 +2969,71 @@ static int __net_init ndpi_net_init(struct net *net)
 		remove_proc_entry(flow_name,n->pde);
 
 	PROC_REMOVE(n->pde,net);
+	n->pde = NULL;
+err_ndpi_struct:
 	ndpi_exit_detection_module(n->ndpi_struct);
+	n->ndpi_struct = NULL;
+	if(ndpi_tables && !atomic_read(&ndpi_ns_active)) {
+		ndpi_put_shared_tables(ndpi_tables);
+		ndpi_tables = NULL;
+	}
+err_str_buf:
+	free_percpu(n->proto_stats);
+	n->proto_stats = NULL;
+	kfree(n->str_buf);
+	n->str_buf = NULL;
+	str_hosts_done(n->hosts);
+	n->hosts = NULL;
 
 	return -ENOMEM;
 }
 
+/* Sets up the namespace on its first ndpi rule (or at creation if not lazy) */
+static int ndpi_net_activate(struct net *net)
+{
+	struct ndpi_net *n = ndpi_pernet(net);
+	int ret = 0;
+
+	if(atomic_read(&n->ndpi_ready))
+		return 0;
+
+	mutex_lock(&ndpi_ns_lock);
+	if(!n->ndpi_struct)
+		ret = ndpi_net_start(net, n);
+	mutex_unlock(&ndpi_ns_lock);
+	return ret;
+}
+
+static int __net_init ndpi_net_init(struct net *net)
+{
+	struct ndpi_net *n;
+
+	n = ndpi_pernet(net);
+	snprintf(n->ns_name,sizeof(n->ns_name)-1,"ns%d",net_ns_id++);
+
+	rwlock_init(&n->ndpi_busy);
+	atomic_set(&n->ndpi_ready,0);
+
+	spin_lock_init(&n->id_lock);
+	spin_lock_init(&n->ipq_lock);
+	spin_lock_init(&n->w_buff_lock);
+	mutex_init(&n->host_lock);
+	mutex_init(&n->rem_lock);
+	n->ndpi_struct = NULL;
+	atomic_inc(&ndpi_ns_total);
+
+	if(ndpi_lazy_netns && !net_eq(net,&init_net)) {
+		if(ndpi_log_debug)
+			pr_info("%s:%s idle\n",__func__,n->ns_name);
+		return 0;
+	}
+	if(ndpi_net_activate(net)) {
+		atomic_dec(&ndpi_ns_total);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 #ifndef NF_CT_CUSTOM
 DEFINE_SPINLOCK(ndpi_hook_mutex);
 
@@ -2823,10 +3102,16 @@ static int __init ndpi_mt_init(void)
 {
         int ret;
 
+	BUILD_BUG_ON(NDPI_PROCESS_ERROR > NDPI_VERDICT_PROTO_MASK);
+
 	ndpi_size_id_struct = sizeof(struct osdpi_id_node);
 	ndpi_size_flow_struct = ndpi_detection_get_sizeof_ndpi_flow_struct();
 	set_ndpi_malloc(malloc_wrapper);
 	set_ndpi_free(free_wrapper);
+	if(ndpi_mem_hard_mb && ndpi_mem_soft_mb > ndpi_mem_hard_mb)
+		ndpi_mem_soft_mb = ndpi_mem_hard_mb;
+	ndpi_set_memory_limits((u_int64_t)ndpi_mem_soft_mb << 20,
+			       (u_int64_t)ndpi_mem_hard_mb << 20);
 
 	if(request_module("nf_conntrack") < 0) {
 		pr_err("xt_ndpi: nf_conntrack required!\n");
@@ -2982,6 +3267,7 @@ static void __exit ndpi_mt_exit(void)
 {
 	xt_unregister_target(&ndpi_tg_reg);
 	xt_unregister_match(&ndpi_mt_reg);
+	ndpi_host_match_exit();
 	unregister_pernet_subsys(&ndpi_net_ops);
 #ifdef NF_CT_CUSTOM
 	nf_ct_extend_unregister(&ndpi_extend);
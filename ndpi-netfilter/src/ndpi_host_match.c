@@ -0,0 +1,420 @@
+/*
+ * ndpi_host_match.c
+ *
+ * All --host/--ssl rules share one compiled matcher: substring rules are
+ * merged into a single Aho-Corasick automaton, regexp rules are kept in a
+ * list. Identical patterns share a rule id. Substring rules match ignoring
+ * case, as the library host automa does.
+ *
+ * Changes of the rule set are batched: a delayed work publishes (RCU) one
+ * new matcher with a new generation number for all of them. Until then a
+ * new rule is evaluated on its own, and a removed rule (and its id) is
+ * kept until no matcher refers to it.
+ *
+ * The matcher output for the host and ssl names of a conntrack is a bitmap
+ * of rule ids. It is cached in the conntrack (ct_ndpi->hmemo) and reused
+ * while the generation is unchanged: host and ssl names are never changed
+ * once set, so a packet costs one bit test per rule.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/ctype.h>
+#include <linux/workqueue.h>
+
+#include "ndpi_config.h"
+#undef HAVE_HYPERSCAN
+#include "ndpi_main.h"
+
+#include "ndpi_strcol.h"
+#include "ndpi_main_common.h"
+#include "ndpi_main_netfilter.h"
+#include "xt_ndpi.h"
+#include "ndpi_host_match.h"
+#include "../libre/regexp.h"
+
+struct ndpi_host_rule {
+	struct list_head	list;
+	unsigned int		refcnt;
+	uint32_t		generation;	/* first matcher with this rule, 0: none yet */
+	uint16_t		id;
+	uint8_t			re;
+	regexp			*reg_data;
+	char			pattern[];	/* info->hostname */
+};
+
+struct ndpi_host_matcher {
+	uint32_t		generation;
+	uint16_t		nbits;		/* max rule id + 1 */
+	uint16_t		num_re;
+	AC_AUTOMATA_t		*ac;		/* substring rules */
+	struct ndpi_host_rule	*re[];		/* regexp rules */
+};
+
+struct ndpi_host_memo {
+	struct rcu_head		rcu;
+	uint32_t		generation;
+	uint16_t		nbits;
+	uint8_t			host_done:1,ssl_done:1;
+	unsigned long		bits[];		/* host: [0,nbits), ssl: [nbits,2*nbits) */
+};
+
+struct host_ac_search {
+	AC_TEXT_t		txt;
+	unsigned long		*bits;
+	unsigned int		offset;
+};
+
+/* Rules added or removed in this interval share one rebuild */
+#define HOST_MATCHER_REBUILD_DELAY	(HZ/10)
+
+static DEFINE_MUTEX(host_rules_lock);
+static LIST_HEAD(host_rules);
+static LIST_HEAD(host_rules_dead);	/* put, maybe still in the matcher */
+static DECLARE_BITMAP(host_rule_ids, NDPI_HOST_RULES_MAX);
+static struct ndpi_host_matcher __rcu *host_matcher = NULL;
+static uint32_t host_generation = 0;
+static unsigned long host_num_rules = 0;
+
+static inline size_t host_memo_size(uint16_t nbits) {
+	return sizeof(struct ndpi_host_memo) + BITS_TO_LONGS(2*nbits) * sizeof(unsigned long);
+}
+
+/* Every pattern ending here occurs in the text (ignoring case) */
+static int host_ac_match_cb(AC_MATCH_t *m, AC_TEXT_t *txt, AC_REP_t *param) {
+	struct host_ac_search *s = container_of(txt, struct host_ac_search, txt);
+	int i;
+
+	for(i = 0; i < m->match_num; i++)
+		__set_bit(s->offset + m->patterns[i].rep.number, s->bits);
+	return 0;
+}
+
+/* strstr() ignoring case, pattern is lowercase */
+static bool host_strcasestr(const char *str, const char *pattern) {
+	size_t len = strlen(pattern);
+
+	for(; *str; str++)
+		if(!strncasecmp(str, pattern, len))
+			return true;
+	return false;
+}
+
+static void host_matcher_eval(const struct ndpi_host_matcher *m, const char *str,
+			      unsigned long *bits, unsigned int offset) {
+	int i;
+
+	if(m->ac) {
+		struct host_ac_search s;
+		AC_REP_t r;
+
+		memset(&s.txt, 0, sizeof(s.txt));
+		s.txt.astring = (AC_ALPHABET_t *)str;
+		s.txt.length = strlen(str);
+		s.bits = bits;
+		s.offset = offset;
+		ac_automata_search(m->ac, &s.txt, &r);
+	}
+	for(i = 0; i < m->num_re; i++)
+		if(ndpi_regexec(m->re[i]->reg_data, (char *)str) != 0)
+			__set_bit(offset + m->re[i]->id, bits);
+}
+
+static void host_matcher_free(struct ndpi_host_matcher *m) {
+	if(!m) return;
+	if(m->ac)
+		ac_automata_release(m->ac, 0); /* patterns belong to the rules */
+	kfree(m);
+}
+
+static void host_rule_free(struct ndpi_host_rule *r) {
+	if(r->reg_data) kfree(r->reg_data);
+	kfree(r);
+}
+
+/*
+ * Build and publish the matcher for the current rule list, then free
+ * the removed rules. Without memory the matcher is NULL and every rule
+ * is evaluated directly. Must hold host_rules_lock.
+ */
+static int host_matcher_rebuild(void) {
+	struct ndpi_host_matcher *m = NULL, *old;
+	struct ndpi_host_rule *r, *tmp;
+	int num_re = 0, nbits = 0, num_ac = 0, err = 0;
+
+	list_for_each_entry(r, &host_rules, list) {
+		if(r->re) num_re++; else num_ac++;
+		if(r->id >= nbits) nbits = r->id + 1;
+	}
+
+	if(nbits) {
+		m = kzalloc(sizeof(*m) + num_re * sizeof(m->re[0]), GFP_KERNEL);
+		if(!m) err = -ENOMEM;
+	}
+
+	if(m && num_ac) {
+		m->ac = ac_automata_init(host_ac_match_cb);
+		if(!m->ac) err = -ENOMEM;
+		else ac_automata_feature(m->ac, AC_FEATURE_LC);
+	}
+
+	if(m && !err) {
+		m->generation = ++host_generation;
+		m->nbits = nbits;
+		list_for_each_entry(r, &host_rules, list) {
+			AC_PATTERN_t p;
+			AC_ERROR_t ae;
+
+			if(r->re) {
+				m->re[m->num_re++] = r;
+				continue;
+			}
+			memset(&p, 0, sizeof(p));
+			p.astring = r->pattern;
+			p.length = strlen(r->pattern);
+			p.rep.number = r->id;
+			ae = ac_automata_add(m->ac, &p);
+			if(ae != ACERR_SUCCESS) {
+				pr_err("xt_ndpi: host rule '%s': %s\n", r->pattern, acerr2txt(ae));
+				err = -EINVAL;
+				break;
+			}
+		}
+		if(!err && m->ac)
+			ac_automata_finalize(m->ac);
+	}
+
+	if(err) {
+		host_matcher_free(m);
+		m = NULL;
+	} else if(m) {
+		list_for_each_entry(r, &host_rules, list)
+			if(!r->generation)
+				WRITE_ONCE(r->generation, m->generation);
+	}
+
+	old = rcu_dereference_protected(host_matcher, lockdep_is_held(&host_rules_lock));
+	rcu_assign_pointer(host_matcher, m);
+	if(old || !list_empty(&host_rules_dead)) {
+		synchronize_rcu();
+		host_matcher_free(old);
+	}
+	list_for_each_entry_safe(r, tmp, &host_rules_dead, list) {
+		list_del(&r->list);
+		__clear_bit(r->id, host_rule_ids);
+		host_rule_free(r);
+	}
+	return err;
+}
+
+static void host_matcher_rebuild_work(struct work_struct *work) {
+	mutex_lock(&host_rules_lock);
+	/* on failure rules are matched one by one, see ndpi_host_rule_match() */
+	host_matcher_rebuild();
+	mutex_unlock(&host_rules_lock);
+}
+
+static DECLARE_DELAYED_WORK(host_rebuild_work, host_matcher_rebuild_work);
+
+int ndpi_host_rule_get(struct xt_ndpi_mtinfo *info) {
+	struct ndpi_host_rule *r;
+	size_t len = strnlen(info->hostname, sizeof(info->hostname)-1);
+	int id;
+
+	info->reg_data = NULL;
+	mutex_lock(&host_rules_lock);
+
+	list_for_each_entry(r, &host_rules, list) {
+		if(r->re == info->re && !r->pattern[len] &&
+		   !(r->re ? strncmp(r->pattern, info->hostname, len) :
+			     strncasecmp(r->pattern, info->hostname, len))) {
+			r->refcnt++;
+			info->reg_data = r;
+			mutex_unlock(&host_rules_lock);
+			return 0;
+		}
+	}
+
+	id = find_first_zero_bit(host_rule_ids, NDPI_HOST_RULES_MAX);
+	if(id >= NDPI_HOST_RULES_MAX) {
+		mutex_unlock(&host_rules_lock);
+		pr_info("Too many host rules\n");
+		return -ENOSPC;
+	}
+
+	r = kzalloc(sizeof(*r) + len + 1, GFP_KERNEL);
+	if(!r) {
+		mutex_unlock(&host_rules_lock);
+		return -ENOMEM;
+	}
+	memcpy(r->pattern, info->hostname, len);
+	if(!info->re) {
+		size_t i;
+
+		for(i = 0; i < len; i++)
+			r->pattern[i] = tolower(r->pattern[i]);
+	}
+	r->re = info->re;
+	r->id = id;
+	r->refcnt = 1;
+
+	if(info->re) {
+		char re_buf[sizeof(info->hostname)];
+		int re_len = len;
+
+		if(re_len < 3 || info->hostname[0] != '/' ||
+				info->hostname[re_len-1] != '/') {
+			mutex_unlock(&host_rules_lock);
+			kfree(r);
+			pr_info("Invalid REGEXP\n");
+			return -EINVAL;
+		}
+		re_len -= 2;
+		strncpy(re_buf,&info->hostname[1],re_len);
+		re_buf[re_len] = '\0';
+		r->reg_data = ndpi_regcomp(re_buf,&re_len);
+		if(!r->reg_data) {
+			mutex_unlock(&host_rules_lock);
+			kfree(r);
+			pr_info("regcomp failed\n");
+			return -EINVAL;
+		}
+		if(ndpi_log_debug > 2)
+			pr_info("regcomp '%s' success\n",re_buf);
+	}
+
+	__set_bit(id, host_rule_ids);
+	list_add_tail(&r->list, &host_rules);
+	host_num_rules++;
+	info->reg_data = r;
+
+	schedule_delayed_work(&host_rebuild_work, HOST_MATCHER_REBUILD_DELAY);
+
+	mutex_unlock(&host_rules_lock);
+	return 0;
+}
+
+void ndpi_host_rule_put(struct xt_ndpi_mtinfo *info) {
+	struct ndpi_host_rule *r = info->reg_data;
+
+	if(!r) return;
+	info->reg_data = NULL;
+
+	mutex_lock(&host_rules_lock);
+	if(--r->refcnt) {
+		mutex_unlock(&host_rules_lock);
+		return;
+	}
+	/* freed (and its id reused) once no matcher refers to it */
+	list_move_tail(&r->list, &host_rules_dead);
+	host_num_rules--;
+	schedule_delayed_work(&host_rebuild_work, HOST_MATCHER_REBUILD_DELAY);
+	mutex_unlock(&host_rules_lock);
+}
+
+/* Module exit: all the rules are put, free the matcher and the rules now */
+void ndpi_host_match_exit(void) {
+	cancel_delayed_work_sync(&host_rebuild_work);
+	mutex_lock(&host_rules_lock);
+	host_matcher_rebuild();
+	mutex_unlock(&host_rules_lock);
+}
+
+/* Same as the per packet evaluation of the rule before the shared matcher */
+static bool host_rule_eval(const struct xt_ndpi_mtinfo *info,
+			   const struct ndpi_host_rule *r,
+			   const char *host, const char *ssl, bool tls) {
+	if(info->host && host) {
+		if(r->re ? ndpi_regexec(r->reg_data, (char *)host) != 0 :
+			   host_strcasestr(host, r->pattern))
+			return true;
+	}
+	if(info->ssl && tls && ssl) {
+		if(r->re ? ndpi_regexec(r->reg_data, (char *)ssl) != 0 :
+			   host_strcasestr(ssl, r->pattern))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Called from the match (rcu read side).
+ * ct_ndpi->hmemo is replaced as a whole and freed after a grace period,
+ * so a memo is never modified once published.
+ */
+bool ndpi_host_rule_match(const struct xt_ndpi_mtinfo *info,
+			  struct nf_ct_ext_ndpi *ct_ndpi,
+			  const char *host, const char *ssl, bool tls) {
+	const struct ndpi_host_rule *r = info->reg_data;
+	const struct ndpi_host_matcher *m;
+	struct ndpi_host_memo *memo, *old;
+	uint32_t generation;
+
+	if(!r || (!host && !ssl)) return false;
+
+	m = rcu_dereference(host_matcher);
+	generation = READ_ONCE(r->generation);
+	/* a rule added after this matcher was built is not in it */
+	if(!m || !generation || generation > m->generation || r->id >= m->nbits)
+		return host_rule_eval(info, r, host, ssl, tls);
+
+	memo = READ_ONCE(ct_ndpi->hmemo);
+	if(!memo || memo->generation != m->generation ||
+	   (host && !memo->host_done) || (ssl && !memo->ssl_done)) {
+		size_t size = host_memo_size(m->nbits);
+
+		memo = kzalloc(size, GFP_ATOMIC);
+		if(!memo)
+			return host_rule_eval(info, r, host, ssl, tls);
+		memo->generation = m->generation;
+		memo->nbits = m->nbits;
+		if(host) {
+			host_matcher_eval(m, host, memo->bits, 0);
+			memo->host_done = 1;
+		}
+		if(ssl) {
+			host_matcher_eval(m, ssl, memo->bits, m->nbits);
+			memo->ssl_done = 1;
+		}
+		ndpi_mem_account(NDPI_MEM_CACHE, size);
+		smp_wmb();
+		old = xchg(&ct_ndpi->hmemo, memo);
+		if(old) {
+			ndpi_mem_account(NDPI_MEM_CACHE, -(int64_t)host_memo_size(old->nbits));
+			kfree_rcu(old, rcu);
+		}
+		this_cpu_inc(ndpi_cpu_stats.host_memo_miss);
+	} else {
+		smp_rmb();
+		this_cpu_inc(ndpi_cpu_stats.host_memo_hit);
+	}
+
+	return (info->host && host && test_bit(r->id, memo->bits)) ||
+	       (info->ssl && tls && ssl && test_bit(memo->nbits + r->id, memo->bits));
+}
+
+void ndpi_host_memo_free(struct nf_ct_ext_ndpi *ct_ndpi) {
+	struct ndpi_host_memo *memo = xchg(&ct_ndpi->hmemo, NULL);
+
+	if(memo) {
+		ndpi_mem_account(NDPI_MEM_CACHE, -(int64_t)host_memo_size(memo->nbits));
+		kfree_rcu(memo, rcu);
+	}
+}
+
+void ndpi_host_match_stats(unsigned long *rules, unsigned long *generation,
+			   unsigned long *hit, unsigned long *miss) {
+	struct ndpi_cpu_stats s;
+
+	ndpi_stats_sum(&s);
+	*rules = host_num_rules;
+	*generation = host_generation;
+	*hit = s.host_memo_hit;
+	*miss = s.host_memo_miss;
+}
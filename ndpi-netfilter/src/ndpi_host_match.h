@@ -0,0 +1,25 @@
+/*
+ * Shared matcher for --host/--ssl rules.
+ */
+
+/* Max number of distinct host/ssl patterns in all tables */
+#define NDPI_HOST_RULES_MAX	4096
+
+struct xt_ndpi_mtinfo;
+struct nf_ct_ext_ndpi;
+struct ndpi_host_memo;
+
+/* checkentry/destroy: info->reg_data points to the shared rule */
+int  ndpi_host_rule_get(struct xt_ndpi_mtinfo *info);
+void ndpi_host_rule_put(struct xt_ndpi_mtinfo *info);
+
+bool ndpi_host_rule_match(const struct xt_ndpi_mtinfo *info,
+			  struct nf_ct_ext_ndpi *ct_ndpi,
+			  const char *host, const char *ssl, bool tls);
+
+void ndpi_host_memo_free(struct nf_ct_ext_ndpi *ct_ndpi);
+
+void ndpi_host_match_exit(void);
+
+void ndpi_host_match_stats(unsigned long *rules, unsigned long *generation,
+			   unsigned long *hit, unsigned long *miss);
@@ -34,6 +34,75 @@ struct write_proc_cmd {
 
 struct nf_ct_ext_ndpi;
 
+/*
+ * Packet path counters. They are per cpu and only summed when
+ * /proc/net/xt_ndpi/info (or the module parameter) is read.
+ */
+enum ndpi_stat_id {
+	NDPI_STAT_IPV4=0,		/* ipv4 */
+	NDPI_STAT_IPV6,			/* ipv6 */
+	NDPI_STAT_NONIP,		/* nonip */
+	NDPI_STAT_ERR_IP_FRAG_LEN,	/* err_ip_frag_len */
+	NDPI_STAT_ERR_BAD_TCP_UDP,	/* err_bad_tcp_udp */
+	NDPI_STAT_CT_CONFIRM,		/* ct_confirm */
+	NDPI_STAT_ERR_ADD_NDPI,		/* err_add_ndpi */
+	NDPI_STAT_NON_TCPUDP,		/* non_tcpudp */
+	NDPI_STAT_ID_NUM,		/* id_num */
+	NDPI_STAT_NONCACHED,		/* noncached */
+	NDPI_STAT_ERR_PROT_ERR,		/* err_prot_err */
+	NDPI_STAT_ERR_PROT_ERR1,	/* err_prot_err1 */
+	NDPI_STAT_ERR_ALLOC_FLOW,	/* err_alloc_flow */
+	NDPI_STAT_ERR_MEM_LIMIT,	/* err_mem_limit */
+	NDPI_STAT_ERR_ALLOC_ID,		/* err_alloc_id */
+	NDPI_STAT_CACHED,		/* cached */
+	NDPI_STAT_C_SKB_NOT,		/* c_skb_not */
+	NDPI_STAT_C_LAST_CT_NOT,	/* c_last_ct_not */
+	NDPI_STAT_C_MAGIC_NOT,		/* c_magic_not */
+	NDPI_STAT_L4MISMATCH,		/* l4mismatch */
+	NDPI_STAT_L4MIS_SIZE,		/* l4mis_size */
+	NDPI_STAT_NDPI_MATCH,		/* ndpi_match */
+	NDPI_STAT_FAST_PATH,		/* fast_path */
+	NDPI_STAT_ERR_OVERSIZE,		/* err_oversize */
+	NDPI_STAT_ERR_SKB_LINEAR,	/* err_skb_linear */
+	NDPI_STAT_SKB_SEG,		/* skb_seg */
+	NDPI_STAT_SKB_LIN,		/* skb_lin */
+	NDPI_STAT_FLOW_CREATED,		/* flow_created */
+	NDPI_STAT_FLOW_DELETED,		/* flow_deleted */
+	NDPI_STAT_NUM
+};
+
+#define NDPI_PARSED_LINES_BINS	11	/* by 10 lines */
+
+struct ndpi_cpu_stats {
+	unsigned long	cnt[NDPI_STAT_NUM];
+	unsigned long	parsed_lines[NDPI_PARSED_LINES_BINS];
+	unsigned long	max_parsed_lines;
+	unsigned long	host_memo_hit, host_memo_miss;	/* ndpi_host_match.c */
+};
+
+DECLARE_PER_CPU(struct ndpi_cpu_stats, ndpi_cpu_stats);
+
+/* Per protocol, per cpu (struct ndpi_net.proto_stats) */
+#define NDPI_LATENCY_BINS	12	/* ndpi_process_packet() time: <256ns, <512ns, ... >=256us */
+#define NDPI_LATENCY_SHIFT	8
+
+/*
+ * Packets to detection are counted by the library (ndpi_get_detection_stats()).
+ * Keep the array below the per cpu allocator limit (32 KB).
+ */
+struct ndpi_proto_stats {
+	unsigned long	packets, bytes;
+	unsigned int	latency[NDPI_LATENCY_BINS];
+};
+
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#endif
+
+void ndpi_stats_sum(struct ndpi_cpu_stats *s);
+void ndpi_proto_stats_sum(const struct ndpi_proto_stats __percpu *ps, int proto,
+		struct ndpi_proto_stats *s);
+
 #define NF_STR_LBUF (sizeof(struct flow_data) + 2*256)
 
 struct ndpi_net {
@@ -106,6 +175,7 @@ struct ndpi_net {
 		uint32_t	mark,mask;
 	} mark[NDPI_NUM_BITS+1];
 	atomic_t	protocols_cnt[NDPI_NUM_BITS+1];
+	struct ndpi_proto_stats __percpu *proto_stats; /* [NDPI_NUM_BITS+1] */
 	NDPI_PROTOCOL_BITMASK protocols_bitmask;
 	char			ns_name[16];
 	u_int8_t debug_level[NDPI_NUM_BITS+1]; /* if defined NDPI_ENABLE_DEBUG_MESSAGES */
@@ -183,7 +253,9 @@ struct nf_ct_ext_ndpi {
 	struct ndpi_id_struct   *src,*dst;	// 8/16
 	char			*host;		// 4/8 bytes
 	char			*ssl;		// 4/8 bytes
+	struct ndpi_host_memo	*hmemo;		// 4/8 bytes, see ndpi_host_match.c
 	ndpi_protocol_nf	proto;		// 4 bytes
+	uint32_t		verdict;	// 4 bytes, see ndpi_publish_verdict()
 	spinlock_t		lock;		// 2/4 bytes
 						// ?/56 bytes with debug spinlock
 #if __SIZEOF_LONG__ == 8
@@ -198,6 +270,19 @@ struct nf_ct_ext_ndpi {
 
 } __attribute__((__aligned__(__SIZEOF_LONG__ * 2)));
 
+/*
+ * The final verdict is published once per conntrack and read without
+ * ct_ndpi->lock. bits 0-11: master protocol, 12-23: app protocol.
+ */
+#define NDPI_VERDICT_FINAL	0x80000000u
+#define NDPI_VERDICT_PROTO_MASK	0xfffu
+
+#define pack_verdict(proto) (NDPI_VERDICT_FINAL | \
+		(((proto).app_protocol & NDPI_VERDICT_PROTO_MASK) << 12) | \
+		((proto).master_protocol & NDPI_VERDICT_PROTO_MASK))
+#define verdict_master(v)	((v) & NDPI_VERDICT_PROTO_MASK)
+#define verdict_app(v)		(((v) >> 12) & NDPI_VERDICT_PROTO_MASK)
+
 extern unsigned long ndpi_log_debug;
 
 #include "../lib/third_party/include/ahocorasick.h"
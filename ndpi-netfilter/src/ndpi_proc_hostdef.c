@@ -183,9 +183,7 @@ int n_hostdef_proc_close(struct inode *inode, struct file *file)
 		if(!n->host_error && str_coll_to_automata(n->host_ac,n->hosts_tmp))
 			n->host_error++;
 		if(!n->host_error) {
-			spin_lock_bh(&nstr->host_automa_lock);
-			XCHGP(nstr->host_automa.ac_automa,n->host_ac);
-			spin_unlock_bh(&nstr->host_automa_lock);
+			n->host_ac = ndpi_automa_host_replace(nstr,n->host_ac);
 
 			XCHGP(n->hosts,n->hosts_tmp);
 
@@ -3,6 +3,7 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/proc_fs.h>
+#include <linux/vmalloc.h>
 
 #include <linux/ip.h>
 #include <linux/ipv6.h>
@@ -17,6 +18,192 @@
 #include "ndpi_proc_parsers.h"
 #include "ndpi_proc_generic.h"
 #include "ndpi_proc_info.h"
+#include "ndpi_host_match.h"
+
+/* Memory budget and host matcher summary, appended to the first line of the info file */
+static int ninfo_mem_stats(char *lbuf, size_t len)
+{
+	struct ndpi_mem_stats st;
+	unsigned long rules,generation,hit,miss;
+	int i,l;
+
+	ndpi_get_memory_stats(&st);
+	l = snprintf(lbuf, len, "memory total %llu peak %llu soft %llu hard %llu level %d shed %llu denied %llu\n",
+			st.total, st.peak, st.soft_limit, st.hard_limit, st.level, st.shed, st.denied);
+	for(i=0; i < NDPI_MEM_NUM_CATEGORIES && l < len; i++)
+		l += snprintf(&lbuf[l], len-l, "%s%s %llu%s", !i ? "memory ":"",
+				ndpi_mem_category_name(i), st.used[i],
+				i == NDPI_MEM_NUM_CATEGORIES-1 ? "\n":" ");
+	ndpi_host_match_stats(&rules,&generation,&hit,&miss);
+	if(l < len)
+		l += snprintf(&lbuf[l], len-l, "host_rules %lu generation %lu memo hit %lu miss %lu\n",
+				rules, generation, hit, miss);
+	return l < len ? l : len;
+}
+
+static const char *const ndpi_stat_name[NDPI_STAT_NUM] = {
+	[NDPI_STAT_IPV4]		= "ipv4",
+	[NDPI_STAT_IPV6]		= "ipv6",
+	[NDPI_STAT_NONIP]		= "nonip",
+	[NDPI_STAT_ERR_IP_FRAG_LEN]	= "err_ip_frag_len",
+	[NDPI_STAT_ERR_BAD_TCP_UDP]	= "err_bad_tcp_udp",
+	[NDPI_STAT_CT_CONFIRM]		= "ct_confirm",
+	[NDPI_STAT_ERR_ADD_NDPI]	= "err_add_ndpi",
+	[NDPI_STAT_NON_TCPUDP]		= "non_tcpudp",
+	[NDPI_STAT_ID_NUM]		= "id_num",
+	[NDPI_STAT_NONCACHED]		= "noncached",
+	[NDPI_STAT_ERR_PROT_ERR]	= "err_prot_err",
+	[NDPI_STAT_ERR_PROT_ERR1]	= "err_prot_err1",
+	[NDPI_STAT_ERR_ALLOC_FLOW]	= "err_alloc_flow",
+	[NDPI_STAT_ERR_MEM_LIMIT]	= "err_mem_limit",
+	[NDPI_STAT_ERR_ALLOC_ID]	= "err_alloc_id",
+	[NDPI_STAT_CACHED]		= "cached",
+	[NDPI_STAT_C_SKB_NOT]		= "c_skb_not",
+	[NDPI_STAT_C_LAST_CT_NOT]	= "c_last_ct_not",
+	[NDPI_STAT_C_MAGIC_NOT]		= "c_magic_not",
+	[NDPI_STAT_L4MISMATCH]		= "l4mismatch",
+	[NDPI_STAT_L4MIS_SIZE]		= "l4mis_size",
+	[NDPI_STAT_NDPI_MATCH]		= "ndpi_match",
+	[NDPI_STAT_FAST_PATH]		= "fast_path",
+	[NDPI_STAT_ERR_OVERSIZE]	= "err_oversize",
+	[NDPI_STAT_ERR_SKB_LINEAR]	= "err_skb_linear",
+	[NDPI_STAT_SKB_SEG]		= "skb_seg",
+	[NDPI_STAT_SKB_LIN]		= "skb_lin",
+	[NDPI_STAT_FLOW_CREATED]	= "flow_created",
+	[NDPI_STAT_FLOW_DELETED]	= "flow_deleted",
+};
+
+/* How flows were classified, from the library (ndpi_get_detection_stats()) */
+static int ninfo_detection_stats(struct ndpi_net *n, char *lbuf, int l, size_t len)
+{
+	struct ndpi_detection_stats ds;
+	int i,j;
+
+	if(l < len)
+		l += snprintf(&lbuf[l], len-l,
+			"#detect pkts 1 2 <=4 <=8 <=16 <=32 <=64 >64"
+			" ms <1 <2 <4 <8 <16 <32 <64 <128 <256 <512 <1024 >=1024\n");
+
+	for(i=0; i < NDPI_NUM_BITS && l < len; i++) {
+		const char *t_proto;
+		char c_buf[32];
+		uint32_t flows = 0;
+		int lp = l;
+
+		if(ndpi_get_detection_stats(n->ndpi_struct, i, &ds))
+			break;
+		for(j=0; j < NDPI_NUM_DETECTION_METHODS; j++)
+			flows += ds.flows[j];
+		if(!flows) continue;
+
+		t_proto = ndpi_get_proto_by_id(n->ndpi_struct,i);
+		if(!t_proto) {
+			snprintf(c_buf,sizeof(c_buf)-1,"custom%d",i);
+			t_proto = c_buf;
+		}
+		l += snprintf(&lbuf[l], len-l, "detect %s", t_proto);
+		for(j=0; j < NDPI_NUM_DETECTION_METHODS && l < len; j++)
+			l += snprintf(&lbuf[l], len-l, " %s %u",
+					ndpi_detection_method2str(j), ds.flows[j]);
+		if(l < len)
+			l += snprintf(&lbuf[l], len-l, " pkts");
+		for(j=0; j < NDPI_DETECTION_PKT_BINS && l < len; j++)
+			l += snprintf(&lbuf[l], len-l, " %u", ds.pkts[j]);
+		if(l < len)
+			l += snprintf(&lbuf[l], len-l, " ms");
+		for(j=0; j < NDPI_DETECTION_TIME_BINS && l < len; j++)
+			l += snprintf(&lbuf[l], len-l, " %u", ds.time_ms[j]);
+		if(l < len)
+			l += snprintf(&lbuf[l], len-l, "\n");
+		if(l >= len) {
+			/* No room left: drop the partial line */
+			l = lp;
+			break;
+		}
+	}
+	return l < len ? l : len;
+}
+
+/* Packet path counters and per protocol statistics, summed over the cpus */
+static int ninfo_cpu_stats(struct ndpi_net *n, char *lbuf, size_t len)
+{
+	struct ndpi_cpu_stats st;
+	struct ndpi_proto_stats ps;
+	struct ndpi_host_match_cache_stats hs;
+	int i,j,l;
+
+	ndpi_stats_sum(&st);
+	l = snprintf(lbuf, len, "counters");
+	for(i=0; i < NDPI_STAT_NUM && l < len; i++)
+		l += snprintf(&lbuf[l], len-l, " %s %lu", ndpi_stat_name[i], st.cnt[i]);
+	if(l < len)
+		l += snprintf(&lbuf[l], len-l, "\nparsed_lines max %lu bins", st.max_parsed_lines);
+	for(i=0; i < NDPI_PARSED_LINES_BINS && l < len; i++)
+		l += snprintf(&lbuf[l], len-l, " %lu", st.parsed_lines[i]);
+	if(l < len)
+		l += snprintf(&lbuf[l], len-l, "\n");
+	if(l < len && !ndpi_get_host_match_cache_stats(n->ndpi_struct, &hs))
+		l += snprintf(&lbuf[l], len-l, "host_cache entries %u hits %llu misses %llu\n",
+				hs.num_entries, hs.hits, hs.misses);
+
+	if(!n->proto_stats)
+		return ninfo_detection_stats(n, lbuf, l, len);
+
+	if(l < len)
+		l += snprintf(&lbuf[l], len-l,
+			"#proto latency <256ns <512ns <1us <2us <4us <8us <16us <32us <64us <128us <256us >=256us\n");
+
+	for(i=0; i <= NDPI_NUM_BITS && l < len; i++) {
+		const char *t_proto;
+		char c_buf[32];
+		int lp = l;
+
+		ndpi_proto_stats_sum(n->proto_stats, i, &ps);
+		if(!ps.packets) continue;
+
+		t_proto = ndpi_get_proto_by_id(n->ndpi_struct,i);
+		if(!t_proto) {
+			snprintf(c_buf,sizeof(c_buf)-1,"custom%d",i);
+			t_proto = c_buf;
+		}
+		l += snprintf(&lbuf[l], len-l, "proto %s packets %lu bytes %lu latency",
+				t_proto, ps.packets, ps.bytes);
+		for(j=0; j < NDPI_LATENCY_BINS && l < len; j++)
+			l += snprintf(&lbuf[l], len-l, " %u", ps.latency[j]);
+		if(l < len)
+			l += snprintf(&lbuf[l], len-l, "\n");
+		if(l >= len) {
+			/* No room left: drop the partial line */
+			l = lp;
+			break;
+		}
+	}
+	return ninfo_detection_stats(n, lbuf, l, len);
+}
+
+/* First read of the info file: summary line, memory and packet statistics */
+#define NINFO_HEAD_SIZE (64*1024)
+
+static ssize_t ninfo_proc_head(struct ndpi_net *n, const char *lbuf, int l,
+		char __user *buf, size_t count, loff_t *ppos)
+{
+	char *hbuf;
+
+	hbuf = vmalloc(NINFO_HEAD_SIZE);
+	if(!hbuf) return -ENOMEM;
+
+	memcpy(hbuf, lbuf, l);
+	l += ninfo_mem_stats(&hbuf[l], NINFO_HEAD_SIZE-1-l);
+	l += ninfo_cpu_stats(n, &hbuf[l], NINFO_HEAD_SIZE-1-l);
+	if(l > count) l = count;
+
+	if (!(ACCESS_OK(VERIFY_WRITE, buf, l) &&
+			! __copy_to_user(buf, hbuf, l))) l = -EFAULT;
+	else
+		(*ppos)++;
+	vfree(hbuf);
+	return l;
+}
 
 ssize_t _ninfo_proc_read(struct ndpi_net *n, char __user *buf,
                               size_t count, loff_t *ppos,int family)
@@ -26,7 +213,7 @@ ssize_t _ninfo_proc_read(struct ndpi_net *n, char __user *buf,
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
 	struct hash_ip4p_table *ht6 = ndpi_struct->bt6_ht;
 #endif
-	char lbuf[128];
+	char lbuf[448];
 	struct hash_ip4p *t;
 	size_t p;
 	int l;
@@ -38,10 +225,7 @@ ssize_t _ninfo_proc_read(struct ndpi_net *n, char __user *buf,
 	if(!ht) {
 	    if(!*ppos) {
 	        l =  snprintf(lbuf,sizeof(lbuf)-1, "hash disabled\n");
-		if (!(ACCESS_OK(VERIFY_WRITE, buf, l) &&
-				! __copy_to_user(buf, lbuf, l))) return -EFAULT;
-		(*ppos)++;
-		return l;
+		return ninfo_proc_head(n, lbuf, l, buf, count, ppos);
 	    }
 	    return 0;
 	}
@@ -62,11 +246,7 @@ ssize_t _ninfo_proc_read(struct ndpi_net *n, char __user *buf,
 			"hash_size %lu hash timeout %lus count %u min %d max %d gc %d\n",
 				(family == AF_INET6 ? bt6_hash_size:bt_hash_size)*1024,
 				bt_hash_tmo, atomic_read(&ht->count),tmin,tmax,n->gc_count );
-
-		if (!(ACCESS_OK(VERIFY_WRITE, buf, l) &&
-				! __copy_to_user(buf, lbuf, l))) return -EFAULT;
-		(*ppos)++;
-		return l;
+		return ninfo_proc_head(n, lbuf, l, buf, count, ppos);
 	    }
 	    /* ppos > 0 */
 #define BSS1 144
@@ -586,7 +586,8 @@ struct ndpi_flow_tcp_struct {
   struct {
     struct {
       uint8_t *buffer;
-      unsigned buffer_len, buffer_used;
+      unsigned buffer_len, buffer_used, max_expected;
+      uint32_t next_seq[2];
     } message;
 
     void* srv_cert_fingerprint_ctx; /* SHA-1 */
@@ -1058,6 +1059,10 @@ struct ndpi_flow_struct {
   uint8_t host_server_name[240];
   uint8_t initial_binary_bytes[8], initial_binary_bytes_len;
   uint8_t risk_checked;
+  uint8_t detection_method; /* ndpi_detection_method + 1, 0 until classified */
+  uint8_t budget_exhausted;
+  uint16_t detection_budget, budget_port; /* packets, see ndpi_set_detection_budget() */
+  uint64_t first_packet_time_ms;
   ndpi_risk risk; /* Issues found with this flow [bitmask of ndpi_risk] */
 
   /*
@@ -1082,9 +1087,10 @@ struct ndpi_flow_struct {
      is remapped to somethign pther than Kerberos due to a faulty
      dissector
   */
-  struct {    
-    char *pktbuf;
-    uint16_t pktbuf_maxlen, pktbuf_currlen;
+  struct {
+    uint8_t *buffer;
+    unsigned buffer_len, buffer_used, max_expected;
+    uint32_t next_seq[2];
   } kerberos_buf;
   union {
     /* the only fields useful for nDPI and ntopng */
@@ -160,6 +160,37 @@ extern "C" {
 					 const u_int8_t ** l4ptr, u_int16_t * l4len,
 					 u_int8_t * nxt_hdr);
   void ndpi_set_risk(struct ndpi_flow_struct *flow, ndpi_risk_enum r);
+
+  /* Streaming fingerprint (JA3, HASSH): hashed while it is built */
+  struct ndpi_MD5Context;
+
+  struct ndpi_fingerprint {
+    struct ndpi_MD5Context *md5, *tail;
+    u_int16_t len, max_len;
+    u_int8_t buf_len, has_tail, sealed;
+    char buf[64];
+  };
+
+  void ndpi_fingerprint_init(struct ndpi_fingerprint *fp, struct ndpi_MD5Context *md5,
+			     struct ndpi_MD5Context *tail, u_int16_t max_len);
+  int ndpi_fingerprint_append(struct ndpi_fingerprint *fp, const char *str, u_int32_t len);
+  int ndpi_fingerprint_append_u16(struct ndpi_fingerprint *fp, char sep, u_int16_t value);
+  int ndpi_fingerprint_append_fields(struct ndpi_fingerprint *fp, char sep,
+				     const char **fields, u_int num_fields);
+  void ndpi_fingerprint_seal(struct ndpi_fingerprint *fp);
+  void ndpi_fingerprint_final(struct ndpi_fingerprint *fp, u_int8_t digest[16],
+			      char hex[33], u_int8_t upper_case);
+
+#ifndef __KERNEL__
+  /* TLS certificates already dissected, by SHA-1 fingerprint */
+  struct ndpi_tls_cert_info_cache *ndpi_tls_cert_info_cache_init(u_int32_t num_entries);
+  void ndpi_tls_cert_info_cache_free(struct ndpi_tls_cert_info_cache *c);
+  struct ndpi_tls_cert_info *ndpi_tls_cert_info_find(struct ndpi_tls_cert_info_cache *c, const u_int8_t *sha1);
+  struct ndpi_tls_cert_info *ndpi_tls_cert_info_add(struct ndpi_tls_cert_info_cache *c, const u_int8_t *sha1);
+
+  int ndpi_hostname_has_match(struct ndpi_detection_module_struct *ndpi_str,
+			      char *name, u_int name_len);
+#endif
 #ifdef __cplusplus
 }
 #endif
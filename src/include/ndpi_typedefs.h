@@ -484,6 +484,7 @@ struct ndpi_vxlanhdr {
 /* ******************* ********************* ****************** */
 /* ************************************************************ */
 
+/* TCP reassembly buffer (see ndpi_tcp_reassembly_append) */
 typedef struct message {
   u_int8_t *buffer;
   u_int buffer_len, buffer_used, max_expected;
@@ -584,6 +585,27 @@ struct ndpi_lru_cache {
   struct ndpi_lru_cache_entry *entries;
 };
 
+/* TLS certificates already dissected, by SHA-1 fingerprint */
+#define NDPI_CERT_MATCH_UNKNOWN   0 /* Not yet checked */
+#define NDPI_CERT_MATCH_NONE      1
+#define NDPI_CERT_MATCH_FOUND     2
+
+struct ndpi_tls_cert_info {
+  u_int8_t sha1[20];
+  u_int8_t is_full:1, has_validity:1, has_san:1, pad:5;
+  u_int8_t subject_match; /* NDPI_CERT_MATCH_XXX */
+  u_int16_t subject_proto, num_names;
+  u_int32_t notBefore, notAfter;
+  char *issuerDN, *subjectDN; /* NULL if empty */
+  char *names; /* SAN dNSNames: match flag (NDPI_CERT_MATCH_XXX) + name + '\0' each */
+  char *data; /* Holds the strings above */
+};
+
+struct ndpi_tls_cert_info_cache {
+  u_int32_t num_entries;
+  struct ndpi_tls_cert_info *entries;
+};
+
 struct ndpi_id_struct {
   /**
      detected_protocol_bitmask:
@@ -1108,6 +1130,7 @@ typedef struct ndpi_default_ports_tree_node {
 
 typedef struct _ndpi_automa {
   void *ac_automa; /* Real type is AC_AUTOMATA_t */
+  void *domains;   /* Suffix index of the domain patterns of ac_automa (host names only) */
   u_int8_t ac_automa_finalized;
 } ndpi_automa;
 
@@ -1129,6 +1152,36 @@ typedef struct ndpi_proto {
   #define NDPI_PROTOCOL_NULL { NDPI_PROTOCOL_UNKNOWN , NDPI_PROTOCOL_UNKNOWN }
 #endif
 
+/* How a flow got its protocol (see ndpi_enable_detection_stats()) */
+typedef enum {
+  ndpi_detection_by_dpi = 0,          /* a dissector matched */
+  ndpi_detection_by_guess,            /* custom/user defined protocol, before the dissectors */
+  ndpi_detection_by_giveup,           /* guessed by ndpi_detection_giveup() */
+  ndpi_detection_unknown,             /* ndpi_detection_giveup() found nothing */
+  ndpi_detection_by_extra_dissection, /* protocol changed by the extra packets dissection */
+  NDPI_NUM_DETECTION_METHODS
+} ndpi_detection_method;
+
+#define NDPI_DETECTION_PKT_BINS   8   /* packets to detection: 1, 2, <=4, ... <=64, >64 */
+#define NDPI_DETECTION_TIME_BINS 12   /* ms from the first packet: <1, <2, <4, ... <1024, >=1024 */
+
+/*
+  Per protocol. The histograms count the first classification of each
+  flow (dpi, guess, giveup and unknown, the latter under protocol 0);
+  extra dissection changes are only counted in flows[]
+*/
+struct ndpi_detection_stats {
+  u_int32_t flows[NDPI_NUM_DETECTION_METHODS];
+  u_int32_t pkts[NDPI_DETECTION_PKT_BINS];
+  u_int32_t time_ms[NDPI_DETECTION_TIME_BINS];
+};
+
+/* Hostname match cache counters, see ndpi_get_host_match_cache_stats() */
+struct ndpi_host_match_cache_stats {
+  u_int64_t hits, misses;
+  u_int32_t num_entries;
+};
+
 #define NUM_CUSTOM_CATEGORIES      5
 #define CUSTOM_CATEGORY_LABEL_LEN 32
 
@@ -1154,6 +1207,44 @@ typedef enum {
   ndpi_hangout_cache
 } ndpi_lru_cache_type;
 
+/*
+  Flow independent result of a host name lookup (host_automa, custom
+  categories, risky domains), by hash of the lowercased name. An entry is
+  valid only while gen matches the module host_match_gen
+*/
+#define NDPI_HOST_MATCH_VALID           0x01
+#define NDPI_HOST_MATCH_CUSTOM_CATEGORY 0x02
+#define NDPI_HOST_MATCH_RISKY_DOMAIN    0x04
+
+struct ndpi_host_match_cache_entry {
+  u_int32_t key, check, gen;
+  u_int16_t len, protocol_id, category, custom_category;
+  u_int8_t breed, flags;
+};
+
+struct ndpi_host_match_cache {
+  u_int64_t hits, misses;
+  struct ndpi_host_match_cache_entry entries[NDPI_HOST_MATCH_CACHE_SIZE];
+};
+
+/*
+  DGA verdicts (see ndpi_check_dga_name()) by two independent hashes of
+  the lowercased name, as the scorer sees it
+*/
+#define NDPI_DGA_CACHE_VALID    0x01
+#define NDPI_DGA_CACHE_HOSTNAME 0x02
+#define NDPI_DGA_CACHE_DGA      0x04
+
+struct ndpi_dga_cache_entry {
+  u_int32_t key, check;
+  u_int16_t len;
+  u_int8_t flags;
+};
+
+struct ndpi_dga_cache {
+  struct ndpi_dga_cache_entry entries[NDPI_DGA_CACHE_SIZE];
+};
+
 struct ndpi_detection_module_struct {
   NDPI_PROTOCOL_BITMASK detection_bitmask;
   NDPI_PROTOCOL_BITMASK generic_http_packet_bitmask;
@@ -1216,6 +1307,15 @@ struct ndpi_detection_module_struct {
     risky_domain_automa, tls_cert_subject_automa,
     malicious_ja3_automa, malicious_sha1_automa;
   /* IMPORTANT: please update ndpi_finalize_initialization() whenever you add a new automa */
+
+  /* Bumped whenever a host name match can change (see ndpi_host_match_cache_invalidate()) */
+  u_int32_t host_match_gen;
+  /* One copy per module in user space, per cpu in the kernel */
+#ifdef __KERNEL__
+  struct ndpi_host_match_cache __percpu *host_match_cache;
+#else
+  struct ndpi_host_match_cache *host_match_cache;
+#endif
   
   spinlock_t host_automa_lock;
 
@@ -1271,6 +1371,7 @@ struct ndpi_detection_module_struct {
 
   /* NDPI_PROTOCOL_TLS and subprotocols */
   struct ndpi_lru_cache *tls_cert_cache;
+  struct ndpi_tls_cert_info_cache *tls_cert_info_cache;
   
   /* NDPI_PROTOCOL_MINING and subprotocols */
   struct ndpi_lru_cache *mining_cache;
@@ -1278,6 +1379,29 @@ struct ndpi_detection_module_struct {
   /* NDPI_PROTOCOL_MSTEAMS */
   struct ndpi_lru_cache *msteams_cache;
 
+  /* DGA: n-gram bitmaps built at init, verdicts cached by name (see ndpi_check_dga_name()) */
+  u_int8_t dga_bigrams[(NDPI_DGA_NGRAM_ALPHABET*NDPI_DGA_NGRAM_ALPHABET+7)/8];
+  u_int8_t dga_impossible_bigrams[(NDPI_DGA_NGRAM_ALPHABET*NDPI_DGA_NGRAM_ALPHABET+7)/8];
+  u_int8_t dga_trigrams[(NDPI_DGA_NGRAM_ALPHABET*NDPI_DGA_NGRAM_ALPHABET*NDPI_DGA_NGRAM_ALPHABET+7)/8];
+#ifdef __KERNEL__
+  struct ndpi_dga_cache __percpu *dga_cache;
+#else
+  struct ndpi_dga_cache *dga_cache;
+#endif
+
+  /* [NDPI_MAX_SUPPORTED_PROTOCOLS+NDPI_MAX_NUM_CUSTOM_PROTOCOLS], NULL unless enabled */
+#ifdef __KERNEL__
+  struct ndpi_detection_stats __percpu *detection_stats;
+#else
+  struct ndpi_detection_stats *detection_stats;
+#endif
+
+  /* Learnt packet budgets, NULL unless ndpi_set_detection_budget() is called */
+  struct ndpi_detection_budget *detection_budget;
+
+  /* Read-only tables shared with other modules (see ndpi_get_shared_tables()) */
+  struct ndpi_shared_tables *shared_tables;
+
   ndpi_proto_defaults_t proto_defaults[NDPI_MAX_SUPPORTED_PROTOCOLS+NDPI_MAX_NUM_CUSTOM_PROTOCOLS];
 
   u_int8_t direction_detect_disable:1, /* disable internal detection of packet direction */ _pad:7;
@@ -1365,6 +1489,10 @@ struct ndpi_flow_struct {
   u_char host_server_name[240];
   u_int8_t initial_binary_bytes[8], initial_binary_bytes_len;
   u_int8_t risk_checked;
+  u_int8_t detection_method; /* ndpi_detection_method + 1, 0 until classified */
+  u_int8_t budget_exhausted;
+  u_int16_t detection_budget, budget_port; /* packets, see ndpi_set_detection_budget() */
+  u_int64_t first_packet_time_ms;
   ndpi_risk risk; /* Issues found with this flow [bitmask of ndpi_risk] */
 
   /*
@@ -1388,10 +1516,11 @@ struct ndpi_flow_struct {
      is remapped to somethign pther than Kerberos due to a faulty
      dissector
   */
-  struct {
-    char *pktbuf;
-    u_int16_t pktbuf_maxlen, pktbuf_currlen;
-  } kerberos_buf;
+  message_t kerberos_buf;
+
+  /* Bytes charged to the memory budget by this flow (see ndpi_flow_data_malloc) */
+  u_int32_t mem_buffer, mem_metadata;
+  u_int32_t mem_flow; /* By ndpi_flow_malloc(): the size of the flow itself */
 
   union {
     /* the only fields useful for nDPI and ntopng */
@@ -1683,6 +1812,49 @@ typedef struct {
   u_int16_t str_len;
 } ndpi_string;
 
+/*
+  Flow record stream: NDPI_FLOW_EXPORT_MAGIC followed by frames made of
+  a 32 bit (network byte order) length and a complete TLV record
+*/
+#define NDPI_FLOW_EXPORT_MAGIC            "nDPItlv1"
+#define NDPI_FLOW_EXPORT_MAGIC_LEN        8
+#define NDPI_FLOW_EXPORT_DEFAULT_BATCH    (4 * 1024 * 1024)
+
+typedef int (*ndpi_flow_export_flush_cb)(const u_int8_t *data, u_int32_t data_len, void *user_data);
+
+typedef struct {
+  ndpi_serializer serializer;          /* TLV, reset (not reallocated) for every record */
+  int fd;                              /* -1 when only flush_cb is used */
+  ndpi_flow_export_flush_cb flush_cb;
+  void *flush_cb_data;
+  u_int8_t *batch;                     /* frames are appended back to back */
+  u_int32_t batch_size, batch_used;
+  u_int32_t flush_interval_ms;
+  u_int64_t last_flush_ms;
+  u_int64_t num_records, num_bytes, num_flushes, num_errors;
+} ndpi_flow_exporter;
+
+typedef struct {
+  u_int8_t *data;
+  u_int64_t size, offset;
+  u_int8_t mapped;
+} ndpi_flow_record_reader;
+
+/* **************************************** */
+
+/* URL validation cost (ndpi_validate_url), collected only when enabled */
+struct ndpi_url_check_counters {
+  u_int64_t calls, matches, nsec;
+};
+
+struct ndpi_url_check_stats {
+  u_int64_t num_urls, num_values;
+  struct ndpi_url_check_counters xss, sqli, rce;
+  struct ndpi_url_check_counters rce_regex; /* one call per pcre_exec() */
+  u_int64_t rce_regex_skipped;              /* pcre_exec() avoided by the prefilter */
+  u_int64_t rce_command_matches;            /* shell/PowerShell commands found by the prefilter */
+};
+
 /* **************************************** */
 
 struct ndpi_analyze_struct {
@@ -1735,7 +1907,9 @@ typedef struct ndpi_ptree ndpi_ptree_t;
 struct ndpi_hll {
   u_int8_t bits;
   size_t size;
-  u_int8_t *registers;
+  u_int8_t *registers;            /* dense: 2^bits registers, NULL while sparse */
+  u_int32_t *sparse;              /* sparse: (index << 8 | rank) sorted by index */
+  u_int32_t sparse_len, sparse_max;
 };
 
 /* **************************************** */
@@ -1757,6 +1931,13 @@ struct ndpi_bin {
   } u;
 };
 
+/* Bins of the same length as rows of a contiguous matrix (e.g. for clustering) */
+struct ndpi_bin_matrix {
+  u_int32_t num_rows;
+  u_int16_t num_bins, stride; /* stride: num_bins rounded up to 4, zero padded */
+  float *values;              /* num_rows * stride */
+};
+
 /* **************************************** */
 
 struct ndpi_str_hash_info {
@@ -1827,6 +2008,96 @@ struct ndpi_des_struct {
 
 /* **************************************** */
 
+/* Per-host time windowed analytics */
+
+typedef enum {
+  ndpi_host_metric_bytes = 0,
+  ndpi_host_metric_flows,
+  ndpi_host_metric_peers,       /* distinct peers (HyperLogLog) */
+  NDPI_HOST_METRIC_MAX          /* Leave this as last member */
+} ndpi_host_metric;
+
+struct ndpi_host_anomaly {
+  ndpi_ip_addr_t host;
+  ndpi_host_metric metric;
+  u_int64_t interval;           /* number of the interval just closed */
+  double value, forecast, confidence_band;
+};
+
+typedef void (*ndpi_host_anomaly_cb)(const struct ndpi_host_anomaly *anomaly, void *user_data);
+
+/*
+  One column per attribute, max_num_hosts rows each, all carved out of a
+  single arena: a host is a row index found through an open addressing
+  table. History is a ring of window_len intervals (one row per slot).
+*/
+struct ndpi_host_series {
+  u_int64_t *history;
+  double *last_value, *last_forecast, *last_trend, *confidence_band;
+  double *sum_square_error, *prev_sum_square_error;
+};
+
+typedef struct {
+  u_int32_t max_num_hosts, num_hosts, hash_size;
+  u_int32_t window_len, interval_sec;
+  u_int8_t peers_hll_bits;
+
+  struct {
+    u_int8_t use_des;
+    double alpha, beta, ro;
+    u_int32_t learning_intervals;  /* no anomaly is reported before */
+  } params;
+
+  ndpi_host_anomaly_cb anomaly_cb;
+  void *anomaly_cb_data;
+
+  u_int64_t num_intervals, next_roll;
+  u_int32_t slot;                  /* history slot of the current interval */
+
+  void *arena;
+  u_int32_t *hash;                 /* row + 1, 0 if empty */
+  ndpi_ip_addr_t *hosts;
+  u_int64_t *last_active;          /* last interval with some traffic */
+  u_int32_t *num_values;           /* closed intervals seen by the forecasters */
+  u_int8_t *rollup;                /* see MAX_SQUARE_ERROR_ITERATIONS */
+  u_int8_t *anomalies;             /* bitmap of metrics, last interval */
+  u_int64_t *bytes, *flows;        /* current interval */
+  u_int8_t *peers;                 /* current interval, dense HLL registers */
+  struct ndpi_host_series series[NDPI_HOST_METRIC_MAX];
+
+  u_int64_t num_dropped_hosts, num_expired_hosts, num_anomalies;
+} ndpi_host_analytics;
+
+/* **************************************** */
+
+/* Memory budget */
+
+typedef enum {
+  NDPI_MEM_FLOW = 0,      /* struct ndpi_flow_struct */
+  NDPI_MEM_BUFFER,        /* per-flow reassembly buffers (TLS) */
+  NDPI_MEM_METADATA,      /* extracted strings: URL, User-Agent, server names, certificates */
+  NDPI_MEM_CACHE,         /* shared tables (e.g. BitTorrent DHT peers) */
+  NDPI_MEM_OTHER,         /* charged by the application with ndpi_mem_account() */
+  NDPI_MEM_NUM_CATEGORIES /* Leave this as last member */
+} ndpi_mem_category;
+
+typedef enum {
+  NDPI_MEM_LEVEL_OK = 0,
+  NDPI_MEM_LEVEL_SOFT,    /* optional metadata extraction is shed */
+  NDPI_MEM_LEVEL_HARD     /* new flows are refused */
+} ndpi_mem_level;
+
+struct ndpi_mem_stats {
+  u_int64_t used[NDPI_MEM_NUM_CATEGORIES];
+  u_int64_t total, peak;
+  u_int64_t soft_limit, hard_limit; /* 0 = unlimited */
+  u_int64_t shed;                   /* metadata extractions skipped past the soft limit */
+  u_int64_t denied;                 /* allocations refused past the hard limit */
+  ndpi_mem_level level;
+};
+
+/* **************************************** */
+
 /* Prototype used to define custom DGA detection function */
 typedef int (*ndpi_custom_dga_predict_fctn)(const char* domain, int domain_length);
 
@@ -0,0 +1,191 @@
+#!/usr/bin/perl -w
+#
+# Build time protocol profile
+#
+# gen_protocol_profile.pl <profile> [<src/lib directory> [<output directory>]]
+#
+# The profile lists the protocols to build, one per line (HTTP or
+# NDPI_PROTOCOL_HTTP, '#' starts a comment). Generates in the output
+# directory:
+#
+#  ndpi_dissectors_profile.inc      dissectors registering at least one of them
+#  ndpi_content_match_profile.c.inc ndpi_content_match.c.inc without the
+#                                   host/certificate patterns of other protocols
+#                                   (one host pattern each is kept for the name)
+#  ndpi_protocol_profile.h          protocols of the profile (default ports)
+#  ndpi_protocol_profile.mk         NDPI_PROFILE_PROTO_SRC: protocols/*.c needed
+#                                   to link them (kernel module)
+#
+# The library is then built with NDPI_PROTOCOL_PROFILE defined
+#
+
+use strict;
+
+my ($profile, $srcdir, $outdir) = @ARGV;
+
+die "Usage: $0 <profile> [<src/lib directory> [<output directory>]]\n" if !defined $profile;
+
+$srcdir = '.' if !defined $srcdir;
+$outdir = $srcdir if !defined $outdir;
+
+# Protocol objects always linked: they are used by ndpi_main.c (and the
+# kernel module) whatever the profile
+my @always_linked = ('tcp_udp', 'bittorrent');
+
+sub slurp {
+  my ($path) = @_;
+  local $/;
+
+  open(my $f, '<', $path) or die "$0: $path: $!\n";
+  my $s = <$f>;
+  close($f);
+
+  return $s;
+}
+
+sub spew {
+  my ($path, $s) = @_;
+
+  open(my $f, '>', "$path.tmp") or die "$0: $path: $!\n";
+  print $f $s;
+  close($f) or die "$0: $path: $!\n";
+  rename("$path.tmp", $path) or die "$0: $path: $!\n";
+}
+
+my $banner = "/* Generated by gen_protocol_profile.pl from $profile: do not edit */\n\n";
+
+# Known protocols
+my %known;
+
+foreach (split(/\n/, slurp("$srcdir/../include/ndpi_protocol_ids.h"))) {
+  $known{$1} = 1 if /^\s*NDPI_PROTOCOL_(\w+)\s*=\s*\d+\s*,/;
+}
+
+# Profile
+my (%wanted, $name);
+
+($name = $profile) =~ s/^.*\///;
+$name =~ s/\.[^.]*$//;
+
+foreach (split(/\n/, slurp($profile))) {
+  s/#.*//;
+  s/^\s+|\s+$//g;
+  next if $_ eq '';
+
+  s/^NDPI_PROTOCOL_//;
+  $_ = uc($_);
+  die "$0: $profile: unknown protocol $_\n" if !defined $known{$_};
+  $wanted{$_} = 1;
+}
+
+die "$0: $profile: no protocols\n" if !%wanted;
+$wanted{'UNKNOWN'} = 1;
+
+# Dissectors: init function -> file, protocols registered
+my (%dissector_file, %dissector_protos, %defined_in, %source);
+
+opendir(my $d, "$srcdir/protocols") or die "$0: $srcdir/protocols: $!\n";
+foreach my $f (sort grep { /\.c$/ } readdir($d)) {
+  my $s = slurp("$srcdir/protocols/$f");
+  (my $base = $f) =~ s/\.c$//;
+
+  $source{$base} = $s;
+
+  while($s =~ /^void\s+init_(\w+)_dissector\s*\(/mg) {
+    $dissector_file{$1} = $base;
+  }
+
+  # Non static functions that other objects may call
+  while($s =~ /^(?!static)[a-z_][\w \t]*[\s\*](\w+)\s*\([^;{]*\)\s*\{/mg) {
+    $defined_in{$1} = $base if $1 !~ /^init_\w+_dissector$/;
+  }
+
+  while($s =~ /ndpi_set_bitmask_protocol_detection\s*\(\s*"[^"]*"\s*,\s*\w+\s*,\s*\w+\s*,\s*\*?\w+\s*,\s*NDPI_PROTOCOL_(\w+)/g) {
+    $dissector_protos{$base}{$1} = 1;
+  }
+}
+closedir($d);
+
+# Registration list
+my ($dissectors, %linked, @missing) = ($banner);
+
+foreach (split(/\n/, slurp("$srcdir/ndpi_dissectors.inc"))) {
+  if(/^NDPI_DISSECTOR\((\w+)\)/) {
+    my $file = $dissector_file{$1};
+
+    die "$0: init_$1_dissector() not found\n" if !defined $file;
+
+    if(grep { $wanted{$_} } keys %{$dissector_protos{$file}}) {
+      $dissectors .= "$_\n";
+      $linked{$file} = 1;
+    }
+  }
+}
+
+foreach my $p (sort keys %wanted) {
+  push(@missing, $p) if ($p ne 'UNKNOWN') && !grep { $dissector_protos{$_}{$p} } keys %dissector_protos;
+}
+
+# Link closure
+$linked{$_} = 1 foreach (@always_linked);
+
+my @todo = keys %linked;
+
+while(my $f = shift(@todo)) {
+  foreach my $fn (keys %defined_in) {
+    my $g = $defined_in{$fn};
+
+    next if $linked{$g} || ($g eq $f);
+
+    if($source{$f} =~ /\b$fn\s*\(/) {
+      $linked{$g} = 1;
+      push(@todo, $g);
+    }
+  }
+}
+
+# Patterns
+# The first host pattern of the other protocols is kept: ndpi_main.c only
+# registers their name from it
+my ($content, $in_patterns, $num_patterns, $num_kept, %named) = ($banner, '', 0, 0);
+
+foreach (split(/\n/, slurp("$srcdir/ndpi_content_match.c.inc"))) {
+  if(/^ndpi_protocol_match\s+host_match\s*\[\]/) {
+    $in_patterns = 'host';
+  } elsif(/^static\s+ndpi_tls_cert_name_match\s+tls_certificate_match\s*\[\]/) {
+    $in_patterns = 'cert';
+  } elsif($in_patterns && /^\s*\}\s*;/) {
+    $in_patterns = '';
+  } elsif($in_patterns && /^\s*\{\s*"(?:[^"\\]|\\.)*"\s*,\s*(?:"(?:[^"\\]|\\.)*"\s*,\s*)?NDPI_PROTOCOL_(\w+)\s*[,}]/) {
+    $num_patterns++;
+    if($wanted{$1}) {
+      $num_kept++;
+    } else {
+      next if ($in_patterns ne 'host') || $named{$1};
+      $named{$1} = 1;
+    }
+  }
+
+  $content .= "$_\n";
+}
+
+# Protocols
+my $header = $banner
+  . "#define NDPI_PROTOCOL_PROFILE_NAME \"$name\"\n\n"
+  . "static const u_int8_t ndpi_profile_protocols[NDPI_MAX_SUPPORTED_PROTOCOLS] = {\n"
+  . join('', map { "  [NDPI_PROTOCOL_$_] = 1,\n" } sort keys %wanted)
+  . "};\n";
+
+my $mk = "# Generated by gen_protocol_profile.pl from $profile: do not edit\n\n"
+  . "NDPI_PROFILE_PROTO_SRC := " . join(' ', map { "$_.c" } sort keys %linked) . "\n";
+
+# The header first: make rules use it as the target, the other files are not older
+spew("$outdir/ndpi_protocol_profile.h", $header);
+spew("$outdir/ndpi_dissectors_profile.inc", $dissectors);
+spew("$outdir/ndpi_content_match_profile.c.inc", $content);
+spew("$outdir/ndpi_protocol_profile.mk", $mk);
+
+printf("Protocol profile %s: %u protocols, %u dissectors, %u/%u patterns, %u protocol sources\n",
+       $name, scalar(keys %wanted) - 1, scalar(grep { /^NDPI_DISSECTOR/ } split(/\n/, $dissectors)),
+       $num_kept, $num_patterns, scalar(keys %linked));
+print "Pattern only (no dissector): @missing\n" if @missing;
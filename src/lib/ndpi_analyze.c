@@ -31,6 +31,9 @@
 #include <stdint.h>
 #include <math.h>
 #include <float.h> /* FLT_EPSILON */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "ndpi_api.h"
 #include "ndpi_config.h"
 
@@ -294,6 +297,164 @@ double ndpi_hll_count(struct ndpi_hll *hll) {
   return(hll_count(hll));
 }
 
+/* ********************************************************************************* */
+
+/* dst |= src: both must have been initialized with the same number of bits */
+int ndpi_hll_merge(struct ndpi_hll *dst, const struct ndpi_hll *src) {
+  return(hll_merge(dst, src));
+}
+
+/* ********************************************************************************* */
+
+#define NDPI_HLL_SERIALIZE_CHUNK  32768
+
+/*
+  The estimator is serialized (TLV only) as a block:
+  "bits" (uint32), "dense" (uint32) and one or more "data" binary chunks
+  with the raw registers (dense) or the network order sparse entries
+*/
+int ndpi_hll_serialize(struct ndpi_hll *hll, ndpi_serializer *serializer, const char *key) {
+  u_int32_t i, len;
+
+  if(ndpi_serializer_get_format(serializer) != ndpi_serialization_format_tlv)
+    return(-1);
+
+  if(ndpi_serialize_start_of_block(serializer, key) != 0
+     || ndpi_serialize_string_uint32(serializer, "bits", hll->bits) != 0
+     || ndpi_serialize_string_uint32(serializer, "dense", hll->registers ? 1 : 0) != 0)
+    return(-1);
+
+  if(hll->registers) {
+    for(i = 0; i < hll->size; i += len) {
+      len = ndpi_min((u_int32_t)hll->size - i, NDPI_HLL_SERIALIZE_CHUNK);
+
+      if(ndpi_serialize_string_binary(serializer, "data", (const char *)&hll->registers[i], len) != 0)
+	return(-1);
+    }
+  } else {
+    u_int32_t buf[1024];
+
+    for(i = 0; i < hll->sparse_len; i += len) {
+      u_int32_t j;
+
+      len = ndpi_min(hll->sparse_len - i, (u_int32_t)(sizeof(buf) / sizeof(u_int32_t)));
+
+      for(j = 0; j < len; j++)
+	buf[j] = htonl(hll->sparse[i + j]);
+
+      if(ndpi_serialize_string_binary(serializer, "data", (const char *)buf, len * sizeof(u_int32_t)) != 0)
+	return(-1);
+    }
+  }
+
+  return(ndpi_serialize_end_of_block(serializer));
+}
+
+/* ********************************************************************************* */
+
+/*
+  The deserializer must point to the start of the block written by
+  ndpi_hll_serialize(): on success it is moved past its end and hll
+  (that must not be initialized) contains the estimator
+*/
+int ndpi_hll_deserialize(struct ndpi_hll *hll, ndpi_deserializer *deserializer) {
+  ndpi_serialization_type kt, et;
+  u_int32_t bits = 0, dense = 0, dense_len = 0;
+  int initialized = 0;
+
+  if(ndpi_deserialize_get_item_type(deserializer, &kt) != ndpi_serialization_start_of_block)
+    return(-1);
+
+  ndpi_deserialize_next(deserializer);
+
+  while((et = ndpi_deserialize_get_item_type(deserializer, &kt)) != ndpi_serialization_unknown) {
+    ndpi_string key, value;
+    u_int32_t v;
+
+    if(et == ndpi_serialization_end_of_block) {
+      ndpi_deserialize_next(deserializer);
+
+      if(!initialized) /* Empty estimator: no data */
+	return(dense ? -1 : hll_init(hll, (u_int8_t)bits));
+      else if(dense && (dense_len != hll->size))
+	break;
+
+      return(0);
+    }
+
+    if(ndpi_deserialize_key_string(deserializer, &key) != 0)
+      break;
+
+    if((key.str_len == 4) && (strncmp(key.str, "bits", 4) == 0)) {
+      if(ndpi_deserialize_value_uint32(deserializer, &v) != 0)
+	break;
+      bits = v;
+    } else if((key.str_len == 5) && (strncmp(key.str, "dense", 5) == 0)) {
+      if(ndpi_deserialize_value_uint32(deserializer, &v) != 0)
+	break;
+      dense = v;
+    } else if((key.str_len == 4) && (strncmp(key.str, "data", 4) == 0)) {
+      if(ndpi_deserialize_value_string(deserializer, &value) != 0)
+	break;
+
+      if(!initialized) {
+	if(hll_init(hll, (u_int8_t)bits) != 0)
+	  return(-1);
+
+	initialized = 1;
+
+	if(dense && (_hll_promote(hll) != 0))
+	  break;
+      }
+
+      if(dense) {
+	u_int32_t i, max_rank = 33 - hll->bits;
+
+	if(value.str_len > (hll->size - dense_len))
+	  break;
+
+	/* Ranks are bounded as in the sparse case: hll_count() indexes a histogram with them */
+	for(i = 0; i < value.str_len; i++)
+	  if((u_int8_t)value.str[i] > max_rank)
+	    break;
+
+	if(i < value.str_len)
+	  break;
+
+	memcpy(&hll->registers[dense_len], value.str, value.str_len);
+	dense_len += value.str_len;
+      } else {
+	u_int32_t i, max_rank = 33 - hll->bits;
+
+	if(value.str_len % sizeof(u_int32_t))
+	  break;
+
+	for(i = 0; i < value.str_len; i += sizeof(u_int32_t)) {
+	  u_int32_t e;
+
+	  memcpy(&e, &value.str[i], sizeof(e));
+	  e = ntohl(e);
+
+	  if((HLL_SPARSE_INDEX(e) >= hll->size) || (HLL_SPARSE_RANK(e) > max_rank))
+	    break;
+
+	  _hll_set_register(hll, HLL_SPARSE_INDEX(e), HLL_SPARSE_RANK(e));
+	}
+
+	if(i < value.str_len)
+	  break;
+      }
+    }
+
+    ndpi_deserialize_next(deserializer);
+  }
+
+  if(initialized)
+    hll_destroy(hll);
+
+  return(-1);
+}
+
 /* ********************************************************************************* */
 /* ********************************************************************************* */
 
@@ -606,215 +767,422 @@ float ndpi_bin_similarity(struct ndpi_bin *b1, struct ndpi_bin *b2, u_int8_t nor
 #define MAX_NUM_CLUSTERS  128
 
 /*
-  Clusters bins into 'num_clusters'
-  - (in) bins: a vection 'num_bins' long of bins to cluster
-  - (in) 'num_clusters': number of desired clusters 0...(num_clusters-1)
-  - (out) 'cluster_ids': a vector 'num_bins' long containing the id's of each clustered bin
-  - (out) 'centroids': an optional 'num_clusters' long vector of (centroid) bins
-  See
-  - https://en.wikipedia.org/wiki/K-means_clustering
- */
-int ndpi_cluster_bins(struct ndpi_bin *bins, u_int16_t num_bins,
-		      u_int8_t num_clusters, u_int16_t *cluster_ids,
-		      struct ndpi_bin *centroids) {
-  u_int16_t i, j, max_iterations = 25, num_iterations, num_moves;
-  u_int8_t verbose = 0, alloc_centroids = 0;
-  char out_buf[256];
-  float *bin_score;
-  u_int16_t num_cluster_elems[MAX_NUM_CLUSTERS] = { 0 };
+  Bin matrix: bins of the same length stored as the rows of a contiguous
+  float matrix. Rows are zero padded to a multiple of 4 values so that
+  distances are computed 4 bins at a time.
+*/
+#define NDPI_BIN_MATRIX_ROW_ALIGN  4
 
-  srand(time(NULL));
+int ndpi_init_bin_matrix(struct ndpi_bin_matrix *m, u_int32_t num_rows, u_int16_t num_bins) {
+  m->num_rows = num_rows, m->num_bins = num_bins;
+  m->stride = (num_bins + NDPI_BIN_MATRIX_ROW_ALIGN - 1) & ~(NDPI_BIN_MATRIX_ROW_ALIGN - 1);
 
-  if(num_clusters > num_bins)         num_clusters = num_bins;
-  if(num_clusters > MAX_NUM_CLUSTERS) num_clusters = MAX_NUM_CLUSTERS;
+  if((num_rows == 0) || (num_bins == 0)
+     || ((m->values = (float*)ndpi_calloc((size_t)num_rows * m->stride, sizeof(float))) == NULL)) {
+    m->values = NULL;
+    return(-1);
+  }
 
-  if(verbose)
-    printf("Distributing %u bins over %u clusters\n", num_bins, num_clusters);
+  return(0);
+}
 
-  if((bin_score = (float*)ndpi_calloc(num_bins, sizeof(float))) == NULL)
-    return(-2);
+/* ********************************************************************************* */
 
-  if(centroids == NULL) {
-    alloc_centroids = 1;
+void ndpi_free_bin_matrix(struct ndpi_bin_matrix *m) {
+  if(m->values) {
+    ndpi_free(m->values);
+    m->values = NULL;
+  }
+}
 
-    if((centroids = (struct ndpi_bin*)ndpi_malloc(sizeof(struct ndpi_bin)*num_clusters)) == NULL) {
-      ndpi_free(bin_score);
-      return(-2);
-    } else {
-      for(i=0; i<num_clusters; i++)
-	ndpi_init_bin(&centroids[i], ndpi_bin_family32 /* Use 32 bit to avoid overlaps */, bins[0].num_bins);
-    }
+/* ********************************************************************************* */
+
+float* ndpi_bin_matrix_row(struct ndpi_bin_matrix *m, u_int32_t row) {
+  return((row < m->num_rows) ? &m->values[(size_t)row * m->stride] : NULL);
+}
+
+/* ********************************************************************************* */
+
+/* With normalize set, values are the same of ndpi_normalize_bin() (b is untouched) */
+int ndpi_bin_matrix_set_row(struct ndpi_bin_matrix *m, u_int32_t row,
+			    struct ndpi_bin *b, u_int8_t normalize) {
+  float *dst = ndpi_bin_matrix_row(m, row);
+  u_int64_t tot = 0;
+  u_int16_t i;
+
+  if((dst == NULL) || (b->num_bins != m->num_bins))
+    return(-1);
+
+  if(normalize && !b->is_empty) {
+    for(i=0; i<b->num_bins; i++) tot += ndpi_get_bin_value(b, i);
   }
 
-  /* Reset the id's */
-  memset(cluster_ids, 0, sizeof(u_int16_t) * num_bins);
+  for(i=0; i<b->num_bins; i++) {
+    u_int64_t v = ndpi_get_bin_value(b, i);
 
-  /* Randomly pick a cluster id */
-  for(i=0; i<num_bins; i++) {
-    u_int cluster_id = rand() % num_clusters;
+    dst[i] = (float)(tot ? ((v * 100) / tot) : v);
+  }
+
+  return(0);
+}
 
-    cluster_ids[i] = cluster_id;
+/* ********************************************************************************* */
+
+/* Square of the euclidean distance (see ndpi_bin_similarity()) */
+static inline float ndpi_bin_sq_distance(const float *a, const float *b, u_int16_t stride) {
+  u_int16_t i;
+#ifdef __SSE2__
+  __m128 acc = _mm_setzero_ps();
+  float v[4];
 
-    if(verbose)
-      printf("Initializing cluster %u for bin %u: %s\n",
-	     cluster_id, i,
-	     ndpi_print_bin(&bins[i], 0, out_buf, sizeof(out_buf)));
+  for(i=0; i<stride; i += 4) {
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i]));
 
-    num_cluster_elems[cluster_id]++;
+    acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
   }
 
-  num_iterations = 0;
+  _mm_storeu_ps(v, acc);
+  return((v[0] + v[1]) + (v[2] + v[3]));
+#else
+  float acc[4] = { 0 };
 
-  /* Now let's try to find a better arrangement */
-  while(num_iterations++ < max_iterations) {
+  for(i=0; i<stride; i += 4) {
+    float d0 = a[i] - b[i], d1 = a[i+1] - b[i+1], d2 = a[i+2] - b[i+2], d3 = a[i+3] - b[i+3];
 
-    /* Compute the centroids for each cluster */
-    memset(bin_score, 0, num_bins*sizeof(float));
+    acc[0] += d0 * d0, acc[1] += d1 * d1, acc[2] += d2 * d2, acc[3] += d3 * d3;
+  }
 
-    if(verbose) {
-      printf("\nIteration %u\n", num_iterations);
+  return((acc[0] + acc[1]) + (acc[2] + acc[3]));
+#endif
+}
 
-      for(j=0; j<num_clusters; j++)
-	printf("Cluster %u: %u bins\n", j, num_cluster_elems[j]);
+/* ********************************************************************************* */
+
+static inline u_int32_t ndpi_bin_cluster_rand(u_int32_t *state) {
+  /* xorshift32 */
+  u_int32_t x = *state;
+
+  x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+  return(*state = x);
+}
+
+/*
+  k-means++: the first centroid is a random row, the next ones are rows
+  picked with a probability proportional to the square of their distance
+  from the closest centroid already chosen
+*/
+static u_int16_t ndpi_bin_cluster_seed(struct ndpi_bin_matrix *m, struct ndpi_bin_matrix *centroids,
+				       u_int16_t num_clusters, float *min_dist, u_int32_t *rand_state) {
+  u_int32_t i, row = ndpi_bin_cluster_rand(rand_state) % m->num_rows;
+  u_int16_t k;
+
+  memcpy(ndpi_bin_matrix_row(centroids, 0), ndpi_bin_matrix_row(m, row), m->stride * sizeof(float));
+
+  for(i=0; i<m->num_rows; i++)
+    min_dist[i] = ndpi_bin_sq_distance(ndpi_bin_matrix_row(m, i), centroids->values, m->stride);
+
+  for(k=1; k<num_clusters; k++) {
+    double tot = 0, r;
+    float *c = ndpi_bin_matrix_row(centroids, k);
+
+    for(i=0; i<m->num_rows; i++) tot += min_dist[i];
+
+    if(tot == 0) break; /* Less distinct rows than clusters */
+
+    r = ((double)ndpi_bin_cluster_rand(rand_state) / 4294967296.0) * tot;
+
+    for(i=0, row = 0; i<m->num_rows; i++) {
+      if(min_dist[i] > 0) row = i; /* Never pick a row that is already a centroid */
+      if((r -= min_dist[i]) < 0) break;
     }
 
-    for(i=0; i<num_clusters; i++)
-      ndpi_reset_bin(&centroids[i]);
+    memcpy(c, ndpi_bin_matrix_row(m, row), m->stride * sizeof(float));
 
-    for(i=0; i<num_bins; i++) {
-      for(j=0; j<bins[i].num_bins; j++) {
-	ndpi_inc_bin(&centroids[cluster_ids[i]], j, ndpi_get_bin_value(&bins[i], j));
-      }
+    for(i=0; i<m->num_rows; i++) {
+      float d = ndpi_bin_sq_distance(ndpi_bin_matrix_row(m, i), c, m->stride);
+
+      if(d < min_dist[i]) min_dist[i] = d;
     }
+  }
+
+  return(k);
+}
+
+/* ********************************************************************************* */
+
+struct ndpi_bin_cluster_job {
+  struct ndpi_bin_matrix *m, *centroids;
+  u_int16_t num_clusters, *cluster_ids;
+  const u_int32_t *num_cluster_elems;
+  u_int32_t first_row, last_row, num_moves;
+};
+
+/*
+  Assignment step on the rows [first_row, last_row): as in the original
+  algorithm, empty clusters are skipped and a row stays where it is on
+  ties unless it is the only element of its cluster. Sizes are the ones
+  of the previous step, so the result does not depend on the threads.
+*/
+static void* ndpi_bin_cluster_assign(void *_job) {
+  struct ndpi_bin_cluster_job *job = (struct ndpi_bin_cluster_job*)_job;
+  u_int16_t stride = job->m->stride;
+  u_int32_t i;
+
+  job->num_moves = 0;
+
+  for(i=job->first_row; i<job->last_row; i++) {
+    const float *row = ndpi_bin_matrix_row(job->m, i);
+    u_int16_t j, current = job->cluster_ids[i], cluster_id = current;
+    float best = FLT_MAX, current_dist = -1;
+
+    for(j=0; j<job->num_clusters; j++) {
+      float d;
 
-    for(i=0; i<num_clusters; i++) {
-      ndpi_normalize_bin(&centroids[i]);
+      if(job->num_cluster_elems[j] == 0) continue;
 
-      if(verbose)
-	printf("Centroid [%u] %s\n", i,
-	       ndpi_print_bin(&centroids[i], 0, out_buf, sizeof(out_buf)));
+      d = ndpi_bin_sq_distance(row, &job->centroids->values[(size_t)j * stride], stride);
+
+      if(j == current) current_dist = d;
+      if(d < best) best = d, cluster_id = j;
     }
 
-    /* Now let's check if there are bins to move across clusters */
-    num_moves = 0;
+    if((best == current_dist) && (job->num_cluster_elems[current] > 1))
+      cluster_id = current;
 
-    for(i=0; i<num_bins; i++) {
-      u_int16_t j;
-      float best_similarity, current_similarity = 0;
-      u_int8_t cluster_id = 0;
+    if(cluster_id != current)
+      job->cluster_ids[i] = cluster_id, job->num_moves++;
+  }
 
-      if(verbose)
-	printf("Analysing bin %u [cluster: %u]\n",
-	       i, cluster_ids[i]);
+  return(NULL);
+}
 
-#ifdef COSINE_SIMILARITY
-      best_similarity = -1;
-#else
-      best_similarity = 99999999999.0f;
-#endif
+/* ********************************************************************************* */
 
-      for(j=0; j<num_clusters; j++) {
-	float similarity;
+#define NDPI_BIN_CLUSTER_MAX_THREADS        64
+#define NDPI_BIN_CLUSTER_MIN_ROWS_PER_JOB   1024
 
-	if(centroids[j].is_empty) continue;
+static u_int32_t ndpi_bin_cluster_assign_all(struct ndpi_bin_cluster_job *job, u_int8_t num_threads) {
+  u_int32_t i, num_moves = 0, num_rows = job->m->num_rows;
 
-	similarity = ndpi_bin_similarity(&bins[i], &centroids[j], 0);
+#ifndef WIN32
+  struct ndpi_bin_cluster_job jobs[NDPI_BIN_CLUSTER_MAX_THREADS];
+  pthread_t threads[NDPI_BIN_CLUSTER_MAX_THREADS];
+  u_int8_t num_started = 0;
 
-	if(j == cluster_ids[i])
-	  current_similarity = similarity;
+  if(num_threads > NDPI_BIN_CLUSTER_MAX_THREADS) num_threads = NDPI_BIN_CLUSTER_MAX_THREADS;
+  if(num_threads > (num_rows / NDPI_BIN_CLUSTER_MIN_ROWS_PER_JOB))
+    num_threads = num_rows / NDPI_BIN_CLUSTER_MIN_ROWS_PER_JOB;
 
-	if(verbose)
-	  printf("Bin %u / centroid %u [similarity: %f]\n", i, j, similarity);
+  if(num_threads > 1) {
+    for(i=0; i<num_threads; i++) {
+      jobs[i] = *job;
+      jobs[i].first_row = (u_int32_t)(((u_int64_t)num_rows * i) / num_threads);
+      jobs[i].last_row  = (u_int32_t)(((u_int64_t)num_rows * (i + 1)) / num_threads);
 
-#ifdef COSINE_SIMILARITY
-	if(similarity > best_similarity) {
-	  cluster_id = j, best_similarity = similarity;
-	}
-#else
-	if(similarity < best_similarity) {
-	  cluster_id = j, best_similarity = similarity;
-	}
+      /* The first job runs in the calling thread */
+      if((i > 0) && (pthread_create(&threads[i], NULL, ndpi_bin_cluster_assign, &jobs[i]) != 0))
+	break;
+
+      num_started = i + 1;
+    }
+
+    ndpi_bin_cluster_assign(&jobs[0]);
+    num_moves = jobs[0].num_moves;
+
+    /*
+      pthread_create() failed for jobs[num_started]: the rows from there
+      to the end are not owned by any thread and are handled here
+    */
+    if(num_started < num_threads) {
+      jobs[num_started].last_row = num_rows;
+      ndpi_bin_cluster_assign(&jobs[num_started]);
+      num_moves += jobs[num_started].num_moves;
+    }
+
+    for(i=1; i<num_started; i++) {
+      pthread_join(threads[i], NULL);
+      num_moves += jobs[i].num_moves;
+    }
+
+    return(num_moves);
+  }
 #endif
-      }
 
-      if((best_similarity == current_similarity) && (num_cluster_elems[cluster_ids[i]] > 1)) {
-	/*
-          In case of identical similarity let's leave things as they are
-          this unless this is a cluster with only one element
-	*/
-	cluster_id = cluster_ids[i];
-      }
+  job->first_row = 0, job->last_row = num_rows;
+  ndpi_bin_cluster_assign(job);
+
+  return(job->num_moves);
+}
 
-      bin_score[i] = best_similarity;
+/* ********************************************************************************* */
 
-      if(cluster_ids[i] != cluster_id) {
-	if(verbose)
-	  printf("Moved bin %u from cluster %u -> %u [similarity: %f]\n",
-		 i, cluster_ids[i], cluster_id, best_similarity);
+/*
+  Clusters the rows of m into 'num_clusters' (k-means)
+  - (in) m: bins to cluster, one per row
+  - (in) 'num_clusters': number of desired clusters 0...(num_clusters-1)
+  - (out) 'cluster_ids': a vector 'm->num_rows' long containing the id's of each clustered row
+  - (out) 'centroids': an optional matrix of 'num_clusters' rows (and m->num_bins bins)
+  - (in) 'seed': initial centroids are chosen with k-means++ (0 = time based seed)
+  - (in) 'num_threads': threads used by the assignment step on large matrices
 
-	num_cluster_elems[cluster_ids[i]]--;
-	num_cluster_elems[cluster_id]++;
+  As ndpi_cluster_bins() centroids are the normalized sum of the bins of
+  the cluster: bins are expected to be normalized (see ndpi_bin_matrix_set_row())
 
-	cluster_ids[i] = cluster_id;
-	num_moves++;
-      }
-    }
+  Return code: number of iterations, -1 on error
+*/
+int ndpi_cluster_bin_matrix(struct ndpi_bin_matrix *m, u_int16_t num_clusters,
+			    u_int16_t *cluster_ids, struct ndpi_bin_matrix *centroids,
+			    u_int32_t seed, u_int8_t num_threads) {
+  struct ndpi_bin_matrix local_centroids;
+  struct ndpi_bin_cluster_job job;
+  u_int32_t i, *num_cluster_elems = NULL, rand_state = seed ? seed : (u_int32_t)time(NULL);
+  u_int16_t j, k, num_seeded, max_iterations = 25, num_iterations = 0;
+  double *sums = NULL;
+  float *min_dist = NULL;
+  int rc = -1;
+
+  if((m->values == NULL) || (num_clusters == 0))
+    return(-1);
+
+  if(num_clusters > m->num_rows) num_clusters = m->num_rows;
+  if(rand_state == 0) rand_state = 1;
+
+  if(centroids == NULL) {
+    if(ndpi_init_bin_matrix(&local_centroids, num_clusters, m->num_bins) != 0)
+      return(-1);
 
-    if(num_moves == 0)
+    centroids = &local_centroids;
+  } else if((centroids->values == NULL) || (centroids->num_bins != m->num_bins)
+	    || (centroids->num_rows < num_clusters))
+    return(-1);
+  else
+    memset(centroids->values, 0, (size_t)centroids->num_rows * centroids->stride * sizeof(float));
+
+  if(((num_cluster_elems = (u_int32_t*)ndpi_calloc(num_clusters, sizeof(u_int32_t))) == NULL)
+     || ((sums = (double*)ndpi_calloc((size_t)num_clusters * m->stride, sizeof(double))) == NULL)
+     || ((min_dist = (float*)ndpi_calloc(m->num_rows, sizeof(float))) == NULL))
+    goto out;
+
+  num_seeded = ndpi_bin_cluster_seed(m, centroids, num_clusters, min_dist, &rand_state);
+
+  /*
+    First step: all rows start in cluster 0 and seeded clusters count one
+    element, so that every row moves to the closest seed. Clusters past
+    the seeded ones (less distinct rows than clusters) stay empty.
+  */
+  for(i=0; i<m->num_rows; i++) cluster_ids[i] = 0;
+  for(j=0; j<num_seeded; j++) num_cluster_elems[j] = 1;
+
+  job.m = m, job.centroids = centroids, job.num_clusters = num_clusters;
+  job.cluster_ids = cluster_ids, job.num_cluster_elems = num_cluster_elems;
+
+  while(num_iterations++ < max_iterations) {
+    if((ndpi_bin_cluster_assign_all(&job, num_threads) == 0) && (num_iterations > 1))
       break;
 
-    if(verbose) {
-      for(j=0; j<num_clusters; j++)
-	printf("Cluster %u: %u bins\n", j, num_cluster_elems[j]);
+    /* Centroids: the normalized sum of the cluster rows (see ndpi_normalize_bin()) */
+    memset(num_cluster_elems, 0, num_clusters * sizeof(u_int32_t));
+    memset(sums, 0, (size_t)num_clusters * m->stride * sizeof(double));
+
+    for(i=0; i<m->num_rows; i++) {
+      const float *row = ndpi_bin_matrix_row(m, i);
+      double *sum = &sums[(size_t)cluster_ids[i] * m->stride];
+
+      num_cluster_elems[cluster_ids[i]]++;
+
+      for(k=0; k<m->num_bins; k++) sum[k] += row[k];
     }
 
-#if 0
     for(j=0; j<num_clusters; j++) {
-      if(num_cluster_elems[j] == 0) {
-	u_int16_t candidate;
-	float score;
+      double *sum = &sums[(size_t)j * m->stride], tot = 0;
+      float *c = ndpi_bin_matrix_row(centroids, j);
 
-	if(verbose)
-	  printf("\nCluster %u is empty: need to rebalance\n", j);
+      for(k=0; k<m->num_bins; k++) tot += sum[k];
 
-#ifdef COSINE_SIMILARITY
-	score = 99999999999;
+      for(k=0; k<m->num_bins; k++)
+	c[k] = (tot > 0) ? (float)floor((sum[k] * 100) / tot) : (float)sum[k];
+    }
+  }
 
-	for(i=0; i<num_bins; i++) {
-	  if((cluster_ids[i] != j) && (bin_score[i] < score) && (num_cluster_elems[cluster_ids[i]] > 1))
-	    score = bin_score[i], candidate = i;
-	}
-#else
-	score = 0;
+  rc = num_iterations;
 
-	for(i=0; i<num_bins; i++) {
-	  if((cluster_ids[i] != j) && (bin_score[i] > score) && (num_cluster_elems[cluster_ids[i]] > 1))
-	    score = bin_score[i], candidate = i;
-	}
-#endif
+ out:
+  if(num_cluster_elems) ndpi_free(num_cluster_elems);
+  if(sums)              ndpi_free(sums);
+  if(min_dist)          ndpi_free(min_dist);
 
-	if(verbose)
-	  printf("Rebalance: moving bin %u from cluster %u -> %u [similarity: %f]\n",
-		 candidate, cluster_ids[candidate], j, score);
+  if(centroids == &local_centroids)
+    ndpi_free_bin_matrix(&local_centroids);
 
-	num_cluster_elems[cluster_ids[candidate]]--;
-	num_cluster_elems[j]++;
-	cluster_ids[candidate] = j;
-      }
+  return(rc);
+}
+
+/* ********************************************************************************* */
+
+/*
+  Clusters bins into 'num_clusters'
+  - (in) bins: a vection 'num_bins' long of bins to cluster
+  - (in) 'num_clusters': number of desired clusters 0...(num_clusters-1)
+  - (out) 'cluster_ids': a vector 'num_bins' long containing the id's of each clustered bin
+  - (out) 'centroids': an optional 'num_clusters' long vector of (centroid) bins
+  See
+  - https://en.wikipedia.org/wiki/K-means_clustering
+
+  Bins are copied in a bin matrix: see ndpi_cluster_bin_matrix()
+ */
+int ndpi_cluster_bins(struct ndpi_bin *bins, u_int16_t num_bins,
+		      u_int8_t num_clusters, u_int16_t *cluster_ids,
+		      struct ndpi_bin *centroids) {
+  struct ndpi_bin_matrix m, c;
+  u_int16_t i, j, k;
+  int rc = 0;
+
+  if((num_bins == 0) || (num_clusters == 0))
+    return(-1);
+
+  if(num_clusters > num_bins)         num_clusters = num_bins;
+  if(num_clusters > MAX_NUM_CLUSTERS) num_clusters = MAX_NUM_CLUSTERS;
+
+  if(ndpi_init_bin_matrix(&m, num_bins, bins[0].num_bins) != 0)
+    return(-2);
+
+  if(ndpi_init_bin_matrix(&c, num_clusters, bins[0].num_bins) != 0) {
+    ndpi_free_bin_matrix(&m);
+    return(-2);
+  }
+
+  for(i=0; i<num_bins; i++) {
+    if(ndpi_bin_matrix_set_row(&m, i, &bins[i], 0 /* as is */) != 0) {
+      rc = -1;
+      break;
     }
-#endif
-  } /* while(...) */
+  }
+
+  if((rc == 0) && (ndpi_cluster_bin_matrix(&m, num_clusters, cluster_ids, &c, 0, 1) < 0))
+    rc = -2;
+
+  if((rc == 0) && centroids) {
+    for(j=0; j<num_clusters; j++) {
+      const float *row = ndpi_bin_matrix_row(&c, j);
 
-  if(alloc_centroids) {
-    for(i=0; i<num_clusters; i++)
-      ndpi_free_bin(&centroids[i]);
+      ndpi_reset_bin(&centroids[j]);
 
-    ndpi_free(centroids);
+      for(i=0; i<num_bins; i++) {
+	if(cluster_ids[i] == j) {
+	  /* Not empty */
+	  for(k=0; k<c.num_bins; k++)
+	    ndpi_set_bin(&centroids[j], k, (u_int32_t)row[k]);
+
+	  centroids[j].is_empty = 0;
+	  break;
+	}
+      }
+    }
   }
 
-  ndpi_free(bin_score);
+  ndpi_free_bin_matrix(&m), ndpi_free_bin_matrix(&c);
 
-  return(0);
+  return(rc);
 }
 
 /* ********************************************************************************* */
@@ -1240,7 +1608,7 @@ int ndpi_ses_add_value(struct ndpi_ses_struct *ses, const u_int32_t _value, doub
 int ndpi_des_init(struct ndpi_des_struct *des, double alpha, double beta, float significance) {
   memset(des, 0, sizeof(struct ndpi_des_struct));
 
-  des->params.alpha = alpha;
+  des->params.alpha = alpha, des->params.beta = beta;
   
   if((significance < 0) || (significance > 1)) significance = 0.05;
   des->params.ro         = ndpi_normal_cdf_inverse(1 - (significance / 2.));
@@ -1303,3 +1671,651 @@ int ndpi_des_add_value(struct ndpi_des_struct *des, const u_int32_t _value, doub
   
   return(rc);
 }
+
+/* ********************************************************************************* */
+/* ********************************************************************************* */
+
+/*
+  Per-host analytics
+
+  Traffic is accounted in the current interval with ndpi_host_analytics_add_*()
+  and ndpi_host_analytics_tick() closes it: counters are moved to the history
+  and the forecasters (same maths of ndpi_ses_add_value()/ndpi_des_add_value())
+  run over the columns of all hosts in one pass, instead of one call per value
+  on scattered per-host structures
+*/
+
+#define NDPI_HOST_ANALYTICS_MAX_HOSTS    (1 << 24)
+#define NDPI_HOST_ANALYTICS_COLUMN_ALIGN 64
+
+/*
+  Lays out the columns: with base == NULL only returns the arena size
+*/
+static size_t ndpi_host_analytics_layout(ndpi_host_analytics *ha, u_int8_t *base) {
+  size_t off = 0, n = ha->max_num_hosts;
+  int m;
+
+#define NDPI_HOST_COLUMN(ptr, len)					\
+  do {									\
+    if(base) ptr = (void *)&base[off];					\
+    off += ((len) + NDPI_HOST_ANALYTICS_COLUMN_ALIGN - 1) & ~((size_t)NDPI_HOST_ANALYTICS_COLUMN_ALIGN - 1); \
+  } while(0)
+
+  NDPI_HOST_COLUMN(ha->hash, ha->hash_size * sizeof(u_int32_t));
+  NDPI_HOST_COLUMN(ha->hosts, n * sizeof(ndpi_ip_addr_t));
+  NDPI_HOST_COLUMN(ha->last_active, n * sizeof(u_int64_t));
+  NDPI_HOST_COLUMN(ha->num_values, n * sizeof(u_int32_t));
+  NDPI_HOST_COLUMN(ha->rollup, n * sizeof(u_int8_t));
+  NDPI_HOST_COLUMN(ha->anomalies, n * sizeof(u_int8_t));
+  NDPI_HOST_COLUMN(ha->bytes, n * sizeof(u_int64_t));
+  NDPI_HOST_COLUMN(ha->flows, n * sizeof(u_int64_t));
+  NDPI_HOST_COLUMN(ha->peers, n << ha->peers_hll_bits);
+
+  for(m = 0; m < NDPI_HOST_METRIC_MAX; m++) {
+    struct ndpi_host_series *s = &ha->series[m];
+
+    NDPI_HOST_COLUMN(s->history, n * ha->window_len * sizeof(u_int64_t));
+    NDPI_HOST_COLUMN(s->last_value, n * sizeof(double));
+    NDPI_HOST_COLUMN(s->last_forecast, n * sizeof(double));
+    NDPI_HOST_COLUMN(s->last_trend, n * sizeof(double));
+    NDPI_HOST_COLUMN(s->confidence_band, n * sizeof(double));
+    NDPI_HOST_COLUMN(s->sum_square_error, n * sizeof(double));
+    NDPI_HOST_COLUMN(s->prev_sum_square_error, n * sizeof(double));
+  }
+
+#undef NDPI_HOST_COLUMN
+
+  return(off);
+}
+
+/* *********************************************************** */
+
+/*
+  Input
+  max_num_hosts    Rows of the arena: traffic of hosts past this limit is dropped
+  window_len       Number of intervals kept in the history
+  interval_sec     Length of an interval
+  peers_hll_bits   Precision of the distinct peers estimator (4..12), 2^bits bytes per host
+
+  The forecaster is single exponential smoothing (alpha 0.9, significance 0.05):
+  see ndpi_host_analytics_set_forecaster()
+*/
+int ndpi_init_host_analytics(ndpi_host_analytics *ha, u_int32_t max_num_hosts,
+			     u_int32_t window_len, u_int32_t interval_sec, u_int8_t peers_hll_bits) {
+  size_t arena_len;
+
+  memset(ha, 0, sizeof(ndpi_host_analytics));
+
+  if((max_num_hosts == 0) || (max_num_hosts > NDPI_HOST_ANALYTICS_MAX_HOSTS)
+     || (window_len == 0) || (interval_sec == 0)
+     || (peers_hll_bits < 4) || (peers_hll_bits > 12))
+    return(-1);
+
+  ha->max_num_hosts = max_num_hosts, ha->window_len = window_len;
+  ha->interval_sec = interval_sec, ha->peers_hll_bits = peers_hll_bits;
+
+  /* Load factor <= 50% */
+  for(ha->hash_size = 2; ha->hash_size < (2 * max_num_hosts); ha->hash_size *= 2)
+    ;
+
+  ndpi_host_analytics_set_forecaster(ha, 0, 0.9, 0, 0.05, MIN_SERIES_LEN);
+
+  arena_len = ndpi_host_analytics_layout(ha, NULL);
+
+  if((ha->arena = ndpi_calloc(1, arena_len)) == NULL)
+    return(-1);
+
+  ndpi_host_analytics_layout(ha, (u_int8_t *)ha->arena);
+
+  return(0);
+}
+
+/* *********************************************************** */
+
+void ndpi_term_host_analytics(ndpi_host_analytics *ha) {
+  if(ha->arena)
+    ndpi_free(ha->arena);
+
+  memset(ha, 0, sizeof(ndpi_host_analytics));
+}
+
+/* *********************************************************** */
+
+/*
+  use_des             Double (with trend) instead of single exponential smoothing
+  learning_intervals  Closed intervals of a host before its anomalies are reported
+*/
+int ndpi_host_analytics_set_forecaster(ndpi_host_analytics *ha, u_int8_t use_des,
+				       double alpha, double beta, float significance,
+				       u_int32_t learning_intervals) {
+  if((significance < 0) || (significance > 1)) significance = 0.05;
+
+  ha->params.use_des = use_des ? 1 : 0;
+  ha->params.alpha = alpha, ha->params.beta = beta;
+  ha->params.ro = ndpi_normal_cdf_inverse(1 - (significance / 2.));
+  ha->params.learning_intervals = learning_intervals ? learning_intervals : 1;
+
+  return(0);
+}
+
+/* *********************************************************** */
+
+void ndpi_host_analytics_set_anomaly_cb(ndpi_host_analytics *ha,
+					ndpi_host_anomaly_cb cb, void *user_data) {
+  ha->anomaly_cb = cb, ha->anomaly_cb_data = user_data;
+}
+
+/* *********************************************************** */
+
+static inline u_int32_t ndpi_host_analytics_home(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host) {
+  return(MurmurHash3_x86_32(host, sizeof(ndpi_ip_addr_t), 0x686f7374) & (ha->hash_size - 1));
+}
+
+/* Hash slot of the host, or the empty slot where it belongs */
+static u_int32_t ndpi_host_analytics_slot(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host) {
+  u_int32_t i = ndpi_host_analytics_home(ha, host);
+
+  while(ha->hash[i] && memcmp(&ha->hosts[ha->hash[i] - 1], host, sizeof(ndpi_ip_addr_t)))
+    i = (i + 1) & (ha->hash_size - 1);
+
+  return(i);
+}
+
+/* *********************************************************** */
+
+static void ndpi_host_analytics_peers_hll(ndpi_host_analytics *ha, u_int32_t row, struct ndpi_hll *hll) {
+  /* Dense estimator on the arena: it must never be destroyed */
+  hll->bits = ha->peers_hll_bits, hll->size = (size_t)1 << ha->peers_hll_bits;
+  hll->registers = &ha->peers[(size_t)row << ha->peers_hll_bits];
+  hll->sparse = NULL, hll->sparse_len = hll->sparse_max = 0;
+}
+
+/* *********************************************************** */
+
+static void ndpi_host_analytics_clear_row(ndpi_host_analytics *ha, u_int32_t row) {
+  u_int32_t i;
+  int m;
+
+  memset(&ha->hosts[row], 0, sizeof(ndpi_ip_addr_t));
+  ha->last_active[row] = 0, ha->num_values[row] = 0, ha->rollup[row] = 0, ha->anomalies[row] = 0;
+  ha->bytes[row] = 0, ha->flows[row] = 0;
+  memset(&ha->peers[(size_t)row << ha->peers_hll_bits], 0, (size_t)1 << ha->peers_hll_bits);
+
+  for(m = 0; m < NDPI_HOST_METRIC_MAX; m++) {
+    struct ndpi_host_series *s = &ha->series[m];
+
+    for(i = 0; i < ha->window_len; i++)
+      s->history[(size_t)i * ha->max_num_hosts + row] = 0;
+
+    s->last_value[row] = s->last_forecast[row] = s->last_trend[row] = 0;
+    s->confidence_band[row] = s->sum_square_error[row] = s->prev_sum_square_error[row] = 0;
+  }
+}
+
+/* *********************************************************** */
+
+static void ndpi_host_analytics_move_row(ndpi_host_analytics *ha, u_int32_t dst, u_int32_t src) {
+  u_int32_t i;
+  int m;
+
+  ha->hosts[dst] = ha->hosts[src];
+  ha->last_active[dst] = ha->last_active[src], ha->num_values[dst] = ha->num_values[src];
+  ha->rollup[dst] = ha->rollup[src], ha->anomalies[dst] = ha->anomalies[src];
+  ha->bytes[dst] = ha->bytes[src], ha->flows[dst] = ha->flows[src];
+  memcpy(&ha->peers[(size_t)dst << ha->peers_hll_bits],
+	 &ha->peers[(size_t)src << ha->peers_hll_bits], (size_t)1 << ha->peers_hll_bits);
+
+  for(m = 0; m < NDPI_HOST_METRIC_MAX; m++) {
+    struct ndpi_host_series *s = &ha->series[m];
+
+    for(i = 0; i < ha->window_len; i++)
+      s->history[(size_t)i * ha->max_num_hosts + dst] = s->history[(size_t)i * ha->max_num_hosts + src];
+
+    s->last_value[dst] = s->last_value[src], s->last_forecast[dst] = s->last_forecast[src];
+    s->last_trend[dst] = s->last_trend[src], s->confidence_band[dst] = s->confidence_band[src];
+    s->sum_square_error[dst] = s->sum_square_error[src];
+    s->prev_sum_square_error[dst] = s->prev_sum_square_error[src];
+  }
+}
+
+/* *********************************************************** */
+
+/* The last row is moved in place of the removed one to keep the columns dense */
+static void ndpi_host_analytics_remove_row(ndpi_host_analytics *ha, u_int32_t row) {
+  u_int32_t mask = ha->hash_size - 1, last = ha->num_hosts - 1;
+  u_int32_t i = ndpi_host_analytics_slot(ha, &ha->hosts[row]), j = i;
+
+  /* Backward shift deletion: no tombstones on the probe sequences */
+  ha->hash[i] = 0;
+
+  while(1) {
+    u_int32_t k;
+
+    j = (j + 1) & mask;
+    if(ha->hash[j] == 0) break;
+
+    k = ndpi_host_analytics_home(ha, &ha->hosts[ha->hash[j] - 1]);
+
+    /* Can the entry at j be moved to i without breaking its probe sequence? */
+    if((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+      ha->hash[i] = ha->hash[j], ha->hash[j] = 0;
+      i = j;
+    }
+  }
+
+  if(row != last) {
+    ndpi_host_analytics_move_row(ha, row, last);
+    ha->hash[ndpi_host_analytics_slot(ha, &ha->hosts[row])] = row + 1;
+  }
+
+  ndpi_host_analytics_clear_row(ha, last);
+  ha->num_hosts--;
+}
+
+/* *********************************************************** */
+
+static int ndpi_host_analytics_lookup(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host, u_int8_t create) {
+  u_int32_t i, row;
+
+  if(ha->arena == NULL)
+    return(-1);
+
+  i = ndpi_host_analytics_slot(ha, host);
+
+  if(ha->hash[i])
+    return(ha->hash[i] - 1);
+  else if(!create)
+    return(-1);
+
+  if(ha->num_hosts == ha->max_num_hosts) {
+    ha->num_dropped_hosts++;
+    return(-1);
+  }
+
+  row = ha->num_hosts++;
+  ha->hosts[row] = *host, ha->hash[i] = row + 1;
+
+  return(row);
+}
+
+/* *********************************************************** */
+
+/*
+  Hosts and peers are compared as ndpi_ip_addr_t: the unused bytes of
+  IPv4 addresses must be zero. peer can be NULL.
+*/
+int ndpi_host_analytics_add_flow(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host,
+				 const ndpi_ip_addr_t *peer) {
+  int row = ndpi_host_analytics_lookup(ha, host, 1);
+
+  if(row < 0)
+    return(-1);
+
+  ha->flows[row]++, ha->last_active[row] = ha->num_intervals;
+
+  if(peer) {
+    struct ndpi_hll hll;
+
+    ndpi_host_analytics_peers_hll(ha, row, &hll);
+    hll_add(&hll, peer, sizeof(ndpi_ip_addr_t));
+  }
+
+  return(0);
+}
+
+/* *********************************************************** */
+
+int ndpi_host_analytics_add_bytes(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host, u_int64_t bytes) {
+  int row = ndpi_host_analytics_lookup(ha, host, 1);
+
+  if(row < 0)
+    return(-1);
+
+  ha->bytes[row] += bytes, ha->last_active[row] = ha->num_intervals;
+
+  return(0);
+}
+
+/* *********************************************************** */
+
+/* One metric of all the hosts: see ndpi_ses_add_value() and ndpi_des_add_value() */
+static void ndpi_host_analytics_forecast(ndpi_host_analytics *ha, int metric, const u_int64_t *values) {
+  struct ndpi_host_series *s = &ha->series[metric];
+  double alpha = ha->params.alpha, beta = ha->params.beta, ro = ha->params.ro;
+  u_int32_t h, num_hosts = ha->num_hosts, learning_intervals = ha->params.learning_intervals;
+  u_int8_t use_des = ha->params.use_des, bit = 1 << metric;
+
+  for(h = 0; h < num_hosts; h++) {
+    double value = (double)values[h], forecast, error;
+    u_int32_t num_values = ha->num_values[h];
+
+    if(num_values == 0)
+      forecast = value, s->last_trend[h] = 0;
+    else if(use_des) {
+      forecast = (alpha * value) + ((1 - alpha) * (s->last_forecast[h] + s->last_trend[h]));
+      s->last_trend[h] = (beta * (forecast - s->last_forecast[h])) + ((1 - beta) * s->last_trend[h]);
+    } else
+      forecast = (alpha * (s->last_value[h] - s->last_forecast[h])) + s->last_forecast[h];
+
+    error = value - forecast;
+    s->sum_square_error[h] += error * error, s->prev_sum_square_error[h] += error * error;
+
+    if(num_values > 0) {
+      u_int32_t observations = (num_values < MAX_SQUARE_ERROR_ITERATIONS) ? (num_values + 1) : ((num_values % MAX_SQUARE_ERROR_ITERATIONS) + MAX_SQUARE_ERROR_ITERATIONS + 1);
+
+      s->confidence_band[h] = ro * sqrt(s->sum_square_error[h] / observations);
+    } else
+      s->confidence_band[h] = 0;
+
+    if((num_values >= learning_intervals) && (fabs(error) > s->confidence_band[h]))
+      ha->anomalies[h] |= bit;
+
+    s->last_value[h] = value, s->last_forecast[h] = forecast;
+
+    if(ha->rollup[h] == (MAX_SQUARE_ERROR_ITERATIONS - 1))
+      s->sum_square_error[h] = s->prev_sum_square_error[h], s->prev_sum_square_error[h] = 0;
+  }
+}
+
+/* *********************************************************** */
+
+static void ndpi_host_analytics_roll(ndpi_host_analytics *ha) {
+  size_t base = (size_t)ha->slot * ha->max_num_hosts;
+  u_int64_t *bytes = &ha->series[ndpi_host_metric_bytes].history[base];
+  u_int64_t *flows = &ha->series[ndpi_host_metric_flows].history[base];
+  u_int64_t *peers = &ha->series[ndpi_host_metric_peers].history[base];
+  u_int32_t h, num_hosts = ha->num_hosts;
+  int m;
+
+  /* Close the interval */
+  memcpy(bytes, ha->bytes, num_hosts * sizeof(u_int64_t));
+  memcpy(flows, ha->flows, num_hosts * sizeof(u_int64_t));
+  memset(ha->bytes, 0, num_hosts * sizeof(u_int64_t));
+  memset(ha->flows, 0, num_hosts * sizeof(u_int64_t));
+
+  for(h = 0; h < num_hosts; h++) {
+    struct ndpi_hll hll;
+
+    ndpi_host_analytics_peers_hll(ha, h, &hll);
+    peers[h] = flows[h] ? (u_int64_t)llround(hll_count(&hll)) : 0;
+  }
+
+  memset(ha->peers, 0, (size_t)num_hosts << ha->peers_hll_bits);
+
+  /* Forecast */
+  memset(ha->anomalies, 0, num_hosts);
+
+  for(m = 0; m < NDPI_HOST_METRIC_MAX; m++)
+    ndpi_host_analytics_forecast(ha, m, &ha->series[m].history[base]);
+
+  for(h = 0; h < num_hosts; h++) {
+    ha->num_values[h]++;
+    ha->rollup[h] = (ha->rollup[h] == (MAX_SQUARE_ERROR_ITERATIONS - 1)) ? 0 : (ha->rollup[h] + 1);
+  }
+
+  /* Report */
+  for(h = 0; h < num_hosts; h++) {
+    if(ha->anomalies[h] == 0) continue;
+
+    for(m = 0; m < NDPI_HOST_METRIC_MAX; m++) {
+      if(ha->anomalies[h] & (1 << m)) {
+	struct ndpi_host_series *s = &ha->series[m];
+
+	ha->num_anomalies++;
+
+	if(ha->anomaly_cb) {
+	  struct ndpi_host_anomaly a;
+
+	  a.host = ha->hosts[h], a.metric = (ndpi_host_metric)m, a.interval = ha->num_intervals;
+	  a.value = s->last_value[h], a.forecast = s->last_forecast[h];
+	  a.confidence_band = s->confidence_band[h];
+	  ha->anomaly_cb(&a, ha->anomaly_cb_data);
+	}
+      }
+    }
+  }
+
+  ha->num_intervals++, ha->slot = (ha->slot + 1) % ha->window_len;
+
+  /* Hosts idle for the whole window are freed */
+  for(h = num_hosts; h > 0; h--) {
+    if((ha->num_intervals - ha->last_active[h - 1]) > ha->window_len) {
+      ndpi_host_analytics_remove_row(ha, h - 1);
+      ha->num_expired_hosts++;
+    }
+  }
+}
+
+/* *********************************************************** */
+
+/*
+  To be called periodically (e.g. once per second): the first call starts
+  the clock, then every elapsed interval is closed. Gaps longer than the
+  history window are closed as a single window of empty intervals.
+
+  Return code: number of anomalies found
+*/
+u_int32_t ndpi_host_analytics_tick(ndpi_host_analytics *ha, u_int64_t now_sec) {
+  u_int64_t num_anomalies = ha->num_anomalies;
+  u_int32_t num_rolls = 0;
+
+  if(ha->arena == NULL)
+    return(0);
+
+  if(ha->next_roll == 0) {
+    ha->next_roll = now_sec + ha->interval_sec;
+    return(0);
+  }
+
+  while(now_sec >= ha->next_roll) {
+    if(num_rolls == ha->window_len) {
+      ha->next_roll += ((now_sec - ha->next_roll) / ha->interval_sec + 1) * ha->interval_sec;
+      break;
+    }
+
+    ndpi_host_analytics_roll(ha);
+    ha->next_roll += ha->interval_sec, num_rolls++;
+  }
+
+  return((u_int32_t)(ha->num_anomalies - num_anomalies));
+}
+
+/* *********************************************************** */
+
+/*
+  Copies up to max_values closed intervals of the host, oldest first
+
+  Return code: number of values, -1 if the host is unknown
+*/
+int ndpi_host_analytics_get_series(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host,
+				   ndpi_host_metric metric, u_int64_t *values, u_int32_t max_values) {
+  int row = ndpi_host_analytics_lookup(ha, host, 0);
+  u_int32_t i, num, slot;
+
+  if((row < 0) || (metric >= NDPI_HOST_METRIC_MAX))
+    return(-1);
+
+  num = ndpi_min(ha->window_len, ha->num_values[row]);
+  num = ndpi_min(num, max_values);
+  slot = (ha->slot + ha->window_len - num) % ha->window_len;
+
+  for(i = 0; i < num; i++, slot = (slot + 1) % ha->window_len)
+    values[i] = ha->series[metric].history[(size_t)slot * ha->max_num_hosts + row];
+
+  return((int)num);
+}
+
+/* *********************************************************** */
+
+/*
+  Forecast and confidence band of the last closed interval
+
+  Return code
+  -1   Unknown host
+  0    Too early: still in the learning phase
+  1    Output values are meaningful
+*/
+int ndpi_host_analytics_get_forecast(ndpi_host_analytics *ha, const ndpi_ip_addr_t *host,
+				     ndpi_host_metric metric, double *forecast, double *confidence_band) {
+  int row = ndpi_host_analytics_lookup(ha, host, 0);
+
+  if((row < 0) || (metric >= NDPI_HOST_METRIC_MAX))
+    return(-1);
+
+  *forecast = ha->series[metric].last_forecast[row];
+  *confidence_band = ha->series[metric].confidence_band[row];
+
+  return((ha->num_values[row] >= ha->params.learning_intervals) ? 1 : 0);
+}
+
+/* ********************************************************************************* */
+
+/*
+  Byte distribution kernels (payload histogram, mean/variance, entropy)
+*/
+
+#define NDPI_BYTE_HIST_BANK_MIN_LEN  256
+#define NDPI_BYTE_HIST_BANK_MAX_LEN  (4 * 0xFFFF) /* u_int16_t bank counters */
+
+/*
+  Counting the same byte value back to back (e.g. zero padding) stalls on
+  the previous store to the same counter: long buffers are spread over four
+  banks, one per byte of a 32 bit word, and merged at the end.
+*/
+void ndpi_byte_histogram_update(u_int32_t byte_count[256], const u_int8_t *data, u_int32_t len) {
+  while(len >= NDPI_BYTE_HIST_BANK_MIN_LEN) {
+    u_int16_t bank[4][256];
+    u_int32_t i, n = ndpi_min(len, NDPI_BYTE_HIST_BANK_MAX_LEN) & ~3u;
+
+    memset(bank, 0, sizeof(bank));
+
+    for(i = 0; i < n; i += 4) {
+      bank[0][data[i]]++;
+      bank[1][data[i+1]]++;
+      bank[2][data[i+2]]++;
+      bank[3][data[i+3]]++;
+    }
+
+    for(i = 0; i < 256; i++)
+      byte_count[i] += (u_int32_t)bank[0][i] + bank[1][i] + bank[2][i] + bank[3][i];
+
+    data += n, len -= n;
+  }
+
+  while(len--)
+    byte_count[*data++]++;
+}
+
+/* ********************************************************************************* */
+
+void ndpi_byte_sum(const u_int8_t *data, u_int32_t len, u_int64_t *sum, u_int64_t *sum_sq) {
+  u_int64_t s = 0, ss = 0;
+  u_int32_t i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc_s = zero, acc_ss = zero;
+
+    while(i + 16 <= len) {
+      /* 32 bit lanes grow by at most 4*255*255 per block: flush every 4096 blocks */
+      u_int32_t blocks = ndpi_min((len - i) / 16, 4096), b;
+      __m128i acc_ss32 = zero;
+      u_int64_t tmp[2];
+
+      for(b = 0; b < blocks; b++, i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+	__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+
+	acc_s = _mm_add_epi64(acc_s, _mm_sad_epu8(v, zero));
+	acc_ss32 = _mm_add_epi32(acc_ss32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+      }
+
+      acc_ss = _mm_add_epi64(acc_ss, _mm_unpacklo_epi32(acc_ss32, zero));
+      acc_ss = _mm_add_epi64(acc_ss, _mm_unpackhi_epi32(acc_ss32, zero));
+
+      _mm_storeu_si128((__m128i *)tmp, acc_s);
+      s = tmp[0] + tmp[1];
+      _mm_storeu_si128((__m128i *)tmp, acc_ss);
+      ss = tmp[0] + tmp[1];
+    }
+  }
+#endif
+
+  for(; i < len; i++)
+    s += data[i], ss += (u_int32_t)data[i] * data[i];
+
+  *sum = s, *sum_sq = ss;
+}
+
+/* ********************************************************************************* */
+
+/*
+  Running mean and sum of squared deviations (Welford's m2) of the byte
+  values: the statistics of the whole buffer are computed at once and merged
+  (Chan et al.) instead of being updated byte by byte.
+*/
+void ndpi_byte_dist_update(u_int32_t *num_bytes, double *mean, double *m2,
+			   const u_int8_t *data, u_int32_t len) {
+  u_int64_t s, ss;
+  double n_a = (double)*num_bytes, n_b = (double)len, n, mean_b, delta;
+
+  if(len == 0) return;
+
+  ndpi_byte_sum(data, len, &s, &ss);
+
+  mean_b = (double)s / n_b;
+  n = n_a + n_b;
+  delta = mean_b - *mean;
+
+  *mean += delta * n_b / n;
+  *m2 += ((double)ss - (double)s * mean_b) + delta * delta * n_a * n_b / n;
+  *num_bytes += len;
+}
+
+/* ********************************************************************************* */
+
+#define NDPI_CLOG2C_TABLE_LEN 4096
+
+static float ndpi_clog2c[NDPI_CLOG2C_TABLE_LEN]; /* c * log2(c) */
+static volatile int ndpi_clog2c_state = 0; /* 0 = empty, 1 = filling, 2 = ready */
+
+static inline double ndpi_count_log2(u_int32_t c, int use_table) {
+  if(use_table && (c < NDPI_CLOG2C_TABLE_LEN))
+    return(ndpi_clog2c[c]);
+  else
+    return((double)c * log2((double)c));
+}
+
+/*
+  Shannon entropy (bits) of the distribution byte_count[] / num_bytes,
+  computed as (C/N)*log2(N) - (1/N)*sum(c*log2(c)) with C = sum(c):
+  c*log2(c) comes from a table for the small counts
+*/
+float ndpi_byte_count_entropy(const u_int32_t byte_count[256], u_int32_t num_bytes) {
+  double sum = 0, n = (double)num_bytes;
+  u_int64_t total = 0;
+  int i, use_table = (ndpi_clog2c_state == 2);
+
+  if(num_bytes == 0) return(0);
+
+  if(!use_table && __sync_bool_compare_and_swap(&ndpi_clog2c_state, 0, 1)) {
+    ndpi_clog2c[0] = 0;
+    for(i = 1; i < NDPI_CLOG2C_TABLE_LEN; i++)
+      ndpi_clog2c[i] = (float)((double)i * log2((double)i));
+    __sync_synchronize();
+    ndpi_clog2c_state = 2, use_table = 1;
+  }
+
+  for(i = 0; i < 256; i++) {
+    u_int32_t c = byte_count[i];
+
+    /* Same cut as the float version: p <= FLT_EPSILON does not contribute */
+    if((c == 0) || ((double)c / n <= FLT_EPSILON)) continue;
+
+    total += c;
+    sum += ndpi_count_log2(c, use_table);
+  }
+
+  return((float)(((double)total * log2(n) - sum) / n));
+}
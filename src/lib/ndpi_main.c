@@ -35,6 +35,7 @@
 #else
   #include <asm/byteorder.h>
   #include <linux/kernel.h>
+  #include <linux/percpu.h>
 #endif
 
 #define NDPI_CURRENT_PROTO NDPI_PROTOCOL_UNKNOWN
@@ -59,7 +60,13 @@
 
 #include "ndpi_network_list.c.inc"
 
+#ifdef NDPI_PROTOCOL_PROFILE
+/* Generated by gen_protocol_profile.pl */
+#include "ndpi_protocol_profile.h"
+#include "ndpi_content_match_profile.c.inc"
+#else
 #include "ndpi_content_match.c.inc"
+#endif
 #include "third_party/include/ndpi_patricia.h"
 #include "third_party/include/ht_hash.h"
 #include "third_party/include/ndpi_md5.h"
@@ -85,6 +92,7 @@ u_int ndpi_verbose_dga_detection = 0;
 /* ****************************************** */
 
 static int ndpi_exact_ac_match(int match_num,const AC_TEXT_t *input_text);
+static int ndpi_domain_match(const void *domains, char *name, u_int name_len, AC_REP_t *match);
 
 static void *(*_ndpi_flow_malloc)(size_t size);
 static void (*_ndpi_flow_free)(void *ptr);
@@ -92,6 +100,17 @@ static void (*_ndpi_flow_free)(void *ptr);
 static void *(*_ndpi_malloc)(size_t size);
 static void (*_ndpi_free)(void *ptr);
 
+/*
+  Memory budget. Like the allocator hooks it is global: the counters are
+  shared by all detection modules and updated with atomic builtins as the
+  kernel module and ndpiReader call into the library from several CPUs.
+*/
+static volatile long ndpi_mem_used[NDPI_MEM_NUM_CATEGORIES];
+static volatile long ndpi_mem_total = 0, ndpi_mem_peak = 0;
+static volatile long ndpi_mem_shed_count = 0, ndpi_mem_denied = 0;
+static u_int64_t ndpi_mem_soft_limit = 0, ndpi_mem_hard_limit = 0;
+static volatile ndpi_mem_level ndpi_mem_cur_level = NDPI_MEM_LEVEL_OK;
+
 static u_int32_t _ticks_per_second = 1000;
 #ifdef __KERNEL__
   #ifdef FRAG_MAN
@@ -168,8 +187,26 @@ void* ndpi_malloc(size_t size) { return(_ndpi_malloc ? _ndpi_malloc(size) :
 #endif
 		); 
 }
-void* ndpi_flow_malloc(size_t size) { 
-  return(_ndpi_flow_malloc ? _ndpi_flow_malloc(size) : ndpi_malloc(size));
+void* ndpi_flow_malloc(size_t size) {
+  void *ret;
+
+  /* Over the hard memory limit: give up on the new flow */
+  if(ndpi_mem_deny())
+    return(NULL);
+
+  ret = _ndpi_flow_malloc ? _ndpi_flow_malloc(size) : ndpi_malloc(size);
+
+  if(ret) {
+    /* Zeroed here so that the charge is recorded in the flow and given back as is */
+    memset(ret, 0, size);
+
+    if(size >= sizeof(struct ndpi_flow_struct))
+      ((struct ndpi_flow_struct *)ret)->mem_flow = size;
+
+    ndpi_mem_account(NDPI_MEM_FLOW, size);
+  }
+
+  return(ret);
 }
 
 /* ****************************************** */
@@ -198,6 +235,15 @@ void ndpi_free(void *ptr) {
 /* ****************************************** */
 
 void ndpi_flow_free(void *ptr) {
+  struct ndpi_flow_struct *flow = (struct ndpi_flow_struct *)ptr;
+
+  if(ptr == NULL)
+    return;
+
+  /* mem_flow is 0 if the caller cleared the flow: assume the usual SIZEOF_FLOW_STRUCT */
+  ndpi_mem_account(NDPI_MEM_FLOW, -(int64_t)(flow->mem_flow ? flow->mem_flow : sizeof(struct ndpi_flow_struct)));
+  flow->mem_flow = 0;
+
   if(_ndpi_flow_free)
     _ndpi_flow_free(ptr);
   else
@@ -239,6 +285,265 @@ char *ndpi_strdup(const char *s) {
   return(m);
 }
 
+/* ****************************************** */
+
+static const char *ndpi_mem_category_names[NDPI_MEM_NUM_CATEGORIES] = {
+  "Flows", "Buffers", "Metadata", "Caches", "Other"
+};
+
+static ndpi_mem_level ndpi_mem_level_of(long total) {
+  if(total < 0) total = 0;
+
+  if(ndpi_mem_hard_limit && ((u_int64_t)total >= ndpi_mem_hard_limit))
+    return(NDPI_MEM_LEVEL_HARD);
+  else if(ndpi_mem_soft_limit && ((u_int64_t)total >= ndpi_mem_soft_limit))
+    return(NDPI_MEM_LEVEL_SOFT);
+
+  return(NDPI_MEM_LEVEL_OK);
+}
+
+/*
+  Concurrent callers could store levels computed from stale totals: the
+  level is recomputed from the current total until it is swapped in
+  unchanged, so the last store always reflects a total read after it
+*/
+static void ndpi_mem_update_level(void) {
+  for(;;) {
+    ndpi_mem_level cur = ndpi_mem_cur_level, level = ndpi_mem_level_of(ndpi_mem_total);
+
+    if((level == cur) || __sync_bool_compare_and_swap(&ndpi_mem_cur_level, cur, level))
+      break;
+  }
+}
+
+/* ****************************************** */
+
+void ndpi_set_memory_limits(u_int64_t soft_limit, u_int64_t hard_limit) {
+  if(hard_limit && (soft_limit > hard_limit))
+    soft_limit = hard_limit;
+
+  ndpi_mem_soft_limit = soft_limit, ndpi_mem_hard_limit = hard_limit;
+  ndpi_mem_update_level();
+}
+
+/* ****************************************** */
+
+void ndpi_get_memory_stats(struct ndpi_mem_stats *stats) {
+  int i;
+
+  if(!stats) return;
+
+  for(i = 0; i < NDPI_MEM_NUM_CATEGORIES; i++)
+    stats->used[i] = (ndpi_mem_used[i] > 0) ? (u_int64_t)ndpi_mem_used[i] : 0;
+
+  stats->total = (ndpi_mem_total > 0) ? (u_int64_t)ndpi_mem_total : 0;
+  stats->peak = (u_int64_t)ndpi_mem_peak;
+  stats->soft_limit = ndpi_mem_soft_limit, stats->hard_limit = ndpi_mem_hard_limit;
+  stats->shed = (u_int64_t)ndpi_mem_shed_count, stats->denied = (u_int64_t)ndpi_mem_denied;
+  stats->level = ndpi_mem_cur_level;
+}
+
+/* ****************************************** */
+
+ndpi_mem_level ndpi_get_memory_level(void) {
+  return(ndpi_mem_cur_level);
+}
+
+/* ****************************************** */
+
+const char *ndpi_mem_category_name(ndpi_mem_category cat) {
+  return(((unsigned int)cat < NDPI_MEM_NUM_CATEGORIES) ? ndpi_mem_category_names[cat] : "Unknown");
+}
+
+/* ****************************************** */
+
+void ndpi_mem_account(ndpi_mem_category cat, int64_t delta) {
+  long total;
+
+  if(((unsigned int)cat >= NDPI_MEM_NUM_CATEGORIES) || (delta == 0))
+    return;
+
+  __sync_fetch_and_add(&ndpi_mem_used[cat], (long)delta);
+  total = __sync_add_and_fetch(&ndpi_mem_total, (long)delta);
+
+  if(total > ndpi_mem_peak)
+    ndpi_mem_peak = total; /* Racy, but good enough for reporting */
+
+  ndpi_mem_update_level();
+}
+
+/* ****************************************** */
+
+int ndpi_mem_shed(void) {
+  if(ndpi_mem_cur_level == NDPI_MEM_LEVEL_OK)
+    return(0);
+
+  __sync_fetch_and_add(&ndpi_mem_shed_count, 1);
+  return(1);
+}
+
+/* ****************************************** */
+
+int ndpi_mem_deny(void) {
+  if(ndpi_mem_cur_level != NDPI_MEM_LEVEL_HARD)
+    return(0);
+
+  __sync_fetch_and_add(&ndpi_mem_denied, 1);
+  return(1);
+}
+
+/* ****************************************** */
+
+static inline u_int32_t *ndpi_flow_mem_counter(struct ndpi_flow_struct *flow, ndpi_mem_category cat) {
+  return((cat == NDPI_MEM_BUFFER) ? &flow->mem_buffer : &flow->mem_metadata);
+}
+
+/* ****************************************** */
+
+void *ndpi_flow_data_malloc(struct ndpi_flow_struct *flow, ndpi_mem_category cat, size_t size) {
+  void *ret;
+
+  if((cat == NDPI_MEM_METADATA) && ndpi_mem_shed())
+    return(NULL);
+
+  if((ret = ndpi_malloc(size)) != NULL) {
+    *ndpi_flow_mem_counter(flow, cat) += size;
+    ndpi_mem_account(cat, size);
+  }
+
+  return(ret);
+}
+
+/* ****************************************** */
+
+void *ndpi_flow_data_realloc(struct ndpi_flow_struct *flow, ndpi_mem_category cat,
+			     void *ptr, size_t old_size, size_t new_size) {
+  void *ret;
+
+  if(ptr == NULL)
+    return(ndpi_flow_data_malloc(flow, cat, new_size));
+
+  /* Growing metadata past the soft limit is shed too; the old copy is kept */
+  if((cat == NDPI_MEM_METADATA) && (new_size > old_size) && ndpi_mem_shed())
+    return(NULL);
+
+  if((ret = ndpi_realloc(ptr, old_size, new_size)) != NULL) {
+    *ndpi_flow_mem_counter(flow, cat) += new_size - old_size;
+    ndpi_mem_account(cat, (int64_t)new_size - (int64_t)old_size);
+  }
+
+  return(ret);
+}
+
+/* ****************************************** */
+
+char *ndpi_flow_data_strdup(struct ndpi_flow_struct *flow, ndpi_mem_category cat, const char *s) {
+  size_t len;
+  char *m;
+
+  if(s == NULL)
+    return(NULL);
+
+  len = strlen(s);
+
+  if((m = ndpi_flow_data_malloc(flow, cat, len + 1)) != NULL) {
+    memcpy(m, s, len);
+    m[len] = '\0';
+  }
+
+  return(m);
+}
+
+/* ****************************************** */
+
+/*
+  Bounded in-order TCP reassembly shared by dissectors that need a
+  protocol message spanning several segments (TLS records, Kerberos
+  over TCP, ...). The payload of the current segment is appended only
+  when it is the next one expected in its direction, so retransmitted
+  and out-of-order segments are skipped. The buffer is charged to the
+  flow as NDPI_MEM_BUFFER and never grows past max_len bytes.
+
+  Return 1 when the payload has been appended, 0 when it has been
+  skipped and -1 when the buffer could not be allocated
+*/
+int ndpi_tcp_reassembly_append(struct ndpi_flow_struct *flow, message_t *msg, u_int max_len) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  u_int8_t dir = packet->packet_direction;
+  u_int32_t seq;
+
+  if((packet->tcp == NULL) || (packet->payload_packet_len == 0))
+    return(0);
+
+  seq = ntohl(packet->tcp->seq);
+
+  if((msg->next_seq[dir] != 0) && (seq != msg->next_seq[dir]))
+    return(0);
+
+  if(msg->buffer == NULL) {
+    u_int len = ndpi_min(NDPI_TCP_REASSEMBLY_BUF_LEN, max_len);
+
+    if((msg->buffer = (u_int8_t*)ndpi_flow_data_malloc(flow, NDPI_MEM_BUFFER, len)) == NULL)
+      return(-1);
+
+    msg->buffer_len = len, msg->buffer_used = 0;
+  }
+
+  if((msg->buffer_len - msg->buffer_used) < packet->payload_packet_len) {
+    u_int new_len = msg->buffer_used + packet->payload_packet_len;
+    void *newbuf;
+
+    if(new_len > max_len)
+      return(0);
+
+    if((newbuf = ndpi_flow_data_realloc(flow, NDPI_MEM_BUFFER, msg->buffer,
+					msg->buffer_len, new_len)) == NULL)
+      return(-1);
+
+    msg->buffer = (u_int8_t*)newbuf, msg->buffer_len = new_len;
+  }
+
+  memcpy(&msg->buffer[msg->buffer_used], packet->payload, packet->payload_packet_len);
+  msg->buffer_used += packet->payload_packet_len;
+  msg->next_seq[dir] = seq + packet->payload_packet_len;
+
+  return(1);
+}
+
+/* ****************************************** */
+
+/* Drop the first len bytes (a fully parsed message) keeping the rest */
+void ndpi_tcp_reassembly_consume(message_t *msg, u_int len) {
+  if(len >= msg->buffer_used)
+    msg->buffer_used = 0;
+  else {
+    msg->buffer_used -= len;
+    memmove(msg->buffer, &msg->buffer[len], msg->buffer_used);
+  }
+}
+
+/* ****************************************** */
+
+/* Empty the buffer and restart from the next segment, whatever its sequence number */
+void ndpi_tcp_reassembly_reset(message_t *msg) {
+  msg->buffer_used = 0, msg->max_expected = 0;
+  msg->next_seq[0] = msg->next_seq[1] = 0;
+}
+
+/* ****************************************** */
+
+void ndpi_tcp_reassembly_free(struct ndpi_flow_struct *flow, message_t *msg) {
+  if(msg->buffer != NULL) {
+    ndpi_free(msg->buffer);
+    /* Give back what has been charged to the flow */
+    flow->mem_buffer -= ndpi_min(flow->mem_buffer, msg->buffer_len);
+    ndpi_mem_account(NDPI_MEM_BUFFER, -(int64_t)msg->buffer_len);
+  }
+
+  msg->buffer = NULL, msg->buffer_len = 0;
+  ndpi_tcp_reassembly_reset(msg);
+}
+
 /* *********************************************************************************** */
 
 /* Opaque structure defined here */
@@ -466,6 +771,12 @@ void ndpi_set_proto_defaults(struct ndpi_detection_module_struct *ndpi_str, ndpi
   ndpi_str->proto_defaults[protoId].subprotocols = NULL;
   ndpi_str->proto_defaults[protoId].subprotocol_count = 0;
 
+#ifdef NDPI_PROTOCOL_PROFILE
+  /* Protocols left out of the profile keep their name but are never guessed by port */
+  if((protoId < NDPI_MAX_SUPPORTED_PROTOCOLS) && !ndpi_profile_protocols[protoId])
+    return;
+#endif
+
   for(j = 0; j < MAX_DEFAULT_PORTS; j++) {
     if(udpDefPorts[j].port_low != 0)
       addDefaultPort(ndpi_str, &udpDefPorts[j], &ndpi_str->proto_defaults[protoId], 0, &ndpi_str->udpRoot,
@@ -591,6 +902,183 @@ static u_int8_t ndpi_is_middle_string_char(char c) {
 
 /* ****************************************************** */
 
+/*
+  buf is the text as seen by ac_match_handler() (at most 63 chars).
+  The patch below allows in case of pattern ws.amazon.com to avoid
+  matching aws.amazon.com whereas a.ws.amazon.com has to match
+*/
+static int ndpi_host_pattern_on_label(const char *buf, const char *pattern) {
+  const char *whatfound = strstr(buf, pattern);
+
+  if(whatfound) {
+#ifdef MATCH_DEBUG
+    printf("[NDPI] %s() [searching=%s][pattern=%s][%s][%c]\n", __FUNCTION__, buf, pattern,
+	   whatfound, whatfound != buf ? whatfound[-1]:'?');
+#endif
+    if((whatfound != buf) && (pattern[0] != '.') /* The searched pattern does not start with . */
+       && strchr(pattern, '.') /* The matched pattern has a . (e.g. numeric or sym IPs) */) {
+      int len = strlen(pattern);
+
+      if((whatfound[-1] != '.') || ((pattern[len - 1] != '.') &&
+				    (whatfound[len] != '\0') /* endsWith does not hold here */))
+	return(0);
+    }
+  }
+
+  return(1);
+}
+
+/* ****************************************************** */
+
+/*
+  Domain suffix index: host patterns that can only match at the end of
+  a name (e.g. netflix.com, .fbcdn.net, |exact.org|) are also kept in an
+  open addressing hash of the whole pattern. The longest one that ends
+  a name is found by hashing its suffixes in one backward pass; when
+  ndpi_domain_match() accepts it, the automa is not searched at all.
+  The strings belong to the automa the patterns were added to.
+*/
+struct ndpi_domain_entry {
+  const char *name; /* NULL: free slot */
+  u_int32_t hash;
+  u_int16_t len;
+  AC_REP_t rep;
+};
+
+#define NDPI_DOMAIN_FILTER_BITS 16
+
+struct ndpi_domain_table {
+  u_int32_t size, num; /* size is a power of 2 */
+  u_int16_t min_len, max_len;
+  u_int8_t disabled;   /* an allocation failed: the automa alone decides */
+  struct ndpi_domain_entry *entries;
+  /* One bit per mixed hash: most suffixes of a name are rejected here */
+  u_int8_t filter[(1 << NDPI_DOMAIN_FILTER_BITS) / 8];
+};
+
+/* The top bits of a short suffix hash are mostly zero: mix them first */
+#define NDPI_DOMAIN_FILTER_BIT(h) (((h) * 2654435761U) >> (32 - NDPI_DOMAIN_FILTER_BITS))
+#define NDPI_DOMAIN_FILTER(t, h)  ((t)->filter[NDPI_DOMAIN_FILTER_BIT(h) >> 3] & (1 << (NDPI_DOMAIN_FILTER_BIT(h) & 7)))
+
+/*
+  END patterns with a '.' are longer than any other pattern ending
+  the same name: the others could only be suffixes of its last label
+*/
+static int ndpi_is_domain_pattern(const char *s, u_int16_t len, u_int32_t number) {
+  return((number & NDPI_HOST_MATCH_END) && (len > 1) && (memchr(s, '.', len) != NULL));
+}
+
+static inline u_int8_t ndpi_domain_lc(char c) {
+  return((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : (u_int8_t)c);
+}
+
+/* Hashed from the end, so that all the suffixes of a name cost one pass */
+static u_int32_t ndpi_domain_hash(const char *s, u_int16_t len) {
+  u_int32_t h = 5381;
+
+  while(len > 0)
+    h = ((h << 5) + h) + ndpi_domain_lc(s[--len]);
+
+  return(h);
+}
+
+static struct ndpi_domain_entry *ndpi_domain_slot(struct ndpi_domain_entry *entries, u_int32_t size,
+						  const char *s, u_int16_t len, u_int32_t hash) {
+  u_int32_t i;
+
+  for(i = hash & (size - 1); entries[i].name; i = (i + 1) & (size - 1))
+    if((entries[i].hash == hash) && (entries[i].len == len)
+       && (strncasecmp(entries[i].name, s, len) == 0))
+      break;
+
+  return(&entries[i]);
+}
+
+/* Called for the patterns ac_automata_add() accepted, so there are no duplicates */
+static void ndpi_domain_table_add(void **_t, const AC_PATTERN_t *p) {
+  struct ndpi_domain_table *t = (struct ndpi_domain_table *)*_t;
+  struct ndpi_domain_entry *e;
+  u_int32_t hash, i;
+
+  if(!t) {
+    if((t = ndpi_calloc(1, sizeof(*t))) == NULL)
+      return; /* No index at all */
+    *_t = t;
+  }
+
+  if(t->disabled)
+    return;
+
+  if((t->num + 1) * 2 > t->size) {
+    u_int32_t size = t->size ? t->size * 2 : 256;
+    struct ndpi_domain_entry *entries = ndpi_calloc(size, sizeof(*entries));
+
+    if(!entries) {
+      /* A partial index could hide the longest pattern */
+      t->disabled = 1;
+      return;
+    }
+
+    for(i = 0; i < t->size; i++)
+      if(t->entries[i].name)
+	*ndpi_domain_slot(entries, size, t->entries[i].name, t->entries[i].len, t->entries[i].hash) = t->entries[i];
+
+    ndpi_free(t->entries);
+    t->entries = entries, t->size = size;
+  }
+
+  hash = ndpi_domain_hash(p->astring, p->length);
+  e = ndpi_domain_slot(t->entries, t->size, p->astring, p->length, hash);
+
+  if(e->name)
+    return;
+
+  e->name = p->astring, e->len = p->length, e->hash = hash, e->rep = p->rep;
+  t->num++;
+  if(!t->min_len || (p->length < t->min_len)) t->min_len = p->length;
+  if(p->length > t->max_len) t->max_len = p->length;
+  t->filter[NDPI_DOMAIN_FILTER_BIT(hash) >> 3] |= 1 << (NDPI_DOMAIN_FILTER_BIT(hash) & 7);
+}
+
+/* Returns the longest pattern that ends name, i.e. the one of the automa node reached at its end */
+static const struct ndpi_domain_entry *ndpi_domain_table_match(const void *_t, const char *name, u_int name_len) {
+  const struct ndpi_domain_table *t = (const struct ndpi_domain_table *)_t;
+  const struct ndpi_domain_entry *found = NULL;
+  u_int32_t h = 5381;
+  u_int len;
+
+  if(!t || !t->num || t->disabled || (name_len < t->min_len) || (name_len > 0xFFFF))
+    return(NULL);
+
+  for(len = 1; (len <= name_len) && (len <= t->max_len); len++) {
+    const struct ndpi_domain_entry *e;
+
+    h = ((h << 5) + h) + ndpi_domain_lc(name[name_len - len]);
+
+    if((len < t->min_len) || !NDPI_DOMAIN_FILTER(t, h))
+      continue;
+
+    e = ndpi_domain_slot(t->entries, t->size, &name[name_len - len], len, h);
+
+    if(e->name)
+      found = e;
+  }
+
+  return(found);
+}
+
+static void ndpi_domain_table_free(void *_t) {
+  struct ndpi_domain_table *t = (struct ndpi_domain_table *)_t;
+
+  if(!t)
+    return;
+
+  ndpi_free(t->entries);
+  ndpi_free(t);
+}
+
+/* ****************************************************** */
+
 static int ndpi_string_to_automa(struct ndpi_detection_module_struct *ndpi_str,
 				 ndpi_automa *automa, char *value,
                                  u_int16_t protocol_id, ndpi_protocol_category_t category,
@@ -643,6 +1131,11 @@ static int ndpi_string_to_automa(struct ndpi_detection_module_struct *ndpi_str,
      }
   }
   r = ac_automata_add(((AC_AUTOMATA_t*)automa->ac_automa), &ac_pattern);
+  if(r == ACERR_SUCCESS && automa == &ndpi_str->host_automa
+     && ndpi_is_domain_pattern(ac_pattern.astring, ac_pattern.length, ac_pattern.rep.number))
+    ndpi_domain_table_add(&automa->domains, &ac_pattern);
+  if(automa == &ndpi_str->host_automa)
+    ndpi_host_match_cache_invalidate(ndpi_str);
   if(r == ACERR_DUPLICATE_PATTERN && 
 	(automa == &ndpi_str->host_automa ||
 	 automa == &ndpi_str->content_automa)) {
@@ -701,17 +1194,10 @@ static int ndpi_remove_host_url_subprotocol(struct ndpi_detection_module_struct
 
 /* ******************************************************************** */
 
-int ndpi_init_protocol_match(struct ndpi_detection_module_struct *ndpi_str,
-			      ndpi_protocol_match *match) {
+static void ndpi_init_protocol_match_name(struct ndpi_detection_module_struct *ndpi_str,
+					  ndpi_protocol_match *match) {
   ndpi_port_range ports_a[MAX_DEFAULT_PORTS], ports_b[MAX_DEFAULT_PORTS];
 
-  if(ndpi_add_host_url_subprotocol(ndpi_str,
-			  match->string_to_match,
-			  match->protocol_id,
-			  match->protocol_category,
-			  match->protocol_breed))
-	  return -1;
-
   if(ndpi_str->proto_defaults[match->protocol_id].protoName == NULL) {
     ndpi_str->proto_defaults[match->protocol_id].protoName    = ndpi_strdup(match->proto_name);
 
@@ -726,15 +1212,27 @@ int ndpi_init_protocol_match(struct ndpi_detection_module_struct *ndpi_str,
 			    ndpi_build_default_ports(ports_a, 0, 0, 0, 0, 0) /* TCP */,
 			    ndpi_build_default_ports(ports_b, 0, 0, 0, 0, 0) /* UDP */);
   }
-
-  return 0;
 }
 
-/* ******************************************************************** */
-
-#ifndef __KERNEL__
-/* Self check function to be called onli for testing purposes */
-void ndpi_self_check_host_match() {
+int ndpi_init_protocol_match(struct ndpi_detection_module_struct *ndpi_str,
+			      ndpi_protocol_match *match) {
+  if(ndpi_add_host_url_subprotocol(ndpi_str,
+			  match->string_to_match,
+			  match->protocol_id,
+			  match->protocol_category,
+			  match->protocol_breed))
+	  return -1;
+
+  ndpi_init_protocol_match_name(ndpi_str, match);
+
+  return 0;
+}
+
+/* ******************************************************************** */
+
+#ifndef __KERNEL__
+/* Self check function to be called onli for testing purposes */
+void ndpi_self_check_host_match() {
   u_int32_t i, j;
 
   for(i = 0; host_match[i].string_to_match != NULL; i++) {
@@ -751,11 +1249,45 @@ void ndpi_self_check_host_match() {
 #endif
 /* ******************************************************************** */
 
+/* DGA n-gram bitmaps: 'a'..'z' map to 0..25, anything else to the last slot that is never set */
+static inline u_int ndpi_dga_char_idx(u_int8_t c) {
+  return(((c >= 'a') && (c <= 'z')) ? (u_int)(c - 'a') : (NDPI_DGA_NGRAM_ALPHABET-1));
+}
+
+static inline int ndpi_dga_ngram_match(const u_int8_t *bitmap, u_int idx) {
+  return((bitmap[idx >> 3] >> (idx & 7)) & 1);
+}
+
+static void ndpi_dga_ngram_set(u_int8_t *bitmap, const char *ngram) {
+  u_int idx = 0;
+
+  for(; *ngram != '\0'; ngram++) {
+    u_int c = ndpi_dga_char_idx((u_int8_t)*ngram);
+
+    if(c == (NDPI_DGA_NGRAM_ALPHABET-1))
+      return;
+
+    idx = idx * NDPI_DGA_NGRAM_ALPHABET + c;
+  }
+
+  bitmap[idx >> 3] |= 1 << (idx & 7);
+}
+
+/* ******************************************************************** */
+
 static void init_string_based_protocols(struct ndpi_detection_module_struct *ndpi_str) {
   int i;
 
-  for(i = 0; host_match[i].string_to_match != NULL; i++)
+  for(i = 0; host_match[i].string_to_match != NULL; i++) {
+#ifdef NDPI_PROTOCOL_PROFILE
+    /* The first pattern of the protocols left out of the profile is kept only for their name */
+    if(!ndpi_profile_protocols[host_match[i].protocol_id]) {
+      ndpi_init_protocol_match_name(ndpi_str, &host_match[i]);
+      continue;
+    }
+#endif
     ndpi_init_protocol_match(ndpi_str, &host_match[i]);
+  }
 
   /* ************************ */
 
@@ -794,6 +1326,16 @@ static void init_string_based_protocols(struct ndpi_detection_module_struct *ndp
   for(i = 0; ndpi_en_impossible_bigrams[i] != NULL; i++)
     ndpi_string_to_automa(ndpi_str, &ndpi_str->impossible_bigrams_automa, (char *) ndpi_en_impossible_bigrams[i], 1,
 			  1, 1, 0, 0);
+
+  /* Same tables, direct indexed for ndpi_check_dga_name() */
+  for(i = 0; ndpi_en_bigrams[i] != NULL; i++)
+    ndpi_dga_ngram_set(ndpi_str->dga_bigrams, ndpi_en_bigrams[i]);
+
+  for(i = 0; ndpi_en_trigrams[i] != NULL; i++)
+    ndpi_dga_ngram_set(ndpi_str->dga_trigrams, ndpi_en_trigrams[i]);
+
+  for(i = 0; ndpi_en_impossible_bigrams[i] != NULL; i++)
+    ndpi_dga_ngram_set(ndpi_str->dga_impossible_bigrams, ndpi_en_impossible_bigrams[i]);
 }
 
 /* ******************************************************************** */
@@ -1774,7 +2316,7 @@ static void ndpi_init_protocol_defaults(struct ndpi_detection_module_struct *ndp
 
 static int ac_match_handler(AC_MATCH_t *m, AC_TEXT_t *txt, AC_REP_t *match) {
   int min_len = (txt->length < m->patterns->length) ? txt->length : m->patterns->length;
-  char buf[64] = {'\0'}, *whatfound;
+  char buf[64] = {'\0'};
   int min_buf_len = ndpi_min(txt->length, sizeof(buf)-1);
 
   strncpy(buf, txt->astring, min_buf_len);
@@ -1788,32 +2330,8 @@ static int ac_match_handler(AC_MATCH_t *m, AC_TEXT_t *txt, AC_REP_t *match) {
 	 m->patterns->astring);
 #endif
 
-  whatfound = strstr(buf, m->patterns->astring);
-
-  if(whatfound) {
-#ifdef MATCH_DEBUG
-      if(min_len > 2)
-      printf("[NDPI] %s() [searching=%s][pattern=%s][%s][%c]\n", __FUNCTION__, buf, m->patterns->astring,
-	 whatfound, whatfound != buf ? whatfound[-1]:'?');
-#endif
-    /*
-      The patch below allows in case of pattern ws.amazon.com
-      to avoid matching aws.amazon.com whereas a.ws.amazon.com
-      has to match
-    */
-    if((whatfound != buf) && (m->patterns->astring[0] != '.') /* The searched pattern does not start with . */
-       && strchr(m->patterns->astring, '.') /* The matched pattern has a . (e.g. numeric or sym IPs) */) {
-      int len = strlen(m->patterns->astring);
-
-      if((whatfound[-1] != '.') || ((m->patterns->astring[len - 1] != '.') &&
-				    (whatfound[len] != '\0') /* endsWith does not hold here */)) {
-	return(0);
-      } else {
-	memcpy(match, &m->patterns[0].rep, sizeof(AC_REP_t)); /* Partial match? */
-	return(0); /* Keep searching as probably there is a better match */
-      }
-    }
-  }
+  if(!ndpi_host_pattern_on_label(buf, m->patterns->astring))
+    return(0);
 
   /*
     Return 1 for stopping to the first match.
@@ -2388,6 +2906,18 @@ struct ndpi_detection_module_struct *ndpi_init_detection_module(ndpi_init_prefs
 
   spin_lock_init(&ndpi_str->host_automa_lock);
   ndpi_str->host_automa.ac_automa = ac_automata_init(ac_match_handler);
+  /* Not mandatory: without it every host name lookup walks the automata */
+#ifdef __KERNEL__
+  ndpi_str->host_match_cache = alloc_percpu(struct ndpi_host_match_cache);
+#else
+  ndpi_str->host_match_cache = ndpi_calloc(1, sizeof(struct ndpi_host_match_cache));
+#endif
+  /* Same for the DGA verdicts */
+#ifdef __KERNEL__
+  ndpi_str->dga_cache = alloc_percpu(struct ndpi_dga_cache);
+#else
+  ndpi_str->dga_cache = ndpi_calloc(1, sizeof(struct ndpi_dga_cache));
+#endif
   ndpi_str->content_automa.ac_automa = ac_automata_init(ac_match_handler);
   ndpi_str->bigrams_automa.ac_automa = ac_automata_init(ac_match_handler);
   ndpi_str->impossible_bigrams_automa.ac_automa = ac_automata_init(ac_match_handler);
@@ -2453,6 +2983,8 @@ void **ndpi_get_automata(struct ndpi_detection_module_struct *ndpi_str) {
 void ndpi_finalize_initialization(struct ndpi_detection_module_struct *ndpi_str) {
   u_int i;
 
+  ndpi_host_match_cache_invalidate(ndpi_str);
+
   for(i = 0; i < 99; i++) {
     ndpi_automa *automa;
 /*
@@ -2573,6 +3105,22 @@ void *ndpi_automa_host(struct ndpi_detection_module_struct *ndpi_struct)
     return (AC_AUTOMATA_t*)ndpi_struct->host_automa.ac_automa;
 }
 
+void *ndpi_automa_host_replace(struct ndpi_detection_module_struct *ndpi_struct, void *ac_automa)
+{
+    void *old_automa, *domains;
+
+    spin_lock_bh(&ndpi_struct->host_automa_lock);
+    old_automa = ndpi_struct->host_automa.ac_automa;
+    domains = ndpi_struct->host_automa.domains;
+    ndpi_struct->host_automa.ac_automa = ac_automa;
+    ndpi_struct->host_automa.domains = NULL;
+    ndpi_host_match_cache_invalidate(ndpi_struct);
+    spin_unlock_bh(&ndpi_struct->host_automa_lock);
+
+    ndpi_domain_table_free(domains);
+    return old_automa;
+}
+
 /* ****************************************************** */
 
 int ndpi_match_string(void *_automa, char *string_to_match) {
@@ -2682,8 +3230,16 @@ int ndpi_match_custom_category(struct ndpi_detection_module_struct *ndpi_str,
                                ndpi_protocol_category_t *category) {
   ndpi_protocol_breed_t breed =0;
   u_int16_t id;
-  int rc = ndpi_match_string_protocol_id(ndpi_str->custom_categories.hostnames.ac_automa,
-					 name, name_len, &id, category, &breed);
+  AC_REP_t m = { 0, NDPI_PROTOCOL_CATEGORY_UNSPECIFIED, NDPI_PROTOCOL_UNRATED };
+  int rc;
+
+  if(ndpi_domain_match(ndpi_str->custom_categories.hostnames.domains, name, name_len, &m)) {
+    *category = m.category;
+    return((m.number != NDPI_PROTOCOL_UNKNOWN) ? 0 : -1);
+  }
+
+  rc = ndpi_match_string_protocol_id(ndpi_str->custom_categories.hostnames.ac_automa,
+				     name, name_len, &id, category, &breed);
   return(rc);
 }
 
@@ -2744,10 +3300,100 @@ static void free_ptree_data(void *data) {
 
 /* ****************************************************** */
 
+/*
+  Lookup tables built from static data and never modified once the
+  module is finalized: they can be shared by several modules (e.g. one
+  per network namespace) instead of being rebuilt by each of them.
+*/
+#define NDPI_NUM_SHARED_AUTOMA 4
+
+struct ndpi_shared_tables {
+  u_int32_t refcnt;
+  ndpi_automa automa[NDPI_NUM_SHARED_AUTOMA];
+};
+
+static ndpi_automa *ndpi_shared_automa(struct ndpi_detection_module_struct *ndpi_str, u_int i) {
+  switch(i) {
+  case 0:  return(&ndpi_str->content_automa);
+  case 1:  return(&ndpi_str->bigrams_automa);
+  case 2:  return(&ndpi_str->trigrams_automa);
+  default: return(&ndpi_str->impossible_bigrams_automa);
+  }
+}
+
+/* ****************************************************** */
+
+struct ndpi_shared_tables *ndpi_get_shared_tables(struct ndpi_detection_module_struct *ndpi_str) {
+  struct ndpi_shared_tables *t = ndpi_str->shared_tables;
+  u_int i;
+
+  if(t == NULL) {
+    if((t = (struct ndpi_shared_tables *)ndpi_calloc(1, sizeof(*t))) == NULL)
+      return(NULL);
+
+    for(i = 0; i < NDPI_NUM_SHARED_AUTOMA; i++)
+      t->automa[i] = *ndpi_shared_automa(ndpi_str, i);
+
+    t->refcnt = 1; /* ndpi_str */
+    ndpi_str->shared_tables = t;
+  }
+
+  t->refcnt++;
+  return(t);
+}
+
+/* ****************************************************** */
+
+int ndpi_use_shared_tables(struct ndpi_detection_module_struct *ndpi_str, struct ndpi_shared_tables *t) {
+  u_int i;
+
+  if(ndpi_str->shared_tables != NULL)
+    return((ndpi_str->shared_tables == t) ? 0 : -1);
+
+  for(i = 0; i < NDPI_NUM_SHARED_AUTOMA; i++) {
+    ndpi_automa *automa = ndpi_shared_automa(ndpi_str, i);
+
+    if(automa->ac_automa != NULL)
+      ac_automata_release((AC_AUTOMATA_t*)automa->ac_automa, 0);
+
+    *automa = t->automa[i];
+  }
+
+  t->refcnt++;
+  ndpi_str->shared_tables = t;
+  return(0);
+}
+
+/* ****************************************************** */
+
+void ndpi_put_shared_tables(struct ndpi_shared_tables *t) {
+  u_int i;
+
+  if((t == NULL) || (--t->refcnt > 0))
+    return;
+
+  for(i = 0; i < NDPI_NUM_SHARED_AUTOMA; i++)
+    if(t->automa[i].ac_automa != NULL)
+      ac_automata_release((AC_AUTOMATA_t*)t->automa[i].ac_automa, 0);
+
+  ndpi_free(t);
+}
+
+/* ****************************************************** */
+
 void ndpi_exit_detection_module(struct ndpi_detection_module_struct *ndpi_str) {
   if(ndpi_str != NULL) {
     int i;
 
+    if(ndpi_str->shared_tables != NULL) {
+      /* Released with the last reference, not here */
+      for(i = 0; i < NDPI_NUM_SHARED_AUTOMA; i++)
+	ndpi_shared_automa(ndpi_str, i)->ac_automa = NULL;
+
+      ndpi_put_shared_tables(ndpi_str->shared_tables);
+      ndpi_str->shared_tables = NULL;
+    }
+
     for (i = 0; i < (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS); i++) {
       if (ndpi_str->proto_defaults[i].protoName)
         ndpi_free(ndpi_str->proto_defaults[i].protoName);
@@ -2771,12 +3417,41 @@ void ndpi_exit_detection_module(struct ndpi_detection_module_struct *ndpi_str) {
     if(ndpi_str->tls_cert_cache)
       ndpi_lru_free_cache(ndpi_str->tls_cert_cache);
 
+#ifndef __KERNEL__
+    if(ndpi_str->tls_cert_info_cache)
+      ndpi_tls_cert_info_cache_free(ndpi_str->tls_cert_info_cache);
+#endif
+
     if(ndpi_str->mining_cache)
       ndpi_lru_free_cache(ndpi_str->mining_cache);
 
     if(ndpi_str->msteams_cache)
       ndpi_lru_free_cache(ndpi_str->msteams_cache);
 
+    if(ndpi_str->dga_cache)
+#ifdef __KERNEL__
+      free_percpu(ndpi_str->dga_cache);
+#else
+      ndpi_free(ndpi_str->dga_cache);
+#endif
+
+    if(ndpi_str->host_match_cache)
+#ifdef __KERNEL__
+      free_percpu(ndpi_str->host_match_cache);
+#else
+      ndpi_free(ndpi_str->host_match_cache);
+#endif
+
+    if(ndpi_str->detection_budget)
+      ndpi_free(ndpi_str->detection_budget);
+
+    if(ndpi_str->detection_stats)
+#ifdef __KERNEL__
+      free_percpu(ndpi_str->detection_stats);
+#else
+      ndpi_free(ndpi_str->detection_stats);
+#endif
+
     if(ndpi_str->protocols_ptree)
       ndpi_patricia_destroy((ndpi_patricia_tree_t *) ndpi_str->protocols_ptree, free_ptree_data);
 
@@ -2794,6 +3469,8 @@ void ndpi_exit_detection_module(struct ndpi_detection_module_struct *ndpi_str) {
 #endif
 		      );
 
+    ndpi_domain_table_free(ndpi_str->host_automa.domains);
+
     if(ndpi_str->content_automa.ac_automa != NULL)
       ac_automata_release((AC_AUTOMATA_t*)ndpi_str->content_automa.ac_automa,0);
 
@@ -2830,6 +3507,9 @@ void ndpi_exit_detection_module(struct ndpi_detection_module_struct *ndpi_str) {
       ac_automata_release((AC_AUTOMATA_t*)ndpi_str->custom_categories.hostnames_shadow.ac_automa,
 		          1 /* free patterns strings memory */);
 
+    ndpi_domain_table_free(ndpi_str->custom_categories.hostnames.domains);
+    ndpi_domain_table_free(ndpi_str->custom_categories.hostnames_shadow.domains);
+
     if(ndpi_str->custom_categories.ipAddresses != NULL)
       ndpi_patricia_destroy((ndpi_patricia_tree_t *) ndpi_str->custom_categories.ipAddresses, free_ptree_data);
 
@@ -3200,6 +3880,7 @@ static int ndpi_load_risky_domain(struct ndpi_detection_module_struct *ndpi_str,
     snprintf(buf, sizeof(buf)-1, "%s", domain_name);
     for(i = 0, len = strlen(buf)-1 /* Skip $ */; i < len; i++) buf[i] = tolower(buf[i]);
 
+    ndpi_host_match_cache_invalidate(ndpi_str);
     return(ndpi_add_string_to_automa_atend(ndpi_str->risky_domain_automa.ac_automa, buf));
   }
 
@@ -3515,609 +4196,144 @@ void ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *n
   /* set this here to zero to be interrupt safe */
   ndpi_str->callback_buffer_size = 0;
 
-  /* HTTP */
-  init_http_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* STARCRAFT */
-  init_starcraft_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TLS+DTLS */
-  init_tls_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* STUN */
-  init_stun_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RTP */
-  init_rtp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RTSP */
-  init_rtsp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RDP */
-  init_rdp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SIP */
-  init_sip_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* IMO */
-  init_imo_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Teredo */
-  init_teredo_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* EDONKEY */
-  init_edonkey_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FASTTRACK */
-  init_fasttrack_dissector(ndpi_str, &a, detection_bitmask);
+#define NDPI_DISSECTOR(name) init_##name##_dissector(ndpi_str, &a, detection_bitmask);
+#ifdef NDPI_PROTOCOL_PROFILE
+#include "ndpi_dissectors_profile.inc"
+#else
+#include "ndpi_dissectors.inc"
+#endif
+#undef NDPI_DISSECTOR
 
-  /* GNUTELLA */
-  init_gnutella_dissector(ndpi_str, &a, detection_bitmask);
+#ifdef CUSTOM_NDPI_PROTOCOLS
+#include "../../../nDPI-custom/custom_ndpi_main_init.c"
+#endif
 
-  /* DIRECTCONNECT */
-  init_directconnect_dissector(ndpi_str, &a, detection_bitmask);
+  /* ----------------------------------------------------------------- */
 
-  /* NATS */
-  init_nats_dissector(ndpi_str, &a, detection_bitmask);
+  ndpi_str->callback_buffer_size = a;
 
-  /* APPLEJUICE */
-  init_applejuice_dissector(ndpi_str, &a, detection_bitmask);
+  NDPI_LOG_DBG2(ndpi_str, "callback_buffer_size is %u\n", ndpi_str->callback_buffer_size);
 
-  /* SOULSEEK */
-  init_soulseek_dissector(ndpi_str, &a, detection_bitmask);
+  /* now build the specific buffer for tcp, udp and non_tcp_udp */
+  ndpi_str->callback_buffer_size_tcp_payload = 0;
+  ndpi_str->callback_buffer_size_tcp_no_payload = 0;
+  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
+    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
+	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
+	 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0) {
+      if(_ndpi_debug_callbacks)
+	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_tcp_payload, adding buffer %u as entry %u\n", a,
+		      ndpi_str->callback_buffer_size_tcp_payload);
 
-  /* SOCKS */
-  init_socks_dissector(ndpi_str, &a, detection_bitmask);
+      memcpy(&ndpi_str->callback_buffer_tcp_payload[ndpi_str->callback_buffer_size_tcp_payload],
+	     &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+      ndpi_str->callback_buffer_size_tcp_payload++;
 
-  /* IRC */
-  init_irc_dissector(ndpi_str, &a, detection_bitmask);
+      if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_HAS_PAYLOAD) ==
+	 0) {
+	if(_ndpi_debug_callbacks)
+	  NDPI_LOG_DBG2(
+                        ndpi_str,
+                        "\tcallback_buffer_tcp_no_payload, additional adding buffer %u to no_payload process\n", a);
 
-  /* JABBER */
-  init_jabber_dissector(ndpi_str, &a, detection_bitmask);
+	memcpy(&ndpi_str->callback_buffer_tcp_no_payload[ndpi_str->callback_buffer_size_tcp_no_payload],
+	       &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+	ndpi_str->callback_buffer_size_tcp_no_payload++;
+      }
+    }
+  }
 
-  /* MAIL_POP */
-  init_mail_pop_dissector(ndpi_str, &a, detection_bitmask);
+  ndpi_str->callback_buffer_size_udp = 0;
+  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
+    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
+	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
+	 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0) {
+      if(_ndpi_debug_callbacks)
+	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_size_udp: adding buffer : %u as entry %u\n", a,
+		      ndpi_str->callback_buffer_size_udp);
 
-  /* MAIL_IMAP */
-  init_mail_imap_dissector(ndpi_str, &a, detection_bitmask);
+      memcpy(&ndpi_str->callback_buffer_udp[ndpi_str->callback_buffer_size_udp], &ndpi_str->callback_buffer[a],
+	     sizeof(struct ndpi_call_function_struct));
+      ndpi_str->callback_buffer_size_udp++;
+    }
+  }
 
-  /* MAIL_SMTP */
-  init_mail_smtp_dissector(ndpi_str, &a, detection_bitmask);
+  ndpi_str->callback_buffer_size_non_tcp_udp = 0;
+  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
+    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
+	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
+	 NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP)) == 0 ||
+       (ndpi_str->callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC) !=
+       0) {
+      if(_ndpi_debug_callbacks)
+	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_non_tcp_udp: adding buffer : %u as entry %u\n", a,
+		      ndpi_str->callback_buffer_size_non_tcp_udp);
 
-  /* USENET */
-  init_usenet_dissector(ndpi_str, &a, detection_bitmask);
+      memcpy(&ndpi_str->callback_buffer_non_tcp_udp[ndpi_str->callback_buffer_size_non_tcp_udp],
+	     &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+      ndpi_str->callback_buffer_size_non_tcp_udp++;
+    }
+  }
+}
 
-  /* DNS */
-  init_dns_dissector(ndpi_str, &a, detection_bitmask);
+/* handle extension headers in IPv6 packets
+ * arguments:
+ * 	l4ptr: pointer to the byte following the initial IPv6 header
+ * 	l4len: the length of the IPv6 packet excluding the IPv6 header
+ * 	nxt_hdr: next header value from the IPv6 header
+ * result:
+ * 	l4ptr: pointer to the start of the actual packet payload
+ * 	l4len: length of the actual payload
+ * 	nxt_hdr: protocol of the actual payload
+ * returns 0 upon success and 1 upon failure
+ */
+int ndpi_handle_ipv6_extension_headers(struct ndpi_detection_module_struct *ndpi_str, const u_int8_t **l4ptr,
+                                       u_int16_t *l4len, u_int8_t *nxt_hdr) {
+  while((*nxt_hdr == 0 || *nxt_hdr == 43 || *nxt_hdr == 44 || *nxt_hdr == 60 || *nxt_hdr == 135 || *nxt_hdr == 59)) {
+    u_int16_t ehdr_len;
 
-  /* VMWARE */
-  init_vmware_dissector(ndpi_str, &a, detection_bitmask);
+    // no next header
+    if(*nxt_hdr == 59) {
+      return(1);
+    }
 
-  /* NON_TCP_UDP */
-  init_non_tcp_udp_dissector(ndpi_str, &a, detection_bitmask);
+    // fragment extension header has fixed size of 8 bytes and the first byte is the next header type
+    if(*nxt_hdr == 44) {
+      if(*l4len < 8) {
+	return(1);
+      }
 
-  /* SOPCAST */
-  init_sopcast_dissector(ndpi_str, &a, detection_bitmask);
+      *nxt_hdr = (*l4ptr)[0];
+      *l4len -= 8;
+      (*l4ptr) += 8;
+      continue;
+    }
 
-  /* TVUPLAYER */
-  init_tvuplayer_dissector(ndpi_str, &a, detection_bitmask);
+    // the other extension headers have one byte for the next header type
+    // and one byte for the extension header length in 8 byte steps minus the first 8 bytes
+    if(*l4len < 2) {
+      return(1);
+    }
 
-  /* PPSTREAM */
-  init_ppstream_dissector(ndpi_str, &a, detection_bitmask);
+    ehdr_len = (*l4ptr)[1];
+    ehdr_len *= 8;
+    ehdr_len += 8;
 
-  /* IAX */
-  init_iax_dissector(ndpi_str, &a, detection_bitmask);
+    if(*l4len < ehdr_len) {
+      return(1);
+    }
 
-  /* MGPC */
-  init_mgpc_dissector(ndpi_str, &a, detection_bitmask);
+    *nxt_hdr = (*l4ptr)[0];
 
-  /* ZATTOO */
-  init_zattoo_dissector(ndpi_str, &a, detection_bitmask);
+    if(*l4len < ehdr_len)
+      return(1);
 
-  /* QQ */
-  init_qq_dissector(ndpi_str, &a, detection_bitmask);
+    *l4len -= ehdr_len;
+    (*l4ptr) += ehdr_len;
+  }
 
-  /* SSH */
-  init_ssh_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AYIYA */
-  init_ayiya_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* THUNDER */
-  init_thunder_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* VNC */
-  init_vnc_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TEAMVIEWER */
-  init_teamviewer_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DHCP */
-  init_dhcp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* STEAM */
-  init_steam_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* HALFLIFE2 */
-  init_halflife2_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* XBOX */
-  init_xbox_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SMB */
-  init_smb_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MINING */
-  init_mining_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TELNET */
-  init_telnet_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NTP */
-  init_ntp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NFS */
-  init_nfs_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SSDP */
-  init_ssdp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WORLD_OF_WARCRAFT */
-  init_world_of_warcraft_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* POSTGRES */
-  init_postgres_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MYSQL */
-  init_mysql_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* BGP */
-  init_bgp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SNMP */
-  init_snmp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* KONTIKI */
-  init_kontiki_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* ICECAST */
-  init_icecast_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SHOUTCAST */
-  init_shoutcast_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* KERBEROS */
-  init_kerberos_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* OPENFT */
-  init_openft_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SYSLOG */
-  init_syslog_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DIRECT_DOWNLOAD_LINK */
-  init_directdownloadlink_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NETBIOS */
-  init_netbios_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* IPP */
-  init_ipp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* LDAP */
-  init_ldap_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WARCRAFT3 */
-  init_warcraft3_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* XDMCP */
-  init_xdmcp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TFTP */
-  init_tftp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MSSQL_TDS */
-  init_mssql_tds_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* PPTP */
-  init_pptp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* STEALTHNET */
-  init_stealthnet_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DHCPV6 */
-  init_dhcpv6_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AFP */
-  init_afp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* check_mk */
-  init_checkmk_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* cpha */
-  init_cpha_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AIMINI */
-  init_aimini_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FLORENSIA */
-  init_florensia_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MAPLESTORY */
-  init_maplestory_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DOFUS */
-  init_dofus_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WORLD_OF_KUNG_FU */
-  init_world_of_kung_fu_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FIESTA */
-  init_fiesta_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CROSSIFIRE */
-  init_crossfire_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* GUILDWARS */
-  init_guildwars_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* ARMAGETRON */
-  init_armagetron_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DROPBOX */
-  init_dropbox_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SPOTIFY */
-  init_spotify_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RADIUS */
-  init_radius_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CITRIX */
-  init_citrix_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* LOTUS_NOTES */
-  init_lotus_notes_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* GTP */
-  init_gtp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DCERPC */
-  init_dcerpc_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NETFLOW */
-  init_netflow_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SFLOW */
-  init_sflow_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* H323 */
-  init_h323_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* OPENVPN */
-  init_openvpn_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NOE */
-  init_noe_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CISCOVPN */
-  init_ciscovpn_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TEAMSPEAK */
-  init_teamspeak_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SKINNY */
-  init_skinny_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RTCP */
-  init_rtcp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RSYNC */
-  init_rsync_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WHOIS_DAS */
-  init_whois_das_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* ORACLE */
-  init_oracle_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CORBA */
-  init_corba_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RTMP */
-  init_rtmp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FTP_CONTROL */
-  init_ftp_control_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FTP_DATA */
-  init_ftp_data_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MEGACO */
-  init_megaco_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* REDIS */
-  init_redis_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* VHUA */
-  init_vhua_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* ZMQ */
-  init_zmq_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TELEGRAM */
-  init_telegram_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* QUIC */
-  init_quic_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DIAMETER */
-  init_diameter_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* APPLE_PUSH */
-  init_apple_push_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* EAQ */
-  init_eaq_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* KAKAOTALK_VOICE */
-  init_kakaotalk_voice_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MPEGTS */
-  init_mpegts_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* UBNTAC2 */
-  init_ubntac2_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* COAP */
-  init_coap_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MQTT */
-  init_mqtt_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SOME/IP */
-  init_someip_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* RX */
-  init_rx_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* GIT */
-  init_git_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* HANGOUT */
-  init_hangout_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DRDA */
-  init_drda_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* BJNP */
-  init_bjnp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SMPP */
-  init_smpp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* TINC */
-  init_tinc_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* FIX */
-  init_fix_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* NINTENDO */
-  init_nintendo_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MODBUS */
-  init_modbus_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CAPWAP */
-  init_capwap_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* ZABBIX */
-  init_zabbix_dissector(ndpi_str, &a, detection_bitmask);
-
-  /*** Put false-positive sensitive protocols at the end ***/
-
-  /* VIBER */
-  init_viber_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SKYPE */
-  init_skype_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* BITTORRENT */
-  init_bittorrent_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WHATSAPP */
-  init_whatsapp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* OOKLA */
-  init_ookla_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AMQP */
-  init_amqp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* CSGO */
-  init_csgo_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* LISP */
-  init_lisp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AJP */
-  init_ajp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Memcached */
-  init_memcached_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Nest Log Sink */
-  init_nest_log_sink_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WireGuard VPN */
-  init_wireguard_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Amazon_Video */
-  init_amazon_video_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Targus Getdata */
-  init_targus_getdata_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* S7 comm */
-  init_s7comm_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* IEC 60870-5-104 */
-  init_104_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DNP3 */
-  init_dnp3_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* WEBSOCKET */
-  init_websocket_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* SOAP */
-  init_soap_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* DNScrypt */
-  init_dnscrypt_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* MongoDB */
-  init_mongodb_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* AmongUS */
-  init_among_us_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* HP Virtual Machine Group Management */
-  init_hpvirtgrp_dissector(ndpi_str, &a, detection_bitmask);
-
-  /* Genshin Impact */
-  init_genshin_impact_dissector(ndpi_str, &a, detection_bitmask);
-
-#ifdef CUSTOM_NDPI_PROTOCOLS
-#include "../../../nDPI-custom/custom_ndpi_main_init.c"
-#endif
-
-  /* ----------------------------------------------------------------- */
-
-  ndpi_str->callback_buffer_size = a;
-
-  NDPI_LOG_DBG2(ndpi_str, "callback_buffer_size is %u\n", ndpi_str->callback_buffer_size);
-
-  /* now build the specific buffer for tcp, udp and non_tcp_udp */
-  ndpi_str->callback_buffer_size_tcp_payload = 0;
-  ndpi_str->callback_buffer_size_tcp_no_payload = 0;
-  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
-    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
-	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
-	 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0) {
-      if(_ndpi_debug_callbacks)
-	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_tcp_payload, adding buffer %u as entry %u\n", a,
-		      ndpi_str->callback_buffer_size_tcp_payload);
-
-      memcpy(&ndpi_str->callback_buffer_tcp_payload[ndpi_str->callback_buffer_size_tcp_payload],
-	     &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-      ndpi_str->callback_buffer_size_tcp_payload++;
-
-      if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_HAS_PAYLOAD) ==
-	 0) {
-	if(_ndpi_debug_callbacks)
-	  NDPI_LOG_DBG2(
-                        ndpi_str,
-                        "\tcallback_buffer_tcp_no_payload, additional adding buffer %u to no_payload process\n", a);
-
-	memcpy(&ndpi_str->callback_buffer_tcp_no_payload[ndpi_str->callback_buffer_size_tcp_no_payload],
-	       &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-	ndpi_str->callback_buffer_size_tcp_no_payload++;
-      }
-    }
-  }
-
-  ndpi_str->callback_buffer_size_udp = 0;
-  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
-    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
-	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
-	 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0) {
-      if(_ndpi_debug_callbacks)
-	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_size_udp: adding buffer : %u as entry %u\n", a,
-		      ndpi_str->callback_buffer_size_udp);
-
-      memcpy(&ndpi_str->callback_buffer_udp[ndpi_str->callback_buffer_size_udp], &ndpi_str->callback_buffer[a],
-	     sizeof(struct ndpi_call_function_struct));
-      ndpi_str->callback_buffer_size_udp++;
-    }
-  }
-
-  ndpi_str->callback_buffer_size_non_tcp_udp = 0;
-  for(a = 0; a < ndpi_str->callback_buffer_size; a++) {
-    if((ndpi_str->callback_buffer[a].ndpi_selection_bitmask &
-	(NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP | NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
-	 NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP)) == 0 ||
-       (ndpi_str->callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC) !=
-       0) {
-      if(_ndpi_debug_callbacks)
-	NDPI_LOG_DBG2(ndpi_str, "callback_buffer_non_tcp_udp: adding buffer : %u as entry %u\n", a,
-		      ndpi_str->callback_buffer_size_non_tcp_udp);
-
-      memcpy(&ndpi_str->callback_buffer_non_tcp_udp[ndpi_str->callback_buffer_size_non_tcp_udp],
-	     &ndpi_str->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-      ndpi_str->callback_buffer_size_non_tcp_udp++;
-    }
-  }
-}
-
-/* handle extension headers in IPv6 packets
- * arguments:
- * 	l4ptr: pointer to the byte following the initial IPv6 header
- * 	l4len: the length of the IPv6 packet excluding the IPv6 header
- * 	nxt_hdr: next header value from the IPv6 header
- * result:
- * 	l4ptr: pointer to the start of the actual packet payload
- * 	l4len: length of the actual payload
- * 	nxt_hdr: protocol of the actual payload
- * returns 0 upon success and 1 upon failure
- */
-int ndpi_handle_ipv6_extension_headers(struct ndpi_detection_module_struct *ndpi_str, const u_int8_t **l4ptr,
-                                       u_int16_t *l4len, u_int8_t *nxt_hdr) {
-  while((*nxt_hdr == 0 || *nxt_hdr == 43 || *nxt_hdr == 44 || *nxt_hdr == 60 || *nxt_hdr == 135 || *nxt_hdr == 59)) {
-    u_int16_t ehdr_len;
-
-    // no next header
-    if(*nxt_hdr == 59) {
-      return(1);
-    }
-
-    // fragment extension header has fixed size of 8 bytes and the first byte is the next header type
-    if(*nxt_hdr == 44) {
-      if(*l4len < 8) {
-	return(1);
-      }
-
-      *nxt_hdr = (*l4ptr)[0];
-      *l4len -= 8;
-      (*l4ptr) += 8;
-      continue;
-    }
-
-    // the other extension headers have one byte for the next header type
-    // and one byte for the extension header length in 8 byte steps minus the first 8 bytes
-    if(*l4len < 2) {
-      return(1);
-    }
-
-    ehdr_len = (*l4ptr)[1];
-    ehdr_len *= 8;
-    ehdr_len += 8;
-
-    if(*l4len < ehdr_len) {
-      return(1);
-    }
-
-    *nxt_hdr = (*l4ptr)[0];
-
-    if(*l4len < ehdr_len)
-      return(1);
-
-    *l4len -= ehdr_len;
-    (*l4ptr) += ehdr_len;
-  }
-
-  return(0);
-}
+  return(0);
+}
 
 static u_int8_t ndpi_iph_is_valid_and_not_fragmented(const struct ndpi_iphdr *iph, const u_int16_t ipsize) {
   /*
@@ -4245,8 +4461,8 @@ void ndpi_free_flow_data(struct ndpi_flow_struct* flow) {
     if(flow->http.user_agent)
       ndpi_free(flow->http.user_agent);
 
-    if(flow->kerberos_buf.pktbuf)
-      ndpi_free(flow->kerberos_buf.pktbuf);
+    if(flow->kerberos_buf.buffer)
+      ndpi_free(flow->kerberos_buf.buffer);
 
     if(flow_is_proto(flow, NDPI_PROTOCOL_QUIC) ||
        flow_is_proto(flow, NDPI_PROTOCOL_TLS) ||
@@ -4277,6 +4493,11 @@ void ndpi_free_flow_data(struct ndpi_flow_struct* flow) {
       if(flow->l4.tcp.tls.message.buffer)
 	ndpi_free(flow->l4.tcp.tls.message.buffer);
     }
+
+    /* Give back what ndpi_flow_data_malloc() charged to this flow */
+    ndpi_mem_account(NDPI_MEM_BUFFER, -(int64_t)flow->mem_buffer);
+    ndpi_mem_account(NDPI_MEM_METADATA, -(int64_t)flow->mem_metadata);
+    flow->mem_buffer = flow->mem_metadata = 0;
   }
 }
 
@@ -4564,150 +4785,488 @@ static u_int32_t check_ndpi_detection_func(struct ndpi_detection_module_struct *
 	}
     }
 
-  if (flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
-    {
-      for (a = 0; a < callback_buffer_size; a++) {
-        if ((func != callback_buffer[a].func) &&
-            (callback_buffer[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	    callback_buffer[a].ndpi_selection_bitmask &&
-            NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-                                 callback_buffer[a].excluded_protocol_bitmask) == 0 &&
-            NDPI_BITMASK_COMPARE(callback_buffer[a].detection_bitmask,
-                                 detection_bitmask) != 0)
-	  {
-	    callback_buffer[a].func(ndpi_str, flow);
-	    num_calls++;
+  if (flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
+    {
+      for (a = 0; a < callback_buffer_size; a++) {
+        if ((func != callback_buffer[a].func) &&
+            (callback_buffer[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	    callback_buffer[a].ndpi_selection_bitmask &&
+            NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
+                                 callback_buffer[a].excluded_protocol_bitmask) == 0 &&
+            NDPI_BITMASK_COMPARE(callback_buffer[a].detection_bitmask,
+                                 detection_bitmask) != 0)
+	  {
+	    callback_buffer[a].func(ndpi_str, flow);
+	    num_calls++;
+
+	    if (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
+	      {
+		break; /* Stop after the first detected protocol. */
+	      }
+	  }
+      }
+    }
+
+  /* Check for subprotocols. */
+  for (a = 0; a < ndpi_str->proto_defaults[flow->detected_protocol_stack[0]].subprotocol_count; a++)
+    {
+      u_int16_t subproto_index;
+      u_int16_t subproto_id = ndpi_str->proto_defaults[flow->detected_protocol_stack[0]].subprotocols[a];
+      if (subproto_id == (uint16_t)NDPI_PROTOCOL_MATCHED_BY_CONTENT)
+	{
+	  continue;
+	}
+
+      subproto_index = ndpi_str->proto_defaults[subproto_id].protoIdx;
+      if ((func != ndpi_str->proto_defaults[subproto_id].func) &&
+          (ndpi_str->callback_buffer[subproto_index].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	  ndpi_str->callback_buffer[subproto_index].ndpi_selection_bitmask &&
+          NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
+                               ndpi_str->callback_buffer[subproto_index].excluded_protocol_bitmask) == 0 &&
+          NDPI_BITMASK_COMPARE(ndpi_str->callback_buffer[subproto_index].detection_bitmask,
+                               detection_bitmask) != 0)
+	{
+	  ndpi_str->callback_buffer[subproto_index].func(ndpi_str, flow);
+	  num_calls++;
+	}
+
+      if (flow->detected_protocol_stack[1] != NDPI_PROTOCOL_UNKNOWN)
+	{
+	  break; /* Stop after the first detected subprotocol. */
+	}
+    }
+
+  return num_calls;
+}
+
+/* ************************************************ */
+
+u_int32_t check_ndpi_other_flow_func(struct ndpi_detection_module_struct *ndpi_str,
+				     struct ndpi_flow_struct *flow,
+				     NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
+{
+  return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
+				   ndpi_str->callback_buffer_non_tcp_udp,
+				   ndpi_str->callback_buffer_size_non_tcp_udp);
+}
+
+/* ************************************************ */
+
+static u_int32_t check_ndpi_udp_flow_func(struct ndpi_detection_module_struct *ndpi_str,
+					  struct ndpi_flow_struct *flow,
+					  NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
+{
+  return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
+				   ndpi_str->callback_buffer_udp,
+				   ndpi_str->callback_buffer_size_udp);
+}
+
+/* ************************************************ */
+
+static u_int32_t check_ndpi_tcp_flow_func(struct ndpi_detection_module_struct *ndpi_str,
+					  struct ndpi_flow_struct *flow,
+					  NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
+{
+  if (flow->packet.payload_packet_len != 0) {
+    return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
+				     ndpi_str->callback_buffer_tcp_payload,
+				     ndpi_str->callback_buffer_size_tcp_payload);
+  } else {
+    /* no payload */
+    return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
+				     ndpi_str->callback_buffer_tcp_no_payload,
+				     ndpi_str->callback_buffer_size_tcp_no_payload);
+  }
+}
+
+/* ********************************************************************************* */
+
+u_int32_t ndpi_check_flow_func(struct ndpi_detection_module_struct *ndpi_str,
+			       struct ndpi_flow_struct *flow,
+			       NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet) {
+  if(!flow)
+    return(0);
+  else if(flow->packet.tcp != NULL)
+    return(check_ndpi_tcp_flow_func(ndpi_str, flow, ndpi_selection_packet));
+  else if(flow->packet.udp != NULL)
+    return(check_ndpi_udp_flow_func(ndpi_str, flow, ndpi_selection_packet));
+  else
+    return(check_ndpi_other_flow_func(ndpi_str, flow, ndpi_selection_packet));
+}
+
+/* ********************************************************************************* */
+
+u_int16_t ndpi_guess_host_protocol_id(struct ndpi_detection_module_struct *ndpi_str,
+				      struct ndpi_flow_struct *flow) {
+  u_int16_t ret = NDPI_PROTOCOL_UNKNOWN;
+
+  if(flow->packet.iph) {
+    struct in_addr addr;
+    u_int16_t sport, dport;
+
+    addr.s_addr = flow->packet.iph->saddr;
+
+    if((flow->l4_proto == IPPROTO_TCP) && flow->packet.tcp)
+      sport = flow->packet.tcp->source, dport = flow->packet.tcp->dest;
+    else if((flow->l4_proto == IPPROTO_UDP) && flow->packet.udp)
+      sport = flow->packet.udp->source, dport = flow->packet.udp->dest;
+    else
+      sport = dport = 0;
+
+    /* guess host protocol */
+    ret = ndpi_network_port_ptree_match(ndpi_str, &addr, sport);
+
+    if(ret == NDPI_PROTOCOL_UNKNOWN) {
+      addr.s_addr = flow->packet.iph->daddr;
+      ret = ndpi_network_port_ptree_match(ndpi_str, &addr, dport);
+    }
+  }
+
+  return(ret);
+}
+
+/* ********************************************************************************* */
+
+#define NDPI_DETECTION_STATS_SIZE \
+  (sizeof(struct ndpi_detection_stats) * (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS))
+
+int ndpi_enable_detection_stats(struct ndpi_detection_module_struct *ndpi_str) {
+  if(ndpi_str->detection_stats != NULL)
+    return(0);
+
+#ifdef __KERNEL__
+  /* One copy per cpu, below the per cpu allocator limit (32 KB) */
+  ndpi_str->detection_stats = __alloc_percpu(NDPI_DETECTION_STATS_SIZE,
+					     __alignof__(struct ndpi_detection_stats));
+#else
+  ndpi_str->detection_stats = ndpi_calloc(1, NDPI_DETECTION_STATS_SIZE);
+#endif
+
+  return(ndpi_str->detection_stats ? 0 : -1);
+}
+
+/* ********************************************************************************* */
+
+int ndpi_get_detection_stats(struct ndpi_detection_module_struct *ndpi_str,
+			     u_int16_t proto_id, struct ndpi_detection_stats *stats) {
+  if((ndpi_str->detection_stats == NULL)
+     || (proto_id >= (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS)))
+    return(-1);
+
+#ifdef __KERNEL__
+  {
+    u_int32_t *s = (u_int32_t *)stats;
+    int cpu, i;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+      const u_int32_t *c = (const u_int32_t *)&per_cpu_ptr(ndpi_str->detection_stats, cpu)[proto_id];
+
+      for(i = 0; i < sizeof(*stats) / sizeof(u_int32_t); i++)
+	s[i] += c[i];
+    }
+  }
+#else
+  memcpy(stats, &ndpi_str->detection_stats[proto_id], sizeof(*stats));
+#endif
+
+  return(0);
+}
+
+/* ********************************************************************************* */
+
+void ndpi_reset_detection_stats(struct ndpi_detection_module_struct *ndpi_str) {
+  if(ndpi_str->detection_stats == NULL)
+    return;
+
+#ifdef __KERNEL__
+  {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+      memset(per_cpu_ptr(ndpi_str->detection_stats, cpu), 0, NDPI_DETECTION_STATS_SIZE);
+  }
+#else
+  memset(ndpi_str->detection_stats, 0, NDPI_DETECTION_STATS_SIZE);
+#endif
+}
+
+/* ********************************************************************************* */
+
+const char* ndpi_detection_method2str(ndpi_detection_method method) {
+  switch(method) {
+  case ndpi_detection_by_dpi:              return("dpi");
+  case ndpi_detection_by_guess:            return("guess");
+  case ndpi_detection_by_giveup:           return("giveup");
+  case ndpi_detection_unknown:             return("unknown");
+  case ndpi_detection_by_extra_dissection: return("extra");
+  default:                                 return("???");
+  }
+}
+
+/* ********************************************************************************* */
+
+/*
+  Adaptive detection budgets (ndpi_set_detection_budget()): log2 histograms
+  of the packets each protocol, and the flows of each port, needed to be
+  detected, and of the extra packets each protocol dissected
+*/
+#define NDPI_BUDGET_PORT_SLOTS    1024    /* (l4 proto, port) hash, no chaining */
+#define NDPI_BUDGET_MIN_SAMPLES   32      /* before a budget is learnt */
+#define NDPI_BUDGET_MIN_ALL       1024    /* before never detected protocols get the overall budget */
+#define NDPI_BUDGET_MAX_SAMPLES   65536   /* then the bins are halved (aging) */
+#define NDPI_BUDGET_MIN_PKTS      8
+#define NDPI_BUDGET_MIN_EXTRA     4
+#define NDPI_BUDGET_NOT_DONE      0xFFFF  /* extra dissection stopped before completion */
+
+struct ndpi_budget_bins {
+  u_int32_t pkts[NDPI_DETECTION_PKT_BINS];
+  u_int32_t num_samples;
+  u_int16_t budget; /* 0 until learnt or if the protocol may need more than 64 packets */
+};
+
+struct ndpi_budget_port {
+  u_int16_t port;
+  u_int8_t l4_proto;
+  struct ndpi_budget_bins bins;
+};
+
+struct ndpi_detection_budget {
+  u_int16_t max_tcp_pkts, max_udp_pkts;
+  struct ndpi_budget_bins all; /* All the protocols */
+  struct ndpi_budget_bins proto[NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS];
+  struct ndpi_budget_bins extra[NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS];
+  struct ndpi_budget_port port[NDPI_BUDGET_PORT_SLOTS];
+};
+
+/* 1, 2, <=4, ... <=64, >64 */
+static inline u_int32_t ndpi_detection_pkt_bin(u_int32_t num_pkts) {
+  u_int32_t bin;
+
+  for(bin = 0; (bin < NDPI_DETECTION_PKT_BINS-1) && (num_pkts > (1u << bin)); bin++)
+    ;
+
+  return(bin);
+}
+
+/* ********************************************************************************* */
+
+int ndpi_set_detection_budget(struct ndpi_detection_module_struct *ndpi_str,
+			      u_int16_t max_tcp_pkts, u_int16_t max_udp_pkts) {
+  if(ndpi_str->detection_budget == NULL) {
+    if((ndpi_str->detection_budget = ndpi_calloc(1, sizeof(struct ndpi_detection_budget))) == NULL)
+      return(-1);
+  }
+
+  ndpi_str->detection_budget->max_tcp_pkts = max_tcp_pkts;
+  ndpi_str->detection_budget->max_udp_pkts = max_udp_pkts;
+
+  return(0);
+}
+
+/* ********************************************************************************* */
+
+/* The budget is twice the upper bound of the bin holding the 99th percentile */
+static void ndpi_budget_learn(struct ndpi_budget_bins *b, u_int32_t num_pkts, u_int16_t min_budget) {
+  u_int32_t bin, sum = 0, target;
+
+  b->pkts[ndpi_detection_pkt_bin(num_pkts)]++;
+
+  if(++b->num_samples >= NDPI_BUDGET_MAX_SAMPLES) {
+    for(bin = 0, b->num_samples = 0; bin < NDPI_DETECTION_PKT_BINS; bin++)
+      b->pkts[bin] /= 2, b->num_samples += b->pkts[bin];
+  }
+
+  if(b->num_samples < NDPI_BUDGET_MIN_SAMPLES)
+    return;
+
+  target = b->num_samples - (b->num_samples / 100);
+  for(bin = 0; bin < NDPI_DETECTION_PKT_BINS-1; bin++)
+    if((sum += b->pkts[bin]) >= target)
+      break;
+
+  if(bin == NDPI_DETECTION_PKT_BINS-1)
+    b->budget = 0;
+  else
+    b->budget = ndpi_max(min_budget, 2u << bin);
+}
+
+/* ********************************************************************************* */
+
+static struct ndpi_budget_bins *ndpi_budget_port_bins(struct ndpi_detection_budget *b,
+						      u_int8_t l4_proto, u_int16_t port, u_int8_t add) {
+  struct ndpi_budget_port *p = &b->port[((((u_int32_t)l4_proto << 16) | port) * 2654435761u) >> 22];
+
+  if((p->port == port) && (p->l4_proto == l4_proto))
+    return(&p->bins);
+
+  /* Ports that learnt a budget are not evicted */
+  if((!add) || (p->bins.num_samples >= NDPI_BUDGET_MIN_SAMPLES))
+    return(NULL);
+
+  memset(p, 0, sizeof(*p));
+  p->port = port, p->l4_proto = l4_proto;
+
+  return(&p->bins);
+}
+
+/* ********************************************************************************* */
+
+/* Flows are learnt under their lower port, usually the server one */
+static void ndpi_budget_set_port(struct ndpi_flow_struct *flow) {
+  if(flow->budget_port != 0)
+    return;
+
+  if(flow->packet.tcp)
+    flow->budget_port = ndpi_min(ntohs(flow->packet.tcp->source), ntohs(flow->packet.tcp->dest));
+  else if(flow->packet.udp)
+    flow->budget_port = ndpi_min(ntohs(flow->packet.udp->source), ntohs(flow->packet.udp->dest));
+}
+
+/* ********************************************************************************* */
 
-	    if (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
-	      {
-		break; /* Stop after the first detected protocol. */
-	      }
-	  }
+/* Called for each packet of an unclassified flow */
+static void ndpi_detection_budget_check(struct ndpi_detection_module_struct *ndpi_str,
+					struct ndpi_flow_struct *flow) {
+  struct ndpi_detection_budget *b = ndpi_str->detection_budget;
+  struct ndpi_call_function_struct *callback_buffer;
+  struct ndpi_budget_bins *port_bins;
+  u_int32_t callback_buffer_size, a, num_candidates = 0;
+  u_int16_t max_pkts, budget = 0, proto_budget;
+
+  if(flow->packet.tcp)
+    max_pkts = b->max_tcp_pkts, callback_buffer = ndpi_str->callback_buffer_tcp_payload,
+      callback_buffer_size = ndpi_str->callback_buffer_size_tcp_payload;
+  else if(flow->packet.udp)
+    max_pkts = b->max_udp_pkts, callback_buffer = ndpi_str->callback_buffer_udp,
+      callback_buffer_size = ndpi_str->callback_buffer_size_udp;
+  else
+    return;
+
+  ndpi_budget_set_port(flow);
+
+  /* The largest budget of the dissectors still candidate */
+  for(a = 0; a < callback_buffer_size; a++) {
+    if((NDPI_COMPARE_PROTOCOL_TO_BITMASK(callback_buffer[a].detection_bitmask, NDPI_PROTOCOL_UNKNOWN) == 0)
+       || NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask, callback_buffer[a].excluded_protocol_bitmask))
+      continue;
+
+    num_candidates++;
+    proto_budget = b->proto[callback_buffer[a].ndpi_protocol_id].budget;
+
+    if(proto_budget == 0) {
+      /*
+	Not learnt: a protocol never (or rarely) detected after many
+	detections gets the overall budget, otherwise no tightening
+      */
+      if((b->proto[callback_buffer[a].ndpi_protocol_id].num_samples == 0)
+	 && (b->all.num_samples >= NDPI_BUDGET_MIN_ALL) && b->all.budget)
+	proto_budget = b->all.budget;
+      else {
+	budget = max_pkts;
+	break;
       }
     }
 
-  /* Check for subprotocols. */
-  for (a = 0; a < ndpi_str->proto_defaults[flow->detected_protocol_stack[0]].subprotocol_count; a++)
-    {
-      u_int16_t subproto_index;
-      u_int16_t subproto_id = ndpi_str->proto_defaults[flow->detected_protocol_stack[0]].subprotocols[a];
-      if (subproto_id == (uint16_t)NDPI_PROTOCOL_MATCHED_BY_CONTENT)
-	{
-	  continue;
-	}
+    if(proto_budget > budget)
+      budget = proto_budget;
+  }
 
-      subproto_index = ndpi_str->proto_defaults[subproto_id].protoIdx;
-      if ((func != ndpi_str->proto_defaults[subproto_id].func) &&
-          (ndpi_str->callback_buffer[subproto_index].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	  ndpi_str->callback_buffer[subproto_index].ndpi_selection_bitmask &&
-          NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-                               ndpi_str->callback_buffer[subproto_index].excluded_protocol_bitmask) == 0 &&
-          NDPI_BITMASK_COMPARE(ndpi_str->callback_buffer[subproto_index].detection_bitmask,
-                               detection_bitmask) != 0)
-	{
-	  ndpi_str->callback_buffer[subproto_index].func(ndpi_str, flow);
-	  num_calls++;
-	}
+  if(budget > max_pkts)
+    budget = max_pkts;
 
-      if (flow->detected_protocol_stack[1] != NDPI_PROTOCOL_UNKNOWN)
-	{
-	  break; /* Stop after the first detected subprotocol. */
-	}
-    }
+  port_bins = ndpi_budget_port_bins(b, flow->l4_proto, flow->budget_port, 0);
+  if(port_bins && port_bins->budget && (port_bins->budget < budget))
+    budget = port_bins->budget;
 
-  return num_calls;
+  flow->detection_budget = budget;
+
+  if((num_candidates == 0) || (flow->num_processed_pkts >= budget)) {
+    flow->budget_exhausted = 1;
+    flow->fail_with_unknown = 1; /* Stop calling the dissectors */
+  }
 }
 
-/* ************************************************ */
+/* ********************************************************************************* */
 
-u_int32_t check_ndpi_other_flow_func(struct ndpi_detection_module_struct *ndpi_str,
-				     struct ndpi_flow_struct *flow,
-				     NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
-{
-  return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
-				   ndpi_str->callback_buffer_non_tcp_udp,
-				   ndpi_str->callback_buffer_size_non_tcp_udp);
-}
+/* First classification by a dissector */
+static void ndpi_detection_budget_learn(struct ndpi_detection_module_struct *ndpi_str,
+					struct ndpi_flow_struct *flow) {
+  struct ndpi_detection_budget *b = ndpi_str->detection_budget;
+  struct ndpi_budget_bins *port_bins;
+  /* The dissector that matched: TLS for Google over TLS */
+  u_int16_t proto_id = flow->detected_protocol_stack[1] ? flow->detected_protocol_stack[1] : flow->detected_protocol_stack[0];
 
-/* ************************************************ */
+  ndpi_budget_learn(&b->all, flow->num_processed_pkts, NDPI_BUDGET_MIN_PKTS);
 
-static u_int32_t check_ndpi_udp_flow_func(struct ndpi_detection_module_struct *ndpi_str,
-					  struct ndpi_flow_struct *flow,
-					  NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
-{
-  return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
-				   ndpi_str->callback_buffer_udp,
-				   ndpi_str->callback_buffer_size_udp);
-}
+  if(proto_id < (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS))
+    ndpi_budget_learn(&b->proto[proto_id], flow->num_processed_pkts, NDPI_BUDGET_MIN_PKTS);
 
-/* ************************************************ */
+  ndpi_budget_set_port(flow);
 
-static u_int32_t check_ndpi_tcp_flow_func(struct ndpi_detection_module_struct *ndpi_str,
-					  struct ndpi_flow_struct *flow,
-					  NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet)
-{
-  if (flow->packet.payload_packet_len != 0) {
-    return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
-				     ndpi_str->callback_buffer_tcp_payload,
-				     ndpi_str->callback_buffer_size_tcp_payload);
-  } else {
-    /* no payload */
-    return check_ndpi_detection_func(ndpi_str, flow, *ndpi_selection_packet,
-				     ndpi_str->callback_buffer_tcp_no_payload,
-				     ndpi_str->callback_buffer_size_tcp_no_payload);
-  }
+  if(flow->budget_port
+     && ((port_bins = ndpi_budget_port_bins(b, flow->l4_proto, flow->budget_port, 1)) != NULL))
+    ndpi_budget_learn(port_bins, flow->num_processed_pkts, NDPI_BUDGET_MIN_PKTS);
 }
 
 /* ********************************************************************************* */
 
-u_int32_t ndpi_check_flow_func(struct ndpi_detection_module_struct *ndpi_str,
-			       struct ndpi_flow_struct *flow,
-			       NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet) {
-  if(!flow)
+u_int8_t ndpi_detection_budget_exhausted(struct ndpi_detection_module_struct *ndpi_str,
+					 struct ndpi_flow_struct *flow) {
+  if((ndpi_str->detection_budget == NULL) || (flow == NULL))
     return(0);
-  else if(flow->packet.tcp != NULL)
-    return(check_ndpi_tcp_flow_func(ndpi_str, flow, ndpi_selection_packet));
-  else if(flow->packet.udp != NULL)
-    return(check_ndpi_udp_flow_func(ndpi_str, flow, ndpi_selection_packet));
-  else
-    return(check_ndpi_other_flow_func(ndpi_str, flow, ndpi_selection_packet));
+
+  if(flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
+    return(flow->budget_exhausted);
+
+  return(((flow->check_extra_packets == 0) || (flow->extra_packets_func == NULL)) ? 1 : 0);
 }
 
 /* ********************************************************************************* */
 
-u_int16_t ndpi_guess_host_protocol_id(struct ndpi_detection_module_struct *ndpi_str,
-				      struct ndpi_flow_struct *flow) {
-  u_int16_t ret = NDPI_PROTOCOL_UNKNOWN;
+/* Called once per flow at classification time, and on extra dissection changes */
+static void ndpi_detection_stats_account(struct ndpi_detection_module_struct *ndpi_str,
+					 struct ndpi_flow_struct *flow, const ndpi_protocol *proto,
+					 ndpi_detection_method method, u_int64_t when_ms) {
+  struct ndpi_detection_stats *s;
+  u_int16_t proto_id = (proto->app_protocol != NDPI_PROTOCOL_UNKNOWN) ? proto->app_protocol : proto->master_protocol;
+  u_int64_t ms;
+  u_int32_t bin;
 
-  if(flow->packet.iph) {
-    struct in_addr addr;
-    u_int16_t sport, dport;
+  if(method != ndpi_detection_by_extra_dissection)
+    flow->detection_method = method + 1;
 
-    addr.s_addr = flow->packet.iph->saddr;
+  if((method == ndpi_detection_by_dpi) && ndpi_str->detection_budget)
+    ndpi_detection_budget_learn(ndpi_str, flow);
 
-    if((flow->l4_proto == IPPROTO_TCP) && flow->packet.tcp)
-      sport = flow->packet.tcp->source, dport = flow->packet.tcp->dest;
-    else if((flow->l4_proto == IPPROTO_UDP) && flow->packet.udp)
-      sport = flow->packet.udp->source, dport = flow->packet.udp->dest;
-    else
-      sport = dport = 0;
+  if((ndpi_str->detection_stats == NULL)
+     || (proto_id >= (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS)))
+    return;
 
-    /* guess host protocol */
-    ret = ndpi_network_port_ptree_match(ndpi_str, &addr, sport);
+#ifdef __KERNEL__
+  s = &this_cpu_ptr(ndpi_str->detection_stats)[proto_id];
+#else
+  s = &ndpi_str->detection_stats[proto_id];
+#endif
 
-    if(ret == NDPI_PROTOCOL_UNKNOWN) {
-      addr.s_addr = flow->packet.iph->daddr;
-      ret = ndpi_network_port_ptree_match(ndpi_str, &addr, dport);
-    }
-  }
+  s->flows[method]++;
 
-  return(ret);
+  if(method == ndpi_detection_by_extra_dissection)
+    return;
+
+  s->pkts[ndpi_detection_pkt_bin(flow->num_processed_pkts)]++;
+
+  ms = (when_ms > flow->first_packet_time_ms) ? when_ms - flow->first_packet_time_ms : 0;
+  for(bin = 0; (bin < NDPI_DETECTION_TIME_BINS-1) && (ms >= (1u << bin)); bin++)
+    ;
+  s->time_ms[bin]++;
 }
 
 /* ********************************************************************************* */
 
-ndpi_protocol ndpi_detection_giveup(struct ndpi_detection_module_struct *ndpi_str, struct ndpi_flow_struct *flow,
-				    u_int8_t enable_guess, u_int8_t *protocol_was_guessed) {
+static ndpi_protocol ndpi_int_detection_giveup(struct ndpi_detection_module_struct *ndpi_str,
+					       struct ndpi_flow_struct *flow,
+					       u_int8_t enable_guess, u_int8_t *protocol_was_guessed) {
   ndpi_protocol ret = NDPI_PROTOCOL_NULL;
 
   *protocol_was_guessed = 0;
@@ -4849,6 +5408,22 @@ ndpi_protocol ndpi_detection_giveup(struct ndpi_detection_module_struct *ndpi_st
 
 /* ********************************************************************************* */
 
+ndpi_protocol ndpi_detection_giveup(struct ndpi_detection_module_struct *ndpi_str, struct ndpi_flow_struct *flow,
+				    u_int8_t enable_guess, u_int8_t *protocol_was_guessed) {
+  ndpi_protocol ret = ndpi_int_detection_giveup(ndpi_str, flow, enable_guess, protocol_was_guessed);
+
+  if(flow && !flow->detection_method)
+    ndpi_detection_stats_account(ndpi_str, flow, &ret,
+				 ((ret.app_protocol != NDPI_PROTOCOL_UNKNOWN)
+				  || (ret.master_protocol != NDPI_PROTOCOL_UNKNOWN)) ?
+				 ndpi_detection_by_giveup : ndpi_detection_unknown,
+				 flow->packet.current_time_ms);
+
+  return(ret);
+}
+
+/* ********************************************************************************* */
+
 static inline uint32_t get_timestamp(uint64_t ts_l,uint32_t divisor) {
 #ifdef __KERNEL__
 	do_div(ts_l,divisor);
@@ -4890,9 +5465,28 @@ void ndpi_process_extra_packet(struct ndpi_detection_module_struct *ndpi_str, st
 
   /* call the extra packet function (which may add more data/info to flow) */
   if(flow->extra_packets_func) {
-    if((flow->extra_packets_func(ndpi_str, flow)) == 0)
+    struct ndpi_budget_bins *extra_bins = NULL;
+
+    if(ndpi_str->detection_budget) {
+      u_int16_t proto_id = flow->detected_protocol_stack[1] ? flow->detected_protocol_stack[1] : flow->detected_protocol_stack[0];
+
+      if(proto_id < (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS)) {
+	extra_bins = &ndpi_str->detection_budget->extra[proto_id];
+
+	if((flow->num_extra_packets_checked == 0) && extra_bins->budget
+	   && (extra_bins->budget < flow->max_extra_packets_to_check))
+	  flow->max_extra_packets_to_check = extra_bins->budget;
+      }
+    }
+
+    if((flow->extra_packets_func(ndpi_str, flow)) == 0) {
       flow->check_extra_packets = 0;
 
+      if(extra_bins)
+	ndpi_budget_learn(extra_bins, flow->num_extra_packets_checked + 1, NDPI_BUDGET_MIN_EXTRA);
+    } else if(extra_bins && (flow->num_extra_packets_checked + 1 == flow->max_extra_packets_to_check))
+      ndpi_budget_learn(extra_bins, NDPI_BUDGET_NOT_DONE, NDPI_BUDGET_MIN_EXTRA);
+
     if(++flow->num_extra_packets_checked == flow->max_extra_packets_to_check)
       flow->extra_packets_func = NULL; /* Enough packets detected */
   }
@@ -4975,6 +5569,9 @@ int ndpi_load_hostname_category(struct ndpi_detection_module_struct *ndpi_str, c
   ac_pattern.rep.category = category;
 
   rc = ac_automata_add(ndpi_str->custom_categories.hostnames_shadow.ac_automa, &ac_pattern);
+  if((rc == ACERR_SUCCESS) && ndpi_is_domain_pattern(ac_pattern.astring, ac_pattern.length, ac_pattern.rep.number))
+    ndpi_domain_table_add(&ndpi_str->custom_categories.hostnames_shadow.domains, &ac_pattern);
+  ndpi_host_match_cache_invalidate(ndpi_str);
   if(rc != ACERR_DUPLICATE_PATTERN && rc != ACERR_SUCCESS) {
     ndpi_free(name);
     return(-1);
@@ -5020,8 +5617,12 @@ int ndpi_enable_loaded_categories(struct ndpi_detection_module_struct *ndpi_str)
   /* Finalize */
   ac_automata_finalize((AC_AUTOMATA_t *) ndpi_str->custom_categories.hostnames_shadow.ac_automa);
 
+  ndpi_domain_table_free(ndpi_str->custom_categories.hostnames.domains);
+
   /* Swap */
   ndpi_str->custom_categories.hostnames.ac_automa = ndpi_str->custom_categories.hostnames_shadow.ac_automa;
+  ndpi_str->custom_categories.hostnames.domains = ndpi_str->custom_categories.hostnames_shadow.domains;
+  ndpi_str->custom_categories.hostnames_shadow.domains = NULL;
 
   /* Realloc */
   ndpi_str->custom_categories.hostnames_shadow.ac_automa = ac_automata_init(ac_match_handler);
@@ -5033,6 +5634,7 @@ int ndpi_enable_loaded_categories(struct ndpi_detection_module_struct *ndpi_str)
   ndpi_str->custom_categories.ipAddresses_shadow = ndpi_patricia_new(32 /* IPv4 */);
 
   ndpi_str->custom_categories.categories_loaded = 1;
+  ndpi_host_match_cache_invalidate(ndpi_str);
 
   return(0);
 }
@@ -5302,7 +5904,7 @@ static int ndpi_do_guess(struct ndpi_detection_module_struct *ndpi_str, struct n
 	  u_int8_t protocol_was_guessed;
 
 	  /* ret->master_protocol = flow->guessed_protocol_id , ret->app_protocol = flow->guessed_host_protocol_id; /\* ****** *\/ */
-	  *ret = ndpi_detection_giveup(ndpi_str, flow, 0, &protocol_was_guessed);
+	  *ret = ndpi_int_detection_giveup(ndpi_str, flow, 0, &protocol_was_guessed);
 	}
 
 	// if(ndpi_str->ndpi_num_custom_protocols != 0)
@@ -5383,7 +5985,8 @@ ndpi_protocol ndpi_detection_process_packet(struct ndpi_detection_module_struct
     return(ret);
   }
 
-  flow->num_processed_pkts++;
+  if(++flow->num_processed_pkts == 1)
+    flow->first_packet_time_ms = current_time_ms;
 
   /* Init default */
   ret.master_protocol = flow->detected_protocol_stack[1],
@@ -5395,8 +5998,12 @@ ndpi_protocol ndpi_detection_process_packet(struct ndpi_detection_module_struct
   if(flow->check_extra_packets) {
     ndpi_process_extra_packet(ndpi_str, flow, packet, packetlen, current_time_ms, src, dst);
     /* Update in case of new match */
-    ret.master_protocol = flow->detected_protocol_stack[1];
-    ret.app_protocol = flow->detected_protocol_stack[0];
+    if((ret.master_protocol != flow->detected_protocol_stack[1])
+       || (ret.app_protocol != flow->detected_protocol_stack[0])) {
+      ret.master_protocol = flow->detected_protocol_stack[1];
+      ret.app_protocol = flow->detected_protocol_stack[0];
+      ndpi_detection_stats_account(ndpi_str, flow, &ret, ndpi_detection_by_extra_dissection, current_time_ms);
+    }
 #ifndef __KERNEL__
     ret.category = flow->category;
 #endif
@@ -5456,12 +6063,19 @@ ndpi_protocol ndpi_detection_process_packet(struct ndpi_detection_module_struct
   if(!flow->protocol_id_already_guessed) {
     flow->protocol_id_already_guessed = 1;
 
-    if(ndpi_do_guess(ndpi_str, flow, &ret) == -1)
+    if(ndpi_do_guess(ndpi_str, flow, &ret) == -1) {
+      if(!flow->detection_method
+	 && ((ret.app_protocol != NDPI_PROTOCOL_UNKNOWN) || (ret.master_protocol != NDPI_PROTOCOL_UNKNOWN)))
+	ndpi_detection_stats_account(ndpi_str, flow, &ret, ndpi_detection_by_guess, current_time_ms);
       goto invalidate_ptr;
+    }
   }
 
   num_calls = ndpi_check_flow_func(ndpi_str, flow, &ndpi_selection_packet);
 
+  if(ndpi_str->detection_budget && (flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN))
+    ndpi_detection_budget_check(ndpi_str, flow);
+
   a = flow->packet.detected_protocol_stack[0];
   if(NDPI_COMPARE_PROTOCOL_TO_BITMASK(ndpi_str->detection_bitmask, a) == 0)
     a = NDPI_PROTOCOL_UNKNOWN;
@@ -5576,6 +6190,10 @@ ndpi_protocol ndpi_detection_process_packet(struct ndpi_detection_module_struct
 
   ndpi_reconcile_protocols(ndpi_str, flow, &ret);
 
+  if(!flow->detection_method
+     && ((ret.app_protocol != NDPI_PROTOCOL_UNKNOWN) || (ret.master_protocol != NDPI_PROTOCOL_UNKNOWN)))
+    ndpi_detection_stats_account(ndpi_str, flow, &ret, ndpi_detection_by_dpi, current_time_ms);
+
   if(num_calls == 0)
     flow->fail_with_unknown = 1;
 
@@ -6832,6 +7450,39 @@ static int ndpi_exact_ac_match(int match_num,const AC_TEXT_t *input_text) {
 
 /* ****************************************************** */
 
+/*
+  The automa reports the longest pattern of the last node it reaches:
+  when a domain pattern ends the name, that is the one found here and,
+  if it passes the label check of ac_match_handler(), the automa would
+  return it. Otherwise (0) the automa alone decides, as it did before.
+*/
+static int ndpi_domain_match(const void *domains, char *name, u_int name_len, AC_REP_t *match) {
+  const struct ndpi_domain_entry *e = ndpi_domain_table_match(domains, name, name_len);
+  char buf[64];
+  u_int buf_len;
+
+  if(!e)
+    return(0);
+
+  buf_len = ndpi_min(name_len, sizeof(buf)-1);
+  strncpy(buf, name, buf_len);
+  buf[buf_len] = '\0';
+
+  if(!ndpi_host_pattern_on_label(buf, e->name))
+    return(0);
+
+  /* ndpi_exact_ac_match() at the end of the name: only |exact| patterns can fail */
+  *match = e->rep;
+  if(((match->number & NDPI_HOST_MATCH_ALL) == NDPI_HOST_MATCH_ALL) && (e->len != name_len))
+    match->number = 0;
+  else
+    match->number &= ~NDPI_HOST_MATCH_ALL;
+
+  return(1);
+}
+
+/* ****************************************************** */
+
 int ndpi_match_prefix(const u_int8_t *payload,
 		      size_t payload_len, const char *str, size_t str_len) {
   int rc = str_len <= payload_len ? memcmp(payload, str, str_len) == 0 : 0;
@@ -6857,9 +7508,19 @@ int ndpi_match_string_subprotocol(struct ndpi_detection_module_struct *ndpi_str,
     return(0); /* No matches */
   }
 
-  if(is_host_match)
+  if(is_host_match) {
     spin_lock_bh(&ndpi_str->host_automa_lock);
 
+    if(ndpi_domain_match(automa->domains, string_to_match, string_to_match_len, &match)) {
+      spin_unlock_bh(&ndpi_str->host_automa_lock);
+
+      ret_match->protocol_id = match.number, ret_match->protocol_category = match.category,
+	ret_match->protocol_breed = match.breed;
+
+      return(match.number);
+    }
+  }
+
   ac_input_text.astring = string_to_match, ac_input_text.length = string_to_match_len;
   ac_input_text.ignore_case = 0;
   rc = ac_automata_search(((AC_AUTOMATA_t *) automa->ac_automa), &ac_input_text, &match);
@@ -6903,12 +7564,40 @@ static u_int8_t ndpi_is_more_generic_protocol(u_int16_t previous_proto, u_int16_
 
 /* ****************************************************** */
 
+/* Applies a host/content match to the flow, unless it is more generic than the flow protocol */
+static u_int16_t ndpi_set_subprotocol_match(struct ndpi_flow_struct *flow, int matching_protocol_id,
+					    u_int16_t master_protocol_id, ndpi_protocol_match_result *ret_match) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+
+  if((matching_protocol_id != NDPI_PROTOCOL_UNKNOWN) &&
+     (!ndpi_is_more_generic_protocol(packet->detected_protocol_stack[0], matching_protocol_id))) {
+    /* Move the protocol on slot 0 down one position */
+    packet->detected_protocol_stack[1] = master_protocol_id,
+      packet->detected_protocol_stack[0] = matching_protocol_id;
+
+    flow->detected_protocol_stack[0] = packet->detected_protocol_stack[0],
+      flow->detected_protocol_stack[1] = packet->detected_protocol_stack[1];
+
+    if(flow->category == NDPI_PROTOCOL_CATEGORY_UNSPECIFIED)
+      flow->category = ret_match->protocol_category;
+
+    return(packet->detected_protocol_stack[0]);
+  }
+
+  ret_match->protocol_id = NDPI_PROTOCOL_UNKNOWN, ret_match->protocol_category = NDPI_PROTOCOL_CATEGORY_UNSPECIFIED,
+    ret_match->protocol_breed = NDPI_PROTOCOL_UNRATED;
+
+  return(NDPI_PROTOCOL_UNKNOWN);
+}
+
+/* ****************************************************** */
+
 static u_int16_t ndpi_automa_match_string_subprotocol(struct ndpi_detection_module_struct *ndpi_str,
 						      struct ndpi_flow_struct *flow, char *string_to_match,
 						      u_int string_to_match_len, u_int16_t master_protocol_id,
 						      ndpi_protocol_match_result *ret_match, u_int8_t is_host_match) {
   int matching_protocol_id;
-  struct ndpi_packet_struct *packet = &flow->packet;
+  u_int16_t rc;
 
   matching_protocol_id =
     ndpi_match_string_subprotocol(ndpi_str, string_to_match, string_to_match_len, ret_match, is_host_match);
@@ -6918,38 +7607,145 @@ static u_int16_t ndpi_automa_match_string_subprotocol(struct ndpi_detection_modu
     char m[256];
     int len = ndpi_min(sizeof(m), string_to_match_len);
 
-    strncpy(m, string_to_match, len);
-    m[len] = '\0';
+    strncpy(m, string_to_match, len);
+    m[len] = '\0';
+
+    NDPI_LOG_DBG2(ndpi_str, "[NDPI] ndpi_match_host_subprotocol(%s): %s\n", m,
+		  ndpi_str->proto_defaults[matching_protocol_id].protoName);
+  }
+#endif
+
+  rc = ndpi_set_subprotocol_match(flow, matching_protocol_id, master_protocol_id, ret_match);
+
+#ifdef DEBUG
+  if(rc == NDPI_PROTOCOL_UNKNOWN) {
+    string_to_match[string_to_match_len] = '\0';
+    NDPI_LOG_DBG2(ndpi_str, "[NTOP] Unable to find a match for '%s'\n", string_to_match);
+  }
+#endif
+
+  return(rc);
+}
+
+/* ****************************************************** */
+
+void ndpi_host_match_cache_invalidate(struct ndpi_detection_module_struct *ndpi_str) {
+  /* Entries tagged with an older generation are ignored, on every cpu */
+  ndpi_str->host_match_gen++;
+}
+
+/* ****************************************************** */
+
+int ndpi_get_host_match_cache_stats(struct ndpi_detection_module_struct *ndpi_str,
+				    struct ndpi_host_match_cache_stats *stats) {
+  if(ndpi_str->host_match_cache == NULL)
+    return(-1);
+
+  memset(stats, 0, sizeof(*stats));
+  stats->num_entries = NDPI_HOST_MATCH_CACHE_SIZE;
+
+#ifdef __KERNEL__
+  {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+      const struct ndpi_host_match_cache *c = per_cpu_ptr(ndpi_str->host_match_cache, cpu);
+
+      stats->hits += c->hits, stats->misses += c->misses;
+    }
+  }
+#else
+  stats->hits = ndpi_str->host_match_cache->hits, stats->misses = ndpi_str->host_match_cache->misses;
+#endif
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/*
+  Lowercases name into buf (at most buf_size-2 chars) and fills m with
+  everything ndpi_match_host_subprotocol() needs that does not depend on
+  the flow: served from the cache when the same name was already seen
+  since the last change of the host automa, categories or risky domains
+*/
+static u_int16_t ndpi_host_match_lookup(struct ndpi_detection_module_struct *ndpi_str,
+					char *name, u_int name_len, char *buf, u_int buf_size,
+					struct ndpi_host_match_cache_entry *m) {
+  struct ndpi_host_match_cache *c;
+  struct ndpi_host_match_cache_entry *e;
+  u_int32_t key = 5381 /* ndpi_quick_hash() */, check = 2166136261U /* FNV-1a */, gen;
+  ndpi_protocol_match_result ret_match;
+  u_int16_t buf_len, i;
+
+  buf_len = ndpi_min(name_len, buf_size-2);
+  for(i=0; i<buf_len; i++) {
+    buf[i] = tolower(name[i]);
+    key = ((key << 5) + key) + (u_int8_t)buf[i], check = (check ^ (u_int8_t)buf[i]) * 16777619U;
+  }
+  buf[i] = '\0';
+
+  gen = ndpi_str->host_match_gen;
+
+  if(ndpi_str->host_match_cache) {
+#ifdef __KERNEL__
+    local_bh_disable();
+    c = this_cpu_ptr(ndpi_str->host_match_cache);
+#else
+    c = ndpi_str->host_match_cache;
+#endif
+    e = &c->entries[key % NDPI_HOST_MATCH_CACHE_SIZE];
+
+    if((e->flags & NDPI_HOST_MATCH_VALID) && (e->key == key) && (e->check == check)
+       && (e->len == buf_len) && (e->gen == gen)) {
+      *m = *e;
+      c->hits++;
+#ifdef __KERNEL__
+      local_bh_enable();
+#endif
+      return(buf_len);
+    }
 
-    NDPI_LOG_DBG2(ndpi_str, "[NDPI] ndpi_match_host_subprotocol(%s): %s\n", m,
-		  ndpi_str->proto_defaults[matching_protocol_id].protoName);
-  }
+    c->misses++;
+#ifdef __KERNEL__
+    local_bh_enable();
 #endif
+  }
 
-  if((matching_protocol_id != NDPI_PROTOCOL_UNKNOWN) &&
-     (!ndpi_is_more_generic_protocol(packet->detected_protocol_stack[0], matching_protocol_id))) {
-    /* Move the protocol on slot 0 down one position */
-    packet->detected_protocol_stack[1] = master_protocol_id,
-      packet->detected_protocol_stack[0] = matching_protocol_id;
+  memset(m, 0, sizeof(*m));
+  m->key = key, m->check = check, m->gen = gen, m->len = buf_len, m->flags = NDPI_HOST_MATCH_VALID;
 
-    flow->detected_protocol_stack[0] = packet->detected_protocol_stack[0],
-      flow->detected_protocol_stack[1] = packet->detected_protocol_stack[1];
+  memset(&ret_match, 0, sizeof(ret_match));
+  m->protocol_id = ndpi_match_string_subprotocol(ndpi_str, buf, buf_len, &ret_match, 1);
+  m->category = ret_match.protocol_category, m->breed = ret_match.protocol_breed;
 
-    if(flow->category == NDPI_PROTOCOL_CATEGORY_UNSPECIFIED)
-      flow->category = ret_match->protocol_category;
+#ifndef __KERNEL__
+  {
+    ndpi_protocol_category_t id;
 
-    return(packet->detected_protocol_stack[0]);
+    if(ndpi_get_custom_category_match(ndpi_str, buf, buf_len, &id) != -1)
+      m->flags |= NDPI_HOST_MATCH_CUSTOM_CATEGORY, m->custom_category = id;
   }
 
-#ifdef DEBUG
-  string_to_match[string_to_match_len] = '\0';
-  NDPI_LOG_DBG2(ndpi_str, "[NTOP] Unable to find a match for '%s'\n", string_to_match);
+  if((ndpi_str->risky_domain_automa.ac_automa != NULL)
+     && (ndpi_match_string(ndpi_str->risky_domain_automa.ac_automa, buf) > 0))
+    m->flags |= NDPI_HOST_MATCH_RISKY_DOMAIN;
 #endif
 
-  ret_match->protocol_id = NDPI_PROTOCOL_UNKNOWN, ret_match->protocol_category = NDPI_PROTOCOL_CATEGORY_UNSPECIFIED,
-    ret_match->protocol_breed = NDPI_PROTOCOL_UNRATED;
+  if(ndpi_str->host_match_cache) {
+#ifdef __KERNEL__
+    local_bh_disable();
+    c = this_cpu_ptr(ndpi_str->host_match_cache);
+#else
+    c = ndpi_str->host_match_cache;
+#endif
+    c->entries[key % NDPI_HOST_MATCH_CACHE_SIZE] = *m;
+#ifdef __KERNEL__
+    local_bh_enable();
+#endif
+  }
 
-  return(NDPI_PROTOCOL_UNKNOWN);
+  return(buf_len);
 }
 
 /* ****************************************************** */
@@ -6969,33 +7765,24 @@ u_int16_t ndpi_match_host_subprotocol(struct ndpi_detection_module_struct *ndpi_
 				      char *string_to_match, u_int string_to_match_len,
 				      ndpi_protocol_match_result *ret_match,
 				      u_int16_t master_protocol_id) {
-  u_int16_t rc, buf_len, i;
-  ndpi_protocol_category_t id;
+  struct ndpi_host_match_cache_entry m;
+  u_int16_t rc;
   char buf[96];
 
-  buf_len = ndpi_min(string_to_match_len, sizeof(buf)-2);
-  for(i=0; i<buf_len; i++) buf[i] = tolower(string_to_match[i]);
-//  buf[i++] = '$'; /* Add trailer $ */
-  buf[i] = '\0';
+  ndpi_host_match_lookup(ndpi_str, string_to_match, string_to_match_len, buf, sizeof(buf), &m);
 
-  rc = ndpi_automa_match_string_subprotocol(ndpi_str, flow, buf, i,
-					    master_protocol_id, ret_match, 1);
-  id = ret_match->protocol_category;
+  ret_match->protocol_id = m.protocol_id, ret_match->protocol_category = (ndpi_protocol_category_t)m.category,
+    ret_match->protocol_breed = (ndpi_protocol_breed_t)m.breed;
+  rc = ndpi_set_subprotocol_match(flow, m.protocol_id, master_protocol_id, ret_match);
 
 #ifndef __KERNEL__
-  if(ndpi_get_custom_category_match(ndpi_str, buf, i, &id) != -1) {
-    /* if(id != -1) */ {
-      flow->category = ret_match->protocol_category = id;
-      rc = master_protocol_id;
-    }
+  if(m.flags & NDPI_HOST_MATCH_CUSTOM_CATEGORY) {
+    flow->category = ret_match->protocol_category = (ndpi_protocol_category_t)m.custom_category;
+    rc = master_protocol_id;
   }
 
-  if(ndpi_str->risky_domain_automa.ac_automa != NULL) {
-    u_int16_t rc1 = ndpi_match_string(ndpi_str->risky_domain_automa.ac_automa, buf);
-
-    if(rc1 > 0)
-      ndpi_set_risk(flow, NDPI_RISKY_DOMAIN);
-  }
+  if(m.flags & NDPI_HOST_MATCH_RISKY_DOMAIN)
+    ndpi_set_risk(flow, NDPI_RISKY_DOMAIN);
 #endif
 
   return(rc);
@@ -7028,6 +7815,29 @@ int ndpi_match_hostname_protocol(struct ndpi_detection_module_struct *ndpi_struc
 
 /* ****************************************************** */
 
+#ifndef __KERNEL__
+/*
+  Flow independent part of ndpi_match_hostname_protocol(): tells if the name
+  matches a host pattern, a custom category or a risky domain, i.e. if
+  ndpi_match_hostname_protocol() could change a flow
+*/
+int ndpi_hostname_has_match(struct ndpi_detection_module_struct *ndpi_str,
+			    char *name, u_int name_len) {
+  struct ndpi_host_match_cache_entry m;
+  char buf[96];
+
+  if((name_len > 2) && (name[0] == '*') && (name[1] == '.'))
+    name++, name_len--;
+
+  ndpi_host_match_lookup(ndpi_str, name, name_len, buf, sizeof(buf), &m);
+
+  return(((m.protocol_id != NDPI_PROTOCOL_UNKNOWN)
+	  || (m.flags & (NDPI_HOST_MATCH_CUSTOM_CATEGORY | NDPI_HOST_MATCH_RISKY_DOMAIN))) ? 1 : 0);
+}
+#endif
+
+/* ****************************************************** */
+
 u_int16_t ndpi_match_content_subprotocol(struct ndpi_detection_module_struct *ndpi_str,
 					 struct ndpi_flow_struct *flow,
 					 char *string_to_match, u_int string_to_match_len,
@@ -7121,6 +7931,8 @@ void ndpi_free_flow(struct ndpi_flow_struct *flow) {
   if(flow) {
     ndpi_free_flow_data(flow);
 #ifndef __KERNEL__
+    /* Allocated by ndpi_flow_malloc() */
+    ndpi_mem_account(NDPI_MEM_FLOW, -(int64_t)flow->mem_flow);
     ndpi_free(flow);
 #endif
   }
@@ -7283,6 +8095,66 @@ void ndpi_lru_add_to_cache(struct ndpi_lru_cache *c, u_int32_t key, u_int16_t va
 
 /* ******************************************************************** */
 
+#ifndef __KERNEL__
+/* TLS certificate cache (direct mapped, by SHA-1 fingerprint) */
+struct ndpi_tls_cert_info_cache *ndpi_tls_cert_info_cache_init(u_int32_t num_entries) {
+  struct ndpi_tls_cert_info_cache *c = (struct ndpi_tls_cert_info_cache *) ndpi_malloc(sizeof(struct ndpi_tls_cert_info_cache));
+
+  if(!c)
+    return(NULL);
+
+  c->entries = (struct ndpi_tls_cert_info *) ndpi_calloc(num_entries, sizeof(struct ndpi_tls_cert_info));
+
+  if(!c->entries) {
+    ndpi_free(c);
+    return(NULL);
+  } else
+    c->num_entries = num_entries;
+
+  return(c);
+}
+
+void ndpi_tls_cert_info_cache_free(struct ndpi_tls_cert_info_cache *c) {
+  u_int32_t i;
+
+  for(i = 0; i < c->num_entries; i++)
+    if(c->entries[i].data)
+      ndpi_free(c->entries[i].data);
+
+  ndpi_free(c->entries);
+  ndpi_free(c);
+}
+
+static u_int32_t ndpi_tls_cert_info_slot(struct ndpi_tls_cert_info_cache *c, const u_int8_t *sha1) {
+  /* The fingerprint is already uniformly distributed */
+  return(((sha1[0] << 24) | (sha1[1] << 16) | (sha1[2] << 8) | sha1[3]) % c->num_entries);
+}
+
+struct ndpi_tls_cert_info *ndpi_tls_cert_info_find(struct ndpi_tls_cert_info_cache *c, const u_int8_t *sha1) {
+  struct ndpi_tls_cert_info *e = &c->entries[ndpi_tls_cert_info_slot(c, sha1)];
+
+  if(e->is_full && (memcmp(e->sha1, sha1, sizeof(e->sha1)) == 0))
+    return(e);
+  else
+    return(NULL);
+}
+
+/* Returns the (emptied) entry where the certificate has to be stored */
+struct ndpi_tls_cert_info *ndpi_tls_cert_info_add(struct ndpi_tls_cert_info_cache *c, const u_int8_t *sha1) {
+  struct ndpi_tls_cert_info *e = &c->entries[ndpi_tls_cert_info_slot(c, sha1)];
+
+  if(e->data)
+    ndpi_free(e->data);
+
+  memset(e, 0, sizeof(*e));
+  memcpy(e->sha1, sha1, sizeof(e->sha1));
+
+  return(e);
+}
+#endif
+
+/* ******************************************************************** */
+
 /*
   This function tells if it's possible to further dissect a given flow
   0 - All possible dissection has been completed
@@ -7570,6 +8442,273 @@ static int ndpi_is_vowel(char c) {
 
 /* ******************************************************************** */
 
+/* N-gram counters of a DGA candidate, kept per word and then summed up */
+struct ndpi_dga_ngrams {
+  int num_found, num_impossible, num_bigram_checks, num_trigram_found, num_trigram_checked,
+    num_trigram_vowels, num_dash, skip_next_bigram, trigram_char_skip, double_dash;
+};
+
+/*
+  Words shorter than 3 chars are counted but their n-grams are ignored,
+  so a word is added to the total only once it is complete
+ */
+static void ndpi_dga_end_word(struct ndpi_dga_ngrams *total, struct ndpi_dga_ngrams *word,
+			      int *word_len, int *num_words) {
+  if(*word_len > 0)
+    (*num_words)++;
+
+  if(*word_len >= 3) {
+    total->num_found += word->num_found, total->num_impossible += word->num_impossible;
+    total->num_bigram_checks += word->num_bigram_checks;
+    total->num_trigram_found += word->num_trigram_found, total->num_trigram_checked += word->num_trigram_checked;
+    total->num_trigram_vowels += word->num_trigram_vowels, total->num_dash += word->num_dash;
+    total->skip_next_bigram = word->skip_next_bigram, total->double_dash |= word->double_dash;
+  }
+
+  memset(word, 0, sizeof(*word));
+  word->skip_next_bigram = total->skip_next_bigram; /* Carried across words */
+  *word_len = 0;
+}
+
+/* ******************************************************************** */
+
+/*
+  Scores a name (len >= 5) in a single pass: n-grams are looked up in the
+  direct indexed bitmaps as soon as the chars ending them are read
+ */
+static int ndpi_dga_score(struct ndpi_detection_module_struct *ndpi_str,
+			  char *name, u_int8_t is_hostname) {
+  int len, rc = 0, i, j, num_digits = 0, num_vowels = 0, num_words = 0, word_len = 0;
+  u_int8_t max_num_char_repetitions = 0, last_char = 0, num_char_repetitions = 0, num_dots = 0;
+  u_int8_t max_domain_element_len = 0, curr_domain_element_len = 0, first_element_is_numeric = 1;
+  struct ndpi_dga_ngrams total, word;
+  char tmp[128];
+  u_int max_tmp_len = sizeof(tmp)-1;
+
+  len = snprintf(tmp, max_tmp_len, "%s", name);
+  if(len < 0) {
+
+    if(ndpi_verbose_dga_detection)
+      printf("[DGA] Too short");
+
+    return(0);
+  } else
+    tmp[len < max_tmp_len ? len : max_tmp_len] = '\0';
+
+  memset(&total, 0, sizeof(total)), memset(&word, 0, sizeof(word));
+
+  for(i=0, j=0; (i<len) && (j<max_tmp_len); i++) {
+    tmp[j] = tolower(name[i]);
+
+    if(tmp[j] == '.') {
+      num_dots++;
+    } else if(num_dots == 0) {
+      if(!isdigit(tmp[j]))
+	first_element_is_numeric = 0;
+    }
+
+    if(ndpi_is_vowel(tmp[j]))
+      num_vowels++;
+
+    if(last_char == tmp[j]) {
+      if(++num_char_repetitions > max_num_char_repetitions)
+	max_num_char_repetitions = num_char_repetitions;
+    } else
+      num_char_repetitions = 1, last_char = tmp[j];
+
+    if(isdigit(tmp[j])) {
+      num_digits++;
+
+      if(((j+2)<len) && isdigit(tmp[j+1]) && (tmp[j+2] == '.')) {
+	/* Check if there are too many digits */
+	if(num_digits < 4)
+	  return(0); /* Double digits */
+      }
+    }
+
+    switch(tmp[j]) {
+    case '.':
+    case '-':
+    case '_':
+    case '/':
+    case ')':
+    case '(':
+    case ';':
+    case ':':
+    case '[':
+    case ']':
+    case ' ':
+      /*
+	Domain/word separator chars
+
+	NOTE:
+	this function is used also to detect other type of issues
+	such as invalid/suspiciuous user agent
+      */
+      if(curr_domain_element_len > max_domain_element_len)
+	max_domain_element_len = curr_domain_element_len;
+
+      curr_domain_element_len = 0;
+      break;
+
+    default:
+      curr_domain_element_len++;
+      break;
+    }
+
+    if(tmp[j] == '.')
+      ndpi_dga_end_word(&total, &word, &word_len, &num_words);
+    else if(++word_len >= 2) {
+      u_int8_t c0 = tmp[j-1], c1 = tmp[j];
+
+      /* Bigram starting at j-1 */
+      switch(c0) {
+      case '-':
+	word.num_dash++;
+	/*
+	  Let's check for double+consecutive --
+	  that are usually ok
+	  r2---sn-uxaxpu5ap5-2n5e.gvt1.com
+	*/
+	if(c1 == '-')
+	  word.double_dash = 1;
+	break;
+
+      case '_':
+      case ':':
+	break;
+
+      default:
+	{
+	  u_int idx = ndpi_dga_char_idx(c0) * NDPI_DGA_NGRAM_ALPHABET + ndpi_dga_char_idx(c1);
+
+	  word.num_bigram_checks++;
+
+	  if(ndpi_dga_ngram_match(ndpi_str->dga_impossible_bigrams, idx)) {
+	    if(ndpi_verbose_dga_detection)
+	      printf("IMPOSSIBLE %c%c\n", c0, c1);
+
+	    word.num_impossible++;
+	  } else if(!word.skip_next_bigram) {
+	    if(ndpi_dga_ngram_match(ndpi_str->dga_bigrams, idx))
+	      word.num_found++, word.skip_next_bigram = 1;
+	  } else
+	    word.skip_next_bigram = 0;
+	}
+	break;
+      }
+
+      /* Trigram starting at j-2 */
+      if(word_len >= 3) {
+	u_int8_t cp = tmp[j-2];
+
+	if((cp == '-') || (cp == '_') || (cp == ':'))
+	  ;
+	else if(ndpi_is_trigram_char(cp) && ndpi_is_trigram_char(c0) && ndpi_is_trigram_char(c1)) {
+	  if(word.trigram_char_skip) {
+	    word.trigram_char_skip--;
+	  } else {
+	    u_int idx = (ndpi_dga_char_idx(cp) * NDPI_DGA_NGRAM_ALPHABET
+			 + ndpi_dga_char_idx(c0)) * NDPI_DGA_NGRAM_ALPHABET + ndpi_dga_char_idx(c1);
+
+	    word.num_trigram_checked++;
+
+	    if(ndpi_dga_ngram_match(ndpi_str->dga_trigrams, idx))
+	      word.num_trigram_found++, word.trigram_char_skip = 2 /* 1 char overlap */;
+	    else if(ndpi_verbose_dga_detection)
+	      printf("[NDPI] NO Trigram %c%c%c\n", cp, c0, c1);
+
+	    /* Count vowels */
+	    word.num_trigram_vowels += ndpi_is_vowel(cp) + ndpi_is_vowel(c0) + ndpi_is_vowel(c1);
+	  }
+	} else
+	  word.trigram_char_skip = 0;
+      }
+    }
+
+    j++;
+  }
+
+  ndpi_dga_end_word(&total, &word, &word_len, &num_words);
+
+  if(num_dots == 0) /* Doesn't look like a domain name */
+    return(0);
+
+  if(curr_domain_element_len > max_domain_element_len)
+    max_domain_element_len = curr_domain_element_len;
+
+  if(ndpi_verbose_dga_detection)
+    printf("[DGA] [max_num_char_repetitions: %u][max_domain_element_len: %u]\n",
+	   max_num_char_repetitions, max_domain_element_len);
+
+  if(
+     (is_hostname
+      && (num_dots > 5)
+      && (!first_element_is_numeric)
+      )
+     || (max_num_char_repetitions > 5 /* num or consecutive repeated chars */)
+     /*
+       In case of a name with too many consecutive chars an alert is triggered
+       This is the case for instance of the wildcard DNS query used by NetBIOS
+       (ckaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa) and that can be exploited
+       for reflection attacks
+       - https://www.akamai.com/uk/en/multimedia/documents/state-of-the-internet/ddos-reflection-netbios-name-server-rpc-portmap-sentinel-udp-threat-advisory.pdf
+       - http://ubiqx.org/cifs/NetBIOS.html
+     */
+     || ((max_domain_element_len >= 19 /* word too long. Example bbcbedxhgjmdobdprmen.com */) && ((num_char_repetitions > 1) || (num_digits > 1)))
+     ) {
+    if(ndpi_verbose_dga_detection)
+      printf("[DGA] Found!");
+
+    return(1);
+  }
+
+  if(total.double_dash)
+    return(0); /* Double dash */
+
+  len = j;
+
+  if(ndpi_verbose_dga_detection)
+    printf("[%s][num_found: %u][num_impossible: %u][num_digits: %u][num_bigram_checks: %u][num_vowels: %u/%u][num_trigram_vowels: %u][num_trigram_found: %u/%u][vowels: %u][rc: %u]\n",
+	   name, total.num_found, total.num_impossible, num_digits, total.num_bigram_checks, num_vowels, len,
+	   total.num_trigram_vowels, total.num_trigram_checked, total.num_trigram_found, num_vowels, rc);
+
+  if((len > 16) && (num_dots < 3) && ((num_vowels*4) < (len-num_dots))) {
+    if((total.num_trigram_checked > 2) && (total.num_trigram_vowels >= (total.num_trigram_found-1)))
+      ; /* skip me */
+    else
+      rc = 1;
+  }
+
+  if(total.num_bigram_checks
+     && (num_dots > 0)
+     && ((total.num_found == 0) || ((num_digits > 5) && (num_words <= 3))
+	 || enough(total.num_found, total.num_impossible)
+	 || ((total.num_trigram_checked > 2)
+	     && ((total.num_trigram_found < (total.num_trigram_checked/2))
+		 || ((total.num_trigram_vowels < (total.num_trigram_found-1)) && (total.num_dash == 0) && (num_dots > 1)))
+	     )
+	 )
+     )
+    rc = 1;
+
+  if((total.num_trigram_checked > 2) && (num_vowels == 0))
+    rc = 1;
+
+  if(total.num_dash > 2)
+    rc = 0;
+
+  if(ndpi_verbose_dga_detection) {
+    if(rc)
+      printf("DGA %s [num_found: %u][num_impossible: %u]\n",
+	     name, total.num_found, total.num_impossible);
+  }
+
+  return(rc);
+}
+
+/* ******************************************************************** */
+
 int ndpi_check_dga_name(struct ndpi_detection_module_struct *ndpi_str,
 			struct ndpi_flow_struct *flow,
 			char *name, u_int8_t is_hostname) {
@@ -7584,9 +8723,7 @@ int ndpi_check_dga_name(struct ndpi_detection_module_struct *ndpi_str,
       
     return(rc);
   } else {    
-    int len, rc = 0, trigram_char_skip = 0;
-    u_int8_t max_num_char_repetitions = 0, last_char = 0, num_char_repetitions = 0, num_dots = 0, num_trigram_dots = 0;
-    u_int8_t max_domain_element_len = 0, curr_domain_element_len = 0, first_element_is_numeric = 1;
+    int len, rc = 0;
 
     if((!name)
        || (strchr(name, '_') != NULL)
@@ -7611,237 +8748,64 @@ int ndpi_check_dga_name(struct ndpi_detection_module_struct *ndpi_str,
     len = strlen(name);
 
     if(len >= 5) {
-      int i, j, num_found = 0, num_impossible = 0, num_bigram_checks = 0,
-	num_trigram_found = 0, num_trigram_checked = 0, num_dash = 0,
-	num_digits = 0, num_vowels = 0, num_trigram_vowels = 0, num_words = 0, skip_next_bigram = 0;
-      char tmp[128], *word, *tok_tmp;
-      u_int max_tmp_len = sizeof(tmp)-1;
-
-      len = snprintf(tmp, max_tmp_len, "%s", name);
-      if(len < 0) {
-
-	if(ndpi_verbose_dga_detection)
-	  printf("[DGA] Too short");
-
-	return(0);
-      } else
-	tmp[len < max_tmp_len ? len : max_tmp_len] = '\0';
-
-      for(i=0, j=0; (i<len) && (j<max_tmp_len); i++) {
-	tmp[j] = tolower(name[i]);
-
-	if(tmp[j] == '.') {
-	  num_dots++;
-	} else if(num_dots == 0) {
-	  if(!isdigit(tmp[j]))
-	    first_element_is_numeric = 0;
-	}
-	
-	if(ndpi_is_vowel(tmp[j]))
-	  num_vowels++;
-	  
-	if(last_char == tmp[j]) {
-	  if(++num_char_repetitions > max_num_char_repetitions)
-	    max_num_char_repetitions = num_char_repetitions;
-	} else
-	  num_char_repetitions = 1, last_char = tmp[j];
-	
-	if(isdigit(tmp[j])) {
-	  num_digits++;
-	  
-	  if(((j+2)<len) && isdigit(tmp[j+1]) && (tmp[j+2] == '.')) {
-	    /* Check if there are too many digits */
-	    if(num_digits < 4)
-	      return(0); /* Double digits */
-	  }
-	}
-	
-	switch(tmp[j]) {
-	case '.':
-	case '-':
-	case '_':
-	case '/':
-	case ')':
-	case '(':
-	case ';':
-	case ':':
-	case '[':
-	case ']':
-	case ' ':
-	  /*
-	    Domain/word separator chars
+      /*
+	The same names (DNS query, then TLS SNI or HTTP Host) are checked
+	over and over: verdicts are cached by two independent hashes of the
+	lowercased name, its length and is_hostname, so that a colliding
+	name cannot reuse the verdict of another one
+      */
+      struct ndpi_dga_cache *c;
+      struct ndpi_dga_cache_entry *e, m;
+      u_int32_t key = 5381 /* ndpi_quick_hash() */, check = 2166136261U /* FNV-1a */;
+      u_int8_t use_cache = (ndpi_str->dga_cache != NULL) && (len <= 0xFFFF) && !ndpi_verbose_dga_detection;
+      u_int8_t found = 0;
 
-	    NOTE:
-	    this function is used also to detect other type of issues
-	    such as invalid/suspiciuous user agent
-	  */
-	  if(curr_domain_element_len > max_domain_element_len)
-	    max_domain_element_len = curr_domain_element_len;
+      if(use_cache) {
+	int i;
 
-	  curr_domain_element_len = 0;
-	  break;
+	for(i = 0; i < len; i++) {
+	  u_int8_t ch = tolower(name[i]);
 
-	default:
-	  curr_domain_element_len++;
-	  break;
+	  key = ((key << 5) + key) + ch, check = (check ^ ch) * 16777619U;
 	}
 
-	j++;
-      }
-
-      if(num_dots == 0) /* Doesn't look like a domain name */
-	return(0);
-
-      if(curr_domain_element_len > max_domain_element_len)
-	max_domain_element_len = curr_domain_element_len;
-
-      if(ndpi_verbose_dga_detection)
-	printf("[DGA] [max_num_char_repetitions: %u][max_domain_element_len: %u]\n",
-	       max_num_char_repetitions, max_domain_element_len);
-
-      if(
-	 (is_hostname
-	  && (num_dots > 5)
-	  && (!first_element_is_numeric)
-	  )
-	 || (max_num_char_repetitions > 5 /* num or consecutive repeated chars */)
-	 /*
-	   In case of a name with too many consecutive chars an alert is triggered
-	   This is the case for instance of the wildcard DNS query used by NetBIOS
-	   (ckaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa) and that can be exploited
-	   for reflection attacks
-	   - https://www.akamai.com/uk/en/multimedia/documents/state-of-the-internet/ddos-reflection-netbios-name-server-rpc-portmap-sentinel-udp-threat-advisory.pdf
-	   - http://ubiqx.org/cifs/NetBIOS.html
-	 */
-	 || ((max_domain_element_len >= 19 /* word too long. Example bbcbedxhgjmdobdprmen.com */) && ((num_char_repetitions > 1) || (num_digits > 1)))	       
-	 ) {
-	if(flow) ndpi_set_risk(flow, NDPI_SUSPICIOUS_DGA_DOMAIN);
+	m.key = key, m.check = check, m.len = len;
+	m.flags = NDPI_DGA_CACHE_VALID | (is_hostname ? NDPI_DGA_CACHE_HOSTNAME : 0);
 
-	if(ndpi_verbose_dga_detection)
-	  printf("[DGA] Found!");
+#ifdef __KERNEL__
+	local_bh_disable();
+	c = this_cpu_ptr(ndpi_str->dga_cache);
+#else
+	c = ndpi_str->dga_cache;
+#endif
+	e = &c->entries[key % NDPI_DGA_CACHE_SIZE];
 
-	return(1);
+	if((e->key == key) && (e->check == check) && (e->len == len)
+	   && ((e->flags & ~NDPI_DGA_CACHE_DGA) == m.flags))
+	  rc = (e->flags & NDPI_DGA_CACHE_DGA) ? 1 : 0, found = 1;
+#ifdef __KERNEL__
+	local_bh_enable();
+#endif
       }
 
-      tmp[j] = '\0';
-      len = j;
-
-      for(word = strtok_r(tmp, ".", &tok_tmp); ; word = strtok_r(NULL, ".", &tok_tmp)) {
-	if(!word) break;
-
-	num_words++;
-
-	if(strlen(word) < 3) continue;
-
-	if(ndpi_verbose_dga_detection)
-	  printf("-> word(%s) [%s][len: %u]\n", word, name, (unsigned int)strlen(word));
-
-	trigram_char_skip = 0;
-	
-	for(i = 0; word[i+1] != '\0'; i++) {
-	  switch(word[i]) {
-	  case '-':
-	    num_dash++;
-	    /*
-	      Let's check for double+consecutive --
-	      that are usually ok
-	      r2---sn-uxaxpu5ap5-2n5e.gvt1.com
-	    */
-	    if(word[i+1] == '-')
-	      return(0); /* Double dash */
-
-	  case '_':
-	  case ':':
-	    continue;
-	    break;
-
-	  case '.':
-	    continue;
-	    break;
-	  }
-	  num_bigram_checks++;
-
-	  if(ndpi_verbose_dga_detection)
-	    printf("-> Checking %c%c\n", word[i], word[i+1]);
-
-	  if(ndpi_match_bigram(ndpi_str,
-			       &ndpi_str->impossible_bigrams_automa,
-			       &word[i])) {
-	    if(ndpi_verbose_dga_detection)
-	      printf("IMPOSSIBLE %s\n", &word[i]);
-
-	    num_impossible++;
-	  } else {
-	    if(!skip_next_bigram) {
-	      if(ndpi_match_bigram(ndpi_str, &ndpi_str->bigrams_automa, &word[i])) {
-		num_found++, skip_next_bigram = 1;
-	      }
-	    } else
-	      skip_next_bigram = 0;
-	  }
-
-	  if((num_trigram_dots < 2) && (word[i+2] != '\0')) {
-	    if(ndpi_verbose_dga_detection)
-	      printf("***> %s [trigram_char_skip: %u]\n", &word[i], trigram_char_skip);
-	    
-	    if(ndpi_is_trigram_char(word[i]) && ndpi_is_trigram_char(word[i+1]) && ndpi_is_trigram_char(word[i+2])) {
-	      if(trigram_char_skip) {
-		trigram_char_skip--;
-	      } else {
-		num_trigram_checked++;
-
-		if(ndpi_match_trigram(ndpi_str, &ndpi_str->trigrams_automa, &word[i]))
-		  num_trigram_found++, trigram_char_skip = 2 /* 1 char overlap */;
-		else if(ndpi_verbose_dga_detection)
-		  printf("[NDPI] NO Trigram %c%c%c\n", word[i], word[i+1], word[i+2]);
-		
-		/* Count vowels */
-		num_trigram_vowels += ndpi_is_vowel(word[i]) + ndpi_is_vowel(word[i+1]) + ndpi_is_vowel(word[i+2]);
-	      }
-	    } else {
-	      if(word[i] == '.')
-		num_trigram_dots++;
-	      
-	      trigram_char_skip = 0;
-	    }
-	  }
-	} /* for */
-      } /* for */
-
-      if(ndpi_verbose_dga_detection)
-	printf("[%s][num_found: %u][num_impossible: %u][num_digits: %u][num_bigram_checks: %u][num_vowels: %u/%u][num_trigram_vowels: %u][num_trigram_found: %u/%u][vowels: %u][rc: %u]\n",
-	       name, num_found, num_impossible, num_digits, num_bigram_checks, num_vowels, len, num_trigram_vowels,
-	       num_trigram_checked, num_trigram_found, num_vowels, rc);
-
-      if((len > 16) && (num_dots < 3) && ((num_vowels*4) < (len-num_dots))) {
-	if((num_trigram_checked > 2) && (num_trigram_vowels >= (num_trigram_found-1)))
-	  ; /* skip me */
-	else
-	  rc = 1;
-      }
-      
-      if(num_bigram_checks
-	 && (num_dots > 0)
-	 && ((num_found == 0) || ((num_digits > 5) && (num_words <= 3))
-	     || enough(num_found, num_impossible)
-	     || ((num_trigram_checked > 2)
-		 && ((num_trigram_found < (num_trigram_checked/2))
-		     || ((num_trigram_vowels < (num_trigram_found-1)) && (num_dash == 0) && (num_dots > 1)))
-		 )
-	     )
-	 )
-	rc = 1;
+      if(!found) {
+	rc = ndpi_dga_score(ndpi_str, name, is_hostname);
 
-      if((num_trigram_checked > 2) && (num_vowels == 0))
-	rc = 1;
+	if(use_cache) {
+	  if(rc)
+	    m.flags |= NDPI_DGA_CACHE_DGA;
 
-      if(num_dash > 2)
-	rc = 0;
-      
-      if(ndpi_verbose_dga_detection) {
-	if(rc)
-	  printf("DGA %s [num_found: %u][num_impossible: %u]\n",
-		 name, num_found, num_impossible);
+#ifdef __KERNEL__
+	  local_bh_disable();
+	  c = this_cpu_ptr(ndpi_str->dga_cache);
+#else
+	  c = ndpi_str->dga_cache;
+#endif
+	  c->entries[key % NDPI_DGA_CACHE_SIZE] = m;
+#ifdef __KERNEL__
+	  local_bh_enable();
+#endif
+	}
       }
     }
 
@@ -29,8 +29,15 @@
 #include <sys/types.h>
 
 #include <time.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifndef WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #if defined __FreeBSD__ || defined __NetBSD__ || defined __OpenBSD__
@@ -94,15 +101,51 @@ static int ndpi_is_number(const char *str, u_int32_t str_len) {
  * It is recommended to provide a destination buffer (dst) which is as large as double the source buffer (src) at least.
  * Upon successful return, these functions return the number of characters printed (excluding the null byte used to terminate the string).
  */
+
+/* Bytes that are escaped or dropped (c < ' ' is also true for bytes >= 0x80 where char is signed) */
+#define NDPI_JSON_NEEDS_ESCAPE(c) (((c) < ' ') || ((c) == '"') || ((c) == '\\') || ((c) == '/'))
+
+/* Length of the leading run of src that can be copied verbatim */
+static inline int ndpi_json_clean_run(const char *src, int len) {
+  int i = 0;
+
+#if defined(__SSE2__) && (CHAR_MIN < 0)
+  const __m128i space = _mm_set1_epi8(' '), quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\'), slash = _mm_set1_epi8('/');
+
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, quote)),
+			     _mm_or_si128(_mm_cmpeq_epi8(v, bslash), _mm_cmpeq_epi8(v, slash)));
+    int mask = _mm_movemask_epi8(m);
+
+    if(mask)
+      return(i + __builtin_ctz(mask));
+  }
+#endif
+
+  while((i < len) && !NDPI_JSON_NEEDS_ESCAPE(src[i]))
+    i++;
+
+  return(i);
+}
+
 static int ndpi_json_string_escape(const char *src, int src_len, char *dst, int dst_max_len) {
   char c = 0;
-  int i, j = 0;
+  int i = 0, j = 0;
 
   dst[j++] = '"';
 
-  for(i = 0; i < src_len && j < dst_max_len; i++) {
+  while(i < src_len && j < dst_max_len) {
+    int run = ndpi_json_clean_run(&src[i], ndpi_min(src_len - i, dst_max_len - j));
+
+    if(run > 0) {
+      memcpy(&dst[j], &src[i], run);
+      i += run, j += run;
+      continue;
+    }
 
-    c = src[i];
+    c = src[i++];
 
     switch (c) {
     case '\\':
@@ -132,10 +175,7 @@ static int ndpi_json_string_escape(const char *src, int src_len, char *dst, int
       dst[j++] = 'r';
       break;
     default:
-      if(c < ' ')
-	; /* non printable */
-      else
-	dst[j++] = c;
+      ; /* non printable */
     }
   }
 
@@ -147,6 +187,159 @@ static int ndpi_json_string_escape(const char *src, int src_len, char *dst, int
 
 /* ********************************** */
 
+/*
+  snprintf() replacements for the number formats used by the serializer:
+  same output, same return value and same truncation/NULL termination
+*/
+
+static const char ndpi_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/* Writes the digits of v right to left ending at end, returns the first one */
+static inline char *ndpi_u32_digits(u_int32_t v, char *end) {
+  while(v >= 100) {
+    u_int32_t d = (v % 100) * 2;
+
+    v /= 100;
+    *--end = ndpi_digit_pairs[d + 1];
+    *--end = ndpi_digit_pairs[d];
+  }
+
+  if(v >= 10) {
+    *--end = ndpi_digit_pairs[v * 2 + 1];
+    *--end = ndpi_digit_pairs[v * 2];
+  } else
+    *--end = '0' + v;
+
+  return(end);
+}
+
+static inline char *ndpi_u64_digits(u_int64_t v, char *end) {
+  /* Peel 8 digits at a time so that the inner loop works on 32 bit values */
+  while(v > 0xFFFFFFFF) {
+    u_int32_t low = (u_int32_t)(v % 100000000);
+    char *stop = end - 8;
+
+    v /= 100000000;
+    end = ndpi_u32_digits(low, end);
+    while(end > stop) *--end = '0';
+  }
+
+  return(ndpi_u32_digits((u_int32_t)v, end));
+}
+
+static inline int ndpi_fmt_copy(char *buf, u_int32_t size, const char *src, int len) {
+  if((u_int32_t)len < size) {
+    memcpy(buf, src, len);
+    buf[len] = '\0';
+  } else if(size > 0) {
+    memcpy(buf, src, size - 1);
+    buf[size - 1] = '\0';
+  }
+
+  return(len);
+}
+
+static inline int ndpi_fmt_u64(char *buf, u_int32_t size, u_int64_t v, u_int8_t negative) {
+  char tmp[24], *end = &tmp[sizeof(tmp)], *p = ndpi_u64_digits(v, end);
+
+  if(negative) *--p = '-';
+
+  return(ndpi_fmt_copy(buf, size, p, (int)(end - p)));
+}
+
+/* "%u" */
+static inline int ndpi_fmt_u32(char *buf, u_int32_t size, u_int32_t v) {
+  char tmp[12], *end = &tmp[sizeof(tmp)], *p = ndpi_u32_digits(v, end);
+
+  return(ndpi_fmt_copy(buf, size, p, (int)(end - p)));
+}
+
+/* "%d" */
+static inline int ndpi_fmt_i32(char *buf, u_int32_t size, int32_t v) {
+  char tmp[12], *end = &tmp[sizeof(tmp)], *p;
+
+  p = ndpi_u32_digits((v < 0) ? -(u_int32_t)v : (u_int32_t)v, end);
+  if(v < 0) *--p = '-';
+
+  return(ndpi_fmt_copy(buf, size, p, (int)(end - p)));
+}
+
+/* "\"%u\":" (JSON numeric key) */
+static inline int ndpi_fmt_json_key(char *buf, u_int32_t size, u_int32_t key) {
+  char tmp[16], *end = &tmp[sizeof(tmp)], *p;
+
+  *--end = ':', *--end = '"';
+  p = ndpi_u32_digits(key, end);
+  *--p = '"';
+
+  return(ndpi_fmt_copy(buf, size, p, (int)(&tmp[sizeof(tmp)] - p)));
+}
+
+/*
+  "%f" and "%.<0-9>f": the value is scaled and rounded as an integer. When
+  the scaled value is too large, or so close to a rounding tie that the
+  scaling error could change the last digit, snprintf() is used instead.
+  Any other format goes straight to snprintf().
+*/
+static int ndpi_fmt_float(char *buf, u_int32_t size, const char *format, double value) {
+  static const u_int64_t pow10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+  };
+  char tmp[40], *end = &tmp[sizeof(tmp)], *p = end;
+  double x, ip, frac;
+  u_int64_t r, int_part;
+  int prec;
+
+  if((format[0] != '%') || !isfinite(value))
+    goto fallback;
+
+  if((format[1] == 'f') && (format[2] == '\0'))
+    prec = 6;
+  else if((format[1] == '.') && isdigit(format[2]) && (format[3] == 'f') && (format[4] == '\0'))
+    prec = format[2] - '0';
+  else
+    goto fallback;
+
+  x = fabs(value) * (double)pow10[prec];
+  if(!(x < 1e15))
+    goto fallback;
+
+  ip = floor(x), frac = x - ip;
+  if(fabs(frac - 0.5) <= (x * 4.5e-16 + 1e-300))
+    goto fallback;
+
+  r = (u_int64_t)ip + ((frac > 0.5) ? 1 : 0);
+  int_part = r / pow10[prec];
+
+  if(prec > 0) {
+    char *stop = end - prec;
+
+    p = ndpi_u64_digits(r % pow10[prec], end);
+    while(p > stop) *--p = '0';
+    *--p = '.';
+  }
+
+  p = ndpi_u64_digits(int_part, p);
+  if(signbit(value)) *--p = '-';
+
+  return(ndpi_fmt_copy(buf, size, p, (int)(end - p)));
+
+ fallback:
+  return(snprintf(buf, size, format, value));
+}
+
+/* ********************************** */
+
 #if UNUSED
 /*
  * Similar to snprintf, this returns the number of bytes actually written
@@ -770,24 +963,18 @@ int ndpi_serialize_uint32_uint32(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *)
-        &serializer->buffer.data[serializer->status.buffer.size_used], 
-        buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], 
-      buff_diff, "%u", value);
+    serializer->status.buffer.size_used += ndpi_fmt_u32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%u", value);
+    serializer->status.buffer.size_used += ndpi_fmt_u32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
   } else {
     ndpi_serialization_type kt;
     u_int8_t type = 0;
@@ -838,24 +1025,18 @@ int ndpi_serialize_uint32_uint64(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-        "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_U64_FORMAT, (unsigned long long)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, 0);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_U64_FORMAT, (unsigned long long)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, 0);
   } else {
     if(value <= 0xffffffff) {
       return(ndpi_serialize_uint32_uint32(_serializer, key, value));
@@ -902,24 +1083,18 @@ int ndpi_serialize_uint32_int32(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
     
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *)
-        &serializer->buffer.data[serializer->status.buffer.size_used], 
-        buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], 
-      buff_diff, "%d", value);
+    serializer->status.buffer.size_used += ndpi_fmt_i32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%d", value);
+    serializer->status.buffer.size_used += ndpi_fmt_i32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
   } else {
     ndpi_serialization_type kt;
     u_int8_t type = 0;
@@ -970,24 +1145,18 @@ int ndpi_serialize_uint32_int64(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], 
-        buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], 
-      buff_diff, NDPI_I64_FORMAT, (long long int)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, (value < 0) ? -(u_int64_t)value : (u_int64_t)value, (value < 0));
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_I64_FORMAT, (long long int)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, (value < 0) ? -(u_int64_t)value : (u_int64_t)value, (value < 0));
   }
   else {
     if((value & 0xFFFFFFFF) == value) {
@@ -1036,18 +1205,18 @@ int ndpi_serialize_uint32_float(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
+    serializer->status.buffer.size_used += ndpi_fmt_float((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
+    serializer->status.buffer.size_used += ndpi_fmt_float((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
 
   } else {
     ndpi_serialization_type kt;
@@ -1092,8 +1261,7 @@ static int ndpi_serialize_uint32_binary(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], 
-        buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
     serializer->status.buffer.size_used += ndpi_json_string_escape(value, slen,
@@ -1104,9 +1272,7 @@ static int ndpi_serialize_uint32_binary(ndpi_serializer *_serializer,
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%s", value);
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, strlen(value));
   } else {
     ndpi_serialization_type kt;
     u_int8_t type = 0;
@@ -1155,24 +1321,18 @@ int ndpi_serialize_uint32_boolean(ndpi_serializer *_serializer,
     ndpi_serialize_json_pre(_serializer);
 
     if (!(serializer->status.flags & NDPI_SERIALIZER_STATUS_LIST)) {
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], 
-        buff_diff, "\"%u\":", key);
+      serializer->status.buffer.size_used += ndpi_fmt_json_key((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, key);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], 
-      buff_diff, "%s", value ? "true" : "false");
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value ? "true" : "false", value ? 4 : 5);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_uint32(serializer, key) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%s", value ? "true" : "false");
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value ? "true" : "false", value ? 4 : 5);
   }
 
   serializer->status.flags |= NDPI_SERIALIZER_STATUS_NOT_EMPTY;
@@ -1213,22 +1373,18 @@ int ndpi_serialize_binary_int32(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used += ndpi_json_string_escape(key, klen,
         (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
     
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, "%d", value);
+    serializer->status.buffer.size_used += ndpi_fmt_i32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%d", value);
+    serializer->status.buffer.size_used += ndpi_fmt_i32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
   } else {
     if(value <= 127 && value >= -128) {
       serializer->buffer.data[serializer->status.buffer.size_used++] = (ndpi_serialization_string << 4) | ndpi_serialization_int8;
@@ -1291,23 +1447,18 @@ int ndpi_serialize_binary_int64(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used += ndpi_json_string_escape(key, klen,
         (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-        ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_I64_FORMAT, (long long int)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, (value < 0) ? -(u_int64_t)value : (u_int64_t)value, (value < 0));
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_I64_FORMAT, (long long int)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, (value < 0) ? -(u_int64_t)value : (u_int64_t)value, (value < 0));
   } else {
     if ((value & 0xFFFFFFFF) == value) {
       return(ndpi_serialize_string_int32(_serializer, key, value));
@@ -1363,24 +1514,18 @@ int ndpi_serialize_binary_uint32(ndpi_serializer *_serializer,
       (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
 
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used],
-        buff_diff, ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used],
-      buff_diff, "%u", value);
+    serializer->status.buffer.size_used += ndpi_fmt_u32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%u", value);
+    serializer->status.buffer.size_used += ndpi_fmt_u32((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value);
   } else {
     if(value <= 0xff) {
       serializer->buffer.data[serializer->status.buffer.size_used++] = (ndpi_serialization_string << 4) | ndpi_serialization_uint8;
@@ -1464,24 +1609,18 @@ int ndpi_serialize_binary_uint64(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used += ndpi_json_string_escape(key, klen,
         (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-      serializer->status.buffer.size_used += snprintf((char *) 
-        &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-        ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) 
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_U64_FORMAT, (unsigned long long)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, 0);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      NDPI_U64_FORMAT, (unsigned long long)value);
+    serializer->status.buffer.size_used += ndpi_fmt_u64((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, 0);
   } else {
     if(value <= 0xffffffff) {
       return(ndpi_serialize_string_uint32(_serializer, key, value));
@@ -1543,14 +1682,14 @@ int ndpi_serialize_binary_float(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used++;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
+    serializer->status.buffer.size_used += ndpi_fmt_float((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
+    serializer->status.buffer.size_used += ndpi_fmt_float((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, format, value);
   } else {
     serializer->buffer.data[serializer->status.buffer.size_used++] = (ndpi_serialization_string << 4) | ndpi_serialization_float;
 
@@ -1607,7 +1746,7 @@ static int ndpi_serialize_binary_raw(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used += ndpi_json_string_escape(key, klen,
         (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-      serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
@@ -1623,9 +1762,7 @@ static int ndpi_serialize_binary_raw(ndpi_serializer *_serializer,
     if (ndpi_serializer_header_string(serializer, key, klen) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%s", value);
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value, strlen(value));
   } else {
     serializer->buffer.data[serializer->status.buffer.size_used++] = (ndpi_serialization_string << 4) | ndpi_serialization_string;
 
@@ -1709,22 +1846,18 @@ int ndpi_serialize_binary_boolean(ndpi_serializer *_serializer,
       serializer->status.buffer.size_used += ndpi_json_string_escape(key, klen,
         (char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-      serializer->status.buffer.size_used += snprintf((char *)
-        &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":");
+      serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, ":", 1);
       buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
     }
 
-    serializer->status.buffer.size_used += snprintf((char *)
-      &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, "%s",
-      value ? "true" : "false");
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value ? "true" : "false", value ? 4 : 5);
 
     ndpi_serialize_json_post(_serializer);
   } else if(serializer->fmt == ndpi_serialization_format_csv) {
     if (ndpi_serializer_header_string(serializer, key, strlen(key)) < 0) return(-1);
     ndpi_serialize_csv_pre(serializer);
     buff_diff = serializer->buffer.size - serializer->status.buffer.size_used;
-    serializer->status.buffer.size_used += snprintf((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff,
-      "%s", value ? "true" : "false");
+    serializer->status.buffer.size_used += ndpi_fmt_copy((char *) &serializer->buffer.data[serializer->status.buffer.size_used], buff_diff, value ? "true" : "false", value ? 4 : 5);
   }
 
   serializer->status.flags |= NDPI_SERIALIZER_STATUS_NOT_EMPTY;
@@ -2572,6 +2705,274 @@ int ndpi_deserialize_clone_all(ndpi_deserializer *deserializer, ndpi_serializer
 
   return(0);
 }
+
+/* ********************************** */
+/* ********************************** */
+
+int ndpi_init_flow_exporter(ndpi_flow_exporter *exporter, int fd,
+			    u_int32_t batch_size, u_int32_t flush_interval_ms) {
+  memset(exporter, 0, sizeof(*exporter));
+
+  if(batch_size == 0)
+    batch_size = NDPI_FLOW_EXPORT_DEFAULT_BATCH;
+
+  if(batch_size < NDPI_FLOW_EXPORT_MAGIC_LEN + NDPI_SERIALIZER_DEFAULT_BUFFER_SIZE)
+    batch_size = NDPI_FLOW_EXPORT_MAGIC_LEN + NDPI_SERIALIZER_DEFAULT_BUFFER_SIZE;
+
+  if(ndpi_init_serializer(&exporter->serializer, ndpi_serialization_format_tlv) == -1)
+    return(-1);
+
+  if((exporter->batch = (u_int8_t*)ndpi_malloc(batch_size)) == NULL) {
+    ndpi_term_serializer(&exporter->serializer);
+    return(-1);
+  }
+
+  exporter->fd = fd;
+  exporter->batch_size = batch_size;
+  exporter->flush_interval_ms = flush_interval_ms;
+
+  /* The stream header goes out with the first batch */
+  memcpy(exporter->batch, NDPI_FLOW_EXPORT_MAGIC, NDPI_FLOW_EXPORT_MAGIC_LEN);
+  exporter->batch_used = NDPI_FLOW_EXPORT_MAGIC_LEN;
+
+  return(0);
+}
+
+/* ********************************** */
+
+void ndpi_flow_exporter_set_flush_cb(ndpi_flow_exporter *exporter,
+				     ndpi_flow_export_flush_cb cb, void *user_data) {
+  exporter->flush_cb = cb;
+  exporter->flush_cb_data = user_data;
+}
+
+/* ********************************** */
+
+ndpi_serializer *ndpi_flow_exporter_begin(ndpi_flow_exporter *exporter) {
+  ndpi_reset_serializer(&exporter->serializer);
+  return(&exporter->serializer);
+}
+
+/* ********************************** */
+
+int ndpi_flow_exporter_flush(ndpi_flow_exporter *exporter) {
+  u_int32_t off = 0;
+  int rc = 0;
+
+  if(exporter->batch_used == 0)
+    return(0);
+
+  if(exporter->flush_cb) {
+    if(exporter->flush_cb(exporter->batch, exporter->batch_used, exporter->flush_cb_data) < 0)
+      rc = -1;
+  }
+
+#ifndef WIN32
+  while((exporter->fd >= 0) && (off < exporter->batch_used)) {
+    ssize_t n = write(exporter->fd, &exporter->batch[off], exporter->batch_used - off);
+
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      rc = -1;
+      break;
+    }
+
+    off += (u_int32_t)n;
+  }
+#endif
+
+  if(rc != 0)
+    exporter->num_errors++;
+
+  exporter->num_bytes += exporter->batch_used;
+  exporter->num_flushes++;
+  exporter->batch_used = 0;
+
+  return(rc);
+}
+
+/* ********************************** */
+
+int ndpi_flow_exporter_tick(ndpi_flow_exporter *exporter, u_int64_t now_ms) {
+  if(exporter->last_flush_ms == 0)
+    exporter->last_flush_ms = now_ms;
+  else if(exporter->flush_interval_ms
+	  && (now_ms - exporter->last_flush_ms) >= exporter->flush_interval_ms) {
+    exporter->last_flush_ms = now_ms;
+    return(ndpi_flow_exporter_flush(exporter));
+  }
+
+  return(0);
+}
+
+/* ********************************** */
+
+int ndpi_flow_exporter_commit(ndpi_flow_exporter *exporter, u_int64_t now_ms) {
+  ndpi_private_serializer *serializer = (ndpi_private_serializer*)&exporter->serializer;
+  u_int32_t rec_len, frame_len, len_n;
+  int rc = 0;
+
+  if(ndpi_serialize_end_of_record(&exporter->serializer) < 0)
+    return(-1);
+
+  rec_len = serializer->status.buffer.size_used;
+  frame_len = sizeof(u_int32_t) + rec_len;
+
+  if(exporter->batch_used + frame_len > exporter->batch_size) {
+    rc = ndpi_flow_exporter_flush(exporter);
+
+    if(frame_len > exporter->batch_size) {
+      /* Larger than a whole batch: grow it rather than dropping the record */
+      u_int8_t *b = (u_int8_t*)ndpi_realloc(exporter->batch, exporter->batch_size, frame_len);
+
+      if(b == NULL) {
+	exporter->num_errors++;
+	return(-1);
+      }
+
+      exporter->batch = b, exporter->batch_size = frame_len;
+    }
+  }
+
+  len_n = htonl(rec_len);
+  memcpy(&exporter->batch[exporter->batch_used], &len_n, sizeof(len_n));
+  memcpy(&exporter->batch[exporter->batch_used + sizeof(len_n)], serializer->buffer.data, rec_len);
+  exporter->batch_used += frame_len;
+  exporter->num_records++;
+
+  if(ndpi_flow_exporter_tick(exporter, now_ms) < 0)
+    rc = -1;
+
+  return(rc);
+}
+
+/* ********************************** */
+
+void ndpi_term_flow_exporter(ndpi_flow_exporter *exporter) {
+  ndpi_flow_exporter_flush(exporter);
+  ndpi_term_serializer(&exporter->serializer);
+
+  if(exporter->batch) {
+    ndpi_free(exporter->batch);
+    exporter->batch = NULL;
+  }
+}
+
+/* ********************************** */
+
+int ndpi_flow_record_reader_init_buf(ndpi_flow_record_reader *reader, u_int8_t *buf, u_int64_t buf_len) {
+  memset(reader, 0, sizeof(*reader));
+
+  if((buf_len < NDPI_FLOW_EXPORT_MAGIC_LEN)
+     || memcmp(buf, NDPI_FLOW_EXPORT_MAGIC, NDPI_FLOW_EXPORT_MAGIC_LEN))
+    return(-1);
+
+  reader->data = buf, reader->size = buf_len;
+  reader->offset = NDPI_FLOW_EXPORT_MAGIC_LEN;
+
+  return(0);
+}
+
+/* ********************************** */
+
+int ndpi_flow_record_reader_open(ndpi_flow_record_reader *reader, const char *path) {
+  u_int8_t *buf;
+  u_int64_t len;
+  int rc;
+#ifndef WIN32
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0)
+    return(-1);
+
+  if((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+    close(fd);
+    return(-1);
+  }
+
+  len = (u_int64_t)st.st_size;
+  buf = (u_int8_t*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(buf == (u_int8_t*)MAP_FAILED)
+    return(-1);
+
+#ifdef MADV_SEQUENTIAL
+  madvise(buf, len, MADV_SEQUENTIAL);
+#endif
+#else
+  FILE *fd = fopen(path, "rb");
+  long flen;
+
+  if(fd == NULL)
+    return(-1);
+
+  fseek(fd, 0, SEEK_END);
+  flen = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+
+  if((flen <= 0) || ((buf = (u_int8_t*)ndpi_malloc(flen)) == NULL)) {
+    fclose(fd);
+    return(-1);
+  }
+
+  len = (u_int64_t)fread(buf, 1, flen, fd);
+  fclose(fd);
+#endif
+
+  if((rc = ndpi_flow_record_reader_init_buf(reader, buf, len)) != 0) {
+#ifndef WIN32
+    munmap(buf, len);
+#else
+    ndpi_free(buf);
+#endif
+    return(rc);
+  }
+
+  reader->mapped = 1;
+
+  return(0);
+}
+
+/* ********************************** */
+
+int ndpi_flow_record_reader_next(ndpi_flow_record_reader *reader, ndpi_deserializer *deserializer) {
+  u_int32_t rec_len;
+
+  if(reader->offset == reader->size)
+    return(0);
+
+  if(reader->size - reader->offset < sizeof(u_int32_t))
+    return(-1); /* Truncated frame */
+
+  memcpy(&rec_len, &reader->data[reader->offset], sizeof(rec_len));
+  rec_len = ntohl(rec_len);
+
+  if(reader->size - reader->offset - sizeof(u_int32_t) < rec_len)
+    return(-1);
+
+  if(ndpi_init_deserializer_buf(deserializer, &reader->data[reader->offset + sizeof(u_int32_t)], rec_len) != 0)
+    return(-2);
+
+  reader->offset += sizeof(u_int32_t) + rec_len;
+
+  return(1);
+}
+
+/* ********************************** */
+
+void ndpi_flow_record_reader_close(ndpi_flow_record_reader *reader) {
+  if(reader->mapped && reader->data) {
+#ifndef WIN32
+    munmap(reader->data, reader->size);
+#else
+    ndpi_free(reader->data);
+#endif
+  }
+
+  memset(reader, 0, sizeof(*reader));
+}
 #else
 int ndpi_serialize_string_string(ndpi_serializer *_serializer,
 				 const char *key, const char *_value) {
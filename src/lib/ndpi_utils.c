@@ -53,6 +53,7 @@
 
 #include "third_party/include/ndpi_patricia.h"
 #include "third_party/include/ht_hash.h"
+#include "third_party/include/ndpi_md5.h"
 
 #ifndef __KERNEL__
 #include "third_party/include/libinjection.h"
@@ -1310,21 +1311,18 @@ int ndpi_dpi2json(struct ndpi_detection_module_struct *ndpi_struct,
 
 /* ********************************** */
 
-/* NOTE: serializer is initialized by the function */
-int ndpi_flow2json(struct ndpi_detection_module_struct *ndpi_struct,
-		   struct ndpi_flow_struct *flow,
-		   u_int8_t ip_version,
-		   u_int8_t l4_protocol, u_int16_t vlan_id,
-		   u_int32_t src_v4, u_int32_t dst_v4,
-		   struct ndpi_in6_addr *src_v6, struct ndpi_in6_addr *dst_v6,
-		   u_int16_t src_port, u_int16_t dst_port,
-		   ndpi_protocol l7_protocol,
-		   ndpi_serializer *serializer) {
+/* NOTE: serializer must be already initialized (e.g. a reused TLV one) */
+int ndpi_flow2serializer(struct ndpi_detection_module_struct *ndpi_struct,
+			 struct ndpi_flow_struct *flow,
+			 u_int8_t ip_version,
+			 u_int8_t l4_protocol, u_int16_t vlan_id,
+			 u_int32_t src_v4, u_int32_t dst_v4,
+			 struct ndpi_in6_addr *src_v6, struct ndpi_in6_addr *dst_v6,
+			 u_int16_t src_port, u_int16_t dst_port,
+			 ndpi_protocol l7_protocol,
+			 ndpi_serializer *serializer) {
   char src_name[32], dst_name[32];
 
-  if(ndpi_init_serializer(serializer, ndpi_serialization_format_json) == -1)
-    return(-1);
-
   if(ip_version == 4) {
     inet_ntop(AF_INET, &src_v4, src_name, sizeof(src_name));
     inet_ntop(AF_INET, &dst_v4, dst_name, sizeof(dst_name));
@@ -1363,6 +1361,26 @@ int ndpi_flow2json(struct ndpi_detection_module_struct *ndpi_struct,
 
 /* ********************************** */
 
+/* NOTE: serializer is initialized by the function */
+int ndpi_flow2json(struct ndpi_detection_module_struct *ndpi_struct,
+		   struct ndpi_flow_struct *flow,
+		   u_int8_t ip_version,
+		   u_int8_t l4_protocol, u_int16_t vlan_id,
+		   u_int32_t src_v4, u_int32_t dst_v4,
+		   struct ndpi_in6_addr *src_v6, struct ndpi_in6_addr *dst_v6,
+		   u_int16_t src_port, u_int16_t dst_port,
+		   ndpi_protocol l7_protocol,
+		   ndpi_serializer *serializer) {
+  if(ndpi_init_serializer(serializer, ndpi_serialization_format_json) == -1)
+    return(-1);
+
+  return(ndpi_flow2serializer(ndpi_struct, flow, ip_version, l4_protocol, vlan_id,
+			      src_v4, dst_v4, src_v6, dst_v6, src_port, dst_port,
+			      l7_protocol, serializer));
+}
+
+/* ********************************** */
+
 const char* ndpi_tunnel2str(ndpi_packet_tunnel tt) {
   switch(tt) {
   case ndpi_no_tunnel:
@@ -1427,6 +1445,49 @@ static int ndpi_url_decode(const char *s, char *out) {
 
 /* ********************************** */
 
+/* URL validation cost counters: collected only when profiling is enabled */
+static struct ndpi_url_check_stats url_check_stats;
+static volatile u_int8_t url_check_profiling = 0;
+
+#define NDPI_URL_CHECK_COUNT(field, n) \
+  do { if(url_check_profiling) __sync_fetch_and_add(&url_check_stats.field, (n)); } while(0)
+
+static u_int64_t ndpi_url_check_nsec() {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return((u_int64_t)tv.tv_sec * 1000000000 + (u_int64_t)tv.tv_usec * 1000);
+#endif
+}
+
+static void ndpi_url_check_account(struct ndpi_url_check_counters *c, u_int64_t t0, int matched) {
+  __sync_fetch_and_add(&c->nsec, ndpi_url_check_nsec() - t0);
+  __sync_fetch_and_add(&c->calls, 1);
+  if(matched) __sync_fetch_and_add(&c->matches, 1);
+}
+
+static int ndpi_url_check_run(int (*check)(char *), char *query, struct ndpi_url_check_counters *c) {
+  u_int64_t t0;
+  int rc;
+
+  if(!url_check_profiling)
+    return(check(query));
+
+  t0 = ndpi_url_check_nsec();
+  rc = check(query);
+  ndpi_url_check_account(c, t0, rc);
+
+  return(rc);
+}
+
+/* ********************************** */
+
 static int ndpi_is_sql_injection(char* query) {
   struct libinjection_sqli_state state;
 
@@ -1480,22 +1541,118 @@ static void ndpi_compile_rce_regex() {
   free((void *)pcreErrorStr);
 }
 
+/*
+  Single pass prefilter: gate tokens of the regexes and shell/PowerShell
+  commands are searched at once; rep.number holds the gates of a token
+  or RCE_TOKEN_COMMAND for a command
+*/
+#define RCE_TOKEN_COMMAND 0x80000000
+
+static AC_AUTOMATA_t *rce_automa = NULL;
+
+static int ndpi_rce_match_handler(AC_MATCH_t *m, AC_TEXT_t *txt, AC_REP_t *match) {
+  unsigned int i;
+
+  for(i = 0; i < m->match_num; i++) {
+    AC_PATTERN_t *p = &m->patterns[i];
+
+    if(p->rep.number & RCE_TOKEN_COMMAND) {
+      /* The automa ignores case while commands are case sensitive (as with strstr) */
+      if(memcmp(&txt->astring[m->position - p->length], p->astring, p->length) == 0) {
+	match->breed = 1;
+	return(1); /* Stop searching */
+      }
+    } else
+      match->number |= p->rep.number;
+  }
+
+  return(0);
+}
+
+static int ndpi_add_rce_token(const char *token, u_int32_t value) {
+  AC_PATTERN_t ac_pattern;
+
+  memset(&ac_pattern, 0, sizeof(ac_pattern));
+  ac_pattern.astring = (char*)token;
+  ac_pattern.length = strlen(token);
+  ac_pattern.rep.number = value;
+
+  return((ac_automata_add(rce_automa, &ac_pattern) == ACERR_SUCCESS) ? 0 : -1);
+}
+
+static void ndpi_compile_rce_prefilter() {
+  size_t i;
+  int rc = 0;
+
+  if((rce_automa = ac_automata_init(ndpi_rce_match_handler)) == NULL)
+    return;
+
+  ac_automata_feature(rce_automa, AC_FEATURE_LC);
+
+  for(i = 0; i < sizeof(rce_gate_tokens) / sizeof(rce_gate_tokens[0]); i++)
+    rc |= ndpi_add_rce_token(rce_gate_tokens[i].token, rce_gate_tokens[i].gate);
+
+  for(i = 0; i < sizeof(ush_commands) / sizeof(ush_commands[0]); i++)
+    rc |= ndpi_add_rce_token(ush_commands[i], RCE_TOKEN_COMMAND);
+
+  for(i = 0; i < sizeof(pwsh_commands) / sizeof(pwsh_commands[0]); i++)
+    rc |= ndpi_add_rce_token(pwsh_commands[i], RCE_TOKEN_COMMAND);
+
+  if((rc != 0) || (ac_automata_finalize(rce_automa) != ACERR_SUCCESS)) {
+    /* A missing token would hide matches: run all checks */
+    ac_automata_release(rce_automa, 0);
+    rce_automa = NULL;
+  }
+}
+
+/* ********************************** */
+
 static int ndpi_is_rce_injection(char* query) {
   if(!initialized_comp_rx) {
     ndpi_compile_rce_regex();
+    ndpi_compile_rce_prefilter();
     initialized_comp_rx = 1;
   }
 
   int pcreExecRet;
   int subStrVec[30];
+  unsigned int length = strlen(query);
+  u_int32_t gates = 0xFF;
+  u_int8_t prefiltered = 0;
+
+  if(rce_automa && (length <= 0xFFFF /* AC_TEXT_t length */)) {
+    AC_TEXT_t ac_input_text;
+    AC_REP_t match;
+
+    memset(&match, 0, sizeof(match));
+    ac_input_text.astring = query, ac_input_text.length = length, ac_input_text.ignore_case = 0;
+    ac_automata_search(rce_automa, &ac_input_text, &match);
+
+    if(match.breed) {
+      NDPI_URL_CHECK_COUNT(rce_command_matches, 1);
+      return 1;
+    }
+
+    gates = match.number, prefiltered = 1;
+  }
 
   for(int i = 0; i < N_RCE_REGEX; i++) {
-    unsigned int length = strlen(query);
+    u_int64_t t0 = 0;
+
+    if(!(rce_regex_gate[i] & gates)) {
+      NDPI_URL_CHECK_COUNT(rce_regex_skipped, 1);
+      continue;
+    }
+
+    if(url_check_profiling) t0 = ndpi_url_check_nsec();
 
     pcreExecRet = pcre_exec(comp_rx[i]->compiled,
                             comp_rx[i]->optimized,
                             query, length, 0, 0, subStrVec, 30);
 
+    if(url_check_profiling)
+      ndpi_url_check_account(&url_check_stats.rce_regex, t0, pcreExecRet >= 0);
+
     if(pcreExecRet >= 0) {
       return 1;
     }
@@ -1528,6 +1685,9 @@ static int ndpi_is_rce_injection(char* query) {
 #endif
   }
 
+  if(prefiltered)
+    return 0; /* Commands have already been searched */
+
   size_t ushlen = sizeof(ush_commands) / sizeof(ush_commands[0]);
 
   for(int i = 0; i < ushlen; i++) {
@@ -1555,6 +1715,8 @@ ndpi_risk_enum ndpi_validate_url(char *url) {
   char *orig_str = NULL, *str = NULL, *question_mark = strchr(url, '?');
   ndpi_risk_enum rc = NDPI_NO_RISK;
 
+  NDPI_URL_CHECK_COUNT(num_urls, 1);
+
   if(question_mark) {
     char *tmp;
 
@@ -1582,12 +1744,14 @@ ndpi_risk_enum ndpi_validate_url(char *url) {
 	} else if(decoded[0] != '\0') {
 	  /* Valid string */
 
-	  if(ndpi_is_xss_injection(decoded))
+	  NDPI_URL_CHECK_COUNT(num_values, 1);
+
+	  if(ndpi_url_check_run(ndpi_is_xss_injection, decoded, &url_check_stats.xss))
 	    rc = NDPI_URL_POSSIBLE_XSS;
-	  else if(ndpi_is_sql_injection(decoded))
+	  else if(ndpi_url_check_run(ndpi_is_sql_injection, decoded, &url_check_stats.sqli))
 	    rc = NDPI_URL_POSSIBLE_SQL_INJECTION;
 #ifdef HAVE_PCRE
-	  else if(ndpi_is_rce_injection(decoded))
+	  else if(ndpi_url_check_run(ndpi_is_rce_injection, decoded, &url_check_stats.rce))
 	    rc = NDPI_URL_POSSIBLE_RCE_INJECTION;
 #endif
 
@@ -1619,6 +1783,26 @@ ndpi_risk_enum ndpi_validate_url(char *url) {
 
   return(rc);
 }
+
+/* ********************************** */
+
+void ndpi_url_check_profiling(u_int8_t enable) {
+  url_check_profiling = enable ? 1 : 0;
+}
+
+/* ********************************** */
+
+/* Counters are updated without locking the whole struct: a snapshot taken
+   while URLs are validated can be slightly inconsistent */
+void ndpi_get_url_check_stats(struct ndpi_url_check_stats *stats) {
+  memcpy(stats, &url_check_stats, sizeof(*stats));
+}
+
+/* ********************************** */
+
+void ndpi_reset_url_check_stats(void) {
+  memset(&url_check_stats, 0, sizeof(url_check_stats));
+}
 #endif
 /* ******************************************************************** */
 
@@ -1999,4 +2183,158 @@ void ndpi_set_risk(struct ndpi_flow_struct *flow, ndpi_risk_enum r) {
   flow->risk |= v;
 }
 
+/* ******************************************************************** */
+
+/*
+  Streaming fingerprint (JA3, HASSH): the fields are hashed as they are
+  appended, staged in a small buffer so that MD5 is fed in 64 byte blocks.
+
+  The string is limited to max_len characters with the semantic of the
+  snprintf() calls into a fixed size buffer it replaces: a write that does
+  not fit is not accounted, but its truncated prefix stays at the end of the
+  string until the next write that fits. That prefix is hashed on a copy of
+  the context (tail), used if nothing else fits before the end.
+*/
+
+void ndpi_fingerprint_init(struct ndpi_fingerprint *fp, struct ndpi_MD5Context *md5,
+			   struct ndpi_MD5Context *tail, u_int16_t max_len) {
+  fp->md5 = md5, fp->tail = tail;
+  fp->len = 0, fp->max_len = max_len;
+  fp->buf_len = 0, fp->has_tail = 0, fp->sealed = 0;
+  ndpi_MD5Init(md5);
+}
+
+/* ******************************************************************** */
+
+static inline void ndpi_fingerprint_flush(struct ndpi_fingerprint *fp) {
+  if(fp->buf_len) {
+    ndpi_MD5Update(fp->md5, (const unsigned char *)fp->buf, fp->buf_len);
+    fp->buf_len = 0;
+  }
+}
+
+/* ******************************************************************** */
+
+static void ndpi_fingerprint_commit(struct ndpi_fingerprint *fp, const char *str, u_int32_t len) {
+  if(fp->buf_len + len > sizeof(fp->buf)) {
+    ndpi_fingerprint_flush(fp);
+
+    if(len >= sizeof(fp->buf)) {
+      ndpi_MD5Update(fp->md5, (const unsigned char *)str, len);
+      return;
+    }
+  }
+
+  memcpy(&fp->buf[fp->buf_len], str, len);
+  fp->buf_len += len;
+}
+
+/* ******************************************************************** */
+
+/* One write made of num_parts strings: 0 if it fits, -1 otherwise */
+static int ndpi_fingerprint_write(struct ndpi_fingerprint *fp, const char **parts,
+				  const u_int32_t *lens, u_int num_parts) {
+  u_int32_t len = 0, room = fp->max_len - fp->len;
+  u_int i;
+
+  if(fp->sealed)
+    return(-1);
+
+  for(i = 0; i < num_parts; i++)
+    len += lens[i];
+
+  if(len > room) {
+    if(fp->tail) {
+      ndpi_fingerprint_flush(fp);
+      memcpy(fp->tail, fp->md5, sizeof(ndpi_MD5_CTX));
+
+      for(i = 0; (i < num_parts) && (room > 0); i++) {
+	len = ndpi_min(lens[i], room);
+	ndpi_MD5Update(fp->tail, (const unsigned char *)parts[i], len);
+	room -= len;
+      }
+
+      fp->has_tail = 1;
+    }
+
+    return(-1);
+  }
+
+  for(i = 0; i < num_parts; i++)
+    ndpi_fingerprint_commit(fp, parts[i], lens[i]);
+
+  fp->len += len, fp->has_tail = 0;
+
+  return(0);
+}
+
+/* ******************************************************************** */
+
+int ndpi_fingerprint_append(struct ndpi_fingerprint *fp, const char *str, u_int32_t len) {
+  return(ndpi_fingerprint_write(fp, &str, &len, 1));
+}
+
+/* ******************************************************************** */
+
+int ndpi_fingerprint_append_u16(struct ndpi_fingerprint *fp, char sep, u_int16_t value) {
+  char tmp[6];
+  u_int8_t i = sizeof(tmp);
+
+  do {
+    tmp[--i] = '0' + (value % 10);
+    value /= 10;
+  } while(value);
+
+  if(sep != '\0')
+    tmp[--i] = sep;
+
+  return(ndpi_fingerprint_append(fp, &tmp[i], sizeof(tmp) - i));
+}
 
+/* ******************************************************************** */
+
+/* Single write of sep field[0] sep field[1] ... */
+int ndpi_fingerprint_append_fields(struct ndpi_fingerprint *fp, char sep,
+				   const char **fields, u_int num_fields) {
+  const char *parts[8];
+  u_int32_t lens[8];
+  u_int i;
+
+  if(num_fields > 4)
+    return(-1);
+
+  for(i = 0; i < num_fields; i++) {
+    parts[i*2] = &sep, lens[i*2] = 1;
+    parts[i*2+1] = fields[i], lens[i*2+1] = strlen(fields[i]);
+  }
+
+  return(ndpi_fingerprint_write(fp, parts, lens, num_fields * 2));
+}
+
+/* ******************************************************************** */
+
+/* The string ends here: no further write is accounted */
+void ndpi_fingerprint_seal(struct ndpi_fingerprint *fp) {
+  if(fp->has_tail) {
+    memcpy(fp->md5, fp->tail, sizeof(ndpi_MD5_CTX));
+    fp->has_tail = 0;
+  }
+
+  fp->sealed = 1;
+}
+
+/* ******************************************************************** */
+
+void ndpi_fingerprint_final(struct ndpi_fingerprint *fp, u_int8_t digest[16],
+			    char hex[33], u_int8_t upper_case) {
+  const char *digits = upper_case ? "0123456789ABCDEF" : "0123456789abcdef";
+  int i;
+
+  ndpi_fingerprint_flush(fp);
+  ndpi_MD5Final(digest, fp->has_tail ? fp->tail : fp->md5);
+
+  for(i = 0; i < 16; i++)
+    hex[i*2] = digits[digest[i] >> 4], hex[i*2+1] = digits[digest[i] & 0x0F];
+
+  hex[32] = '\0';
+}
@@ -54,6 +54,9 @@ extern struct kmem_cache *bt_port_cache;
 
 #endif
 
+/* Peers are charged to the NDPI_MEM_CACHE memory budget */
+#define BT_NODE_SIZE(ht) (sizeof(struct hash_ip4p_node) + ((ht)->ipv6 ? 12:0))
+
 time_t ndpi_bt_node_expire = 1200; /* time in seconds */
 
 #ifndef __KERNEL__
@@ -157,6 +160,7 @@ for(key=0; key < ht->size; key++) {
 	while(n) {
 		t = n->next;
 		BT_N_FREE(n);
+		ndpi_mem_account(NDPI_MEM_CACHE, -(int64_t)BT_NODE_SIZE(ht));
 		n = t;
 	}
 	ht->tbl[key].top = NULL;
@@ -200,6 +204,7 @@ while(n) {
 	atomic_dec(&ht->count);
 	ret++;
 	BT_N_FREE(n);
+	ndpi_mem_account(NDPI_MEM_CACHE, -(int64_t)BT_NODE_SIZE(ht));
 	n = p;
 }
 return ret;
@@ -257,6 +262,7 @@ spin_lock(&ht->tbl[key].lock);
 	    }
 	    n = n->next;
 	}
+	if(ndpi_mem_shed()) goto unlock;
 	n = BT_N_MALLOC(sizeof(struct hash_ip4p_node)+12);
 	if(!n) goto unlock;
 	memcpy(&n->ip,ip->ipv6.u6_addr.u6_addr8,16);
@@ -271,12 +277,14 @@ spin_lock(&ht->tbl[key].lock);
 	    }
 	    n = n->next;
 	}
+	if(ndpi_mem_shed()) goto unlock; /* no new peers past the soft limit */
 	n = BT_N_MALLOC(sizeof(struct hash_ip4p_node));
 	if(!n) goto unlock;
 	n->ip = ip->ipv4;
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
     }
 #endif
+    ndpi_mem_account(NDPI_MEM_CACHE, BT_NODE_SIZE(ht));
     t = ht->tbl[key].top;
     n->next = t;
     n->prev = NULL;
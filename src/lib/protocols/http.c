@@ -447,7 +447,7 @@ int http_process_user_agent(struct ndpi_detection_module_struct *ndpi_struct,
   if(flow->http.user_agent == NULL) {
     int len = ua_ptr_len + 1;
 
-    flow->http.user_agent = ndpi_malloc(len);
+    flow->http.user_agent = ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, len);
     if(flow->http.user_agent) {
       memcpy(flow->http.user_agent, (char*)ua_ptr, ua_ptr_len);
       flow->http.user_agent[ua_ptr_len] = '\0';
@@ -518,7 +518,7 @@ static void check_content_type_and_change_protocol(struct ndpi_detection_module_
        && (packet->host_line.len < 21))
       ndpi_check_numeric_ip(ndpi_struct, flow, (char*)packet->host_line.ptr, packet->host_line.len);
 
-    flow->http.url = ndpi_malloc(len);
+    flow->http.url = ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, len);
     if(flow->http.url) {
       strncpy(flow->http.url, (char*)packet->host_line.ptr, packet->host_line.len);
       strncpy(&flow->http.url[packet->host_line.len], (char*)packet->http_url_name.ptr,
@@ -640,7 +640,7 @@ static void check_content_type_and_change_protocol(struct ndpi_detection_module_
       if((flow->http.request_content_type == NULL) && (packet->content_line.len > 0)) {
 	int len = packet->content_line.len + 1;
 	
-	flow->http.request_content_type = ndpi_malloc(len);
+	flow->http.request_content_type = ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, len);
 	if(flow->http.request_content_type) {
 	  strncpy(flow->http.request_content_type, (char*)packet->content_line.ptr,
 		  packet->content_line.len);
@@ -652,7 +652,7 @@ static void check_content_type_and_change_protocol(struct ndpi_detection_module_
       if((flow->http.content_type == NULL) && (packet->content_line.len > 0)) {
 	int len = packet->content_line.len + 1;
 	
-	flow->http.content_type = ndpi_malloc(len);
+	flow->http.content_type = ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, len);
 	if(flow->http.content_type) {
 	  strncpy(flow->http.content_type, (char*)packet->content_line.ptr,
 		  packet->content_line.len);
@@ -59,25 +59,20 @@ void ndpi_search_kerberos(struct ndpi_detection_module_struct *ndpi_struct,
   printf("\n[Kerberos] Process packet [len: %u]\n", packet->payload_packet_len);
 #endif
     
-  if(flow->kerberos_buf.pktbuf != NULL) {
-    u_int missing = flow->kerberos_buf.pktbuf_maxlen - flow->kerberos_buf.pktbuf_currlen;
-
-    if(packet->payload_packet_len <= missing) {
-      memcpy(&flow->kerberos_buf.pktbuf[flow->kerberos_buf.pktbuf_currlen], packet->payload, packet->payload_packet_len);
-      flow->kerberos_buf.pktbuf_currlen += packet->payload_packet_len;
-
-      if(flow->kerberos_buf.pktbuf_currlen == flow->kerberos_buf.pktbuf_maxlen) {
+  if((flow->kerberos_buf.buffer != NULL) && (flow->kerberos_buf.max_expected > 0)) {
+    if(ndpi_tcp_reassembly_append(flow, &flow->kerberos_buf, flow->kerberos_buf.max_expected) == 1) {
+      if(flow->kerberos_buf.buffer_used == flow->kerberos_buf.max_expected) {
 	original_packet_payload = packet->payload;
 	original_payload_packet_len = packet->payload_packet_len;
-	packet->payload = (u_int8_t *)flow->kerberos_buf.pktbuf;
-	packet->payload_packet_len = flow->kerberos_buf.pktbuf_currlen;
+	packet->payload = flow->kerberos_buf.buffer;
+	packet->payload_packet_len = flow->kerberos_buf.buffer_used;
 #ifdef KERBEROS_DEBUG
 	printf("[Kerberos] Packet is now full: processing\n");
 #endif
       } else {
 #ifdef KERBEROS_DEBUG
 	printf("[Kerberos] Missing %u bytes: skipping\n",
-	       flow->kerberos_buf.pktbuf_maxlen - flow->kerberos_buf.pktbuf_currlen);
+	       flow->kerberos_buf.max_expected - flow->kerberos_buf.buffer_used);
 #endif
 
 	return;
@@ -109,23 +104,16 @@ void ndpi_search_kerberos(struct ndpi_detection_module_struct *ndpi_struct,
       */
       if(kerberos_len > expected_len) {
 	if(packet->tcp) {
-	  if(flow->kerberos_buf.pktbuf == NULL) {
-	    flow->kerberos_buf.pktbuf = (char*)ndpi_malloc(kerberos_len+4);
+	  /* Restart reassembly from this segment */
+	  ndpi_tcp_reassembly_reset(&flow->kerberos_buf);
+	  flow->kerberos_buf.max_expected = kerberos_len+4;
 
-	    if(flow->kerberos_buf.pktbuf != NULL) {
-	      flow->kerberos_buf.pktbuf_maxlen = kerberos_len+4;	      
+	  if(ndpi_tcp_reassembly_append(flow, &flow->kerberos_buf, flow->kerberos_buf.max_expected) != 1)
+	    flow->kerberos_buf.max_expected = 0;
 #ifdef KERBEROS_DEBUG
-	      printf("[Kerberos] Allocated %u bytes\n", flow->kerberos_buf.pktbuf_maxlen);
-#endif	      
-	    }
-	  }
-	  
-	  if(flow->kerberos_buf.pktbuf != NULL) {
-	    if(packet->payload_packet_len <= flow->kerberos_buf.pktbuf_maxlen) {
-	      memcpy(flow->kerberos_buf.pktbuf, packet->payload, packet->payload_packet_len);
-	      flow->kerberos_buf.pktbuf_currlen = packet->payload_packet_len;
-	    }
-	  }
+	  else
+	    printf("[Kerberos] Reassembling %u bytes\n", flow->kerberos_buf.max_expected);
+#endif
 	}
 	
 	return;
@@ -335,12 +323,12 @@ void ndpi_search_kerberos(struct ndpi_detection_module_struct *ndpi_struct,
 		    snprintf(flow->protos.kerberos.domain, sizeof(flow->protos.kerberos.domain), "%s", realm_str);
 
 		    /* If necessary we can decode sname */
-		    if(flow->kerberos_buf.pktbuf) {
-			    ndpi_free(flow->kerberos_buf.pktbuf);
-			    packet->payload = original_packet_payload;
-			    packet->payload_packet_len = original_payload_packet_len;
+		    if(original_packet_payload != NULL) {
+		      packet->payload = original_packet_payload;
+		      packet->payload_packet_len = original_payload_packet_len;
+		      original_packet_payload = NULL;
 		    }
-		    flow->kerberos_buf.pktbuf = NULL;
+		    ndpi_tcp_reassembly_free(flow, &flow->kerberos_buf);
 		  }
 		}
 	      }
@@ -349,12 +337,11 @@ void ndpi_search_kerberos(struct ndpi_detection_module_struct *ndpi_struct,
 		ndpi_int_kerberos_add_connection(ndpi_struct, flow);
 
 	      /* We set the protocol in the response */
-	      if(flow->kerberos_buf.pktbuf != NULL) {
-		ndpi_free(flow->kerberos_buf.pktbuf);
+	      if(original_packet_payload != NULL) {
 		packet->payload = original_packet_payload;
 		packet->payload_packet_len = original_payload_packet_len;
-		flow->kerberos_buf.pktbuf = NULL;
 	      }
+	      ndpi_tcp_reassembly_free(flow, &flow->kerberos_buf);
 	      
 	      return;
 	    } else if(msg_type == 0x0d) /* TGS-REP */ {
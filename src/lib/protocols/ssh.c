@@ -217,11 +217,27 @@ static void ndpi_int_ssh_add_connection(struct ndpi_detection_module_struct
 
 /* ************************************************************************ */
 
+/* Name lists are hashed as strncpy() used to copy them: zero padded after a NUL */
+static void hash_name_list(struct ndpi_fingerprint *fp, const u_int8_t *list, u_int32_t len) {
+  static const char zeros[64] = { 0 };
+  u_int32_t n = 0;
+
+  while((n < len) && (list[n] != '\0')) n++;
+  ndpi_fingerprint_append(fp, (const char *)list, n);
+
+  for(len -= n; len > 0; len -= n) {
+    n = ndpi_min(len, sizeof(zeros));
+    ndpi_fingerprint_append(fp, zeros, n);
+  }
+}
+
+/* ************************************************************************ */
+
 static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_struct,
 				    struct ndpi_flow_struct *flow,
 				    struct ndpi_packet_struct *packet,
-				    char *buf, u_int8_t client_hash) {
-  u_int32_t offset = 22, len, buf_out_len = 0, max_payload_len = packet->payload_packet_len-sizeof(u_int32_t);
+				    struct ndpi_fingerprint *fp, u_int8_t client_hash) {
+  u_int32_t offset = 22, len, max_payload_len = packet->payload_packet_len-sizeof(u_int32_t);
   const u_int32_t len_max = 65565;
     
   if(offset >= max_payload_len)
@@ -235,8 +251,8 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     goto invalid_payload;
 
   /* ssh.kex_algorithms [C/S] */
-  strncpy(buf, (const char *)&packet->payload[offset], buf_out_len = len);
-  buf[buf_out_len++] = ';';
+  hash_name_list(fp, &packet->payload[offset], len);
+  ndpi_fingerprint_append(fp, ";", 1);
   offset += len;
 
   if(offset >= max_payload_len)
@@ -260,10 +276,9 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
+    hash_name_list(fp, &packet->payload[offset], len);
     ssh_analyse_cipher(ndpi_struct, flow, (char*)&packet->payload[offset], len, 1 /* client */);
-    buf_out_len += len;
-    buf[buf_out_len++] = ';';
+    ndpi_fingerprint_append(fp, ";", 1);
   }
 
   if(len > len_max)
@@ -281,10 +296,9 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
+    hash_name_list(fp, &packet->payload[offset], len);
     ssh_analyse_cipher(ndpi_struct, flow, (char*)&packet->payload[offset], len, 0 /* server */);
-    buf_out_len += len;
-    buf[buf_out_len++] = ';';
+    ndpi_fingerprint_append(fp, ";", 1);
   }
 
   if(len > len_max)
@@ -301,9 +315,8 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
-    buf_out_len += len;
-    buf[buf_out_len++] = ';';
+    hash_name_list(fp, &packet->payload[offset], len);
+    ndpi_fingerprint_append(fp, ";", 1);
   }
   
   if(len > len_max)
@@ -320,9 +333,8 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
-    buf_out_len += len;
-    buf[buf_out_len++] = ';';
+    hash_name_list(fp, &packet->payload[offset], len);
+    ndpi_fingerprint_append(fp, ";", 1);
   }
 
   if(len > len_max)
@@ -340,8 +352,7 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
-    buf_out_len += len;
+    hash_name_list(fp, &packet->payload[offset], len);
   }
 
   if(len > len_max)
@@ -358,8 +369,7 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
     if((offset >= packet->payload_packet_len) || (len >= packet->payload_packet_len-offset-1))
       goto invalid_payload;
 
-    strncpy(&buf[buf_out_len], (const char *)&packet->payload[offset], len);
-    buf_out_len += len;
+    hash_name_list(fp, &packet->payload[offset], len);
   }
 
   if(len > len_max)
@@ -370,17 +380,16 @@ static u_int16_t concat_hash_string(struct ndpi_detection_module_struct *ndpi_st
 
   /* ssh.languages_server_to_client [None] */
 
-#ifdef SSH_DEBUG
-  printf("[SSH] %s\n", buf);
-#endif
-
-  return(buf_out_len);
+  return(fp->len);
 
  invalid_payload:
 #ifdef SSH_DEBUG
   printf("[SSH] Invalid packet payload\n");
 #endif
 
+  /* As before, an invalid payload gets the fingerprint of an empty string */
+  ndpi_fingerprint_init(fp, fp->md5, fp->tail, fp->max_len);
+
   return(0);
 }
 
@@ -457,56 +466,29 @@ static void ndpi_search_ssh_tcp(struct ndpi_detection_module_struct *ndpi_struct
     ndpi_MD5_CTX ctx;
     
     if(msgcode == 20 /* key exchange init */) {
-      char *hassh_buf = ndpi_calloc(packet->payload_packet_len, sizeof(char));
-      u_int i, len;
+      struct ndpi_fingerprint fp;
+      u_char fingerprint[16];
 
 #ifdef SSH_DEBUG
       printf("[SSH] [stage: %u][msg: %u][direction: %u][key exchange init]\n", flow->l4.tcp.ssh_stage, msgcode, packet->packet_direction);
 #endif
 
-      if(hassh_buf) {
-	if(packet->packet_direction == 0 /* client */) {
-	  u_char fingerprint_client[16];
+      /* The hash string is shorter than the payload: no truncation */
+      ndpi_fingerprint_init(&fp, &ctx, NULL, packet->payload_packet_len);
 
-	  len = concat_hash_string(ndpi_struct, flow, packet, hassh_buf, 1 /* client */);
-
-	  ndpi_MD5Init(&ctx);
-	  ndpi_MD5Update(&ctx, (const unsigned char *)hassh_buf, len);
-	  ndpi_MD5Final(fingerprint_client, &ctx);
-
-#ifdef SSH_DEBUG
-	  {
-	    printf("[SSH] [client][%s][", hassh_buf);
-	    for(i=0; i<16; i++) printf("%02X", fingerprint_client[i]);
-	    printf("]\n");
-	  }
-#endif
-	  for(i=0; i<16; i++) sprintf(&flow->protos.ssh.hassh_client[i*2], "%02X", fingerprint_client[i] & 0xFF);
-	  flow->protos.ssh.hassh_client[32] = '\0';
-	} else {
-	  u_char fingerprint_server[16];
-
-	  len = concat_hash_string(ndpi_struct, flow, packet, hassh_buf, 0 /* server */);
-
-	  ndpi_MD5Init(&ctx);
-	  ndpi_MD5Update(&ctx, (const unsigned char *)hassh_buf, len);
-	  ndpi_MD5Final(fingerprint_server, &ctx);
+      if(packet->packet_direction == 0 /* client */) {
+	concat_hash_string(ndpi_struct, flow, packet, &fp, 1 /* client */);
+	ndpi_fingerprint_final(&fp, fingerprint, flow->protos.ssh.hassh_client, 1);
+      } else {
+	concat_hash_string(ndpi_struct, flow, packet, &fp, 0 /* server */);
+	ndpi_fingerprint_final(&fp, fingerprint, flow->protos.ssh.hassh_server, 1);
+      }
 
 #ifdef SSH_DEBUG
-	  {
-	    printf("[SSH] [server][%s][", hassh_buf);
-	    for(i=0; i<16; i++) printf("%02X", fingerprint_server[i]);
-	    printf("]\n");
-	  }
+      printf("[SSH] [%s][%s]\n", (packet->packet_direction == 0) ? "client" : "server",
+	     (packet->packet_direction == 0) ? flow->protos.ssh.hassh_client : flow->protos.ssh.hassh_server);
 #endif
 
-	  for(i=0; i<16; i++) sprintf(&flow->protos.ssh.hassh_server[i*2], "%02X", fingerprint_server[i] & 0xFF);
-	  flow->protos.ssh.hassh_server[32] = '\0';
-	}
-
-	ndpi_free(hassh_buf);
-      }
-
       ndpi_int_ssh_add_connection(ndpi_struct, flow);
     }
 
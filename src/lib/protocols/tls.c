@@ -150,87 +150,21 @@ static u_int32_t ndpi_tls_refine_master_protocol(struct ndpi_detection_module_st
 
 void ndpi_search_tls_tcp_memory(struct ndpi_detection_module_struct *ndpi_struct,
 				struct ndpi_flow_struct *flow) {
-  struct ndpi_packet_struct *packet = &flow->packet;
-  u_int avail_bytes;
-
-  /* TCP */
-#ifdef DEBUG_TLS_MEMORY
-  printf("[TLS Mem] Handling TCP/TLS flow [payload_len: %u][buffer_len: %u][direction: %u]\n",
-	 packet->payload_packet_len,
-	 flow->l4.tcp.tls.message.buffer_len,
-	 packet->packet_direction);
-#endif
-
-  if(flow->l4.tcp.tls.message.buffer == NULL) {
-    /* Allocate buffer */
-    flow->l4.tcp.tls.message.buffer_len = 2048, flow->l4.tcp.tls.message.buffer_used = 0;
-    flow->l4.tcp.tls.message.buffer = (u_int8_t*)ndpi_malloc(flow->l4.tcp.tls.message.buffer_len);
-
-    if(flow->l4.tcp.tls.message.buffer == NULL)
-      return;
-
-#ifdef DEBUG_TLS_MEMORY
-    printf("[TLS Mem] Allocating %u buffer\n", flow->l4.tcp.tls.message.buffer_len);
-#endif
-  }
-
-  avail_bytes = flow->l4.tcp.tls.message.buffer_len - flow->l4.tcp.tls.message.buffer_used;
-
-  if(avail_bytes < packet->payload_packet_len) {
-    void *newbuf;
-    u_int new_len = flow->l4.tcp.tls.message.buffer_len + packet->payload_packet_len;
-
-    if(new_len >= ndpi_struct->max_tls_buf) return;
-
-    newbuf  = ndpi_realloc(flow->l4.tcp.tls.message.buffer,
-			 flow->l4.tcp.tls.message.buffer_len, new_len);
-    if(!newbuf) return;
-    flow->l4.tcp.tls.message.buffer = (u_int8_t*)newbuf;
-    flow->l4.tcp.tls.message.buffer_len = new_len;
-    avail_bytes = flow->l4.tcp.tls.message.buffer_len - flow->l4.tcp.tls.message.buffer_used;
-
+  /* TCP: in-order segments are appended to the shared reassembly buffer */
+  if(ndpi_tcp_reassembly_append(flow, &flow->l4.tcp.tls.message, ndpi_struct->max_tls_buf) != 1) {
 #ifdef DEBUG_TLS_MEMORY
-    printf("[TLS Mem] Enlarging %5u -> %5u buffer\n", flow->l4.tcp.tls.message.buffer_len, new_len);
+    printf("[TLS Mem] Skipping packet [%u bytes][direction: %u][tcp_seq: %u]\n",
+	   flow->packet.payload_packet_len, flow->packet.packet_direction,
+	   ntohl(flow->packet.tcp->seq));
 #endif
-
-    flow->l4.tcp.tls.message.buffer = (u_int8_t*)newbuf;
-    flow->l4.tcp.tls.message.buffer_len = new_len;
-    avail_bytes = flow->l4.tcp.tls.message.buffer_len - flow->l4.tcp.tls.message.buffer_used;
+    return;
   }
 
-  if(packet->payload_packet_len > 0 && avail_bytes >= packet->payload_packet_len) {
-    u_int8_t ok = 0;
-
-    if(flow->l4.tcp.tls.message.next_seq[packet->packet_direction] != 0) {
-      if(ntohl(packet->tcp->seq) == flow->l4.tcp.tls.message.next_seq[packet->packet_direction])
-	ok = 1;
-    } else
-      ok = 1;
-
-    if(ok) {
-      memcpy(&flow->l4.tcp.tls.message.buffer[flow->l4.tcp.tls.message.buffer_used],
-	     packet->payload, packet->payload_packet_len);
-
-      flow->l4.tcp.tls.message.buffer_used += packet->payload_packet_len;
-#ifdef DEBUG_TLS_MEMORY
-      printf("[TLS Mem] Copied data to buffer [%u/%u bytes][direction: %u][tcp_seq: %u][next: %u]\n",
-	     flow->l4.tcp.tls.message.buffer_used, flow->l4.tcp.tls.message.buffer_len,
-	     packet->packet_direction,
-	     ntohl(packet->tcp->seq),
-	     ntohl(packet->tcp->seq)+packet->payload_packet_len);
-#endif
-
-      flow->l4.tcp.tls.message.next_seq[packet->packet_direction] = ntohl(packet->tcp->seq)+packet->payload_packet_len;
-    } else {
 #ifdef DEBUG_TLS_MEMORY
-      printf("[TLS Mem] Skipping packet [%u bytes][direction: %u][tcp_seq: %u][expected next: %u]\n",
-	     flow->l4.tcp.tls.message.buffer_len,
-	     packet->packet_direction,
-	     ntohl(packet->tcp->seq),
-	     ntohl(packet->tcp->seq)+packet->payload_packet_len);
+  printf("[TLS Mem] Copied data to buffer [%u/%u bytes][direction: %u]\n",
+	 flow->l4.tcp.tls.message.buffer_used, flow->l4.tcp.tls.message.buffer_len,
+	 flow->packet.packet_direction);
 #endif
-    }
-  }
 }
 
 /* **************************************** */
@@ -258,59 +192,229 @@ static void cleanupServerName(char *buffer, int buffer_len) {
 
 /* **************************************** */
 #ifndef __KERNEL__
+
+/* DER (X.509) TLV */
+struct der_tlv {
+  u_int8_t tag;
+  u_int32_t len;
+  const u_int8_t *value, *end;
+};
+
 /*
+  Reads the TLV at *p (before end) and moves *p past it
   Return code
-  -1: error (buffer too short)
-   0: OK but buffer is not human readeable (so something went wrong)
-   1: OK
+  -1: malformed or truncated
+   0: OK
  */
-static int extractRDNSequence(struct ndpi_packet_struct *packet,
-			      u_int offset, char *buffer, u_int buffer_len,
-			      char *rdnSeqBuf, u_int *rdnSeqBuf_offset,
-			      u_int rdnSeqBuf_len,
-			      const char *label) {
-  u_int8_t str_len = packet->payload[offset+4], is_printable = 1;
-  char *str;
-  u_int len, j;
+static int der_next(const u_int8_t **p, const u_int8_t *end, struct der_tlv *tlv) {
+  const u_int8_t *s = *p;
+  u_int32_t len;
+  u_int8_t n;
 
-  if (*rdnSeqBuf_offset >= rdnSeqBuf_len) {
-#ifdef DEBUG_TLS
-    printf("[TLS] %s() [buffer capacity reached][%u]\n",
-           __FUNCTION__, rdnSeqBuf_len);
-#endif
-    return -1;
+  if((end - s) < 2)
+    return(-1);
+
+  tlv->tag = *s++;
+  if((tlv->tag & 0x1F) == 0x1F)
+    return(-1); /* High tag numbers are not used by X.509 */
+
+  len = *s++;
+
+  if(len & 0x80) {
+    n = len & 0x7F;
+
+    if((n == 0) || (n > 3) || ((end - s) < n))
+      return(-1);
+
+    for(len = 0; n > 0; n--)
+      len = (len << 8) | *s++;
   }
 
-  // packet is truncated... further inspection is not needed
-  if((offset+4+str_len) >= packet->payload_packet_len)
+  if(len > (u_int32_t)(end - s))
     return(-1);
 
-  str = (char*)&packet->payload[offset+5];
+  tlv->len = len, tlv->value = s, tlv->end = s + len;
+  *p = tlv->end;
+
+  return(0);
+}
+
+static int der_expect(const u_int8_t **p, const u_int8_t *end,
+		      u_int8_t tag, struct der_tlv *tlv) {
+  if((der_next(p, end, tlv) != 0) || (tlv->tag != tag))
+    return(-1);
+  else
+    return(0);
+}
 
-  len = (u_int)ndpi_min(str_len, buffer_len-1);
-  strncpy(buffer, str, len);
-  buffer[len] = '\0';
+/* **************************************** */
 
-  // check string is printable
-  for(j = 0; j < len; j++) {
-    if(!ndpi_isprint(buffer[j])) {
-      is_printable = 0;
-      break;
+/*
+  See https://www.ibm.com/support/knowledgecenter/SSFKSJ_7.5.0/com.ibm.mq.sec.doc/q009860_.htm
+  for X.509 certificate labels
+*/
+static const char *x509_rdn_label(const struct der_tlv *oid) {
+  /* 2.5.4.X */
+  if((oid->len != 3) || (oid->value[0] != 0x55) || (oid->value[1] != 0x04))
+    return(NULL);
+
+  switch(oid->value[2]) {
+  case 0x03: return("CN"); /* Common Name */
+  case 0x06: return("C");  /* Country */
+  case 0x07: return("L");  /* Locality */
+  case 0x08: return("ST"); /* State or Province */
+  case 0x0a: return("O");  /* Organization Name */
+  case 0x0b: return("OU"); /* Organization Unit */
+  }
+
+  return(NULL);
+}
+
+/*
+  Formats a Name (issuer, subject) as "CN=..., O=..."
+  Values are truncated to 63 chars and the ones not human readable skipped
+ */
+static u_int x509_format_name(const struct der_tlv *name, char *buf, u_int buf_len) {
+  const u_int8_t *p = name->value, *q, *r;
+  struct der_tlv set, atv, oid, value;
+  u_int len = 0;
+
+  buf[0] = '\0';
+
+  /* RDNSequence ::= SEQUENCE OF SET OF AttributeTypeAndValue */
+  while((len < (buf_len - 1)) && (der_expect(&p, name->end, 0x31, &set) == 0)) {
+    for(q = set.value; (len < (buf_len - 1)) && (der_expect(&q, set.end, 0x30, &atv) == 0); ) {
+      const char *label;
+      u_int value_len, j;
+      int rc;
+
+      r = atv.value;
+      if((der_expect(&r, atv.end, 0x06, &oid) != 0)
+	 || (der_next(&r, atv.end, &value) != 0)
+	 || ((label = x509_rdn_label(&oid)) == NULL))
+	continue;
+
+      value_len = ndpi_min(value.len, 63);
+
+      for(j = 0; j < value_len; j++)
+	if(!ndpi_isprint(value.value[j]))
+	  break;
+
+      if(j < value_len)
+	continue; /* Not human readeable (so something went wrong) */
+
+      rc = snprintf(&buf[len], buf_len - len, "%s%s=%.*s",
+		    (len > 0) ? ", " : "", label, (int)value_len, (const char*)value.value);
+
+      if(rc > 0)
+	len += rc;
     }
   }
 
-  if(is_printable) {
-    int rc = snprintf(&rdnSeqBuf[*rdnSeqBuf_offset],
-		      rdnSeqBuf_len-(*rdnSeqBuf_offset),
-		      "%s%s=%s", (*rdnSeqBuf_offset > 0) ? ", " : "",
-		      label, buffer);
+  return(ndpi_min(len, buf_len - 1));
+}
+
+/* **************************************** */
+
+static int x509_parse_time(const struct der_tlv *t, u_int32_t *when) {
+  char utcDate[32];
+  struct tm utc;
+
+  if(((t->tag != 0x17 /* UTCTime */) && (t->tag != 0x18 /* GeneralizedTime */))
+     || (t->len >= sizeof(utcDate)))
+    return(-1);
+
+  memcpy(utcDate, t->value, t->len);
+  utcDate[t->len] = '\0';
+
+  memset(&utc, 0, sizeof(utc));
+  utc.tm_isdst = -1; /* Not set by strptime */
+
+  /* 141021000000Z or 20141021000000Z */
+  if(strptime(utcDate, (t->tag == 0x17) ? "%y%m%d%H%M%SZ" : "%Y%m%d%H%M%SZ", &utc) == NULL)
+    return(-1);
+
+  *when = timegm(&utc);
+
+  return(0);
+}
+
+/* **************************************** */
+
+/* tbsCertificate fields we care about */
+struct x509_fields {
+  struct der_tlv issuer, validity, subject, san;
+  u_int8_t has_san;
+};
+
+/*
+  Single pass over the certificate: jumps from one tbsCertificate field to
+  the next one without looking into the ones we don't need
+ */
+static int x509_walk(const u_int8_t *cert, u_int32_t cert_len, struct x509_fields *f) {
+  const u_int8_t *p = cert, *q, *r;
+  struct der_tlv c, tbs, t, exts, ext, oid, v;
+
+  f->has_san = 0;
+
+  /* Certificate ::= SEQUENCE { tbsCertificate, signatureAlgorithm, signatureValue } */
+  if(der_expect(&p, cert + cert_len, 0x30, &c) != 0)
+    return(-1);
+
+  p = c.value;
+  if(der_expect(&p, c.end, 0x30, &tbs) != 0)
+    return(-1);
+
+  p = tbs.value;
+
+  if(der_next(&p, tbs.end, &t) != 0)
+    return(-1);
+
+  if((t.tag == 0xA0 /* [0] version */) && (der_next(&p, tbs.end, &t) != 0))
+    return(-1);
+
+  if((t.tag != 0x02 /* serialNumber */)
+     || (der_expect(&p, tbs.end, 0x30, &t) != 0 /* signature */)
+     || (der_expect(&p, tbs.end, 0x30, &f->issuer) != 0)
+     || (der_expect(&p, tbs.end, 0x30, &f->validity) != 0)
+     || (der_expect(&p, tbs.end, 0x30, &f->subject) != 0)
+     || (der_expect(&p, tbs.end, 0x30, &t) != 0 /* subjectPublicKeyInfo */))
+    return(-1);
+
+  /* [1] issuerUniqueID, [2] subjectUniqueID, [3] extensions */
+  while(der_next(&p, tbs.end, &t) == 0) {
+    if(t.tag != 0xA3)
+      continue;
+
+    q = t.value;
+    if(der_expect(&q, t.end, 0x30, &exts) != 0)
+      break;
+
+    /* Extension ::= SEQUENCE { extnID, critical BOOLEAN DEFAULT FALSE, extnValue OCTET STRING } */
+    for(q = exts.value; der_expect(&q, exts.end, 0x30, &ext) == 0; ) {
+      r = ext.value;
+
+      if((der_expect(&r, ext.end, 0x06, &oid) != 0)
+	 || (der_next(&r, ext.end, &v) != 0)
+	 || ((v.tag == 0x01 /* critical */) && (der_next(&r, ext.end, &v) != 0))
+	 || (v.tag != 0x04))
+	continue;
+
+      /* 2.5.29.17 (subjectAltName) */
+      if((oid.len == 3) && (oid.value[0] == 0x55) && (oid.value[1] == 0x1d) && (oid.value[2] == 0x11)) {
+	r = v.value;
+	if(der_expect(&r, v.end, 0x30, &f->san) == 0)
+	  f->has_san = 1;
+	break;
+      }
+    }
 
-    if(rc > 0)
-      (*rdnSeqBuf_offset) += rc;
+    break;
   }
 
-  return(is_printable);
+  return(0);
 }
+
 #endif
 /* **************************************** */
 
@@ -344,281 +448,176 @@ static void checkTLSSubprotocol(struct ndpi_detection_module_struct *ndpi_struct
 
 /* **************************************** */
 
-/* See https://blog.catchpoint.com/2017/05/12/dissecting-tls-using-wireshark/ */
-static void processCertificateElements(struct ndpi_detection_module_struct *ndpi_struct,
-				       struct ndpi_flow_struct *flow,
-				       u_int16_t p_offset, u_int16_t certificate_len) {
-  struct ndpi_packet_struct *packet = &flow->packet;
-  u_int num_found = 0, i;
-  char buffer[64] = { '\0' }, rdnSeqBuf[2048] = { '\0' };
-  u_int rdn_len = 0;
-
-#ifdef DEBUG_TLS
-  printf("[TLS] %s() [offset: %u][certificate_len: %u]\n", __FUNCTION__, p_offset, certificate_len);
-#endif
-
-  /* Check after handshake protocol header (5 bytes) and message header (4 bytes) */
-  for(i = p_offset; i < certificate_len; i++) {
-    /*
-       See https://www.ibm.com/support/knowledgecenter/SSFKSJ_7.5.0/com.ibm.mq.sec.doc/q009860_.htm
-       for X.509 certificate labels
-    */
-    if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x03)) {
-      /* Common Name */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "CN");
-      if(rc == -1) break;
+/* Parses the certificate fields into the (empty) entry e */
+static int tls_cert_info_build(const struct x509_fields *f, struct ndpi_tls_cert_info *e) {
+  char issuerDN[2048], subjectDN[2048], *s;
+  u_int issuer_len, subject_len, names_len = 0;
+  const u_int8_t *p;
+  struct der_tlv t, notBefore, notAfter;
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "Common Name", buffer);
-#endif
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x06)) {
-      /* Country */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "C");
-      if(rc == -1) break;
+  issuer_len = x509_format_name(&f->issuer, issuerDN, sizeof(issuerDN));
+  subject_len = x509_format_name(&f->subject, subjectDN, sizeof(subjectDN));
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "Country", buffer);
-#endif
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x07)) {
-      /* Locality */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "L");
-      if(rc == -1) break;
+  p = f->validity.value;
+  if((der_next(&p, f->validity.end, &notBefore) == 0)
+     && (der_next(&p, f->validity.end, &notAfter) == 0)
+     && (x509_parse_time(&notBefore, &e->notBefore) == 0)
+     && (x509_parse_time(&notAfter, &e->notAfter) == 0))
+    e->has_validity = 1;
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "Locality", buffer);
-#endif
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x08)) {
-      /* State or Province */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "ST");
-      if(rc == -1) break;
+  if(f->has_san) {
+    e->has_san = 1;
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "State or Province", buffer);
-#endif
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x0a)) {
-      /* Organization Name */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "O");
-      if(rc == -1) break;
+    /* GeneralNames ::= SEQUENCE OF GeneralName: only dNSName [2] matters */
+    for(p = f->san.value; der_next(&p, f->san.end, &t) == 0; )
+      if((t.tag == 0x82) && (t.len > 0) && (t.len < 256))
+	names_len += 2 /* flag + '\0' */ + strnlen((const char*)t.value, t.len), e->num_names++;
+  }
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "Organization Name", buffer);
-#endif
+  if((e->data = (char*)ndpi_malloc(issuer_len + 1 + subject_len + 1 + names_len)) == NULL)
+    return(-1);
 
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x04) && (packet->payload[i+2] == 0x0b)) {
-      /* Organization Unit */
-      int rc = extractRDNSequence(packet, i, buffer, sizeof(buffer), rdnSeqBuf, &rdn_len, sizeof(rdnSeqBuf), "OU");
-      if(rc == -1) break;
+  s = e->data;
+  memcpy(s, issuerDN, issuer_len + 1);
+  e->issuerDN = issuer_len ? s : NULL, s += issuer_len + 1;
+  memcpy(s, subjectDN, subject_len + 1);
+  e->subjectDN = subject_len ? s : NULL, s += subject_len + 1;
+  e->names = s;
+
+  if(e->num_names) {
+    for(p = f->san.value; der_next(&p, f->san.end, &t) == 0; ) {
+      if((t.tag == 0x82) && (t.len > 0) && (t.len < 256)) {
+	u_int len = strnlen((const char*)t.value, t.len);
+
+	*s++ = NDPI_CERT_MATCH_UNKNOWN;
+	memcpy(s, t.value, len);
+	cleanupServerName(s, len);
+	s[len] = '\0', s += len + 1;
+      }
+    }
+  }
 
-#ifdef DEBUG_TLS
-      printf("[TLS] %s() [%s][%s: %s]\n", __FUNCTION__, (num_found == 0) ? "Subject" : "Issuer", "Organization Unit", buffer);
-#endif
-    } else if((packet->payload[i] == 0x30) && (packet->payload[i+1] == 0x1e) && (packet->payload[i+2] == 0x17)) {
-      /* Certificate Validity */
-      u_int8_t len = packet->payload[i+3];
-      u_int offset = i+4;
+  return(0);
+}
 
-      if(num_found == 0) {
-	num_found++;
+/* **************************************** */
 
+/*
+  Sets the flow metadata and risks from a certificate, either just parsed or
+  found in the cache: the SAN names and the subject are matched only once
+ */
+static void tls_cert_info_apply(struct ndpi_detection_module_struct *ndpi_struct,
+				struct ndpi_flow_struct *flow,
+				struct ndpi_tls_cert_info *e) {
 #ifdef DEBUG_TLS
-	printf("[TLS] %s() IssuerDN [%s]\n", __FUNCTION__, rdnSeqBuf);
+  printf("[TLS] %s() IssuerDN [%s]\n", __FUNCTION__, e->issuerDN ? e->issuerDN : "");
 #endif
 
-	if(rdn_len && (flow->protos.tls_quic_stun.tls_quic.issuerDN == NULL))
-	  flow->protos.tls_quic_stun.tls_quic.issuerDN = ndpi_strdup(rdnSeqBuf);
+  if(e->issuerDN && (flow->protos.tls_quic_stun.tls_quic.issuerDN == NULL))
+    flow->protos.tls_quic_stun.tls_quic.issuerDN = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, e->issuerDN);
 
-	rdn_len = 0; /* Reset buffer */
-      }
+  if(e->has_validity) {
+    u_int32_t time_sec = flow->packet.current_time;
 
-      if((offset+len) < packet->payload_packet_len) {
-#ifndef __KERNEL__
-	char utcDate[32];
+    flow->protos.tls_quic_stun.tls_quic.notBefore = e->notBefore;
+    flow->protos.tls_quic_stun.tls_quic.notAfter = e->notAfter;
 
 #ifdef DEBUG_TLS
-	u_int j;
-
-	printf("[CERTIFICATE] notBefore [len: %u][", len);
-	for(j=0; j<len; j++) printf("%c", packet->payload[i+4+j]);
-	printf("]\n");
+    printf("[CERTIFICATE] notBefore %u notAfter %u\n", e->notBefore, e->notAfter);
 #endif
 
-	if(len < (sizeof(utcDate)-1)) {
-	  struct tm utc;
-	  utc.tm_isdst = -1; /* Not set by strptime */
-
-	  strncpy(utcDate, (const char*)&packet->payload[i+4], len);
-	  utcDate[len] = '\0';
-
-	  /* 141021000000Z */
-	  if(strptime(utcDate, "%y%m%d%H%M%SZ", &utc) != NULL) {
-	    flow->protos.tls_quic_stun.tls_quic.notBefore = timegm(&utc);
-#ifdef DEBUG_TLS
-	    printf("[CERTIFICATE] notBefore %u [%s]\n",
-		   flow->protos.tls_quic_stun.tls_quic.notBefore, utcDate);
-#endif
-	  }
-	}
-#endif
-	offset += len;
+    if((time_sec < e->notBefore) || (time_sec > e->notAfter))
+      ndpi_set_risk(flow, NDPI_TLS_CERTIFICATE_EXPIRED); /* Certificate expired */
+  }
 
-	if((offset+1) < packet->payload_packet_len) {
-	  len = packet->payload[offset+1];
+  if(e->has_san) {
+    /* Organization OID: 2.5.29.17 (subjectAltName) */
+    u_int8_t matched_name = 0;
+    char *name = e->names;
+    u_int16_t i;
 
-	  offset += 2;
+    for(i = 0; i < e->num_names; i++) {
+      char *dNSName = &name[1];
+      u_int16_t len = strlen(dNSName);
 
-	  if((offset+len) < packet->payload_packet_len) {
-            u_int32_t time_sec = flow->packet.current_time;
-#ifndef __KERNEL__
 #ifdef DEBUG_TLS
-	    u_int j;
-
-	    printf("[CERTIFICATE] notAfter [len: %u][", len);
-	    for(j=0; j<len; j++) printf("%c", packet->payload[offset+j]);
-	    printf("]\n");
+      printf("[TLS] dNSName %s [%s][len: %u]\n", dNSName,
+	     flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, len);
 #endif
-	    if(len < (sizeof(utcDate)-1)) {
-	      struct tm utc;
-	      utc.tm_isdst = -1; /* Not set by strptime */
+      if(matched_name == 0) {
+	if(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name[0] == '\0')
+	  matched_name = 1;	/* No SNI */
+	else if (dNSName[0] == '*')
+	{
+	  char * label = strstr(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, &dNSName[1]);
 
-	      strncpy(utcDate, (const char*)&packet->payload[offset], len);
-	      utcDate[len] = '\0';
+	  if (label != NULL)
+	  {
+	    char * first_dot = strchr(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, '.');
 
-	      /* 141021000000Z */
-	      if(strptime(utcDate, "%y%m%d%H%M%SZ", &utc) != NULL) {
-		flow->protos.tls_quic_stun.tls_quic.notAfter = timegm(&utc);
-#ifdef DEBUG_TLS
-		printf("[CERTIFICATE] notAfter %u [%s]\n",
-		       flow->protos.tls_quic_stun.tls_quic.notAfter, utcDate);
-#endif
-	      }
+	    if (first_dot == NULL || first_dot >= label)
+	    {
+	      matched_name = 1;
 	    }
-#endif // __KERNEL__
-
-
-	    if((time_sec < flow->protos.tls_quic_stun.tls_quic.notBefore)
-	       || (time_sec > flow->protos.tls_quic_stun.tls_quic.notAfter))
-	    ndpi_set_risk(flow, NDPI_TLS_CERTIFICATE_EXPIRED); /* Certificate expired */
 	  }
 	}
+	else if(strcmp(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, dNSName) == 0)
+	  matched_name = 1;
       }
-    } else if((packet->payload[i] == 0x55) && (packet->payload[i+1] == 0x1d) && (packet->payload[i+2] == 0x11)) {
-      /* Organization OID: 2.5.29.17 (subjectAltName) */
-      u_int8_t matched_name = 0;
-
-#ifdef DEBUG_TLS
-      printf("******* [TLS] Found subjectAltName\n");
-#endif
-
-      i += 3 /* skip the initial patten 55 1D 11 */;
-      i++; /* skip the first type, 0x04 == BIT STRING, and jump to it's length */
-      if(i < packet->payload_packet_len) {
-	i += (packet->payload[i] & 0x80) ? (packet->payload[i] & 0x7F) : 0; /* skip BIT STRING length */
-	if(i < packet->payload_packet_len) {
-	  i += 2; /* skip the second type, 0x30 == SEQUENCE, and jump to it's length */
-	  if(i < packet->payload_packet_len) {
-	    i += (packet->payload[i] & 0x80) ? (packet->payload[i] & 0x7F) : 0; /* skip SEQUENCE length */
-	    i++;
-
-	    while(i < packet->payload_packet_len) {
-	      if(packet->payload[i] == 0x82) {
-		if((i < (packet->payload_packet_len - 1))
-		   && ((i + packet->payload[i + 1] + 2) < packet->payload_packet_len)) {
-		  u_int8_t len = packet->payload[i + 1];
-		  char dNSName[256];
-
-		  i += 2;
-
-		  /* The check "len > sizeof(dNSName) - 1" will be always false. If we add it,
-		     the compiler is smart enough to detect it and throws a warning */
-		  if((len == 0 /* Looks something went wrong */)
-		     || ((i+len) >  packet->payload_packet_len))
-		    break;
-
-		  strncpy(dNSName, (const char*)&packet->payload[i], len);
-		  dNSName[len] = '\0';
-
-		  cleanupServerName(dNSName, len);
-
-#ifdef DEBUG_TLS
-		  printf("[TLS] dNSName %s [%s][len: %u][leftover: %d]\n", dNSName,
-			 flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, len,
-			 packet->payload_packet_len-i-len);
-#endif
-		  if(matched_name == 0) {
-		    if(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name[0] == '\0')
-		      matched_name = 1;	/* No SNI */
-		    else if (dNSName[0] == '*')
-		    {
-		      char * label = strstr(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, &dNSName[1]);
-
-		      if (label != NULL)
-		      {
-		        char * first_dot = strchr(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, '.');
-
-		        if (first_dot == NULL || first_dot >= label)
-		        {
-		          matched_name = 1;
-		        }
-		      }
-		    }
-		    else if(strcmp(flow->protos.tls_quic_stun.tls_quic.client_requested_server_name, dNSName) == 0)
-		      matched_name = 1;
-		  }
-
-		  if(flow->protos.tls_quic_stun.tls_quic.server_names == NULL)
-		    flow->protos.tls_quic_stun.tls_quic.server_names = ndpi_strdup(dNSName),
-		      flow->protos.tls_quic_stun.tls_quic.server_names_len = strlen(dNSName);
-		  else {
-		    u_int16_t dNSName_len = strlen(dNSName);
-		    u_int16_t newstr_len = flow->protos.tls_quic_stun.tls_quic.server_names_len + dNSName_len + 1;
-		    char *newstr = (char*)ndpi_realloc(flow->protos.tls_quic_stun.tls_quic.server_names,
-						       flow->protos.tls_quic_stun.tls_quic.server_names_len+1, newstr_len+1);
-
-		    if(newstr) {
-		      flow->protos.tls_quic_stun.tls_quic.server_names = newstr;
-		      flow->protos.tls_quic_stun.tls_quic.server_names[flow->protos.tls_quic_stun.tls_quic.server_names_len] = ',';
-		      strncpy(&flow->protos.tls_quic_stun.tls_quic.server_names[flow->protos.tls_quic_stun.tls_quic.server_names_len+1],
-			      dNSName, dNSName_len+1);
-		      flow->protos.tls_quic_stun.tls_quic.server_names[newstr_len] = '\0';
-		      flow->protos.tls_quic_stun.tls_quic.server_names_len = newstr_len;
-		    }
-		  }
 
-		  if(!flow->l4.tcp.tls.subprotocol_detected)
-		    if(ndpi_match_hostname_protocol(ndpi_struct, flow, NDPI_PROTOCOL_TLS, dNSName, len))
-		      flow->l4.tcp.tls.subprotocol_detected = 1;
+      if(flow->protos.tls_quic_stun.tls_quic.server_names == NULL)
+	flow->protos.tls_quic_stun.tls_quic.server_names = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, dNSName),
+	  flow->protos.tls_quic_stun.tls_quic.server_names_len = len;
+      else {
+	u_int16_t newstr_len = flow->protos.tls_quic_stun.tls_quic.server_names_len + len + 1;
+	char *newstr = (char*)ndpi_flow_data_realloc(flow, NDPI_MEM_METADATA,
+						     flow->protos.tls_quic_stun.tls_quic.server_names,
+						     flow->protos.tls_quic_stun.tls_quic.server_names_len+1, newstr_len+1);
+
+	if(newstr) {
+	  flow->protos.tls_quic_stun.tls_quic.server_names = newstr;
+	  flow->protos.tls_quic_stun.tls_quic.server_names[flow->protos.tls_quic_stun.tls_quic.server_names_len] = ',';
+	  strncpy(&flow->protos.tls_quic_stun.tls_quic.server_names[flow->protos.tls_quic_stun.tls_quic.server_names_len+1],
+		  dNSName, len+1);
+	  flow->protos.tls_quic_stun.tls_quic.server_names[newstr_len] = '\0';
+	  flow->protos.tls_quic_stun.tls_quic.server_names_len = newstr_len;
+	}
+      }
 
-		  i += len;
-		} else {
-#ifdef DEBUG_TLS
-		  printf("[TLS] Leftover %u bytes", packet->payload_packet_len - i);
-#endif
-		  break;
-		}
-	      } else {
-		break;
-	      }
-	    } /* while */
+      if(!flow->l4.tcp.tls.subprotocol_detected) {
+	/* Names not matching anything are not looked up again for the next flows */
+	if(name[0] == NDPI_CERT_MATCH_UNKNOWN)
+	  name[0] = ndpi_hostname_has_match(ndpi_struct, dNSName, len) ? NDPI_CERT_MATCH_FOUND : NDPI_CERT_MATCH_NONE;
 
-	    if(!matched_name)
-	      ndpi_set_risk(flow, NDPI_TLS_CERTIFICATE_MISMATCH); /* Certificate mismatch */
-	  }
-	}
+	if((name[0] == NDPI_CERT_MATCH_FOUND)
+	   && ndpi_match_hostname_protocol(ndpi_struct, flow, NDPI_PROTOCOL_TLS, dNSName, len))
+	  flow->l4.tcp.tls.subprotocol_detected = 1;
       }
+
+      name = &dNSName[len + 1];
     }
+
+    if(!matched_name)
+      ndpi_set_risk(flow, NDPI_TLS_CERTIFICATE_MISMATCH); /* Certificate mismatch */
   }
 
-  if(rdn_len && (flow->protos.tls_quic_stun.tls_quic.subjectDN == NULL)) {
-    flow->protos.tls_quic_stun.tls_quic.subjectDN = ndpi_strdup(rdnSeqBuf);
+  if(e->subjectDN && (flow->protos.tls_quic_stun.tls_quic.subjectDN == NULL)) {
+    flow->protos.tls_quic_stun.tls_quic.subjectDN = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, e->subjectDN);
 
     if(flow->detected_protocol_stack[1] == NDPI_PROTOCOL_UNKNOWN) {
       /* No idea what is happening behind the scenes: let's check the certificate */
-      u_int32_t proto_id = 0;
-      int rc = ndpi_match_string_value(ndpi_struct->tls_cert_subject_automa.ac_automa,
-				       rdnSeqBuf, strlen(rdnSeqBuf),&proto_id);
+      if(e->subject_match == NDPI_CERT_MATCH_UNKNOWN) {
+	u_int32_t proto_id = 0;
+	int rc = ndpi_match_string_value(ndpi_struct->tls_cert_subject_automa.ac_automa,
+					 e->subjectDN, strlen(e->subjectDN), &proto_id);
+
+	e->subject_match = (rc == 0) ? NDPI_CERT_MATCH_FOUND : NDPI_CERT_MATCH_NONE;
+	e->subject_proto = proto_id;
+      }
 
-      if(rc == 0) {
+      if(e->subject_match == NDPI_CERT_MATCH_FOUND) {
 	/* Match found */
+	u_int16_t proto_id = e->subject_proto;
 	ndpi_protocol ret = { NDPI_PROTOCOL_TLS, proto_id, NDPI_PROTOCOL_CATEGORY_UNSPECIFIED};
 
 	flow->detected_protocol_stack[0] = proto_id,
@@ -644,8 +643,55 @@ static void processCertificateElements(struct ndpi_detection_module_struct *ndpi
     ndpi_set_risk(flow, NDPI_TLS_SELFSIGNED_CERTIFICATE);
 
 #ifdef DEBUG_TLS
-  printf("[TLS] %s() SubjectDN [%s]\n", __FUNCTION__, rdnSeqBuf);
+  printf("[TLS] %s() SubjectDN [%s]\n", __FUNCTION__, e->subjectDN ? e->subjectDN : "");
+#endif
+}
+
+/* **************************************** */
+
+/* See https://blog.catchpoint.com/2017/05/12/dissecting-tls-using-wireshark/ */
+static void processCertificateElements(struct ndpi_detection_module_struct *ndpi_struct,
+				       struct ndpi_flow_struct *flow,
+				       u_int16_t p_offset, u_int16_t certificate_len) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  const u_int8_t *sha1 = flow->protos.tls_quic_stun.tls_quic.sha1_certificate_fingerprint;
+  struct ndpi_tls_cert_info *e, tmp;
+  struct x509_fields f;
+
+#ifdef DEBUG_TLS
+  printf("[TLS] %s() [offset: %u][certificate_len: %u]\n", __FUNCTION__, p_offset, certificate_len);
+#endif
+
+  if(ndpi_struct->tls_cert_info_cache == NULL)
+    ndpi_struct->tls_cert_info_cache = ndpi_tls_cert_info_cache_init(1024);
+
+  if(ndpi_struct->tls_cert_info_cache
+     && ((e = ndpi_tls_cert_info_find(ndpi_struct->tls_cert_info_cache, sha1)) != NULL)) {
+    /* Certificate already seen: nothing to parse */
+    tls_cert_info_apply(ndpi_struct, flow, e);
+    return;
+  }
+
+  if(x509_walk(&packet->payload[p_offset], certificate_len, &f) != 0) {
+#ifdef DEBUG_TLS
+    printf("[TLS] %s() Malformed certificate\n", __FUNCTION__);
 #endif
+    return;
+  }
+
+  if(ndpi_struct->tls_cert_info_cache)
+    e = ndpi_tls_cert_info_add(ndpi_struct->tls_cert_info_cache, sha1);
+  else
+    e = &tmp, memset(e, 0, sizeof(*e));
+
+  if(tls_cert_info_build(&f, e) != 0)
+    return;
+
+  e->is_full = 1;
+  tls_cert_info_apply(ndpi_struct, flow, e);
+
+  if(e == &tmp)
+    ndpi_free(tmp.data);
 }
 
 /* **************************************** */
@@ -757,7 +803,9 @@ int processCertificate(struct ndpi_detection_module_struct *ndpi_struct,
           ndpi_set_risk(flow, NDPI_MALICIOUS_SHA1_CERTIFICATE);
       }
 
-      processCertificateElements(ndpi_struct, flow, certificates_offset, certificate_len);
+      /* Past the soft memory limit the certificate is fingerprinted but not dissected */
+      if(!ndpi_mem_shed())
+	processCertificateElements(ndpi_struct, flow, certificates_offset, certificate_len);
       }
     }
 
@@ -956,13 +1004,9 @@ static int ndpi_search_tls_tcp(struct ndpi_detection_module_struct *ndpi_struct,
 
     packet->payload = p;
     packet->payload_packet_len = p_len; /* Restore */
-    flow->l4.tcp.tls.message.buffer_used -= len;
+    ndpi_tcp_reassembly_consume(&flow->l4.tcp.tls.message, len);
 
-    if(flow->l4.tcp.tls.message.buffer_used > 0)
-      memmove(flow->l4.tcp.tls.message.buffer,
-	      &flow->l4.tcp.tls.message.buffer[len],
-	      flow->l4.tcp.tls.message.buffer_used);
-    else
+    if(flow->l4.tcp.tls.message.buffer_used == 0)
       break;
 
 #ifdef DEBUG_TLS_MEMORY
@@ -1201,10 +1245,10 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 			     struct ndpi_flow_struct *flow, uint32_t quic_version) {
   struct ndpi_packet_struct *packet = &flow->packet;
   union ja3_info ja3;
-  u_int8_t invalid_ja3 = 0;
-  u_int16_t tls_version, ja3_str_len;
-  char ja3_str[JA3_STR_LEN];
-  ndpi_MD5_CTX ctx;
+  u_int8_t invalid_ja3 = 0, shed_ja3;
+  u_int16_t tls_version;
+  struct ndpi_fingerprint fp;
+  ndpi_MD5_CTX ctx, tail_ctx;
   u_char md5_hash[16];
   int i;
   u_int16_t total_len;
@@ -1219,6 +1263,9 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 
   memset(&ja3, 0, sizeof(ja3));
 
+  /* Past the soft memory limit JA3 fingerprints are not computed */
+  shed_ja3 = ndpi_mem_shed();
+
   handshake_type = packet->payload[0];
   total_len = (packet->payload[1] << 16) +  (packet->payload[2] << 8) + packet->payload[3];
 
@@ -1231,7 +1278,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
   if(total_len > 4) {
     u_int16_t base_offset    = (!is_dtls) ? 38 : 46;
     u_int16_t version_offset = (!is_dtls) ? 4 : 12;
-    u_int16_t offset = (!is_dtls) ? 38 : 46, extension_len, j;
+    u_int16_t offset = (!is_dtls) ? 38 : 46, extension_len;
     u_int8_t  session_id_len =  0;
 
     if((base_offset >= total_len) ||
@@ -1247,7 +1294,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
     tls_version = ntohs(*((u_int16_t*)&packet->payload[version_offset]));
 
     if(handshake_type == 0x02 /* Server Hello */) {
-      int i, rc;
+      int i;
 
       ja3.server.tls_handshake_version = tls_version;
 
@@ -1365,7 +1412,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 	  printf("Server TLS [ALPN: %s][len: %u]\n", alpn_str, alpn_str_len);
 #endif
 	  if(flow->protos.tls_quic_stun.tls_quic.alpn == NULL)
-	    flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_strdup(alpn_str);
+	    flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, alpn_str);
 
 	  if(flow->protos.tls_quic_stun.tls_quic.alpn != NULL)
 	    tlsCheckUncommonALPN(flow);
@@ -1409,61 +1456,46 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 	i += 4 + extension_len, offset += 4 + extension_len;
       } /* for */
 
-      ja3_str_len = snprintf(ja3_str, JA3_STR_LEN, "%u,", ja3.server.tls_handshake_version);
+      if(!shed_ja3) {
+	ndpi_fingerprint_init(&fp, &ctx, &tail_ctx, JA3_STR_LEN-1);
+	ndpi_fingerprint_append_u16(&fp, '\0', ja3.server.tls_handshake_version);
+	ndpi_fingerprint_append(&fp, ",", 1);
 
-      for(i=0; (i<ja3.server.num_cipher) && (JA3_STR_LEN > ja3_str_len); i++) {
-	rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u", (i > 0) ? "-" : "", ja3.server.cipher[i]);
+	/* Ciphers and extensions are truncated to JA3_STR_LEN */
+	for(i=0; i<ja3.server.num_cipher; i++)
+	  if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.server.cipher[i]) != 0) {
+	    ndpi_fingerprint_seal(&fp);
+	    break;
+	  }
 
-	if(rc <= 0) break; else ja3_str_len += rc;
-      }
+	ndpi_fingerprint_append(&fp, ",", 1);
 
-      if(JA3_STR_LEN > ja3_str_len) {
-	rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, ",");
-	if(rc > 0 && ja3_str_len + rc < JA3_STR_LEN) ja3_str_len += rc;
-      }
+	/* ********** */
 
-      /* ********** */
+	for(i=0; i<ja3.server.num_tls_extension; i++)
+	  if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.server.tls_extension[i]) != 0) {
+	    ndpi_fingerprint_seal(&fp);
+	    break;
+	  }
 
-      for(i=0; (i<ja3.server.num_tls_extension) && (JA3_STR_LEN > ja3_str_len); i++) {
-	int rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u", (i > 0) ? "-" : "", ja3.server.tls_extension[i]);
+	if(ndpi_struct->enable_ja3_plus) {
+	  for(i=0; i<ja3.server.num_elliptic_curve_point_format; i++)
+	    if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.server.elliptic_curve_point_format[i]) != 0)
+	      break;
 
-	if(rc <= 0) break; else ja3_str_len += rc;
-      }
+	  if(ja3.server.alpn[0] != '\0') {
+	    const char *alpn = ja3.server.alpn;
 
-      if(ndpi_struct->enable_ja3_plus) {
-	for(i=0; (i<ja3.server.num_elliptic_curve_point_format) && (JA3_STR_LEN > ja3_str_len); i++) {
-	  rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u",
-			(i > 0) ? "-" : "", ja3.server.elliptic_curve_point_format[i]);
-	  if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc; else break;
+	    ndpi_fingerprint_append_fields(&fp, ',', &alpn, 1);
+	  }
 	}
 
-	if((ja3.server.alpn[0] != '\0') && (JA3_STR_LEN > ja3_str_len)) {
-	  rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, ",%s", ja3.server.alpn);
-	  if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc;
-	}
+	ndpi_fingerprint_final(&fp, md5_hash, flow->protos.tls_quic_stun.tls_quic.ja3_server, 0);
 
 #ifdef DEBUG_TLS
-	printf("[JA3+] Server: %s \n", ja3_str);
+	printf("[JA3] Server: %s \n", flow->protos.tls_quic_stun.tls_quic.ja3_server);
 #endif
-      } else {
-#ifdef DEBUG_TLS
-	printf("[JA3] Server: %s \n", ja3_str);
-#endif
-      }
-
-      ndpi_MD5Init(&ctx);
-      ndpi_MD5Update(&ctx, (const unsigned char *)ja3_str, strlen(ja3_str));
-      ndpi_MD5Final(md5_hash, &ctx);
-
-      for(i=0, j=0; i<16; i++) {
-	int rc = snprintf(&flow->protos.tls_quic_stun.tls_quic.ja3_server[j],
-			  sizeof(flow->protos.tls_quic_stun.tls_quic.ja3_server)-j, "%02x", md5_hash[i]);
-	if(rc <= 0) break; else j += rc;
       }
-
-#ifdef DEBUG_TLS
-      printf("[JA3] Server: %s \n", flow->protos.tls_quic_stun.tls_quic.ja3_server);
-#endif
     } else if(handshake_type == 0x01 /* Client Hello */) {
       u_int16_t cipher_len, cipher_offset;
       u_int8_t cookie_len = 0;
@@ -1620,7 +1652,6 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 	    /* Move to the first extension
 	       Type is u_int to avoid possible overflow on extension_len addition */
 	    u_int extension_offset = 0;
-	    u_int32_t j;
 
 	    while(extension_offset < extensions_len &&
 		  offset+extension_offset+4 <= total_len) {
@@ -1934,7 +1965,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 		printf("Client TLS [ALPN: %s][len: %u]\n", alpn_str, alpn_str_len);
 #endif
 		if(flow->protos.tls_quic_stun.tls_quic.alpn == NULL)
-		  flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_strdup(alpn_str);
+		  flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, alpn_str);
 
 		snprintf(ja3.client.alpn, sizeof(ja3.client.alpn), "%s", alpn_str);
 
@@ -1992,7 +2023,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 #endif
 
 		  if(flow->protos.tls_quic_stun.tls_quic.tls_supported_versions == NULL)
-		    flow->protos.tls_quic_stun.tls_quic.tls_supported_versions = ndpi_strdup(version_str);
+		    flow->protos.tls_quic_stun.tls_quic.tls_supported_versions = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, version_str);
 		}
 	      } else if(extension_id == 65486 /* encrypted server name */) {
 		/*
@@ -2026,7 +2057,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 #endif
 
 		      if(flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni == NULL) {
-			flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni = (char*)ndpi_malloc(e_sni_len*2+1);
+			flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni = (char*)ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, e_sni_len*2+1);
 
 			if(flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni) {
 			  u_int16_t i, off;
@@ -2109,70 +2140,46 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 #endif
 	    } /* while */
 
-	    if(!invalid_ja3) {
-	      int rc;
-
+	    if(!invalid_ja3 && !shed_ja3) {
 	    compute_ja3c:
-	      ja3_str_len = snprintf(ja3_str, JA3_STR_LEN, "%u,", ja3.client.tls_handshake_version);
+	      ndpi_fingerprint_init(&fp, &ctx, &tail_ctx, JA3_STR_LEN-1);
+	      ndpi_fingerprint_append_u16(&fp, '\0', ja3.client.tls_handshake_version);
+	      ndpi_fingerprint_append(&fp, ",", 1);
 
-	      for(i=0; i<ja3.client.num_cipher; i++) {
-		rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u",
-			      (i > 0) ? "-" : "", ja3.client.cipher[i]);
-		if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc; else break;
-	      }
+	      for(i=0; i<ja3.client.num_cipher; i++)
+		if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.client.cipher[i]) != 0)
+		  break;
 
-	      rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, ",");
-	      if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc;
+	      ndpi_fingerprint_append(&fp, ",", 1);
 
 	      /* ********** */
 
-	      for(i=0; i<ja3.client.num_tls_extension; i++) {
-		rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u",
-			      (i > 0) ? "-" : "", ja3.client.tls_extension[i]);
-		if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc; else break;
-	      }
+	      for(i=0; i<ja3.client.num_tls_extension; i++)
+		if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.client.tls_extension[i]) != 0)
+		  break;
 
-	      rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, ",");
-	      if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc;
+	      ndpi_fingerprint_append(&fp, ",", 1);
 
 	      /* ********** */
 
-	      for(i=0; i<ja3.client.num_elliptic_curve; i++) {
-		rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u",
-			      (i > 0) ? "-" : "", ja3.client.elliptic_curve[i]);
-		if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc; else break;
-	      }
+	      for(i=0; i<ja3.client.num_elliptic_curve; i++)
+		if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.client.elliptic_curve[i]) != 0)
+		  break;
 
-	      rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, ",");
-	      if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc;
+	      ndpi_fingerprint_append(&fp, ",", 1);
 
-	      for(i=0; i<ja3.client.num_elliptic_curve_point_format; i++) {
-		rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len, "%s%u",
-			      (i > 0) ? "-" : "", ja3.client.elliptic_curve_point_format[i]);
-		if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc; else break;
-	      }
+	      for(i=0; i<ja3.client.num_elliptic_curve_point_format; i++)
+		if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', ja3.client.elliptic_curve_point_format[i]) != 0)
+		  break;
 
 	      if(ndpi_struct->enable_ja3_plus) {
-		rc = snprintf(&ja3_str[ja3_str_len], JA3_STR_LEN-ja3_str_len,
-			      ",%s,%s,%s", ja3.client.signature_algorithms, ja3.client.supported_versions, ja3.client.alpn);
-		if((rc > 0) && (ja3_str_len + rc < JA3_STR_LEN)) ja3_str_len += rc;
-	      }
-
-#ifdef DEBUG_JA3C
-	      printf("[JA3+] Client: %s \n", ja3_str);
-#endif
+		const char *fields[3] = { ja3.client.signature_algorithms, ja3.client.supported_versions, ja3.client.alpn };
 
-	      ndpi_MD5Init(&ctx);
-	      ndpi_MD5Update(&ctx, (const unsigned char *)ja3_str, strlen(ja3_str));
-	      ndpi_MD5Final(md5_hash, &ctx);
-
-	      for(i=0, j=0; i<16; i++) {
-		rc = snprintf(&flow->protos.tls_quic_stun.tls_quic.ja3_client[j],
-			      sizeof(flow->protos.tls_quic_stun.tls_quic.ja3_client)-j, "%02x",
-			      md5_hash[i]);
-		if(rc > 0) j += rc; else break;
+		ndpi_fingerprint_append_fields(&fp, ',', fields, 3);
 	      }
 
+	      ndpi_fingerprint_final(&fp, md5_hash, flow->protos.tls_quic_stun.tls_quic.ja3_client, 0);
+
 #ifdef DEBUG_JA3C
 	      printf("[JA3] Client: %s \n", flow->protos.tls_quic_stun.tls_quic.ja3_client);
 #endif
@@ -2217,7 +2224,8 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 	  }
 	} else if(offset == total_len) {
 	  /* TLS does not have extensions etc */
-	  goto compute_ja3c;
+	  if(!shed_ja3)
+	    goto compute_ja3c;
 	}
       } else {
 #ifdef DEBUG_TLS
@@ -2374,7 +2382,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 	  printf("Server TLS [ALPN: %s][len: %u]\n", alpn_str, alpn_str_len);
 #endif
 	  if(flow->protos.tls_quic_stun.tls_quic.alpn == NULL)
-	    flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_strdup(alpn_str);
+	    flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, alpn_str);
 
 	} else if(extension_id == 11 /* ec_point_formats groups */) {
 
@@ -2576,7 +2584,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 		printf("Client TLS [ALPN: %s][len: %u]\n", alpn_str, alpn_str_len);
 #endif
 		if(flow->protos.tls_quic_stun.tls_quic.alpn == NULL)
-		  flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_strdup(alpn_str);
+		  flow->protos.tls_quic_stun.tls_quic.alpn = ndpi_flow_data_strdup(flow, NDPI_MEM_METADATA, alpn_str);
 
 	      } else if(extension_id == 43 /* supported versions */) {
 #ifdef DEBUG_TLS
@@ -2617,7 +2625,7 @@ int processClientServerHello(struct ndpi_detection_module_struct *ndpi_struct,
 #endif
 
 		      if(flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni == NULL) {
-			flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni = (char*)ndpi_malloc(e_sni_len*2+1);
+			flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni = (char*)ndpi_flow_data_malloc(flow, NDPI_MEM_METADATA, e_sni_len*2+1);
 
 			if(flow->protos.tls_quic_stun.tls_quic.encrypted_sni.esni) {
 			  u_int16_t i, off;
@@ -219,6 +219,64 @@ static const char *rce_regex[N_RCE_REGEX] = {
 
 /* ********************************** */
 
+/**
+ * Prefilter
+ *
+ * None of the regexes above can match unless the query contains one of
+ * their starting tokens (for the anchored direct RCE regex, one of the
+ * characters that must follow the command): a regex is executed only if
+ * one of the tokens of its gate has been found. Tokens are matched
+ * ignoring case, so the gates are a superset of the regexes.
+ */
+
+#define RCE_GATE_SHELL_SEP   0x01 /* Unix command injection */
+#define RCE_GATE_CMD_SEP     0x02 /* Windows command injection */
+#define RCE_GATE_SHELL_EXPR  0x04 /* Unix shell expressions */
+#define RCE_GATE_FOR_IF      0x08 /* Windows FOR, IF commands */
+#define RCE_GATE_DIRECT      0x10 /* Unix direct remote command execution */
+
+static const u_int8_t rce_regex_gate[N_RCE_REGEX] = {
+  RCE_GATE_SHELL_SEP,
+  RCE_GATE_SHELL_SEP,
+  RCE_GATE_CMD_SEP,
+  RCE_GATE_CMD_SEP,
+  RCE_GATE_SHELL_EXPR,
+  RCE_GATE_FOR_IF,
+  RCE_GATE_DIRECT
+};
+
+static const struct {
+  const char *token;
+  u_int8_t gate;
+} rce_gate_tokens[] = {
+  { ";",    RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP | RCE_GATE_DIRECT },
+  { "{",    RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP },
+  { "|",    RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP | RCE_GATE_DIRECT },
+  { "&",    RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP | RCE_GATE_DIRECT },
+  { "\n",   RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP | RCE_GATE_DIRECT },
+  { "\r",   RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP | RCE_GATE_DIRECT },
+  { "`",    RCE_GATE_SHELL_SEP | RCE_GATE_CMD_SEP },
+  { " ",    RCE_GATE_DIRECT }, /* \s */
+  { "\t",   RCE_GATE_DIRECT },
+  { "\v",   RCE_GATE_DIRECT },
+  { "\f",   RCE_GATE_DIRECT },
+  { "$",    RCE_GATE_SHELL_SEP },
+  { "<",    RCE_GATE_SHELL_SEP | RCE_GATE_DIRECT },
+  { ">",    RCE_GATE_SHELL_SEP | RCE_GATE_DIRECT },
+  { "(",    RCE_GATE_SHELL_SEP }, /* \(\s*\) */
+  { "$(",   RCE_GATE_SHELL_EXPR },
+  { "${",   RCE_GATE_SHELL_EXPR },
+  { "<(",   RCE_GATE_SHELL_EXPR },
+  { ">(",   RCE_GATE_SHELL_EXPR },
+  { "if ",  RCE_GATE_FOR_IF },
+  { "if/",  RCE_GATE_FOR_IF },
+  { "if(",  RCE_GATE_FOR_IF },
+  { "for ", RCE_GATE_FOR_IF },
+  { "for/", RCE_GATE_FOR_IF }
+};
+
+/* ********************************** */
+
 /**
  * [ Unix shell snippets ]
  *
@@ -30,15 +30,42 @@
 #include "../include/MurmurHash3.h"
 #include "../include/hll.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+  Registers start in sparse mode: an array of (index << 8 | rank) sorted by
+  index. It is promoted to the dense array of 2^bits registers once it would
+  take more than 1/2 of it (each sparse entry takes 4 bytes)
+*/
+#define HLL_SPARSE_MIN_ENTRIES  8
+#define HLL_SPARSE_MAX_ENTRIES(hll) ((u_int32_t)((hll)->size / 8))
+
+#define HLL_SPARSE_INDEX(e) ((e) >> 8)
+#define HLL_SPARSE_RANK(e)  ((u_int8_t)((e) & 0xFF))
+
 u_int32_t _hll_hash(const struct ndpi_hll *hll) {
-  return MurmurHash3_x86_32(hll->registers, (u_int32_t)hll->size, 0);
+  if(hll->registers)
+    return MurmurHash3_x86_32(hll->registers, (u_int32_t)hll->size, 0);
+  else
+    return MurmurHash3_x86_32(hll->sparse, hll->sparse_len * sizeof(u_int32_t), 0);
 }
 
-/* Count the number of leading zero's */
+/* Count the number of trailing zero's */
 static __inline u_int8_t _hll_rank(u_int32_t hash, u_int8_t bits) {
+  u_int8_t max_rank = 32 - bits + 1;
+#if defined(__GNUC__)
   u_int8_t i;
 
-  for(i = 1; i <= 32 - bits; i++) {
+  if(hash == 0) return max_rank;
+
+  i = __builtin_ctz(hash) + 1;
+  return((i < max_rank) ? i : max_rank);
+#else
+  u_int8_t i;
+
+  for(i = 1; i < max_rank; i++) {
     if(hash & 1)
       break;
 
@@ -46,6 +73,7 @@ static __inline u_int8_t _hll_rank(u_int32_t hash, u_int8_t bits) {
   }
 
   return i;
+#endif
 }
 
 /*
@@ -78,7 +106,8 @@ int hll_init(struct ndpi_hll *hll, u_int8_t bits) {
 
   hll->bits = bits; /* Number of bits of buckets number */
   hll->size = (size_t)1 << bits; /* Number of buckets 2^bits */
-  hll->registers = ndpi_calloc(hll->size, 1); /* Create the bucket register counters */
+  hll->registers = NULL; /* Allocated when promoted to dense */
+  hll->sparse = NULL, hll->sparse_len = hll->sparse_max = 0;
 
   /* printf("%lu bytes\n", hll->size); */
   return 0;
@@ -90,21 +119,95 @@ void hll_destroy(struct ndpi_hll *hll) {
     
     hll->registers = NULL;
   }
+
+  if(hll->sparse) {
+    ndpi_free(hll->sparse);
+
+    hll->sparse = NULL;
+  }
+
+  hll->sparse_len = hll->sparse_max = 0;
 }
 
+/* Empties the estimator keeping its memory: dense registers are zeroed in place */
 void hll_reset(struct ndpi_hll *hll) {
   if(hll->registers)
     memset(hll->registers, 0, hll->size);
+
+  hll->sparse_len = 0;
 }
 
-static __inline void _hll_add_hash(struct ndpi_hll *hll, u_int32_t hash) {
+static int _hll_promote(struct ndpi_hll *hll) {
+  u_int32_t i;
+
+  if((hll->registers = ndpi_calloc(hll->size, 1)) == NULL)
+    return -1;
+
+  for(i = 0; i < hll->sparse_len; i++)
+    hll->registers[HLL_SPARSE_INDEX(hll->sparse[i])] = HLL_SPARSE_RANK(hll->sparse[i]);
+
+  if(hll->sparse) {
+    ndpi_free(hll->sparse);
+
+    hll->sparse = NULL;
+  }
+
+  hll->sparse_len = hll->sparse_max = 0;
+  return 0;
+}
+
+static void _hll_set_register(struct ndpi_hll *hll, u_int32_t index, u_int8_t rank) {
+  u_int32_t lo = 0, hi;
+
   if(hll->registers) {
-    u_int32_t index = hash >> (32 - hll->bits);   /* Use the first 'hll->bits' bits as bucket index */
-    u_int8_t rank   = _hll_rank(hash, hll->bits); /* Count the number of leading 0 */
-    
     if(rank > hll->registers[index])
-      hll->registers[index] = rank; /* Store the largest number of lesding zeros for the bucket */    
+      hll->registers[index] = rank; /* Store the largest number of leading zeros for the bucket */
+    return;
+  }
+
+  for(hi = hll->sparse_len; lo < hi; ) {
+    u_int32_t mid = (lo + hi) / 2;
+
+    if(HLL_SPARSE_INDEX(hll->sparse[mid]) < index)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if((lo < hll->sparse_len) && (HLL_SPARSE_INDEX(hll->sparse[lo]) == index)) {
+    if(rank > HLL_SPARSE_RANK(hll->sparse[lo]))
+      hll->sparse[lo] = (index << 8) | rank;
+    return;
+  }
+
+  if(hll->sparse_len == hll->sparse_max) {
+    u_int32_t new_max = hll->sparse_max ? (hll->sparse_max * 2) : HLL_SPARSE_MIN_ENTRIES;
+
+    if(new_max > HLL_SPARSE_MAX_ENTRIES(hll)) {
+      if(_hll_promote(hll) == 0)
+	_hll_set_register(hll, index, rank);
+      return;
+    } else {
+      u_int32_t *sparse = ndpi_realloc(hll->sparse, hll->sparse_max * sizeof(u_int32_t),
+				       new_max * sizeof(u_int32_t));
+
+      if(sparse == NULL)
+	return;
+
+      hll->sparse = sparse, hll->sparse_max = new_max;
+    }
   }
+
+  memmove(&hll->sparse[lo + 1], &hll->sparse[lo], (hll->sparse_len - lo) * sizeof(u_int32_t));
+  hll->sparse[lo] = (index << 8) | rank;
+  hll->sparse_len++;
+}
+
+static __inline void _hll_add_hash(struct ndpi_hll *hll, u_int32_t hash) {
+  u_int32_t index = hash >> (32 - hll->bits);   /* Use the first 'hll->bits' bits as bucket index */
+  u_int8_t rank   = _hll_rank(hash, hll->bits); /* Count the number of trailing 0 */
+
+  _hll_set_register(hll, index, rank);
 }
 
 void hll_add(struct ndpi_hll *hll, const void *buf, size_t size) {
@@ -113,10 +216,77 @@ void hll_add(struct ndpi_hll *hll, const void *buf, size_t size) {
   _hll_add_hash(hll, hash);
 }
 
-double hll_count(const struct ndpi_hll *hll) {
+/* Registers are merged as max(dst, src): both must have the same size */
+int hll_merge(struct ndpi_hll *dst, const struct ndpi_hll *src) {
+  u_int32_t i = 0;
+
+  if(dst->bits != src->bits)
+    return -1;
+
+  if(src->registers == NULL) {
+    for(i = 0; i < src->sparse_len; i++)
+      _hll_set_register(dst, HLL_SPARSE_INDEX(src->sparse[i]), HLL_SPARSE_RANK(src->sparse[i]));
+
+    return 0;
+  }
+
+  if((dst->registers == NULL) && (_hll_promote(dst) != 0))
+    return -1;
+
+#ifdef __SSE2__
+  for(; i + 16 <= dst->size; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&dst->registers[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&src->registers[i]);
+
+    _mm_storeu_si128((__m128i *)&dst->registers[i], _mm_max_epu8(a, b));
+  }
+#endif
+
+  for(; i < dst->size; i++)
+    if(src->registers[i] > dst->registers[i])
+      dst->registers[i] = src->registers[i];
+
+  return 0;
+}
+
+/* Ranks are <= 29: anything else (e.g. corrupted registers) is counted as 31 */
+#define HLL_HIST_RANK(r) (((r) < 32) ? (r) : 31)
+
+/* Number of registers for each rank */
+static void _hll_rank_histogram(const struct ndpi_hll *hll, u_int32_t hist[32]) {
+  u_int32_t i;
+
+  memset(hist, 0, 32 * sizeof(u_int32_t));
+
   if(hll->registers) {
+    /* Four banks so that equal ranks (e.g. runs of zeros) do not serialize */
+    u_int32_t bank[4][32];
+    const u_int8_t *r = hll->registers;
+
+    memset(bank, 0, sizeof(bank));
+
+    for(i = 0; i + 4 <= hll->size; i += 4) {
+      bank[0][HLL_HIST_RANK(r[i])]++, bank[1][HLL_HIST_RANK(r[i+1])]++;
+      bank[2][HLL_HIST_RANK(r[i+2])]++, bank[3][HLL_HIST_RANK(r[i+3])]++;
+    }
+
+    for(; i < hll->size; i++)
+      bank[0][HLL_HIST_RANK(r[i])]++;
+
+    for(i = 0; i < 32; i++)
+      hist[i] = bank[0][i] + bank[1][i] + bank[2][i] + bank[3][i];
+  } else {
+    hist[0] = (u_int32_t)hll->size - hll->sparse_len;
+
+    for(i = 0; i < hll->sparse_len; i++)
+      hist[HLL_HIST_RANK(HLL_SPARSE_RANK(hll->sparse[i]))]++;
+  }
+}
+
+double hll_count(const struct ndpi_hll *hll) {
+  if(hll->registers || hll->sparse_len) {
     double alpha_mm, sum, estimate;
-    u_int32_t i;
+    u_int32_t i, hist[32];
 
     switch(hll->bits) {
     case 4:
@@ -135,17 +305,16 @@ double hll_count(const struct ndpi_hll *hll) {
 
     alpha_mm *= ((double)hll->size * (double)hll->size);
 
+    _hll_rank_histogram(hll, hist);
+
     sum = 0;
-    for(i = 0; i < hll->size; i++)
-      sum += 1.0 / (1 << hll->registers[i]);    
+    for(i = 0; i < 32; i++)
+      sum += ldexp((double)hist[i], -(int)i);
 
     estimate = alpha_mm / sum;
 
     if(estimate <= (5.0 / 2.0 * (double)hll->size)) {
-      int zeros = 0;
-
-      for(i = 0; i < hll->size; i++)
-	zeros += (hll->registers[i] == 0);
+      int zeros = hist[0];
 
       if(zeros)
 	estimate = (double)hll->size * log((double)hll->size / zeros);
@@ -158,4 +327,3 @@ double hll_count(const struct ndpi_hll *hll) {
   } else
     return(0.);
 }
-
@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <ndpi_api.h>
 #include <ndpi_main.h>
 #include <ndpi_typedefs.h>
@@ -33,9 +34,120 @@
 
 void help() {
   printf("dga_evaluate <file name> [<verbose>]\n");
+  printf("dga_evaluate -e <dga file name> <non dga file name>\n");
+  printf("  -e    Report accuracy, precision, recall and throughput\n");
   exit(0);
 }
 
+/* *********************************************** */
+
+struct dga_names {
+  char **names;
+  u_int32_t num_names, max_names;
+};
+
+static void load_names(const char *path, struct dga_names *n) {
+  FILE *fd = fopen(path, "r");
+  char buffer[512];
+
+  if(fd == NULL) {
+    printf("Unable to open file %s\n", path);
+    exit(0);
+  }
+
+  while(fgets(buffer, sizeof(buffer), fd) != NULL) {
+    char *hostname = strtok(buffer, "\n");
+
+    if(hostname == NULL) continue;
+
+    if(n->num_names == n->max_names) {
+      n->max_names = n->max_names ? (n->max_names * 2) : 1024;
+      n->names = realloc(n->names, n->max_names * sizeof(char *));
+      assert(n->names != NULL);
+    }
+
+    n->names[n->num_names] = strdup(hostname);
+    assert(n->names[n->num_names] != NULL);
+    n->num_names++;
+  }
+
+  fclose(fd);
+}
+
+static void free_names(struct dga_names *n) {
+  u_int32_t i;
+
+  for(i = 0; i < n->num_names; i++)
+    free(n->names[i]);
+
+  free(n->names);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((double)ts.tv_sec + ((double)ts.tv_nsec / 1e9));
+}
+
+/* Checks every name 'repeat' times in a row, returns the number of detections */
+static u_int32_t check_names(struct ndpi_detection_module_struct *ndpi_str,
+			     struct dga_names *n, u_int repeat) {
+  u_int32_t i, num_detections = 0;
+  u_int r;
+
+  for(i = 0; i < n->num_names; i++) {
+    for(r = 0; r < repeat; r++) {
+      if(ndpi_check_dga_name(ndpi_str, NULL, n->names[i], 1) && (r == 0))
+	num_detections++;
+    }
+  }
+
+  return(num_detections);
+}
+
+/*
+  The first run scores every name, the second one checks each name twice
+  in a row so that its extra cost is the one of a verdict cache hit
+*/
+static void evaluate(struct ndpi_detection_module_struct *ndpi_str,
+		     const char *dga_path, const char *non_dga_path) {
+  struct dga_names dga = { NULL, 0, 0 }, non_dga = { NULL, 0, 0 };
+  u_int32_t tp, fp, fn, tn, num_names;
+  double t0, t1, t2;
+
+  load_names(dga_path, &dga);
+  load_names(non_dga_path, &non_dga);
+  num_names = dga.num_names + non_dga.num_names;
+
+  t0 = now_sec();
+  tp = check_names(ndpi_str, &dga, 1);
+  fp = check_names(ndpi_str, &non_dga, 1);
+  t1 = now_sec();
+  check_names(ndpi_str, &dga, 2);
+  check_names(ndpi_str, &non_dga, 2);
+  t2 = now_sec();
+
+  fn = dga.num_names - tp, tn = non_dga.num_names - fp;
+
+  printf("Names:      %u [DGA: %u][non DGA: %u]\n", num_names, dga.num_names, non_dga.num_names);
+  printf("Confusion:  [TP: %u][FN: %u][FP: %u][TN: %u]\n", tp, fn, fp, tn);
+  printf("Accuracy:   %.4f\n", num_names ? ((double)(tp + tn) / num_names) : 0);
+  printf("Precision:  %.4f\n", (tp + fp) ? ((double)tp / (tp + fp)) : 0);
+  printf("Recall:     %.4f\n", (tp + fn) ? ((double)tp / (tp + fn)) : 0);
+
+  if((t1 > t0) && (t2 - t1) > (t1 - t0))
+    printf("Throughput: %.0f names/sec [scored: %.1f ns/name][cached: %.1f ns/name]\n",
+	   num_names / (t1 - t0), ((t1 - t0) * 1e9) / num_names,
+	   ((t2 - t1) - (t1 - t0)) * 1e9 / num_names);
+  else
+    printf("Throughput: %.0f names/sec [scored: %.1f ns/name]\n",
+	   (t1 > t0) ? (num_names / (t1 - t0)) : 0, ((t1 - t0) * 1e9) / (num_names ? num_names : 1));
+
+  free_names(&dga);
+  free_names(&non_dga);
+}
+
 
 /* *********************************************** */
 
@@ -48,14 +160,20 @@ int main(int argc, char **argv) {
   int num_detections = 0;
   
   if(argc < 2) help();
-  fd = fopen(argv[1], "r");
-  
-  if(fd == NULL) {
-    printf("Unable to open file %s\n", argv[1]);
-    exit(0);
+
+  if(strcmp(argv[1], "-e") == 0) {
+    if(argc < 4) help();
+    fd = NULL;
+  } else {
+    fd = fopen(argv[1], "r");
+
+    if(fd == NULL) {
+      printf("Unable to open file %s\n", argv[1]);
+      exit(0);
+    }
   }
 
-  if(argv[2] != NULL) {
+  if((fd != NULL) && (argv[2] != NULL)) {
     verbose = 1;
     
     if(argv[3] != NULL)
@@ -76,6 +194,11 @@ int main(int argc, char **argv) {
   ndpi_finalize_initialization(ndpi_str);
   assert(ndpi_str != NULL);
 
+  if(fd == NULL) {
+    evaluate(ndpi_str, argv[2], argv[3]);
+    ndpi_exit_detection_module(ndpi_str);
+    return 0;
+  }
 
   while(fgets(buffer, sizeof(buffer), fd) != NULL) {
     char *hostname = strtok(buffer, "\n");
